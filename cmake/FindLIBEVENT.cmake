@@ -14,7 +14,11 @@ find_library(LIBEVENT_LIBRARY
    NAMES event
    HINTS "${LIBEVENT_ROOT}/lib")
 
-set(LIBEVENT_LIBRARIES ${LIBEVENT_LIBRARY})
+find_library(LIBEVENT_PTHREADS_LIBRARY
+   NAMES event_pthreads
+   HINTS "${LIBEVENT_ROOT}/lib")
+
+set(LIBEVENT_LIBRARIES ${LIBEVENT_LIBRARY} ${LIBEVENT_PTHREADS_LIBRARY})
 set(LIBEVENT_INCLUDE_DIRS ${LIBEVENT_INCLUDE_DIR})
 
 include(FindPackageHandleStandardArgs)
@@ -22,6 +26,6 @@ include(FindPackageHandleStandardArgs)
 # handle the QUIETLY and REQUIRED arguments and set LIBEVENT_FOUND to TRUE
 # if all listed variables are TRUE
 find_package_handle_standard_args(LIBEVENT DEFAULT_MSG
-                                  LIBEVENT_LIBRARY LIBEVENT_INCLUDE_DIR)
+                                  LIBEVENT_LIBRARY LIBEVENT_PTHREADS_LIBRARY LIBEVENT_INCLUDE_DIR)
 
-mark_as_advanced(LIBEVENT_INCLUDE_DIR LIBEVENT_LIBRARY)
+mark_as_advanced(LIBEVENT_INCLUDE_DIR LIBEVENT_LIBRARY LIBEVENT_PTHREADS_LIBRARY)
@@ -45,7 +45,8 @@ enum option_type
 	option_string,
 	option_verbosity,
 	option_backend,
-	option_bytes
+	option_bytes,
+	option_millis
 };
 
 struct option
@@ -70,14 +71,23 @@ struct option options[] =
 {
 	{ "verbosity", &paxos_config.verbosity, option_verbosity },
 	{ "tcp-nodelay", &paxos_config.tcp_nodelay, option_boolean },
+	{ "wire-binary", &paxos_config.wire_binary, option_boolean },
 	{ "learner-catch-up", &paxos_config.learner_catch_up, option_boolean },
-	{ "proposer-timeout", &paxos_config.proposer_timeout, option_integer },
+	{ "proposer-timeout", &paxos_config.proposer_timeout, option_millis },
 	{ "proposer-preexec-window", &paxos_config.proposer_preexec_window, option_integer },
+	{ "proposer-stable-leader", &paxos_config.proposer_stable_leader, option_boolean },
+	{ "proposer-batch-size", &paxos_config.proposer_batch_size, option_bytes },
+	{ "proposer-batch-count", &paxos_config.proposer_batch_count, option_integer },
+	{ "proposer-batch-linger", &paxos_config.proposer_batch_linger, option_integer },
 	{ "storage-backend", &paxos_config.storage_backend, option_backend },
 	{ "acceptor-trash-files", &paxos_config.trash_files, option_boolean },
 	{ "lmdb-sync", &paxos_config.lmdb_sync, option_boolean },
 	{ "lmdb-env-path", &paxos_config.lmdb_env_path, option_string },
 	{ "lmdb-mapsize", &paxos_config.lmdb_mapsize, option_bytes },
+	{ "wal-path", &paxos_config.wal_path, option_string },
+	{ "wal-segment-size", &paxos_config.wal_segment_size, option_bytes },
+	{ "wal-sync-interval", &paxos_config.wal_sync_interval, option_integer },
+	{ "wal-sync-bytes", &paxos_config.wal_sync_bytes, option_bytes },
 	{ 0 }
 };
 
@@ -298,6 +308,36 @@ static int parse_bytes(char* str, size_t* bytes)
 	return 1;
 }
 
+/**
+ * Parses a duration (e.g., "2", "2s", "250ms") and converts it to
+ * milliseconds. A number without modifier is in seconds.
+ *
+ * @param str The string representation of the duration.
+ * @param millis A pointer to store the duration in milliseconds.
+ * @return 1 on successful parsing, 0 on failure.
+ */
+static int parse_millis(char* str, int* millis)
+{
+	long n;
+	char* end;
+
+	n = strtol(str, &end, 10);
+
+	if (end == str || n < 0)
+		return 0;
+
+	while (isspace(*end))
+		end++;
+
+	if (*end == '\0' || strcasecmp(end, "s") == 0)
+		n *= 1000;
+	else if (strcasecmp(end, "ms") != 0)
+		return 0;
+
+	*millis = n;
+	return 1;
+}
+
 /**
  * Parses a string representation of a boolean value ("yes" or "no") and converts it to an integer (1 or 0).
  *
@@ -454,6 +494,8 @@ static int parse_backend(char* str, paxos_storage_backend* backend)
 		*backend = PAXOS_MEM_STORAGE;
 	else if (strcasecmp(str, "lmdb") == 0) 
 		*backend = PAXOS_LMDB_STORAGE;
+	else if (strcasecmp(str, "wal") == 0)
+		*backend = PAXOS_WAL_STORAGE;
 	else 
 		return 0;
 
@@ -560,12 +602,17 @@ static int parse_line(struct evpaxos_config* c, char* line)
 		case option_backend:
 			rv = parse_backend(line, opt->value);
 			if (rv == 0) 
-				paxos_log_error("Expected memory or lmdb\n");
+				paxos_log_error("Expected memory, lmdb or wal\n");
 			break;
 		case option_bytes:
 			rv = parse_bytes(line, opt->value);
 			if (rv == 0) 
 				paxos_log_error("Expected number of bytes.\n");
+			break;
+		case option_millis:
+			rv = parse_millis(line, opt->value);
+			if (rv == 0)
+				paxos_log_error("Expected seconds, or milliseconds with ms.\n");
 	}
 	
 	return rv;
@@ -30,6 +30,9 @@
 #include "peers.h"
 #include "acceptor.h"
 #include "message.h"
+#include "carray.h"
+#include "aidset.h"
+#include "topology.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,18 +46,120 @@ struct evacceptor
 	struct acceptor* state;
 	struct event* timer_ev;
 	struct timeval timer_tv;
+	struct event* sync_ev;  /* syncs the storage every wal-sync-interval */
+	struct timeval sync_tv;
 	int    subordinates;
+	int    batching;        /* a read burst is being applied */
+	struct carray* replies; /* replies held back until the burst commits */
+	struct carray* repeats; /* repeat requests served once the burst commits */
 };
 
+/* A reply to a peer, or to all the clients when peer is NULL. */
+struct evacceptor_reply
+{
+	struct peer* peer;
+	paxos_message msg;
+};
+
+/* A repeat request, served once the values it reads are durable. */
+struct evacceptor_repeat
+{
+	struct evacceptor* a;
+	struct peer* p;
+	paxos_repeat msg;
+};
+
+static void evacceptor_serve_repeat(struct evacceptor_repeat* r);
+
+static void evacceptor_send_reply(struct evacceptor* a, struct peer* p, paxos_message* msg)
+{
+	if (p == NULL)
+		peers_broadcast_clients(a->peers, msg);
+	else
+		peer_send_message(p, msg);
+}
+
+/*
+ * Sends a reply and hands the message over, so that the values it carries
+ * are sent from where they are rather than copied.
+ */
+static void evacceptor_hand_over_reply(struct evacceptor* a, struct peer* p,
+	paxos_message* msg)
+{
+	if (p == NULL)
+		peers_broadcast_clients_owned(a->peers, msg);
+	else
+		peer_send_message_owned(p, msg);
+}
+
 /**
- * Sends a Paxos message using the given peer's buffer.
+ * Sends a reply built by the acceptor, taking ownership of the message.
+ * While a read burst is being applied the reply is queued instead, since
+ * the state it announces is not durable before the burst is committed.
  *
- * @param p A pointer to the peer structure representing the connection.
- * @param arg A pointer to the Paxos message to send.
+ * @param a A pointer to the evacceptor structure.
+ * @param p The peer to reply to, or NULL to reply to all the clients.
+ * @param msg The reply.
+ */
+static void evacceptor_reply(struct evacceptor* a, struct peer* p, paxos_message* msg)
+{
+	if (a->batching) {
+		struct evacceptor_reply* r = malloc(sizeof(struct evacceptor_reply));
+		r->peer = p;
+		r->msg = *msg;
+		carray_push_back(a->replies, r);
+		return;
+	}
+	evacceptor_hand_over_reply(a, p, msg);
+}
+
+/**
+ * Called before the messages of a read burst are dispatched. Opens the
+ * acceptor transaction shared by the whole burst.
+ *
+ * @param arg A pointer to the evacceptor structure.
  */
-static void peer_send_paxos_message(struct peer* p, void* arg)
+static void evacceptor_burst_begin(void* arg)
 {
-	send_paxos_message(peer_get_buffer(p), arg);
+	struct evacceptor* a = (struct evacceptor*)arg;
+	if (acceptor_batch_begin(a->state) == 0)
+		a->batching = 1;
+}
+
+/**
+ * Called once the messages of a read burst are dispatched. Commits the
+ * burst transaction and only then releases the queued replies. If the
+ * commit fails the replies are dropped, as if the requests were lost.
+ * Repeat requests are served last, from the committed state.
+ *
+ * @param arg A pointer to the evacceptor structure.
+ */
+static void evacceptor_burst_end(void* arg)
+{
+	struct evacceptor_reply* r;
+	struct evacceptor_repeat* rp;
+	struct evacceptor* a = (struct evacceptor*)arg;
+
+	if (!a->batching)
+		return;
+	a->batching = 0;
+
+	int committed = acceptor_batch_commit(a->state) == 0;
+	if (!committed)
+		paxos_log_error("Acceptor %u failed to commit a read burst", get_aid(a->state));
+
+	while ((r = carray_pop_front(a->replies)) != NULL) {
+		if (committed)
+			evacceptor_hand_over_reply(a, r->peer, &r->msg);
+		else
+			paxos_message_destroy(&r->msg);
+		free(r);
+	}
+
+	while ((rp = carray_pop_front(a->repeats)) != NULL) {
+		evacceptor_serve_repeat(rp);
+		free(rp);
+	}
 }
 
 static void evacceptor_fwd_promise(struct peer* p, paxos_message* msg, void* arg)
@@ -71,7 +176,20 @@ static void evacceptor_fwd_promise(struct peer* p, paxos_message* msg, void* arg
 		struct peer* srcpeer = peer_get_acceptor(p,srcid);
 
 		if (srcpeer != NULL)
-			send_paxos_message(peer_get_buffer(srcpeer), msg);
+			peer_send_message(srcpeer, msg);
+	}
+}
+
+static void evacceptor_fwd_promise_range(struct peer* p, paxos_message* msg, void* arg)
+{
+	int srcid = get_srcid_promise_range(&(msg->u.promise_range), ((struct evacceptor*)arg)->state);
+
+	if (srcid >= 0)
+	{
+		struct peer* srcpeer = peer_get_acceptor(p, srcid);
+
+		if (srcpeer != NULL)
+			peer_send_message(srcpeer, msg);
 	}
 }
 
@@ -89,26 +207,33 @@ static void evacceptor_fwd_preempted(struct peer* p, paxos_message* msg, void* a
 		struct peer* srcpeer = peer_get_acceptor(p, srcid);
 
 		if (srcpeer != NULL)
-			send_paxos_message(peer_get_buffer(srcpeer), msg);
+			peer_send_message(srcpeer, msg);
 	}
 }
 
 
+/**
+ * Received an accepted from a subordinate acceptor. It is aggregated with
+ * the others of the subtree, and a single combined accepted is sent upward
+ * once a majority of the subtree accepted.
+ *
+ * @param p A pointer to the peer structure representing the connection.
+ * @param msg A pointer to the received Paxos message.
+ * @param arg A pointer to the evacceptor structure.
+ */
 static void evacceptor_fwd_accepted(struct peer* p, paxos_message* msg, void* arg)
 {
-	int srcid = -1;
-
-	if (msg->type == PAXOS_ACCEPTED)
-	{
-		srcid = get_srcid_accepted(&(msg->u.accepted), ((struct evacceptor*)arg)->state);
-	}
+	paxos_message out;
+	struct evacceptor* a = (struct evacceptor*)arg;
+	int srcid = acceptor_aggregate_accepted(&(msg->u.accepted), a->state, &out);
 
 	if (srcid >= 0)
 	{
 		struct peer* srcpeer = peer_get_acceptor(p, srcid);
 
 		if (srcpeer != NULL)
-			send_paxos_message(peer_get_buffer(srcpeer), msg);
+			peer_send_message(srcpeer, &out);
+		paxos_message_destroy(&out);
 	}
 }
 
@@ -131,16 +256,42 @@ static void evacceptor_handle_prepare(struct peer* p, paxos_message* msg, void*
 
 	uint32_t originalsrc = prepare->src;
 	prepare->src = get_aid(a->state);
-	peers_foreach_down_acceptor(a->peers, peer_send_paxos_message, msg);
+	peers_broadcast_down_acceptors(a->peers, msg);
 	prepare->src = originalsrc;
 
 	if (acceptor_receive_prepare(prepare->src,a->state, prepare, &out) != 0) {
 		// paxos_log_debug("EVACCEPTOR --> Sending Message Info: %x %x %x %x ", msg->msg_info[0], msg->msg_info[1], msg->msg_info[2], msg->msg_info[3]);
-		send_paxos_message(peer_get_buffer(p), &out);
-		paxos_message_destroy(&out);
+		evacceptor_reply(a, p, &out);
 	}
 }
 
+/**
+ * Received a prepare request for a range of instances (phase 1a).
+ *
+ * Forwards the request to the subordinate acceptors and answers the sender
+ * with a single aggregated promise for the whole range.
+ *
+ * @param p A pointer to the peer structure representing the connection.
+ * @param msg A pointer to the received Paxos message.
+ * @param arg A pointer to the evacceptor structure.
+ */
+static void evacceptor_handle_prepare_range(struct peer* p, paxos_message* msg, void* arg)
+{
+	paxos_message out;
+	paxos_prepare_range* prepare = &msg->u.prepare_range;
+	struct evacceptor* a = (struct evacceptor*)arg;
+	paxos_log_debug("Acceptor %u Handle prepare for iids %u-%u ballot %u", get_aid(a->state),
+		prepare->from_iid, prepare->to_iid, prepare->ballot);
+
+	uint32_t originalsrc = prepare->src;
+	prepare->src = get_aid(a->state);
+	peers_broadcast_down_acceptors(a->peers, msg);
+	prepare->src = originalsrc;
+
+	if (acceptor_receive_prepare_range(prepare->src, a->state, prepare, &out) != 0)
+		evacceptor_reply(a, p, &out);
+}
+
 /**
  * Received a accept request (phase 2a).
  * 
@@ -158,24 +309,41 @@ static void evacceptor_handle_accept(struct peer* p, paxos_message* msg, void* a
 	struct evacceptor* a = (struct evacceptor*) arg;
 	paxos_log_debug("Acceptor %u Handle accept for iid %u bal %u", get_aid(a->state),accept->iid, accept->ballot);
 	uint32_t originalsrc = accept->src;
-	peers_foreach_down_acceptor(a->peers, peer_send_paxos_message, msg);
+	peers_broadcast_down_acceptors(a->peers, msg);
 	accept->src = originalsrc;
 
 	if (acceptor_receive_accept(a->state, accept, &out) != 0) {
 		if (out.type == PAXOS_ACCEPTED) {
-			peers_foreach_client(a->peers, peer_send_paxos_message, &out);
+			evacceptor_reply(a, NULL, &out);
 		} else if (out.type == PAXOS_PREEMPTED) {
-			send_paxos_message(peer_get_buffer(p), &out);
+			evacceptor_reply(a, p, &out);
+		} else {
+			paxos_message_destroy(&out);
 		}
-
 		// paxos_log_debug("EVACCEPTOR --> (Handle Accept) out Message Info: %x %x %x %x", out.msg_info[0], out.msg_info[1], out.msg_info[2], out.msg_info[3]);
-		paxos_message_destroy(&out);
 	}
 }
 
+static void evacceptor_send_repeated(paxos_accepted* acc, void* arg)
+{
+	struct evacceptor_repeat* r = arg;
+	paxos_message out = {.type = PAXOS_ACCEPTED, .u.accepted = *acc};
+	memcpy(&(out.msg_info[0]), "ACCY", 4);
+	evacceptor_send_reply(r->a, r->p, &out);
+}
+
+/*
+ * Streams the accepted values of a repeated range to the peer, each one
+ * packed into its output as soon as it is read.
+ */
+static void evacceptor_serve_repeat(struct evacceptor_repeat* r)
+{
+	acceptor_receive_repeat_range(r->a->state, &r->msg, evacceptor_send_repeated, r);
+}
+
 /**
  * Handles a received repeat request from a peer, resending accepted values
- * for a range of instance IDs.
+ * for a range of instance IDs. The whole range is read in one transaction.
  *
  * @param p A pointer to the peer structure representing the connection.
  * @param msg A pointer to the received Paxos message.
@@ -183,27 +351,18 @@ static void evacceptor_handle_accept(struct peer* p, paxos_message* msg, void* a
  */
 static void evacceptor_handle_repeat(struct peer* p, paxos_message* msg, void* arg)
 {
-	iid_t iid;
-	paxos_accepted accepted;
-	memset(&accepted, 0, sizeof(accepted));
-	paxos_repeat* repeat = &msg->u.repeat;
 	struct evacceptor* a = (struct evacceptor*)arg;
-	// paxos_log_debug("EVACCEPTOR --> (Handle Repeat) repeat Message Info: %x %x %x %x", msg->msg_info[0], msg->msg_info[1], msg->msg_info[2], msg->msg_info[3]);
-	paxos_log_debug("Acceptor %u Handle repeat for iids %u-%u", get_aid(a->state), repeat->from, repeat->to);
-//	peers_foreach_down_acceptor(a->peers, peer_send_paxos_message, msg);
-
-	for (iid = repeat->from; iid <= repeat->to; ++iid) {
-		//paxos_log_debug("processing iid %ld", iid);
-
-		if (acceptor_receive_repeat(a->state, iid, &accepted)) {
-			//paxos_log_debug("acceptor receive repeat %ld", iid);
-			send_paxos_accepted(peer_get_buffer(p), &accepted);
-			//paxos_log_debug("Repeat sent.");
-			paxos_accepted_destroy(&accepted);
-		}
-		// else
-			// paxos_log_debug("Acceptor did not receive repeat %ld", iid);
+	struct evacceptor_repeat r = {a, p, msg->u.repeat};
+
+	paxos_log_debug("Acceptor %u Handle repeat for iids %u-%u", get_aid(a->state), r.msg.from, r.msg.to);
+	if (a->batching) {
+		// Values accepted in this burst are not durable yet
+		struct evacceptor_repeat* q = malloc(sizeof(struct evacceptor_repeat));
+		*q = r;
+		carray_push_back(a->repeats, q);
+		return;
 	}
+	evacceptor_serve_repeat(&r);
 }
 
 /**
@@ -218,7 +377,7 @@ static void evacceptor_handle_trim(struct peer* p, paxos_message* msg, void* arg
 {
 	paxos_trim* trim = &msg->u.trim;
 	struct evacceptor* a = (struct evacceptor*)arg;
-	peers_foreach_down_acceptor(a->peers, peer_send_paxos_message, msg);
+	peers_broadcast_down_acceptors(a->peers, msg);
 	acceptor_receive_trim(a->state, trim);
 }
 
@@ -275,13 +434,25 @@ static void send_acceptor_state(int fd, short ev, void* arg)
 
 	paxos_message msg = {.type = PAXOS_ACCEPTOR_STATE};
 	// paxos_log_debug("EVACCEPTOR --> (Send State) Message Info: %x %x %x %x", msg.msg_info[0], msg.msg_info[1], msg.msg_info[2], msg.msg_info[3]);
-	peers_foreach_down_acceptor(a->peers, peer_send_paxos_message, (void*)&msg);
+	peers_broadcast_down_acceptors(a->peers, &msg);
 	acceptor_set_current_state(a->state, &msg.u.state);
-	peers_foreach_client(a->peers, peer_send_paxos_message, &msg);
+	peers_broadcast_clients(a->peers, &msg);
 
 
 }
 
+/**
+ * Syncs the records committed since the last sync, so that they do not
+ * stay unsynced longer than the sync interval when traffic stops.
+ */
+static void evacceptor_sync(evutil_socket_t fd, short event, void* arg)
+{
+	struct evacceptor* a = arg;
+	if (acceptor_sync(a->state) != 0)
+		paxos_log_error("Acceptor %u failed to sync its storage", get_aid(a->state));
+	event_add(a->sync_ev, &a->sync_tv);
+}
+
 /**
  * Initializes an evacceptor structure with the specified acceptor ID, evpaxos
  * configuration, and peers structure. Subscribes the evacceptor to receive
@@ -302,57 +473,20 @@ struct evacceptor* evacceptor_init_internal(int id, struct evpaxos_config* c, st
 	// Create a new acceptor state associated with the specified ID
 	acceptor->state = acceptor_new(id);
 	acceptor->peers = p;
+	acceptor->replies = carray_new(64);
+	acceptor->repeats = carray_new(8);
+	setacceptors(acceptor->state, c->acceptors_count);
 	
-	int acceptor_count = c->acceptors_count;
-	int* scanned = malloc(sizeof(int) * acceptor_count);
-	for (int i = 0; i < acceptor_count; i++) scanned[i] = -1;
-	int* toscan = malloc(sizeof(int) * acceptor_count);
-	for (int i = 0; i < acceptor_count; i++) toscan[i] = -1;
-	if (c->acceptors[id].groupid != c->acceptors[id].parentid) 	toscan[0] = c->acceptors[id].groupid;
-	int ncnt = 0;
-
-	while (toscan[0] != -1)
-	{
-		
-		int grp = toscan[0]; 
-//		paxos_log_debug("Acceptor %d scanning group %d", id, grp);
-		for (int j = 0; j < acceptor_count - 1; j++) toscan[j] = toscan[j + 1]; toscan[acceptor_count - 1] = -1;
-		for (int j = 0; j < acceptor_count; j++) { if (scanned[j] == grp) break; else if (scanned[j] == -1) { scanned[j] = grp; break; } };
-
-		for (int i = 0; i < acceptor_count; i++)
-		{
-			if (c->acceptors[i].groupid == grp 
-				 && c->acceptors[i].groupid == c->acceptors[id].parentid )
-			{
-				ncnt++;
-			}
-			else
-				if (c->acceptors[i].parentid == grp /*  && c->acceptors[i].parentid != c->acceptors[i].groupid*/ )
-				{
-					ncnt++;
-					{
-						int fnd = 0;
-						for (int k = 0; k < acceptor_count; k++) if (scanned[k] == c->acceptors[i].groupid) { fnd = 1; break; }
-						if (fnd == 0)
-						{
-							for (int k = 0; k < acceptor_count; k++) if (toscan[k] == c->acceptors[i].groupid) { fnd = 1; break; }
-						}
-						if (fnd == 0)
-						{
-							for (int l = 0; l < acceptor_count; l++) { if (toscan[l] == c->acceptors[i].groupid) break; else if (toscan[l] == -1) { toscan[l] = c->acceptors[i].groupid; break; } };
-						}
-					}
-
-				}
-		}
-
+	// Count the acceptors below this one in the tree
+	paxos_aidset subtree;
+	aidset_clear(&subtree);
+	struct topology* t = topology_new(c, id);
+	if (t != NULL) {
+		acceptor->subordinates = topology_subordinates(t, &subtree);
+		topology_free(t);
 	}
-	free(scanned);
-	free(toscan);
-	acceptor->subordinates = ncnt;
-	setsubordinates(acceptor->state, ncnt);
-//	paxos_log_debug("Acceptor %d subordinates %d", id, ncnt);
-
+	setsubordinates(acceptor->state, acceptor->subordinates);
+	setsubtree(acceptor->state, &subtree);
 
 	// Subscribe the acceptor to handle various types of Paxos messages
 	peers_subscribe(p, PAXOS_PREPARE, evacceptor_handle_prepare, acceptor);
@@ -362,6 +496,9 @@ struct evacceptor* evacceptor_init_internal(int id, struct evpaxos_config* c, st
 	peers_subscribe(p, PAXOS_PROMISE, evacceptor_fwd_promise, acceptor);
 	peers_subscribe(p, PAXOS_ACCEPTED, evacceptor_fwd_accepted, acceptor);
 	peers_subscribe(p, PAXOS_PREEMPTED, evacceptor_fwd_preempted, acceptor);
+	peers_subscribe(p, PAXOS_PREPARE_RANGE, evacceptor_handle_prepare_range, acceptor);
+	peers_subscribe(p, PAXOS_PROMISE_RANGE, evacceptor_fwd_promise_range, acceptor);
+	peers_subscribe_burst(p, evacceptor_burst_begin, evacceptor_burst_end, acceptor);
 
 
 	// Obtain the event base from the peers structure
@@ -372,6 +509,13 @@ struct evacceptor* evacceptor_init_internal(int id, struct evpaxos_config* c, st
 	acceptor->timer_tv = (struct timeval){2, 0};
 	// Add the timer event to the event loop
 	event_add(acceptor->timer_ev, &acceptor->timer_tv);
+
+	if (paxos_config.wal_sync_interval > 0) {
+		acceptor->sync_ev = evtimer_new(base, evacceptor_sync, acceptor);
+		acceptor->sync_tv.tv_sec = paxos_config.wal_sync_interval / 1000000;
+		acceptor->sync_tv.tv_usec = paxos_config.wal_sync_interval % 1000000;
+		event_add(acceptor->sync_ev, &acceptor->sync_tv);
+	}
 	return acceptor;
 }
 
@@ -433,6 +577,10 @@ struct evacceptor* evacceptor_init(int id, const char* config_file, struct event
 void evacceptor_free_internal(struct evacceptor* a)
 {
 	event_free(a->timer_ev);
+	if (a->sync_ev != NULL)
+		event_free(a->sync_ev);
+	carray_free(a->replies);
+	carray_free(a->repeats);
 	acceptor_free(a->state);
 	free(a);
 }
@@ -28,6 +28,7 @@
 
 #include "evpaxos.h"
 #include "learner.h"
+#include "valuebatch.h"
 #include "peers.h"
 #include "message.h"
 #include <stdlib.h>
@@ -35,28 +36,114 @@
 #include <stdio.h>
 #include <event2/event.h>
 
+/* Bounds of the number of instances requested by a repeat */
+#define EVLEARNER_REPEAT_MIN 16
+#define EVLEARNER_REPEAT_MAX (1 << 16)
+
 struct evlearner
 {
 	struct learner* state;      /* The actual learner */
 	deliver_function delfun;    /* Delivery callback */
+	deliver_batch_function batchfun; /* Delivery callback for decided ranges */
+	void* batcharg;             /* The argument to the batch callback */
+	deliver_owned_function ownfun; /* Delivery callback keeping the values */
 	void* delarg;               /* The argument to the delivery callback */
+	paxos_accepted* decided;    /* Instances decided in the current event */
+	int decided_cap;
+	struct evpaxos_delivery* batch; /* Values of the decided instances */
+	int batch_count;
+	int batch_cap;
 	struct event* hole_timer;   /* Timer to check for holes */
 	struct timeval tv;          /* Check for holes every tv units of time */
+	iid_t repeat_from;          /* First hole when last checked */
+	iid_t repeat_to;            /* Last instance requested, 0 if none */
+	iid_t repeat_chunk;         /* Instances requested at once */
+	int repeat_idle;            /* Checks without progress of the repair */
+	int repeat_peer;            /* Acceptor asked first */
+	int repeat_fanout;          /* Acceptors asked, enough for a quorum */
 	struct peers* acceptors;    /* Connections to acceptors */
 	struct evpaxos_config* c;
 };
 
 
+struct evlearner_repeat
+{
+	struct evlearner* l;
+	paxos_repeat msg;
+	int index;
+};
+
 /**
  * This function sends a repeat message to a peer using the provided buffer and argument.
  * It is typically used to request the retransmission of Paxos messages that were missed.
+ * Only the acceptors of the window chosen for the current request are asked.
  *
  * @param p A pointer to the peer to which the repeat message should be sent.
- * @param arg The argument to be included in the repeat message.
+ * @param arg The repeat request being sent.
  */
 static void peer_send_repeat(struct peer* p, void* arg)
 {
-	send_paxos_repeat(peer_get_buffer(p), arg);
+	struct evlearner_repeat* r = arg;
+	int count = peers_count(r->l->acceptors);
+	int offset = (r->index++ - r->l->repeat_peer + count) % count;
+
+	if (offset < r->l->repeat_fanout) {
+		paxos_message msg = {
+			.type = PAXOS_REPEAT,
+			.u.repeat = r->msg };
+		peer_send_message(p, &msg);
+	}
+}
+
+/**
+ * Requests the next range of missing instances. The range starts small and
+ * doubles each time the previous one was repaired, up to the size of the gap,
+ * so that a learner far behind catches up in a few round trips. A repair
+ * making no progress for two checks is requested again, halved, from the
+ * next acceptors. A single accepted value is only one vote, so the request
+ * goes to as many acceptors as a quorum needs rather than to all of them.
+ *
+ * @param l A pointer to the event-driven learner structure.
+ * @param tick Whether called from the periodic check.
+ */
+static void evlearner_repair_holes(struct evlearner* l, int tick)
+{
+	iid_t gap;
+	int count = peers_count(l->acceptors);
+	struct evlearner_repeat r = {l, {0, 0}, 0};
+
+	if (count == 0 || !learner_has_holes(l->state, &r.msg.from, &r.msg.to)) {
+		l->repeat_to = 0;
+		l->repeat_chunk = EVLEARNER_REPEAT_MIN;
+		return;
+	}
+
+	if (l->repeat_to != 0 && r.msg.from <= l->repeat_to) {
+		// The last range is still being repaired
+		if (r.msg.from > l->repeat_from) {
+			l->repeat_from = r.msg.from;
+			l->repeat_idle = 0;
+			return;
+		}
+		if (!tick || ++l->repeat_idle < 2)
+			return;
+		l->repeat_chunk = l->repeat_chunk / 2 > EVLEARNER_REPEAT_MIN ?
+			l->repeat_chunk / 2 : EVLEARNER_REPEAT_MIN;
+		l->repeat_peer = (l->repeat_peer + 1) % count;
+	} else if (l->repeat_to != 0 && l->repeat_chunk < EVLEARNER_REPEAT_MAX) {
+		l->repeat_chunk *= 2;
+	}
+
+	gap = r.msg.to - r.msg.from + 1;
+	if (gap > l->repeat_chunk)
+		r.msg.to = r.msg.from + l->repeat_chunk - 1;
+	l->repeat_from = r.msg.from;
+	l->repeat_to = r.msg.to;
+	l->repeat_idle = 0;
+
+	paxos_log_debug("Learner requests iids %u-%u from %d acceptors",
+		r.msg.from, r.msg.to, l->repeat_fanout);
+	peers_foreach_acceptor(l->acceptors, peer_send_repeat, &r);
 }
 
 /**
@@ -70,41 +157,161 @@ static void peer_send_repeat(struct peer* p, void* arg)
  */
 static void evlearner_check_holes(evutil_socket_t fd, short event, void *arg)
 {
-	return; // 11:26 14.11.2023
-
-	paxos_repeat msg;
-	int chunks = 10;
 	struct evlearner* l = arg;
 
-	if (learner_has_holes(l->state, &msg.from, &msg.to)) {
-		if ((msg.to - msg.from) > chunks)
-			msg.to = msg.from + chunks;
+	evlearner_repair_holes(l, 1);
+	event_add(l->hole_timer, &l->tv);
+}
+
+/*
+ * A delivered buffer, shared by the values unpacked from it and freed
+ * when the last of them is released.
+ */
+struct evlearner_ref
+{
+	int refs;
+	char* buffer;
+};
+
+struct evlearner_delivery
+{
+	struct evlearner* l;
+	unsigned iid;
+	struct evlearner_ref* ref;
+};
 
-		peers_foreach_acceptor(l->acceptors, peer_send_repeat, &msg);
+/**
+ * Releases a value delivered to a deliver_owned_function. Values may be
+ * released from any thread.
+ *
+ * @param ref The ref passed along with the value.
+ */
+void evpaxos_value_release(void* ref)
+{
+	struct evlearner_ref* r = ref;
+	if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(r->buffer);
+		free(r);
 	}
+}
 
-	event_add(l->hole_timer, &l->tv);
+static void evlearner_give_value(const char* value, size_t size, void* arg)
+{
+	struct evlearner_delivery* d = arg;
+	__atomic_add_fetch(&d->ref->refs, 1, __ATOMIC_ACQ_REL);
+	d->l->ownfun(d->iid, (char*)value, size, d->ref, d->l->delarg);
+}
+
+/*
+ * Passes each client value held by a decided value to cb. Only the values
+ * flagged as batches by the proposer are unpacked, any other value, or a
+ * batch that does not parse, is passed whole.
+ */
+static void evlearner_split(uint32_t flags, const char* value, size_t size,
+	value_batch_cb cb, void* arg)
+{
+	if (!(flags & PAXOS_VALUE_BATCH) ||
+		value_batch_foreach(value, size, cb, arg) < 0)
+		cb(value, size, arg);
+}
+
+/*
+ * Appends a value to the batch of the current event.
+ */
+static void evlearner_batch_add(const char* value, size_t size, void* arg)
+{
+	struct evlearner_delivery* d = arg;
+	struct evlearner* l = d->l;
+
+	if (l->batch_count == l->batch_cap) {
+		l->batch_cap *= 2;
+		l->batch = realloc(l->batch, l->batch_cap * sizeof(struct evpaxos_delivery));
+	}
+	l->batch[l->batch_count++] = (struct evpaxos_delivery) {d->iid, (char*)value, size};
+}
+
+/*
+ * Adapts a deliver_function to batches, delivering one value at a time.
+ */
+static void evlearner_deliver_each(struct evpaxos_delivery* values, int count, void* arg)
+{
+	struct evlearner* l = arg;
+	int i;
+
+	for (i = 0; i < count; i++)
+		l->delfun(values[i].iid, values[i].value, values[i].size, l->delarg);
+}
+
+/*
+ * Hands the value of a decided instance over to the owned delivery
+ * callback. The learner holds a reference of its own while the values of
+ * a batch are delivered.
+ */
+static void evlearner_deliver_owned(struct evlearner* l, paxos_accepted* deliver)
+{
+	paxos_value* v = &deliver->values[0];
+	struct evlearner_ref* ref = malloc(sizeof(struct evlearner_ref));
+	struct evlearner_delivery d = {l, deliver->iid, ref};
+	size_t size = v->paxos_value_len;
+
+	ref->refs = 1;
+	ref->buffer = v->paxos_value_val;
+	v->paxos_value_val = NULL;
+	v->paxos_value_len = 0;
+
+	evlearner_split(v->paxos_value_flags, ref->buffer, size,
+		evlearner_give_value, &d);
+	evpaxos_value_release(ref);
 }
 
 /**
- * This function delivers the next closed Paxos message to the application layer using the provided
- * delivery function. It iterates through the received Paxos messages and delivers them in sequence.
+ * This function delivers the closed Paxos instances to the application layer using the provided
+ * delivery function. All the contiguous instances closed so far are collected first, in sequence,
+ * and delivered with a single call to the batch callback, the single value callback being
+ * invoked once per value through an adapter. Values flagged as batches are unpacked, all
+ * their client values carrying the iid of the instance.
  *
  * @param l A pointer to the event-driven learner structure.
  */
 static void evlearner_deliver_next_closed(struct evlearner* l)
 {
-	paxos_accepted deliver;
-	memset(&deliver, 0, sizeof(paxos_accepted));
-
-	while (learner_deliver_next(l->state, &deliver)) {
-		// paxos_log_debug("learner callback");
-		l->delfun(deliver.iid, deliver.values[0].paxos_value_val, deliver.values[0].paxos_value_len, l->delarg);
-		// paxos_log_debug("learner destroy after callback");
-		paxos_accepted_destroy(&deliver);
+	int i, count = 0;
+
+	if (l->ownfun != NULL) {
+		paxos_accepted deliver;
 		memset(&deliver, 0, sizeof(paxos_accepted));
-		// paxos_log_debug("learner to the next");
+		while (learner_deliver_next(l->state, &deliver)) {
+			evlearner_deliver_owned(l, &deliver);
+			paxos_accepted_destroy(&deliver);
+			memset(&deliver, 0, sizeof(paxos_accepted));
+		}
+		return;
 	}
+
+	for (;;) {
+		if (count == l->decided_cap) {
+			l->decided_cap *= 2;
+			l->decided = realloc(l->decided, l->decided_cap * sizeof(paxos_accepted));
+		}
+		memset(&l->decided[count], 0, sizeof(paxos_accepted));
+		if (!learner_deliver_next(l->state, &l->decided[count]))
+			break;
+		count++;
+	}
+	if (count == 0)
+		return;
+
+	l->batch_count = 0;
+	for (i = 0; i < count; i++) {
+		struct evlearner_delivery d = {l, l->decided[i].iid, NULL};
+		paxos_value* v = &l->decided[i].values[0];
+		evlearner_split(v->paxos_value_flags, v->paxos_value_val,
+			v->paxos_value_len, evlearner_batch_add, &d);
+	}
+	l->batchfun(l->batch, l->batch_count, l->batcharg);
+
+	for (i = 0; i < count; i++)
+		paxos_accepted_destroy(&l->decided[i]);
 }
 
 /*
@@ -125,8 +332,13 @@ static void evlearner_deliver_next_closed(struct evlearner* l)
 static void evlearner_handle_accepted(struct peer* p, paxos_message* msg, void* arg)
 {
 	struct evlearner* l = arg;
-	learner_receive_accepted(l->state, &msg->u.accepted);
+	// Subscribed after a collocated acceptor and proposer, the learner is
+	// the last reader of the message and takes its value
+	learner_take_accepted(l->state, &msg->u.accepted);
 	evlearner_deliver_next_closed(l);
+	// Request the next range as soon as the last one is repaired
+	if (l->repeat_to != 0)
+		evlearner_repair_holes(l, 0);
 }
 
 /**
@@ -148,9 +360,23 @@ struct evlearner* evlearner_init_internal(struct evpaxos_config* config, struct
 	
 	// Set up underlaying learner.
 	learner->delfun = f;
+	learner->batchfun = evlearner_deliver_each;
+	learner->batcharg = learner;
+	learner->ownfun = NULL;
 	learner->delarg = arg;
+	learner->decided_cap = 16;
+	learner->decided = malloc(learner->decided_cap * sizeof(paxos_accepted));
+	learner->batch_count = 0;
+	learner->batch_cap = 16;
+	learner->batch = malloc(learner->batch_cap * sizeof(struct evpaxos_delivery));
 	learner->state = learner_new(acceptor_count);
 	learner->acceptors = peers;
+	learner->repeat_from = 0;
+	learner->repeat_to = 0;
+	learner->repeat_chunk = EVLEARNER_REPEAT_MIN;
+	learner->repeat_idle = 0;
+	learner->repeat_peer = 0;
+	learner->repeat_fanout = acceptor_count / 2 + 1;
 	
 	peers_subscribe(peers, PAXOS_ACCEPTED, evlearner_handle_accepted, learner);
 	
@@ -187,6 +413,48 @@ struct evlearner* evlearner_init(const char* config_file, deliver_function f, vo
 	return l;
 }
 
+/**
+ * Initializes an event-driven learner delivering all the values decided
+ * while handling a message with a single call, see deliver_batch_function.
+ *
+ * @param config_file The path to the configuration file for Paxos.
+ * @param f The delivery function for batches of values.
+ * @param arg The argument to be passed to the delivery function.
+ * @param b The event base for event-driven operations.
+ * @return A pointer to the initialized event-driven learner structure.
+ */
+struct evlearner* evlearner_init_batch(const char* config_file, deliver_batch_function f,
+	void* arg, struct event_base* b)
+{
+	struct evlearner* l = evlearner_init(config_file, NULL, arg, b);
+
+	if (l != NULL) {
+		l->batchfun = f;
+		l->batcharg = arg;
+	}
+	return l;
+}
+
+/**
+ * Initializes an event-driven learner whose delivery callback takes
+ * ownership of the values, see deliver_owned_function.
+ *
+ * @param config_file The path to the configuration file for Paxos.
+ * @param f The delivery function keeping the values.
+ * @param arg The argument to be passed to the delivery function.
+ * @param b The event base for event-driven operations.
+ * @return A pointer to the initialized event-driven learner structure.
+ */
+struct evlearner* evlearner_init_owned(const char* config_file, deliver_owned_function f,
+	void* arg, struct event_base* b)
+{
+	struct evlearner* l = evlearner_init(config_file, NULL, arg, b);
+
+	if (l != NULL)
+		l->ownfun = f;
+	return l;
+}
+
 /**
  * This internal function frees the resources associated with an event-driven learner,
  * including the event timer for hole checking and the learner's state.
@@ -197,6 +465,8 @@ void evlearner_free_internal(struct evlearner* l)
 {
 	event_free(l->hole_timer);
 	learner_free(l->state);
+	free(l->decided);
+	free(l->batch);
 
 	evpaxos_config_free(l->c);
 	free(l);
@@ -238,7 +508,10 @@ void evlearner_set_instance_id(struct evlearner* l, unsigned iid)
  */
 static void peer_send_trim(struct peer* p, void* arg)
 {
-	send_paxos_trim(peer_get_buffer(p), arg);
+	paxos_message msg = {
+		.type = PAXOS_TRIM,
+		.u.trim = *(paxos_trim*)arg };
+	peer_send_message(p, &msg);
 }
 
 
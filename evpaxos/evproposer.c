@@ -38,35 +38,59 @@ struct evproposer
 {
 	int id;
 	int preexec_window;
+	int stable_leader;
 	struct proposer* state;
 	struct peers* peers;
-	struct timeval tv;
+	struct timeval tv;          /* timeout check period */
 	struct event* timeout_ev;
+	struct timeval linger;      /* how long a client value may wait in a batch */
+	struct event* linger_ev;
 };
 
 /**
- * Sends a paxos_prepare message to the specified peer.
+ * Sends a paxos_prepare message to all the acceptors.
  *
- * @param p Pointer to the peer structure to which the paxos_prepare message will be sent.
- * @param arg A pointer to the argument to be passed to the paxos_prepare message.
+ * @param peers Pointer to the peers of the proposer.
+ * @param pr Pointer to the paxos_prepare message to send.
  */
-static void peer_send_prepare(struct peer* p, void* arg)
+static void broadcast_prepare(struct peers* peers, paxos_prepare* pr)
 {
-	//getcnt();
-	send_paxos_prepare(peer_get_buffer(p), arg);
+	paxos_message msg = {
+		.type = PAXOS_PREPARE,
+		.u.prepare = *pr };
+	memcpy(&(msg.msg_info[0]), "PREP", 4);
+	peers_broadcast_acceptors(peers, &msg);
 }
 
+/**
+ * Sends a paxos_prepare_range message to all the acceptors.
+ *
+ * @param peers Pointer to the peers of the proposer.
+ * @param pr Pointer to the paxos_prepare_range message to send.
+ */
+static void broadcast_prepare_range(struct peers* peers, paxos_prepare_range* pr)
+{
+	paxos_message msg = {
+		.type = PAXOS_PREPARE_RANGE,
+		.u.prepare_range = *pr };
+	memcpy(&(msg.msg_info[0]), "PRER", 4);
+	peers_broadcast_acceptors(peers, &msg);
+}
 
 /**
- * Sends a paxos_accept message to the specified peer.
+ * Sends a paxos_accept message to all the acceptors. The message is encoded
+ * once, however many acceptors there are.
  *
- * @param p Pointer to the peer structure to which the paxos_accept message will be sent.
- * @param arg A pointer to the argument to be passed to the paxos_accept message.
+ * @param peers Pointer to the peers of the proposer.
+ * @param ar Pointer to the paxos_accept message to send.
  */
-static void peer_send_accept(struct peer* p, void* arg)
+static void broadcast_accept(struct peers* peers, paxos_accept* ar)
 {
-	//getcnt();
-	send_paxos_accept(peer_get_buffer(p), arg);
+	paxos_message msg = {
+		.type = PAXOS_ACCEPT,
+		.u.accept = *ar };
+	memcpy(&(msg.msg_info[0]), "ACCN", 4);
+	peers_broadcast_acceptors(peers, &msg);
 }
 
 /**
@@ -76,20 +100,26 @@ static void peer_send_accept(struct peer* p, void* arg)
  */
 static void proposer_preexecute(struct evproposer* p)
 {
+	paxos_prepare_range pr;
+
+	// A stable leader prepares all future instances once, values or not
+	if (p->stable_leader) {
+		if (proposer_prepare_leader(p->state, &pr))
+			broadcast_prepare_range(p->peers, &pr);
+		return;
+	}
+
 	if (proposer_no_values(p->state))
 		return;
 
-	int i;
-	paxos_prepare pr;
 	int count = p->preexec_window - proposer_prepared_count(p->state);
 
 	if (count <= 0)
 		return;
 
-	for (i = 0; i < count; i++) {
-		proposer_prepare(p->state, &pr);
-		peers_foreach_acceptor(p->peers, peer_send_prepare, &pr);
-	}
+	// One prepare (and one storage transaction per acceptor) for the window
+	if (proposer_prepare_range(p->state, count, &pr) > 0)
+		broadcast_prepare_range(p->peers, &pr);
 
 	// paxos_log_debug("Opened %d new instances", count);
 }
@@ -104,7 +134,7 @@ static void try_accept(struct evproposer* p)
 	paxos_accept accept;
 
 	while (proposer_accept(p->state, &accept))
-		peers_foreach_acceptor(p->peers, peer_send_accept, &accept);
+		broadcast_accept(p->peers, &accept);
 
 	proposer_preexecute(p);
 }
@@ -124,12 +154,33 @@ static void evproposer_handle_promise(struct peer* p, paxos_message* msg, void*
 	int preempted = proposer_receive_promise(proposer->state, pro, &prepare);
 
 	if (preempted)
-		peers_foreach_acceptor(proposer->peers, peer_send_prepare, &prepare);
+		broadcast_prepare(proposer->peers, &prepare);
 
 	paxos_log_debug("Proposer %u handling promise from %u trying to accept", get_prid(proposer->state), pro->aids[0]);
 	try_accept(proposer);
 }
 
+/**
+ * Handles the aggregated promise for a range of instances received from an acceptor.
+ *
+ * @param p Pointer to the peer structure.
+ * @param msg Pointer to the paxos_message received.
+ * @param arg Pointer to the evproposer structure.
+ */
+static void evproposer_handle_promise_range(struct peer* p, paxos_message* msg, void* arg)
+{
+	struct evproposer* proposer = arg;
+	paxos_prepare_range prepare;
+	paxos_promise_range* pro = &msg->u.promise_range;
+
+	if (proposer_receive_promise_range(proposer->state, pro, &prepare))
+		broadcast_prepare_range(proposer->peers, &prepare);
+
+	paxos_log_debug("Proposer %u handling promise from %u for iids %u-%u", get_prid(proposer->state),
+		pro->aid, pro->from_iid, pro->to_iid);
+	try_accept(proposer);
+}
+
 /**
  * Handles the accepted message received from an acceptor.
  *
@@ -159,7 +210,7 @@ static void evproposer_handle_preempted(struct peer* p, paxos_message* msg, void
 	int preempted = proposer_receive_preempted(proposer->state, &msg->u.preempted, &prepare);
 
 	if (preempted) {
-		peers_foreach_acceptor(proposer->peers, peer_send_prepare, &prepare);
+		broadcast_prepare(proposer->peers, &prepare);
 		try_accept(proposer);
 	}
 }
@@ -180,10 +231,28 @@ static void evproposer_handle_client_value(struct peer* p, paxos_message* msg, v
 	struct paxos_client_value* v = &msg->u.client_value;
 	paxos_log_debug("Proposer %u client value request", get_prid(proposer->state));
 	proposer_propose(proposer->state, v->value.paxos_value_val, v->value.paxos_value_len);
+	if (proposer_batched_count(proposer->state) > 0
+		&& !evtimer_pending(proposer->linger_ev, NULL))
+		evtimer_add(proposer->linger_ev, &proposer->linger);
 	try_accept(proposer);
 	paxos_log_debug("Proposer %u client value request completed", get_prid(proposer->state));
 }
 
+/**
+ * Seals the batch of client values once its linger time is over, even if
+ * it did not fill up.
+ *
+ * @param fd File descriptor.
+ * @param event Type of event.
+ * @param arg Pointer to the evproposer structure.
+ */
+static void evproposer_flush_batch(evutil_socket_t fd, short event, void *arg)
+{
+	struct evproposer* p = arg;
+	if (proposer_flush_batch(p->state))
+		try_accept(p);
+}
+
 /**
  * Handles the acceptor_state message received from an acceptor.
  *
@@ -199,7 +268,8 @@ static void evproposer_handle_acceptor_state(struct peer* p, paxos_message* msg,
 }
 
 /**
- * Checks for timeouts in the proposer and triggers corresponding actions.
+ * Checks for timeouts in the proposer and retransmits the prepares and
+ * accepts that timed out. Only the expired instances are visited.
  *
  * @param fd File descriptor.
  * @param event Type of event.
@@ -207,21 +277,23 @@ static void evproposer_handle_acceptor_state(struct peer* p, paxos_message* msg,
  */
 static void evproposer_check_timeouts(evutil_socket_t fd, short event, void *arg)
 {
-	return; // 11:26 14.11.2023
-
 	struct evproposer* p = arg;
 	struct timeout_iterator* iter = proposer_timeout_iterator(p->state);
 
 	paxos_prepare pr;	
 	while (timeout_iterator_prepare(iter, &pr)) {
 		// paxos_log_info("Instance %d timed out in phase 1.", pr.iid);
-		peers_foreach_acceptor(p->peers, peer_send_prepare, &pr);
+		broadcast_prepare(p->peers, &pr);
 	}
+
+	paxos_prepare_range lr;
+	if (timeout_iterator_prepare_leader(iter, &lr))
+		broadcast_prepare_range(p->peers, &lr);
 	
 	paxos_accept ar;
 	while (timeout_iterator_accept(iter, &ar)) {
 		// paxos_log_info("Instance %d timed out in phase 2.", ar.iid);
-		peers_foreach_acceptor(p->peers, peer_send_accept, &ar);
+		broadcast_accept(p->peers, &ar);
 	}
 	
 	timeout_iterator_free(iter);
@@ -257,19 +329,27 @@ struct evproposer* evproposer_init_internal(int id, struct evpaxos_config* c, st
 	p = malloc(sizeof(struct evproposer));
 	p->id = id;
 	p->preexec_window = paxos_config.proposer_preexec_window;
+	p->stable_leader = paxos_config.proposer_stable_leader;
 
 	peers_subscribe(peers, PAXOS_PROMISE, evproposer_handle_promise, p);
+	peers_subscribe(peers, PAXOS_PROMISE_RANGE, evproposer_handle_promise_range, p);
 	peers_subscribe(peers, PAXOS_ACCEPTED, evproposer_handle_accepted, p);
 	peers_subscribe(peers, PAXOS_PREEMPTED, evproposer_handle_preempted, p);
 	peers_subscribe(peers, PAXOS_CLIENT_VALUE, evproposer_handle_client_value, p);
 	peers_subscribe(peers, PAXOS_ACCEPTOR_STATE, evproposer_handle_acceptor_state, p);
 
-	// Setup timeout
+	// Setup timeout, checked a few times per proposer timeout
 	struct event_base* base = peers_get_event_base(peers);
-	p->tv.tv_sec = paxos_config.proposer_timeout;
-	p->tv.tv_usec = 0;
+	int period = paxos_config.proposer_timeout / 4;
+	if (period < 1)
+		period = 1;
+	p->tv.tv_sec = period / 1000;
+	p->tv.tv_usec = (period % 1000) * 1000;
 	p->timeout_ev = evtimer_new(base, evproposer_check_timeouts, p);
 	event_add(p->timeout_ev, &p->tv);
+	p->linger.tv_sec = paxos_config.proposer_batch_linger / 1000000;
+	p->linger.tv_usec = paxos_config.proposer_batch_linger % 1000000;
+	p->linger_ev = evtimer_new(base, evproposer_flush_batch, p);
 	p->state = proposer_new(p->id, acceptor_count);
 	p->peers = peers;
 	
@@ -320,6 +400,7 @@ struct evproposer* evproposer_init(int id, const char* config_file, struct event
 void evproposer_free_internal(struct evproposer* p)
 {
 	if (p != NULL) event_free(p->timeout_ev);
+	if (p != NULL) event_free(p->linger_ev);
 	if (p != NULL) proposer_free(p->state);
 	if (p != NULL) free(p);
 }
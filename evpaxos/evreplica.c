@@ -262,7 +262,10 @@ void evpaxos_replica_set_instance_id(struct evpaxos_replica* r, unsigned iid)
  */
 static void peer_send_trim(struct peer* p, void* arg)
 {
-	send_paxos_trim(peer_get_buffer(p), arg);
+	paxos_message msg = {
+		.type = PAXOS_TRIM,
+		.u.trim = *(paxos_trim*)arg };
+	peer_send_message(p, &msg);
 }
 
 /**
@@ -295,7 +298,11 @@ void evpaxos_replica_submit(struct evpaxos_replica* r, char* value, int size)
 	for (i = 0; i < peers_count(r->peers); ++i) {
 		p = peers_get_acceptor(r->peers, i);
 		if (peer_connected(p)) {
-			paxos_submit(peer_get_buffer(p), value, size);
+			paxos_message msg = {
+				.type = PAXOS_CLIENT_VALUE,
+				.u.client_value.value.paxos_value_len = size,
+				.u.client_value.value.paxos_value_val = value };
+			peer_send_message(p, &msg);
 			return;
 		}
 	}
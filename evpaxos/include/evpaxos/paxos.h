@@ -53,6 +53,49 @@ typedef void (*deliver_function)(
 	char* value,
 	size_t size,
 	void* arg);
+
+/**
+ * A value delivered to a deliver_batch_function.
+ */
+struct evpaxos_delivery
+{
+	unsigned int iid;
+	char* value;
+	size_t size;
+};
+
+/**
+ * A delivery callback invoked once with the values of all the contiguous
+ * instances decided while handling a message, in order. Values unpacked
+ * from a batched instance come in sequence with the same iid. The array
+ * and the values are valid only until the callback returns.
+ */
+typedef void (*deliver_batch_function)(
+	struct evpaxos_delivery* values,
+	int count,
+	void* arg);
+
+/**
+ * A delivery callback taking ownership of the value, which stays valid after
+ * the callback returns until evpaxos_value_release() is called on ref. The
+ * value is the buffer received from the network, handed over without copy;
+ * values unpacked from the same batch share it, and each of them must be
+ * released.
+ */
+typedef void (*deliver_owned_function)(
+	unsigned int iid,
+	char* value,
+	size_t size,
+	void* ref,
+	void* arg);
+
+/**
+ * Releases a value delivered to a deliver_owned_function.
+ *
+ * @param ref the ref passed along with the value
+ */
+void evpaxos_value_release(void* ref);
+
 /*
 *	Allocates param struct for threading
 */
@@ -121,6 +164,20 @@ int evpaxos_replica_count(struct evpaxos_replica* replica);
  */
 struct evlearner* evlearner_init(const char* config, deliver_function f, void* arg, struct event_base* base);
 
+/**
+ * Same as evlearner_init(), but the values decided together are delivered
+ * with a single call.
+ */
+struct evlearner* evlearner_init_batch(const char* config, deliver_batch_function f,
+	void* arg, struct event_base* base);
+
+/**
+ * Same as evlearner_init(), but values are handed over to the callback
+ * instead of being freed when it returns.
+ */
+struct evlearner* evlearner_init_owned(const char* config, deliver_owned_function f,
+	void* arg, struct event_base* base);
+
 /**
  * Release the memory allocated by the learner
  */
@@ -38,14 +38,42 @@ extern "C" {
 #include <event2/bufferevent.h>
 
 void send_paxos_message(struct bufferevent* bev, paxos_message* msg);
+void send_paxos_frame(struct bufferevent* bev, paxos_message* msg);
+void send_paxos_hello(struct bufferevent* bev);
+void send_paxos_switch(struct bufferevent* bev);
 void send_paxos_prepare(struct bufferevent* bev, paxos_prepare* msg);
+void send_paxos_prepare_range(struct bufferevent* bev, paxos_prepare_range* msg);
 void send_paxos_promise(struct bufferevent* bev, paxos_promise* msg);
 void send_paxos_accept(struct bufferevent* bev, paxos_accept* msg);
 void send_paxos_accepted(struct bufferevent* bev, paxos_accepted* msg);
 void send_paxos_preempted(struct bufferevent* bev, paxos_preempted* msg);
 void send_paxos_repeat(struct bufferevent* bev, paxos_repeat* msg);
 void send_paxos_trim(struct bufferevent* bev, paxos_trim* msg);
-int recv_paxos_message(struct evbuffer* in, paxos_message* out);
+
+// Packed messages at least this large are referenced by the output buffers
+// instead of being copied into them.
+#define PACKED_MESSAGE_REFERENCE_MIN 512
+
+// Values at least this large in a message handed over when packed are
+// referenced in place instead of being copied into the packed bytes.
+#define PACKED_VALUE_REFERENCE_MIN 1024
+
+struct packed_message;
+struct packed_message* pack_paxos_message(paxos_message* msg);
+struct packed_message* pack_paxos_frame(paxos_message* msg);
+struct packed_message* pack_paxos_message_owned(paxos_message* msg);
+struct packed_message* pack_paxos_frame_owned(paxos_message* msg);
+void send_packed_message(struct bufferevent* bev, struct packed_message* pm);
+void packed_message_release(struct packed_message* pm);
+int packed_message_refs(struct packed_message* pm);
+
+struct message_reader;
+struct message_reader* message_reader_new(void);
+void message_reader_free(struct message_reader* r);
+void message_reader_reset(struct message_reader* r);
+int message_reader_peer_version(struct message_reader* r);
+int recv_paxos_message(struct message_reader* r, struct evbuffer* in, paxos_message* out);
+
 unsigned long getcnt();
 unsigned long getcntbytes();
 
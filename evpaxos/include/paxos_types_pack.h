@@ -54,6 +54,10 @@ void msgpack_pack_paxos_acceptor_state(msgpack_packer* p, paxos_acceptor_state*
 void msgpack_unpack_paxos_acceptor_state(msgpack_object* o, paxos_acceptor_state* v);
 void msgpack_pack_paxos_client_value(msgpack_packer* p, paxos_client_value* v);
 void msgpack_unpack_paxos_client_value(msgpack_object* o, paxos_client_value* v);
+void msgpack_pack_paxos_prepare_range(msgpack_packer* p, paxos_prepare_range* v);
+void msgpack_unpack_paxos_prepare_range(msgpack_object* o, paxos_prepare_range* v);
+void msgpack_pack_paxos_promise_range(msgpack_packer* p, paxos_promise_range* v);
+void msgpack_unpack_paxos_promise_range(msgpack_object* o, paxos_promise_range* v);
 void msgpack_pack_paxos_message(msgpack_packer* p, paxos_message* v);
 void msgpack_unpack_paxos_message(msgpack_object* o, paxos_message* v);
 
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PAXOS_TYPES_WIRE_H_
+#define _PAXOS_TYPES_WIRE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "paxos_types.h"
+#include <stddef.h>
+
+/*
+ * Fixed-layout binary encoding of the hot message types. A frame is an
+ * 8 bytes header followed by the payload; all the integers are little-endian
+ * u32, the arrays of an accepted are stored one after the other so that
+ * they can be copied in and out in one go.
+ *
+ *   header:   u8 magic, u8 version, u8 type, u8 flags, u32 payload length
+ *   prepare:  src, iid, ballot
+ *   accept:   src, iid, ballot, value length, value
+ *   accepted: iid, n_aids, contents, [aids, ballots, value ballots],
+ *             [value lengths, values]
+ *
+ * The top bit of a value length is set when the value is a batch, see
+ * PAXOS_VALUE_BATCH. The bytes of the values come last, after a head of
+ * fixed size given the first bytes of the payload, so that large values can
+ * be copied straight out of the receive buffer. The magic byte is never the
+ * first byte of a msgpack object.
+ */
+#define PAXOS_WIRE_MAGIC 0xc1
+#define PAXOS_WIRE_VERSION 1
+#define PAXOS_WIRE_HEADER_SIZE 8
+
+/* Bytes of a payload paxos_wire_head_size() looks at. */
+#define PAXOS_WIRE_PREFIX_SIZE 12
+
+/* The payload is a msgpack encoded message, of a type with no fixed layout. */
+#define PAXOS_WIRE_MSGPACK 0x80
+
+/* Set in the length of a value that is a batch. */
+#define PAXOS_WIRE_VALUE_BATCH 0x80000000u
+
+struct paxos_wire_header
+{
+	uint8_t type;
+	uint8_t flags;
+	uint32_t len;
+};
+
+typedef void (*paxos_wire_value_cb)(char* buf, uint32_t len, void* arg);
+
+int paxos_wire_supported(paxos_message_type type);
+size_t paxos_wire_size(paxos_message* msg);
+size_t paxos_wire_encode(paxos_message* msg, char* buf);
+size_t paxos_wire_encode_head(paxos_message* msg, char* buf);
+int paxos_wire_values(paxos_message* msg, paxos_value** values);
+void paxos_wire_write_header(char* buf, uint8_t type, uint8_t flags, uint32_t len);
+int paxos_wire_read_header(const char* buf, struct paxos_wire_header* h);
+int paxos_wire_decode(struct paxos_wire_header* h, const char* payload, paxos_message* out);
+size_t paxos_wire_head_size(struct paxos_wire_header* h, const char* prefix);
+int paxos_wire_decode_head(struct paxos_wire_header* h, const char* head,
+	paxos_message* out, paxos_wire_value_cb read, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -43,6 +43,10 @@ struct peers;
 
 typedef void (*peer_cb)(struct peer* p, paxos_message* m, void* arg);
 typedef void (*peer_iter_cb)(struct peer* p, void* arg);
+typedef void (*peers_burst_cb)(void* arg);
+
+// Pairs of read burst callbacks a peers structure can hold.
+#define PEERS_MAX_BURST_SUBSCRIPTIONS 4
 	
 struct peers* peers_new(struct event_base* base, struct evpaxos_config* config);
 struct evpaxos_config* getconfigfrompeers(struct peers* peers);
@@ -51,14 +55,21 @@ int peers_count(struct peers* p);
 void peers_connect_to_acceptors(struct peers* p,int replica_id);
 int peers_listen(struct peers* p, int port);
 void peers_subscribe(struct peers* p, paxos_message_type t, peer_cb cb, void*);
+int peers_subscribe_burst(struct peers* p, peers_burst_cb begin, peers_burst_cb end, void* arg);
 void peers_foreach_acceptor(struct peers* p, peer_iter_cb cb, void* arg);
 void peers_foreach_down_acceptor(struct peers* p, peer_iter_cb cb, void* arg);
 void peers_foreach_client(struct peers* p, peer_iter_cb cb, void* arg);
+void peers_broadcast_acceptors(struct peers* p, paxos_message* msg);
+void peers_broadcast_down_acceptors(struct peers* p, paxos_message* msg);
+void peers_broadcast_clients(struct peers* p, paxos_message* msg);
+void peers_broadcast_clients_owned(struct peers* p, paxos_message* msg);
 struct peer* peers_get_acceptor(struct peers* p, int id);
 struct peer* peer_get_acceptor(struct peer* p, int id);
 struct event_base* peers_get_event_base(struct peers* p);
 int peer_get_id(struct peer* p);
 struct bufferevent* peer_get_buffer(struct peer* p);
+void peer_send_message(struct peer* p, paxos_message* msg);
+void peer_send_message_owned(struct peer* p, paxos_message* msg);
 int peer_connected(struct peer* p);
 
 #ifdef __cplusplus
@@ -29,6 +29,8 @@
 #include "paxos.h"
 #include "message.h"
 #include "paxos_types_pack.h"
+#include "paxos_types_wire.h"
+#include <stdlib.h>
 #include <string.h>
 
 volatile unsigned long nmsg = 0;
@@ -48,78 +50,427 @@ unsigned long getcntbytes()
 	return __sync_fetch_and_add(&nbytes, 0);
 }
 
+// Scratch buffers that grew larger than this while packing a message are
+// freed once the message is sent, rather than kept for the next one.
+#define MESSAGE_SCRATCH_MAX (1024 * 1024)
+
+// Messages packed into a scratch buffer at least this large are handed over
+// to the output buffer with the scratch buffer, instead of being copied.
+#define MESSAGE_SCRATCH_REFERENCE_MIN (4 * 1024)
+
+// Per-thread buffer messages are packed into before being sent
+static __thread msgpack_sbuffer scratch; // zeroed, i.e. empty
+
+static void message_free_cleanup(const void* data, size_t len, void* arg)
+{
+	free((void*)data);
+}
+
 /**
-  * Callback function to pack data and write it to a bufferevent.
-  *
-  * @param data A pointer to the bufferevent where the data should be written.
-  * @param buf A pointer to the data buffer to be written.
-  * @param len The length of the data to be written.
-  * @return Always returns 0.
-  */
-static int bufferevent_pack_data(void* data, const char* buf, size_t len)
+ * Appends the content of the scratch buffer to the output of a bufferevent
+ * with a single write, so the bufferevent lock is taken once per message.
+ * Large messages, e.g. carrying values of several KB, are not copied: the
+ * output buffer takes the scratch buffer and frees it once written out.
+ *
+ * @param bev The bufferevent to use for sending the message.
+ */
+static void send_scratch(struct bufferevent* bev)
 {
-	struct bufferevent* bev = (struct bufferevent*)data;
-	/*	
-	paxos_log_debug("len %d buffer: %lx", len, buf);
-	if(len == 1) 
-	{ 
-		paxos_log_debug("data written on 0 %lx", ((unsigned long) (*buf))&0xff);
-	}
-	*/
-	bufferevent_write(bev, buf, len);
-	__sync_fetch_and_add(&nbytes, len);
+	struct evbuffer* out = bufferevent_get_output(bev);
 
-	return 0;
+	if (scratch.size >= MESSAGE_SCRATCH_REFERENCE_MIN) {
+		size_t size = scratch.size;
+		char* data = msgpack_sbuffer_release(&scratch);
+		// On failure the cleanup function is not called
+		if (evbuffer_add_reference(out, data, size, message_free_cleanup, NULL) != 0) {
+			evbuffer_add(out, data, size);
+			free(data);
+		}
+		return;
+	}
+	evbuffer_add(out, scratch.data, scratch.size);
+	if (scratch.alloc > MESSAGE_SCRATCH_MAX) {
+		msgpack_sbuffer_destroy(&scratch);
+		memset(&scratch, 0, sizeof(scratch));
+	}
 }
 
 /**
- * Packs and sends a Paxos message using a bufferevent.
+ * Packs and sends a Paxos message using a bufferevent. The message is packed
+ * into a per-thread scratch buffer and appended to the output at once.
  *
  * @param bev The bufferevent to use for sending the message.
  * @param msg A pointer to the Paxos message to be sent.
  */
 void send_paxos_message(struct bufferevent* bev, paxos_message* msg)
 {
+	msgpack_packer packer;
+
+	msgpack_sbuffer_clear(&scratch);
+	msgpack_packer_init(&packer, &scratch, msgpack_sbuffer_write);
+	msgpack_pack_paxos_message(&packer, msg);
+	__sync_fetch_and_add(&nmsg, inc);
+	__sync_fetch_and_add(&nbytes, scratch.size);
+	send_scratch(bev);
+}
+
+/**
+ * Packs a message with no fixed binary layout as a frame whose payload is
+ * the msgpack encoding of the message.
+ *
+ * @param buffer The buffer to append the frame to.
+ * @param msg A pointer to the Paxos message to be packed.
+ */
+static void pack_msgpack_frame(msgpack_sbuffer* buffer, paxos_message* msg)
+{
+	char header[PAXOS_WIRE_HEADER_SIZE] = {0};
+	msgpack_packer packer;
+	size_t start = buffer->size;
+
+	msgpack_sbuffer_write(buffer, header, sizeof(header));
+	msgpack_packer_init(&packer, buffer, msgpack_sbuffer_write);
+	msgpack_pack_paxos_message(&packer, msg);
+	paxos_wire_write_header(buffer->data + start, msg->type, PAXOS_WIRE_MSGPACK,
+		buffer->size - start - PAXOS_WIRE_HEADER_SIZE);
+}
+
+/**
+ * Sends a Paxos message as a frame, to a peer that switched to frames.
+ * Messages with a fixed binary layout are encoded in place in the output
+ * buffer, the others are wrapped in a frame as msgpack.
+ *
+ * @param bev The bufferevent to use for sending the message.
+ * @param msg A pointer to the Paxos message to be sent.
+ */
+void send_paxos_frame(struct bufferevent* bev, paxos_message* msg)
+{
+	struct evbuffer* out = bufferevent_get_output(bev);
+	struct evbuffer_iovec v;
+	size_t size;
+
+	if (!paxos_wire_supported(msg->type)) {
+		msgpack_sbuffer_clear(&scratch);
+		pack_msgpack_frame(&scratch, msg);
+		__sync_fetch_and_add(&nmsg, inc);
+		__sync_fetch_and_add(&nbytes, scratch.size);
+		send_scratch(bev);
+		return;
+	}
+
+	size = paxos_wire_size(msg);
+	// Nothing may be added between the reservation and the commit
+	evbuffer_lock(out);
+	if (evbuffer_reserve_space(out, size, &v, 1) == 1) {
+		v.iov_len = paxos_wire_encode(msg, v.iov_base);
+		evbuffer_commit_space(out, &v, 1);
+	} else {
+		paxos_log_error("Could not reserve %lu bytes to send a message",
+			(unsigned long)size);
+	}
+	evbuffer_unlock(out);
+	__sync_fetch_and_add(&nmsg, inc);
+	__sync_fetch_and_add(&nbytes, size);
+}
+
+/**
+ * Sends the version of the frames this side can decode. A peer that can
+ * decode them too answers by switching its messages to frames.
+ *
+ * @param bev The bufferevent to use for sending the message.
+ */
+void send_paxos_hello(struct bufferevent* bev)
+{
+	msgpack_packer packer;
+
+	msgpack_sbuffer_clear(&scratch);
+	msgpack_packer_init(&packer, &scratch, msgpack_sbuffer_write);
+	msgpack_pack_unsigned_int(&packer, PAXOS_WIRE_VERSION);
+	send_scratch(bev);
+}
+
+/**
+ * Tells the peer that everything sent after this marker is a frame.
+ *
+ * @param bev The bufferevent to use for sending the message.
+ */
+void send_paxos_switch(struct bufferevent* bev)
+{
+	msgpack_packer packer;
+
+	msgpack_sbuffer_clear(&scratch);
+	msgpack_packer_init(&packer, &scratch, msgpack_sbuffer_write);
+	msgpack_pack_nil(&packer);
+	send_scratch(bev);
+}
+
+/*
+ * A value of a packed message that is not copied into the packed bytes:
+ * output buffers reference it in place, at the given offset of the bytes.
+ */
+struct packed_value
+{
+	size_t offset;
+	const char* data;
+	size_t len;
+};
+
+/*
+ * A message packed once and shared by the output buffers of all the peers
+ * it is sent to. Output buffers reference the packed bytes until they are
+ * written out; the last reference released frees them.
+ *
+ * A message handed over when packed is kept along with its packed bytes,
+ * and its large values are referenced where they are instead of being
+ * copied; the last reference released destroys it.
+ */
+struct packed_message
+{
+	int refs;
+	msgpack_sbuffer buffer;
+	int owned;                    /* msg was handed over */
+	paxos_message msg;
+	int values_count;
+	struct packed_value* values;  /* ordered by offset */
+	size_t values_size;
+};
+
+static struct packed_message* packed_message_new(void)
+{
+	struct packed_message* pm = malloc(sizeof(struct packed_message));
+	pm->refs = 1;
+	msgpack_sbuffer_init(&pm->buffer);
+	pm->owned = 0;
+	pm->values_count = 0;
+	pm->values = NULL;
+	pm->values_size = 0;
+	return pm;
+}
+
+/**
+ * Appends bytes to a packed message that owns its message. Bytes at least
+ * PACKED_VALUE_REFERENCE_MIN long can only be a value of the message, and
+ * are referenced rather than copied.
+ *
+ * @param data A pointer to the packed message.
+ * @param buf The bytes to append.
+ * @param len The number of bytes.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int packed_message_write(void* data, const char* buf, size_t len)
+{
+	struct packed_message* pm = data;
+	struct packed_value* values;
+
+	if (len < PACKED_VALUE_REFERENCE_MIN)
+		return msgpack_sbuffer_write(&pm->buffer, buf, len);
+	values = realloc(pm->values, (pm->values_count + 1) * sizeof(struct packed_value));
+	if (values == NULL)
+		return -1;
+	values[pm->values_count].offset = pm->buffer.size;
+	values[pm->values_count].data = buf;
+	values[pm->values_count].len = len;
+	pm->values = values;
+	pm->values_count++;
+	pm->values_size += len;
+	return 0;
+}
+
+/**
+ * Packs a Paxos message once, to be sent to several peers.
+ *
+ * @param msg A pointer to the Paxos message to be packed.
+ * @return The packed message, to be released with packed_message_release().
+ */
+struct packed_message* pack_paxos_message(paxos_message* msg)
+{
+	msgpack_packer packer;
+	struct packed_message* pm = packed_message_new();
+	msgpack_packer_init(&packer, &pm->buffer, msgpack_sbuffer_write);
+	msgpack_pack_paxos_message(&packer, msg);
+	return pm;
+}
+
+/**
+ * Packs a Paxos message once as a frame, to be sent to several peers that
+ * switched to frames.
+ *
+ * @param msg A pointer to the Paxos message to be packed.
+ * @return The packed message, to be released with packed_message_release().
+ */
+struct packed_message* pack_paxos_frame(paxos_message* msg)
+{
+	struct packed_message* pm = packed_message_new();
+	if (paxos_wire_supported(msg->type)) {
+		pm->buffer.alloc = paxos_wire_size(msg);
+		pm->buffer.data = malloc(pm->buffer.alloc);
+		pm->buffer.size = paxos_wire_encode(msg, pm->buffer.data);
+	} else {
+		pack_msgpack_frame(&pm->buffer, msg);
+	}
+	return pm;
+}
+
+/**
+ * Packs a Paxos message handed over by the caller, who must neither use
+ * nor destroy it afterwards. Values of at least PACKED_VALUE_REFERENCE_MIN
+ * bytes are not copied: output buffers reference them in place, and the
+ * message is destroyed with the last reference.
+ *
+ * The message stays valid while the caller holds its reference, e.g. to
+ * pack it once more with pack_paxos_frame() or pack_paxos_message().
+ *
+ * @param msg A pointer to the Paxos message to be handed over.
+ * @param framed Whether to pack the message as a frame.
+ * @return The packed message, to be released with packed_message_release().
+ */
+static struct packed_message* pack_owned(paxos_message* msg, int framed)
+{
+	char header[PAXOS_WIRE_HEADER_SIZE] = {0};
+	msgpack_packer packer;
+	paxos_value* values;
+	size_t size;
+	int i, n;
+	struct packed_message* pm = packed_message_new();
+
+	pm->owned = 1;
+	pm->msg = *msg;
+	msgpack_packer_init(&packer, pm, packed_message_write);
+	if (!framed) {
+		msgpack_pack_paxos_message(&packer, &pm->msg);
+	} else if (paxos_wire_supported(pm->msg.type)) {
+		// The head is encoded in place, the values are appended after it
+		n = paxos_wire_values(&pm->msg, &values);
+		size = paxos_wire_size(&pm->msg);
+		for (i = 0; i < n; i++)
+			if (values[i].paxos_value_val != NULL &&
+				values[i].paxos_value_len >= PACKED_VALUE_REFERENCE_MIN)
+				size -= values[i].paxos_value_len;
+		pm->buffer.alloc = size;
+		pm->buffer.data = malloc(size);
+		pm->buffer.size = paxos_wire_encode_head(&pm->msg, pm->buffer.data);
+		for (i = 0; i < n; i++)
+			if (values[i].paxos_value_val != NULL && values[i].paxos_value_len > 0)
+				packed_message_write(pm, values[i].paxos_value_val,
+					values[i].paxos_value_len);
+	} else {
+		msgpack_sbuffer_write(&pm->buffer, header, sizeof(header));
+		msgpack_pack_paxos_message(&packer, &pm->msg);
+		paxos_wire_write_header(pm->buffer.data, pm->msg.type, PAXOS_WIRE_MSGPACK,
+			pm->buffer.size + pm->values_size - PAXOS_WIRE_HEADER_SIZE);
+	}
+	return pm;
+}
+
+/**
+ * Packs a Paxos message handed over by the caller, see pack_owned().
+ *
+ * @param msg A pointer to the Paxos message to be handed over.
+ * @return The packed message, to be released with packed_message_release().
+ */
+struct packed_message* pack_paxos_message_owned(paxos_message* msg)
+{
+	return pack_owned(msg, 0);
+}
+
+/**
+ * Packs a Paxos message handed over by the caller as a frame, see
+ * pack_owned().
+ *
+ * @param msg A pointer to the Paxos message to be handed over.
+ * @return The packed message, to be released with packed_message_release().
+ */
+struct packed_message* pack_paxos_frame_owned(paxos_message* msg)
+{
+	return pack_owned(msg, 1);
+}
+
+/**
+ * Releases a reference to a packed message, freeing it with the last one.
+ * References may be released from any thread.
+ *
+ * @param pm A pointer to the packed message.
+ */
+void packed_message_release(struct packed_message* pm)
+{
+	if (__atomic_sub_fetch(&pm->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		msgpack_sbuffer_destroy(&pm->buffer);
+		if (pm->owned)
+			paxos_message_destroy(&pm->msg);
+		free(pm->values);
+		free(pm);
+	}
+}
+
+/**
+ * Returns the number of references held to a packed message: the one of
+ * its owner plus one per piece of it queued in an output buffer and not
+ * written yet.
+ *
+ * @param pm A pointer to the packed message.
+ * @return The number of references.
+ */
+int packed_message_refs(struct packed_message* pm)
+{
+	return __atomic_load_n(&pm->refs, __ATOMIC_ACQUIRE);
+}
+
+static void packed_message_cleanup(const void* data, size_t len, void* arg)
+{
+	packed_message_release(arg);
+}
+
+/**
+ * Appends a piece of a packed message to an output buffer. Small pieces
+ * are copied, larger ones are referenced until written out.
+ *
+ * @param out The output buffer.
+ * @param pm A pointer to the packed message.
+ * @param data The first byte of the piece.
+ * @param len The length of the piece.
+ */
+static void packed_message_add(struct evbuffer* out, struct packed_message* pm,
+	const char* data, size_t len)
+{
+	if (len < PACKED_MESSAGE_REFERENCE_MIN) {
+		if (len > 0)
+			evbuffer_add(out, data, len);
+		return;
+	}
+	__atomic_add_fetch(&pm->refs, 1, __ATOMIC_ACQ_REL);
+	// On failure the cleanup function is not called
+	if (evbuffer_add_reference(out, data, len, packed_message_cleanup, pm) != 0) {
+		evbuffer_add(out, data, len);
+		packed_message_release(pm);
+	}
+}
+
+/**
+ * Appends a packed message to the output of a bufferevent. Small messages
+ * are copied, larger ones are referenced until written out. The values a
+ * message references in place are added as pieces of their own between
+ * its packed bytes, so they are written out with scatter/gather I/O.
+ *
+ * @param bev The bufferevent to use for sending the message.
+ * @param pm A pointer to the packed message.
+ */
+void send_packed_message(struct bufferevent* bev, struct packed_message* pm)
+{
+	struct evbuffer* out = bufferevent_get_output(bev);
+	size_t offset = 0;
+	int i;
+
 	__sync_fetch_and_add(&nmsg, inc);
-	// paxos_log_debug("message counter2 %ld", __sync_fetch_and_add(&nmsg, 0));
-	msgpack_packer* packer;
-	// Create a msgpack_packer associated with the provided bufferevent
-	packer = msgpack_packer_new(bev, bufferevent_pack_data);
-	// Pack the paxos_message using the msgpack_packer
-	// paxos_log_debug("Packing message for sending of type %d",msg->type);
-	/*switch (msg->type)
-	{
-	case PAXOS_PREPARE:
-		paxos_log_debug("PAXOS_PREPARE");
-		break;
-	case PAXOS_PROMISE:
-		paxos_log_debug("PAXOS_PROMISE");
-		break;
-	case PAXOS_ACCEPT:
-		paxos_log_debug("PAXOS_ACCEPT");
-		break;
-	case PAXOS_ACCEPTED:
-		paxos_log_debug("PAXOS_ACCEPTED");
-		break;
-	case PAXOS_PREEMPTED:
-		paxos_log_debug("PAXOS_PREEMPTED");
-		break;
-	case PAXOS_REPEAT:
-		paxos_log_debug("PAXOS_REPEAT");
-		break;
-	case PAXOS_TRIM:
-		paxos_log_debug("PAXOS_TRIM");
-		break;
-	case PAXOS_ACCEPTOR_STATE:
-		paxos_log_debug("PAXOS_ACCEPTOR_STATE");
-		break;
-	case PAXOS_CLIENT_VALUE:
-		paxos_log_debug("PAXOS_CLIENT_VALUE");
-		break;
+	__sync_fetch_and_add(&nbytes, pm->buffer.size + pm->values_size);
+	// Nothing may be added between the pieces of the message
+	evbuffer_lock(out);
+	for (i = 0; i < pm->values_count; i++) {
+		struct packed_value* v = &pm->values[i];
+		packed_message_add(out, pm, pm->buffer.data + offset, v->offset - offset);
+		packed_message_add(out, pm, v->data, v->len);
+		offset = v->offset;
 	}
-	*/
-	msgpack_pack_paxos_message(packer, msg);	
-	msgpack_packer_free(packer);
+	packed_message_add(out, pm, pm->buffer.data + offset, pm->buffer.size - offset);
+	evbuffer_unlock(out);
 }
 
 /**
@@ -138,6 +489,21 @@ void send_paxos_prepare(struct bufferevent* bev, paxos_prepare* p)
 	// paxos_log_debug("Send prepare for iid %d ballot %d", p->iid, p->ballot);
 }
 
+/**
+ * Sends a Paxos prepare message for a range of instances using a bufferevent.
+ *
+ * @param bev The bufferevent to use for sending the prepare message.
+ * @param p A pointer to the Paxos range prepare message to be sent.
+ */
+void send_paxos_prepare_range(struct bufferevent* bev, paxos_prepare_range* p)
+{
+	paxos_message msg = {
+		.type = PAXOS_PREPARE_RANGE,
+		.u.prepare_range = *p };
+	memcpy(&(msg.msg_info[0]), "PRER", 4);
+	send_paxos_message(bev, &msg);
+}
+
 /**
  * Sends a Paxos promise message using a bufferevent.
  *
@@ -253,70 +619,316 @@ void paxos_submit(struct bufferevent* bev, char* data, int size)
 	send_paxos_message(bev, &msg);
 }
 
+/*
+ * Incremental decoder of the messages received on a connection. Bytes are
+ * moved once from the input evbuffer into the unpacker, which keeps its
+ * parsing state across reads, so a message split across reads is not
+ * parsed again from its start and a burst is never linearised.
+ *
+ * Once the peer sends the switch marker, the rest of the stream is made of
+ * frames (see paxos_types_wire.h), which are decoded one at a time out of
+ * the frames buffer.
+ */
+struct message_reader
+{
+	msgpack_unpacker unpacker;
+	msgpack_unpacked result;
+	int peer_version;      /* frame version the peer can decode, 0 if none */
+	int framed;            /* the peer sends frames */
+	struct evbuffer* frames;
+};
+
+// Input chunks moved into the unpacker per feed.
+#define MESSAGE_READER_IOVECS 16
+
+// Frames at least this large are not pulled up: their values are copied
+// straight out of the input chunks into their own buffers.
+#define MESSAGE_READER_PULLUP_MAX (1024)
+
 /**
- * Unpacks a Paxos message from an event buffer and stores the result in the provided paxos_message structure.
+ * Creates a decoder for the messages received on a connection.
  *
- * @param in Pointer to the input event buffer containing the packed Paxos message.
- * @param out Pointer to the paxos_message structure where the unpacked message will be stored.
- * @return Returns 1 if the message was successfully unpacked and stored, 0 otherwise.
- */
-int recv_paxos_message(struct evbuffer* in, paxos_message* out)
-{
-	int rv = 0; // Return value indicating successful unpacking
-	char* buffer; // Buffer holding packed message data
-	size_t size, offset = 0;
-	msgpack_unpacked msg; // Unpacked message structure
-	size = evbuffer_get_length(in);
-
-	if (size == 0) // Return 0 if buffer is empty
-		return rv;
-
-	// paxos_log_debug("Bytes in buffer %ld, Starting to unpack.",size);
-	msgpack_unpacked_init(&msg);
-	buffer = (char*)evbuffer_pullup(in, size);
-	int rc = msgpack_unpack_next(&msg, buffer, size, &offset);
-	// paxos_log_debug("is message ready %ld", rc);
-	// paxos_log_debug("Buffer: %d", sizeof(buffer));
-	if (rc > 0) {
-		if (size > 0)
-		{
-			char bf[1024]; 
-			for (int i = 0; i < (size+15)/16; i++)
-			{
-				memset(bf, 0, sizeof(bf));
-				// sprintf(&(bf[strlen(bf)]), "\n%d:", i * 16);
-				/*for (int j = 0; j + i * 16 < size && j < 16; j++)
-				{
-					// sprintf(&(bf[strlen(bf)]), "0x%2x.", (0xff) & ((unsigned int)buffer[i*16+j]));
-				}*/
-				// paxos_log_debug(bf);
+ * @return Pointer to the new reader.
+ */
+struct message_reader* message_reader_new(void)
+{
+	struct message_reader* r = malloc(sizeof(struct message_reader));
+	if (r == NULL)
+		return NULL;
+	if (!msgpack_unpacker_init(&r->unpacker, MSGPACK_UNPACKER_INIT_BUFFER_SIZE)) {
+		free(r);
+		return NULL;
+	}
+	msgpack_unpacked_init(&r->result);
+	r->peer_version = 0;
+	r->framed = 0;
+	r->frames = evbuffer_new();
+	return r;
+}
+
+/**
+ * Frees a reader and any partially received message.
+ *
+ * @param r Pointer to the reader.
+ */
+void message_reader_free(struct message_reader* r)
+{
+	msgpack_unpacked_destroy(&r->result);
+	msgpack_unpacker_destroy(&r->unpacker);
+	evbuffer_free(r->frames);
+	free(r);
+}
+
+/**
+ * Discards the bytes buffered by a reader, e.g. when its connection is
+ * re-established, so that decoding restarts at a message boundary. The
+ * reader expects msgpack again until the peer switches to frames.
+ *
+ * @param r Pointer to the reader.
+ */
+void message_reader_reset(struct message_reader* r)
+{
+	msgpack_unpacked_destroy(&r->result);
+	msgpack_unpacked_init(&r->result);
+	msgpack_unpacker_destroy(&r->unpacker);
+	msgpack_unpacker_init(&r->unpacker, MSGPACK_UNPACKER_INIT_BUFFER_SIZE);
+	evbuffer_drain(r->frames, evbuffer_get_length(r->frames));
+	r->peer_version = 0;
+	r->framed = 0;
+}
+
+/**
+ * Returns the frame version announced by the peer.
+ *
+ * @param r Pointer to the reader.
+ * @return The version, 0 if the peer did not announce one.
+ */
+int message_reader_peer_version(struct message_reader* r)
+{
+	return r->peer_version;
+}
+
+/**
+ * Switches a reader to frames. The bytes the unpacker holds past the switch
+ * marker are the first bytes of the frames.
+ *
+ * @param r Pointer to the reader.
+ */
+static void message_reader_switch(struct message_reader* r)
+{
+	size_t pending = msgpack_unpacker_nonparsed_size(&r->unpacker);
+	evbuffer_add(r->frames, r->unpacker.buffer + r->unpacker.off, pending);
+	msgpack_unpacker_skip_nonparsed_buffer(&r->unpacker, pending);
+	r->framed = 1;
+}
+
+/**
+ * Decodes the payload of a frame.
+ *
+ * @param r Pointer to the reader.
+ * @param h The header of the frame.
+ * @param payload The payload of the frame.
+ * @param out Pointer to the paxos_message structure to fill in.
+ * @return 0 on success, -1 if the payload is malformed.
+ */
+static int message_reader_decode_frame(struct message_reader* r,
+	struct paxos_wire_header* h, const char* payload, paxos_message* out)
+{
+	size_t off = 0;
+
+	if (!(h->flags & PAXOS_WIRE_MSGPACK))
+		return paxos_wire_decode(h, payload, out);
+	if (msgpack_unpack_next(&r->result, payload, h->len, &off) != MSGPACK_UNPACK_SUCCESS
+		|| off != h->len || r->result.data.type != MSGPACK_OBJECT_ARRAY)
+		return -1;
+	msgpack_unpack_paxos_message(&r->result.data, out);
+	return 0;
+}
+
+/*
+ * Position of the next value to read in a frame that was not pulled up.
+ *
+ * Each value is copied once into a buffer of its own rather than detached
+ * with evbuffer_remove_buffer(): storage, the learner and the applications
+ * take values as contiguous buffers freed with free(), which a detached
+ * evbuffer cannot be turned into without that same copy. Receiving values
+ * without copying needs a reference counted value type throughout, and is
+ * not done yet.
+ */
+struct frame_values
+{
+	struct evbuffer* frames;
+	struct evbuffer_ptr pos;
+};
+
+static void message_reader_copy_value(char* buf, uint32_t len, void* arg)
+{
+	struct frame_values* v = arg;
+	evbuffer_copyout_from(v->frames, &v->pos, buf, len);
+	evbuffer_ptr_set(v->frames, &v->pos, len, EVBUFFER_PTR_ADD);
+}
+
+/**
+ * Decodes a large frame with a fixed binary layout, leaving its values
+ * where they were received: only the head of the payload is pulled up,
+ * while the bytes of each value are copied once into its own buffer,
+ * whatever the number of input chunks they span.
+ *
+ * @param r Pointer to the reader.
+ * @param h The header of the frame, at the start of the frames buffer.
+ * @param out Pointer to the paxos_message structure to fill in.
+ * @return 0 on success, -1 if the frame is malformed.
+ */
+static int message_reader_decode_large_frame(struct message_reader* r,
+	struct paxos_wire_header* h, paxos_message* out)
+{
+	struct frame_values v;
+	unsigned char* head;
+	size_t size;
+
+	head = evbuffer_pullup(r->frames, PAXOS_WIRE_HEADER_SIZE + PAXOS_WIRE_PREFIX_SIZE);
+	if (head == NULL)
+		return -1;
+	size = paxos_wire_head_size(h, (char*)head + PAXOS_WIRE_HEADER_SIZE);
+	if (size == 0)
+		return -1;
+	head = evbuffer_pullup(r->frames, PAXOS_WIRE_HEADER_SIZE + size);
+	if (head == NULL)
+		return -1;
+	v.frames = r->frames;
+	evbuffer_ptr_set(r->frames, &v.pos, PAXOS_WIRE_HEADER_SIZE + size, EVBUFFER_PTR_SET);
+	return paxos_wire_decode_head(h, (char*)head + PAXOS_WIRE_HEADER_SIZE, out,
+		message_reader_copy_value, &v);
+}
+
+/**
+ * Decodes the next frame received on a connection. A frame not yet
+ * complete stays buffered until more bytes arrive; a complete one is
+ * pulled up alone, so a burst of frames is never linearised, and large
+ * ones are not pulled up at all.
+ *
+ * @param r Pointer to the reader of the connection.
+ * @param in Pointer to the input event buffer of the connection.
+ * @param out Pointer to the paxos_message structure to fill in.
+ * @return Returns 1 if a message was decoded and stored, 0 if more bytes
+ *         are needed, -1 if the frame is malformed.
+ */
+static int recv_paxos_frame(struct message_reader* r, struct evbuffer* in, paxos_message* out)
+{
+	char header[PAXOS_WIRE_HEADER_SIZE];
+	struct paxos_wire_header h;
+	size_t size, pending;
+	unsigned char* frame;
+
+	evbuffer_add_buffer(r->frames, in);
+	pending = evbuffer_get_length(r->frames);
+	if (pending < PAXOS_WIRE_HEADER_SIZE)
+		return 0;
+	evbuffer_copyout(r->frames, header, PAXOS_WIRE_HEADER_SIZE);
+	if (paxos_wire_read_header(header, &h) == 0) {
+		size = PAXOS_WIRE_HEADER_SIZE + (size_t)h.len;
+		if (pending < size)
+			return 0;
+		if (h.len >= MESSAGE_READER_PULLUP_MAX && !(h.flags & PAXOS_WIRE_MSGPACK)) {
+			if (message_reader_decode_large_frame(r, &h, out) == 0) {
+				evbuffer_drain(r->frames, size);
+				return 1;
+			}
+		} else {
+			frame = evbuffer_pullup(r->frames, size);
+			if (frame != NULL && message_reader_decode_frame(r, &h,
+					(char*)frame + PAXOS_WIRE_HEADER_SIZE, out) == 0) {
+				evbuffer_drain(r->frames, size);
+				return 1;
 			}
 		}
-		// paxos_log_debug("Size: %d offset", size, offset);
-		msgpack_unpack_paxos_message(&msg.data, out); // Unpack the message into the provided paxos_message structure
-		evbuffer_drain(in, offset); // Remove the consumed data from the input buffer
-		rv = 1;
+	}
+	paxos_log_error("Invalid frame received, %lu bytes pending",
+		(unsigned long)pending);
+	return -1;
+}
+
+/**
+ * Moves the first chunks of an input buffer into the unpacker.
+ *
+ * @param r Pointer to the reader.
+ * @param in Pointer to the input event buffer.
+ * @return The number of bytes moved, 0 if the buffer is empty or on error.
+ */
+static size_t message_reader_feed(struct message_reader* r, struct evbuffer* in)
+{
+	struct evbuffer_iovec v[MESSAGE_READER_IOVECS];
+	size_t total = 0;
+	char* buffer;
+	int i, n;
 
+	n = evbuffer_peek(in, -1, NULL, v, MESSAGE_READER_IOVECS);
+	if (n > MESSAGE_READER_IOVECS)
+		n = MESSAGE_READER_IOVECS;
+	for (i = 0; i < n; i++)
+		total += v[i].iov_len;
+	if (total == 0)
+		return 0;
+	if (!msgpack_unpacker_reserve_buffer(&r->unpacker, total)) {
+		paxos_log_error("Could not reserve %lu bytes to decode messages",
+			(unsigned long)total);
+		return 0;
 	}
-	else if (rc == 0)
-	{
-		// paxos_log_debug("No data in buffer");
-		if (size > 0)
-		{
-			for (int i = 0; i < size; i++)
-			{
-		//		 paxos_log_debug("offset %d value 0x%2x", i, (0xff) & ((unsigned int) buffer[i]));
+	buffer = msgpack_unpacker_buffer(&r->unpacker);
+	for (i = 0; i < n; i++) {
+		memcpy(buffer, v[i].iov_base, v[i].iov_len);
+		buffer += v[i].iov_len;
+	}
+	msgpack_unpacker_buffer_consumed(&r->unpacker, total);
+	evbuffer_drain(in, total);
+	return total;
+}
+
+/**
+ * Unpacks the next Paxos message received on a connection. Messages are
+ * yielded one at a time; a message not yet complete stays buffered in the
+ * reader until more bytes arrive. The peer's hello and switch marker are
+ * consumed here and never yielded.
+ *
+ * A stream that fails to parse cannot be resumed at a known boundary, so
+ * the reader gives up: the caller must close the connection, and reset the
+ * reader before using it on a new one.
+ *
+ * @param r Pointer to the reader of the connection.
+ * @param in Pointer to the input event buffer of the connection.
+ * @param out Pointer to the paxos_message structure where the unpacked message will be stored.
+ * @return Returns 1 if a message was unpacked and stored, 0 if more bytes
+ *         are needed, -1 if the stream is malformed.
+ */
+int recv_paxos_message(struct message_reader* r, struct evbuffer* in, paxos_message* out)
+{
+	if (r->framed)
+		return recv_paxos_frame(r, in, out);
+	for (;;) {
+		msgpack_unpack_return rc = msgpack_unpacker_next(&r->unpacker, &r->result);
+		if (rc == MSGPACK_UNPACK_SUCCESS) {
+			msgpack_object* o = &r->result.data;
+			if (o->type == MSGPACK_OBJECT_ARRAY) {
+				msgpack_unpack_paxos_message(o, out);
+				return 1;
+			}
+			if (o->type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+				r->peer_version = (int)o->via.u64;
+				continue;
+			}
+			if (o->type == MSGPACK_OBJECT_NIL) {
+				message_reader_switch(r);
+				return recv_paxos_frame(r, in, out);
 			}
+			rc = MSGPACK_UNPACK_PARSE_ERROR;
 		}
-		// paxos_log_debug("Size: %d offset", size, offset);
-
-	}
-	else
-	{
-		// paxos_log_debug("Error in the buffer,rc= %d size: %d, draining buffer" ,rc, size);
-		evbuffer_drain(in, 2 * 1024 * 1024);
+		if (rc != MSGPACK_UNPACK_CONTINUE) {
+			paxos_log_error("Invalid message received, %lu bytes pending",
+				(unsigned long)(msgpack_unpacker_message_size(&r->unpacker)
+					+ evbuffer_get_length(in)));
+			return -1;
+		}
+		if (message_reader_feed(r, in) == 0)
+			return 0;
 	}
-	// paxos_log_debug("Finishing unpack.");
-	msgpack_unpacked_destroy(&msg);  // Clean up the unpacked message structure
-	return rv; // Return the result of the unpacking process (1 for success, 0 for failure)
 }
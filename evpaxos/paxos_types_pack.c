@@ -27,6 +27,7 @@
 
 
 #include "paxos_types_pack.h"
+#include "aidset.h"
 void paxos_log(int level, const char* format, va_list ap);
 void paxos_log_error(const char* format, ...);
 void paxos_log_info(const char* format, ...);
@@ -109,6 +110,8 @@ static void msgpack_unpack_string_at(msgpack_object* o, char** buffer, int* len,
 
 /**
  * Packs a paxos_value structure into a MessagePack buffer using the given packer.
+ * A value with flags is packed as a [flags, bytes] array in place of its
+ * bytes, so that the messages keep the same number of elements.
  *
  * @param p Pointer to the MessagePack packer.
  * @param v Pointer to the paxos_value structure to be packed.
@@ -118,8 +121,14 @@ static void msgpack_pack_paxos_value(msgpack_packer* p, paxos_value* v)
 	if (v == NULL)
 	{
 		msgpack_pack_string(p, "", 0);
-	} 
-	else if (v->paxos_value_val == NULL)
+		return;
+	}
+	if (v->paxos_value_flags != 0)
+	{
+		msgpack_pack_array(p, 2);
+		msgpack_pack_uint32(p, v->paxos_value_flags);
+	}
+	if (v->paxos_value_val == NULL)
 	{
 		msgpack_pack_string(p, "", 0);
 	}
@@ -138,6 +147,17 @@ static void msgpack_pack_paxos_value(msgpack_packer* p, paxos_value* v)
  */
 static void msgpack_unpack_paxos_value_at(msgpack_object* o, paxos_value* v, int* i)
 {
+	msgpack_object* e = &o->via.array.ptr[*i];
+	int j = 0;
+
+	v->paxos_value_flags = 0;
+	if (e->type == MSGPACK_OBJECT_ARRAY && e->via.array.size == 2)
+	{
+		msgpack_unpack_uint32_at(e, &v->paxos_value_flags, &j);
+		msgpack_unpack_string_at(e, &v->paxos_value_val, &v->paxos_value_len, &j);
+		(*i)++;
+		return;
+	}
 	msgpack_unpack_string_at(o, &v->paxos_value_val, &v->paxos_value_len, i);
 }
 
@@ -171,6 +191,89 @@ void msgpack_unpack_paxos_prepare(msgpack_object* o, paxos_prepare* v)
 	msgpack_unpack_uint32_at(o, &v->ballot, &i);
 }
 
+/**
+ * Packs a paxos_prepare_range structure into a MessagePack buffer using the given packer.
+ *
+ * @param p Pointer to the MessagePack packer.
+ * @param v Pointer to the paxos_prepare_range structure to be packed.
+ */
+void msgpack_pack_paxos_prepare_range(msgpack_packer* p, paxos_prepare_range* v)
+{
+	msgpack_pack_array(p, 5);
+	msgpack_pack_int32(p, PAXOS_PREPARE_RANGE);
+	msgpack_pack_uint32(p, v->src);
+	msgpack_pack_uint32(p, v->from_iid);
+	msgpack_pack_uint32(p, v->to_iid);
+	msgpack_pack_uint32(p, v->ballot);
+}
+
+/**
+ * Unpacks a paxos_prepare_range structure from a MessagePack object.
+ *
+ * @param o Pointer to the msgpack_object containing the paxos_prepare_range structure.
+ * @param v Pointer to the paxos_prepare_range structure where the unpacked data will be stored.
+ */
+void msgpack_unpack_paxos_prepare_range(msgpack_object* o, paxos_prepare_range* v)
+{
+	int i = 1;
+	msgpack_unpack_uint32_at(o, &v->src, &i);
+	msgpack_unpack_uint32_at(o, &v->from_iid, &i);
+	msgpack_unpack_uint32_at(o, &v->to_iid, &i);
+	msgpack_unpack_uint32_at(o, &v->ballot, &i);
+}
+
+/**
+ * Packs a paxos_promise_range structure into a MessagePack buffer using the given packer.
+ * The instances with a value follow the header as (iid, value ballot, value) triples.
+ *
+ * @param p Pointer to the MessagePack packer.
+ * @param v Pointer to the paxos_promise_range structure to be packed.
+ */
+void msgpack_pack_paxos_promise_range(msgpack_packer* p, paxos_promise_range* v)
+{
+	msgpack_pack_array(p, 6 + 3 * v->n_values);
+	msgpack_pack_int32(p, PAXOS_PROMISE_RANGE);
+	msgpack_pack_uint32(p, v->aid);
+	msgpack_pack_uint32(p, v->from_iid);
+	msgpack_pack_uint32(p, v->to_iid);
+	msgpack_pack_uint32(p, v->ballot);
+	msgpack_pack_uint32(p, v->n_values);
+	for (int i = 0; i < v->n_values; i++) {
+		msgpack_pack_uint32(p, v->iids[i]);
+		msgpack_pack_uint32(p, v->value_ballots[i]);
+		msgpack_pack_paxos_value(p, &(v->values[i]));
+	}
+}
+
+/**
+ * Unpacks a paxos_promise_range structure from a MessagePack object.
+ *
+ * @param o Pointer to the msgpack_object containing the paxos_promise_range structure.
+ * @param v Pointer to the paxos_promise_range structure where the unpacked data will be stored.
+ */
+void msgpack_unpack_paxos_promise_range(msgpack_object* o, paxos_promise_range* v)
+{
+	int i = 1;
+	msgpack_unpack_uint32_at(o, &v->aid, &i);
+	msgpack_unpack_uint32_at(o, &v->from_iid, &i);
+	msgpack_unpack_uint32_at(o, &v->to_iid, &i);
+	msgpack_unpack_uint32_at(o, &v->ballot, &i);
+	msgpack_unpack_uint32_at(o, &v->n_values, &i);
+	v->iids = NULL;
+	v->value_ballots = NULL;
+	v->values = NULL;
+	if (v->n_values == 0)
+		return;
+	v->iids = calloc(v->n_values, sizeof(uint32_t));
+	v->value_ballots = calloc(v->n_values, sizeof(uint32_t));
+	v->values = calloc(v->n_values, sizeof(paxos_value));
+	for (int ii = 0; ii < v->n_values; ii++) {
+		msgpack_unpack_uint32_at(o, &v->iids[ii], &i);
+		msgpack_unpack_uint32_at(o, &v->value_ballots[ii], &i);
+		msgpack_unpack_paxos_value_at(o, &v->values[ii], &i);
+	}
+}
+
 /**
  * Packs a paxos_promise structure into a MessagePack buffer using the given packer.
  *
@@ -225,6 +328,8 @@ void msgpack_unpack_paxos_promise(msgpack_object* o, paxos_promise* v)
 		msgpack_unpack_uint32_at(o, &v->ballots[ii], &i);
 	for (int ii = 0; ii < v->n_aids; ii++)
 		msgpack_unpack_uint32_at(o, &v->value_ballots[ii], &i);
+	v->aids_cap = v->n_aids;
+	aidset_from_aids(&v->aidset, v->aids, v->n_aids);
 }
 
 /**
@@ -330,6 +435,7 @@ void msgpack_unpack_paxos_accepted(msgpack_object* o, paxos_accepted* v)
 	// msgpack_unpack_paxos_value_at(o, &v->value, &i);
 	v->value_0.paxos_value_len = 0;
 	v->value_0.paxos_value_val = NULL;
+	v->value_0.paxos_value_flags = 0;
 	if (is_aids)
 	{
 		v->aids = calloc(v->n_aids, sizeof(uint32_t));
@@ -359,6 +465,13 @@ void msgpack_unpack_paxos_accepted(msgpack_object* o, paxos_accepted* v)
 		for (int ii = 0; ii < v->n_aids; ii++)
 			msgpack_unpack_uint32_at(o, &v->value_ballots[ii], &i);
 	}
+	else
+	{
+		v->ballots = NULL;
+		v->value_ballots = NULL;
+	}
+	v->aids_cap = is_aids ? v->n_aids : 0;
+	aidset_from_aids(&v->aidset, v->aids, is_aids ? v->n_aids : 0);
 	// paxos_log_debug("Unpacked accepted with aid  %d , iid %d", v->aids[0], v->iid);
 }
 
@@ -533,6 +646,12 @@ void msgpack_pack_paxos_message(msgpack_packer* p, paxos_message* v)
 	case PAXOS_CLIENT_VALUE:
 		msgpack_pack_paxos_client_value(p, &v->u.client_value);
 		break;
+	case PAXOS_PREPARE_RANGE:
+		msgpack_pack_paxos_prepare_range(p, &v->u.prepare_range);
+		break;
+	case PAXOS_PROMISE_RANGE:
+		msgpack_pack_paxos_promise_range(p, &v->u.promise_range);
+		break;
 	}
 }
 
@@ -577,6 +696,12 @@ void msgpack_unpack_paxos_message(msgpack_object* o, paxos_message* v)
 	case PAXOS_CLIENT_VALUE:
 		msgpack_unpack_paxos_client_value(o, &v->u.client_value);
 		break;
+	case PAXOS_PREPARE_RANGE:
+		msgpack_unpack_paxos_prepare_range(o, &v->u.prepare_range);
+		break;
+	case PAXOS_PROMISE_RANGE:
+		msgpack_unpack_paxos_promise_range(o, &v->u.promise_range);
+		break;
 	default:
 		{
 			(*((void_cb)0))();
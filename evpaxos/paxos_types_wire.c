@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "paxos_types_wire.h"
+#include "aidset.h"
+#include <stdlib.h>
+#include <string.h>
+
+// What an accepted frame carries besides its header
+#define WIRE_ACCEPTED_AIDS 0x1
+#define WIRE_ACCEPTED_VALUES 0x2
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define WIRE_BIG_ENDIAN 1
+#define wire_swap32(x) __builtin_bswap32(x)
+#else
+#define wire_swap32(x) (x)
+#endif
+
+static char* wire_put32(char* p, uint32_t v)
+{
+	v = wire_swap32(v);
+	memcpy(p, &v, sizeof(uint32_t));
+	return p + sizeof(uint32_t);
+}
+
+static const char* wire_get32(const char* p, uint32_t* v)
+{
+	memcpy(v, p, sizeof(uint32_t));
+	*v = wire_swap32(*v);
+	return p + sizeof(uint32_t);
+}
+
+/**
+ * Writes an array of u32, or n zeroes if the array is NULL.
+ *
+ * @param p Where to write the array.
+ * @param a The array to write, or NULL.
+ * @param n The number of elements.
+ * @return The position following the array.
+ */
+static char* wire_put32_array(char* p, const uint32_t* a, uint32_t n)
+{
+	size_t size = n * sizeof(uint32_t);
+#ifdef WIRE_BIG_ENDIAN
+	uint32_t i;
+	for (i = 0; i < n; i++)
+		wire_put32(p + i * sizeof(uint32_t), a != NULL ? a[i] : 0);
+#else
+	if (a == NULL)
+		memset(p, 0, size);
+	else
+		memcpy(p, a, size);
+#endif
+	return p + size;
+}
+
+/**
+ * Reads an array of u32 into a newly allocated array.
+ *
+ * @param p Where to read the array from.
+ * @param a Set to the new array.
+ * @param n The number of elements.
+ * @return The position following the array.
+ */
+static const char* wire_get32_array(const char* p, uint32_t** a, uint32_t n)
+{
+	size_t size = n * sizeof(uint32_t);
+	*a = malloc(size);
+#ifdef WIRE_BIG_ENDIAN
+	uint32_t i;
+	for (i = 0; i < n; i++)
+		wire_get32(p + i * sizeof(uint32_t), &(*a)[i]);
+#else
+	memcpy(*a, p, size);
+#endif
+	return p + size;
+}
+
+static uint32_t wire_value_len(paxos_value* v)
+{
+	if (v->paxos_value_val == NULL)
+		return 0;
+	return v->paxos_value_len;
+}
+
+/* The length of a value as put in a head, with its flags in the top bit. */
+static uint32_t wire_value_word(paxos_value* v)
+{
+	uint32_t word = wire_value_len(v);
+	if (v->paxos_value_flags & PAXOS_VALUE_BATCH)
+		word |= PAXOS_WIRE_VALUE_BATCH;
+	return word;
+}
+
+/**
+ * Allocates a value and has its bytes read in by the caller. Values are
+ * zero padded, as the ones decoded from msgpack.
+ *
+ * @param word The length of the value, as read from the head.
+ * @param v The value to fill in.
+ * @param read The callback reading the bytes of the value.
+ * @param arg The argument of the callback.
+ */
+static void wire_get_value(uint32_t word, paxos_value* v, paxos_wire_value_cb read, void* arg)
+{
+	uint32_t len = word & ~PAXOS_WIRE_VALUE_BATCH;
+	v->paxos_value_len = len;
+	v->paxos_value_val = NULL;
+	v->paxos_value_flags = (word & PAXOS_WIRE_VALUE_BATCH) ? PAXOS_VALUE_BATCH : 0;
+	if (len > 0) {
+		v->paxos_value_val = malloc(len + 16);
+		memset(v->paxos_value_val + len, 0, 16);
+		read(v->paxos_value_val, len, arg);
+	}
+}
+
+static int wire_accepted_contents(paxos_accepted* v)
+{
+	int contents = 0;
+	if (v->n_aids > 0 && v->aids != NULL)
+		contents |= WIRE_ACCEPTED_AIDS;
+	if (v->n_aids > 0 && v->values != NULL)
+		contents |= WIRE_ACCEPTED_VALUES;
+	return contents;
+}
+
+static size_t wire_accepted_size(paxos_accepted* v)
+{
+	uint32_t i;
+	int contents = wire_accepted_contents(v);
+	size_t size = 3 * sizeof(uint32_t);
+	if (contents & WIRE_ACCEPTED_AIDS)
+		size += 3 * v->n_aids * sizeof(uint32_t);
+	if (contents & WIRE_ACCEPTED_VALUES) {
+		size += v->n_aids * sizeof(uint32_t);
+		for (i = 0; i < v->n_aids; i++)
+			size += wire_value_len(&v->values[i]);
+	}
+	return size;
+}
+
+static size_t wire_payload_size(paxos_message* msg)
+{
+	switch (msg->type) {
+	case PAXOS_PREPARE:
+		return 3 * sizeof(uint32_t);
+	case PAXOS_ACCEPT:
+		return 4 * sizeof(uint32_t) + wire_value_len(&msg->u.accept.value);
+	case PAXOS_ACCEPTED:
+		return wire_accepted_size(&msg->u.accepted);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Tells whether messages of the given type have a fixed binary layout.
+ *
+ * @param type The message type.
+ * @return 1 if the type can be encoded by paxos_wire_encode(), 0 otherwise.
+ */
+int paxos_wire_supported(paxos_message_type type)
+{
+	return type == PAXOS_PREPARE || type == PAXOS_ACCEPT || type == PAXOS_ACCEPTED;
+}
+
+/**
+ * Computes the size of the frame encoding a message, header included.
+ *
+ * @param msg A message of a supported type.
+ * @return The size of the frame in bytes.
+ */
+size_t paxos_wire_size(paxos_message* msg)
+{
+	return PAXOS_WIRE_HEADER_SIZE + wire_payload_size(msg);
+}
+
+/**
+ * Writes a frame header.
+ *
+ * @param buf Where to write the PAXOS_WIRE_HEADER_SIZE bytes of the header.
+ * @param type The type of the message.
+ * @param flags The frame flags, e.g. PAXOS_WIRE_MSGPACK.
+ * @param len The length of the payload following the header.
+ */
+void paxos_wire_write_header(char* buf, uint8_t type, uint8_t flags, uint32_t len)
+{
+	buf[0] = (char)PAXOS_WIRE_MAGIC;
+	buf[1] = PAXOS_WIRE_VERSION;
+	buf[2] = type;
+	buf[3] = flags;
+	wire_put32(buf + 4, len);
+}
+
+/**
+ * Encodes the head of a frame, i.e. all of it but the bytes of its values,
+ * which follow in the order given by paxos_wire_values().
+ *
+ * @param msg The message to encode.
+ * @param buf Where to write the head, at least paxos_wire_size() bytes.
+ * @return The number of bytes written.
+ */
+size_t paxos_wire_encode_head(paxos_message* msg, char* buf)
+{
+	uint32_t i, n;
+	int contents;
+	char* p = buf + PAXOS_WIRE_HEADER_SIZE;
+
+	paxos_wire_write_header(buf, msg->type, 0, wire_payload_size(msg));
+	switch (msg->type) {
+	case PAXOS_PREPARE:
+		p = wire_put32(p, msg->u.prepare.src);
+		p = wire_put32(p, msg->u.prepare.iid);
+		p = wire_put32(p, msg->u.prepare.ballot);
+		break;
+	case PAXOS_ACCEPT:
+		p = wire_put32(p, msg->u.accept.src);
+		p = wire_put32(p, msg->u.accept.iid);
+		p = wire_put32(p, msg->u.accept.ballot);
+		p = wire_put32(p, wire_value_word(&msg->u.accept.value));
+		break;
+	case PAXOS_ACCEPTED:
+		n = msg->u.accepted.n_aids;
+		contents = wire_accepted_contents(&msg->u.accepted);
+		p = wire_put32(p, msg->u.accepted.iid);
+		p = wire_put32(p, n);
+		p = wire_put32(p, contents);
+		if (contents & WIRE_ACCEPTED_AIDS) {
+			p = wire_put32_array(p, msg->u.accepted.aids, n);
+			p = wire_put32_array(p, msg->u.accepted.ballots, n);
+			p = wire_put32_array(p, msg->u.accepted.value_ballots, n);
+		}
+		if (contents & WIRE_ACCEPTED_VALUES)
+			for (i = 0; i < n; i++)
+				p = wire_put32(p, wire_value_word(&msg->u.accepted.values[i]));
+		break;
+	default:
+		break;
+	}
+	return p - buf;
+}
+
+/**
+ * Lists the values whose bytes end the frame of a message, in order. A
+ * value with a NULL buffer is empty.
+ *
+ * @param msg A message of a supported type.
+ * @param values Set to the array of values, or NULL if there are none.
+ * @return The number of values.
+ */
+int paxos_wire_values(paxos_message* msg, paxos_value** values)
+{
+	*values = NULL;
+	if (msg->type == PAXOS_ACCEPT) {
+		*values = &msg->u.accept.value;
+		return 1;
+	}
+	if (msg->type == PAXOS_ACCEPTED &&
+		(wire_accepted_contents(&msg->u.accepted) & WIRE_ACCEPTED_VALUES)) {
+		*values = msg->u.accepted.values;
+		return msg->u.accepted.n_aids;
+	}
+	return 0;
+}
+
+/**
+ * Encodes a message of a supported type as a frame.
+ *
+ * @param msg The message to encode.
+ * @param buf Where to write the frame, at least paxos_wire_size() bytes.
+ * @return The number of bytes written.
+ */
+size_t paxos_wire_encode(paxos_message* msg, char* buf)
+{
+	int i, n;
+	paxos_value* values;
+	char* p = buf + paxos_wire_encode_head(msg, buf);
+
+	n = paxos_wire_values(msg, &values);
+	for (i = 0; i < n; i++) {
+		uint32_t len = wire_value_len(&values[i]);
+		if (len > 0)
+			memcpy(p, values[i].paxos_value_val, len);
+		p += len;
+	}
+	return p - buf;
+}
+
+/**
+ * Parses a frame header.
+ *
+ * @param buf The first PAXOS_WIRE_HEADER_SIZE bytes of the frame.
+ * @param h The header to fill in.
+ * @return 0 on success, -1 if the bytes are not a frame of this version.
+ */
+int paxos_wire_read_header(const char* buf, struct paxos_wire_header* h)
+{
+	if ((uint8_t)buf[0] != PAXOS_WIRE_MAGIC || buf[1] != PAXOS_WIRE_VERSION)
+		return -1;
+	h->type = buf[2];
+	h->flags = buf[3];
+	wire_get32(buf + 4, &h->len);
+	return 0;
+}
+
+/**
+ * Computes the size of the part of a payload that precedes the bytes of
+ * its values, i.e. of what paxos_wire_decode_head() needs to be contiguous.
+ *
+ * @param h The header of the frame.
+ * @param prefix The first PAXOS_WIRE_PREFIX_SIZE bytes of the payload, or
+ *        the whole payload if shorter.
+ * @return The size of the head, 0 if the payload is malformed.
+ */
+size_t paxos_wire_head_size(struct paxos_wire_header* h, const char* prefix)
+{
+	uint32_t n, contents;
+	size_t size;
+
+	if (h->flags & PAXOS_WIRE_MSGPACK)
+		return 0;
+	switch (h->type) {
+	case PAXOS_PREPARE:
+		size = 3 * sizeof(uint32_t);
+		return h->len == size ? size : 0;
+	case PAXOS_ACCEPT:
+		size = 4 * sizeof(uint32_t);
+		return h->len >= size ? size : 0;
+	case PAXOS_ACCEPTED:
+		size = 3 * sizeof(uint32_t);
+		if (h->len < size)
+			return 0;
+		wire_get32(prefix + sizeof(uint32_t), &n);
+		wire_get32(prefix + 2 * sizeof(uint32_t), &contents);
+		if (n > PAXOS_MAX_ACCEPTORS)
+			return 0;
+		if (n > 0 && (contents & WIRE_ACCEPTED_AIDS))
+			size += 3 * n * sizeof(uint32_t);
+		if (n > 0 && (contents & WIRE_ACCEPTED_VALUES))
+			size += n * sizeof(uint32_t);
+		return h->len >= size ? size : 0;
+	default:
+		return 0;
+	}
+}
+
+static int wire_decode_accepted(struct paxos_wire_header* h, const char* head,
+	paxos_accepted* v, paxos_wire_value_cb read, void* arg)
+{
+	uint32_t i, n, contents, lens[PAXOS_MAX_ACCEPTORS];
+	uint64_t size = 3 * sizeof(uint32_t);
+	const char* p = head;
+
+	p = wire_get32(p, &v->iid);
+	p = wire_get32(p, &n);
+	p = wire_get32(p, &contents);
+	if (n == 0)
+		contents = 0;
+	if (contents & WIRE_ACCEPTED_AIDS)
+		size += 3 * n * sizeof(uint32_t);
+	if (contents & WIRE_ACCEPTED_VALUES) {
+		const char* lenp = head + size;
+		size += n * sizeof(uint32_t);
+		for (i = 0; i < n; i++) {
+			wire_get32(lenp + i * sizeof(uint32_t), &lens[i]);
+			size += lens[i] & ~PAXOS_WIRE_VALUE_BATCH;
+		}
+	}
+	if (size != h->len)
+		return -1;
+
+	v->src = -1;
+	v->ballot_0 = 0;
+	v->value_ballot_0 = 0;
+	v->n_aids = n;
+	v->value_0.paxos_value_len = 0;
+	v->value_0.paxos_value_val = NULL;
+	v->value_0.paxos_value_flags = 0;
+	v->aids = NULL;
+	v->ballots = NULL;
+	v->value_ballots = NULL;
+	v->values = NULL;
+	if (contents & WIRE_ACCEPTED_AIDS) {
+		p = wire_get32_array(p, &v->aids, n);
+		p = wire_get32_array(p, &v->ballots, n);
+		p = wire_get32_array(p, &v->value_ballots, n);
+	}
+	if (contents & WIRE_ACCEPTED_VALUES) {
+		v->values = calloc(n, sizeof(paxos_value));
+		for (i = 0; i < n; i++)
+			wire_get_value(lens[i], &v->values[i], read, arg);
+	}
+	v->aids_cap = v->aids != NULL ? n : 0;
+	aidset_from_aids(&v->aidset, v->aids, v->aids_cap);
+	return 0;
+}
+
+/**
+ * Decodes a frame whose values are not contiguous with the rest of the
+ * payload. The head is validated against the layout of its type before
+ * anything is allocated; then each value is allocated and its bytes are
+ * read in, in order, by the given callback. This lets the bytes of large
+ * values be copied once, straight from where they were received.
+ *
+ * @param h The header of the frame.
+ * @param head The paxos_wire_head_size() first bytes of the payload.
+ * @param out The message to fill in, to be destroyed with paxos_message_destroy().
+ * @param read The callback reading the bytes of each value.
+ * @param arg The argument of the callback.
+ * @return 0 on success, -1 if the payload is malformed.
+ */
+int paxos_wire_decode_head(struct paxos_wire_header* h, const char* head,
+	paxos_message* out, paxos_wire_value_cb read, void* arg)
+{
+	const char* p = head;
+	uint32_t vlen;
+
+	out->type = h->type;
+	switch (h->type) {
+	case PAXOS_PREPARE:
+		p = wire_get32(p, &out->u.prepare.src);
+		p = wire_get32(p, &out->u.prepare.iid);
+		p = wire_get32(p, &out->u.prepare.ballot);
+		return 0;
+	case PAXOS_ACCEPT:
+		wire_get32(p + 3 * sizeof(uint32_t), &vlen);
+		if ((vlen & ~PAXOS_WIRE_VALUE_BATCH) != h->len - 4 * sizeof(uint32_t))
+			return -1;
+		p = wire_get32(p, &out->u.accept.src);
+		p = wire_get32(p, &out->u.accept.iid);
+		p = wire_get32(p, &out->u.accept.ballot);
+		wire_get_value(vlen, &out->u.accept.value, read, arg);
+		return 0;
+	case PAXOS_ACCEPTED:
+		return wire_decode_accepted(h, head, &out->u.accepted, read, arg);
+	default:
+		return -1;
+	}
+}
+
+static void wire_read_memory(char* buf, uint32_t len, void* arg)
+{
+	const char** p = arg;
+	memcpy(buf, *p, len);
+	*p += len;
+}
+
+/**
+ * Decodes the payload of a frame. The payload must have been checked to be
+ * h->len bytes long; it is validated against the layout of its type before
+ * anything is allocated.
+ *
+ * @param h The header of the frame.
+ * @param payload The h->len bytes following the header.
+ * @param out The message to fill in, to be destroyed with paxos_message_destroy().
+ * @return 0 on success, -1 if the payload is malformed.
+ */
+int paxos_wire_decode(struct paxos_wire_header* h, const char* payload, paxos_message* out)
+{
+	const char* values;
+	size_t head = paxos_wire_head_size(h, payload);
+
+	if (head == 0)
+		return -1;
+	values = payload + head;
+	return paxos_wire_decode_head(h, payload, out, wire_read_memory, &values);
+}
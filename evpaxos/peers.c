@@ -28,6 +28,8 @@
 
 #include "peers.h"
 #include "message.h"
+#include "topology.h"
+#include "paxos_types_wire.h"
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,6 +49,9 @@ struct peer
 	int id;
 	int status;
 	struct bufferevent* bev;
+	struct message_reader* reader; /* decodes the messages received */
+	int hello;  /* sent our frame version */
+	int framed; /* messages are sent as frames */
 	struct event* reconnect_ev;
 	struct sockaddr_in addr;
 	struct peers* peers;
@@ -59,6 +64,13 @@ struct subscription
 	void* arg;
 };
 
+struct burst_subscription
+{
+	peers_burst_cb begin;
+	peers_burst_cb end;
+	void* arg;
+};
+
 struct peers
 {
 	int peers_count, clients_count;
@@ -69,7 +81,14 @@ struct peers
 	struct evpaxos_config* config;
 	int subs_count;
 	int ownid;
+	struct topology* topology;
+	int acceptors_count;
+	struct peer** acceptors; /* acceptors we connected to, by id */
+	struct peer** down;      /* acceptors requests are forwarded to */
+	int down_count;
 	struct subscription subs[32];
+	int bursts_count;
+	struct burst_subscription bursts[PEERS_MAX_BURST_SUBSCRIPTIONS];
 };
 
 static struct timeval reconnect_timeout = { 2,0 };
@@ -105,12 +124,18 @@ struct peers* peers_new(struct event_base* base, struct evpaxos_config* config)
 	p->peers_count = 0;
 	p->clients_count = 0;
 	p->subs_count = 0;
+	p->bursts_count = 0;
 	p->peers = NULL;
 	p->clients = NULL;
 	p->listener = NULL;
 	p->base = base;
 	p->config = config;
 	p->ownid = -1;
+	p->topology = NULL;
+	p->acceptors_count = evpaxos_acceptor_count(config);
+	p->acceptors = calloc(p->acceptors_count, sizeof(struct peer*));
+	p->down = NULL;
+	p->down_count = 0;
 	//p->subs[(config->acceptors_count + config->proposers_count)];
 	return p;
 }
@@ -136,6 +161,10 @@ void peers_free(struct peers* p)
 	if (p->listener != NULL)
 		evconnlistener_free(p->listener);
 
+	if (p->topology != NULL)
+		topology_free(p->topology);
+	free(p->acceptors);
+	free(p->down);
 	free(p);
 }
 
@@ -170,6 +199,7 @@ static void peers_connect(struct peers* p, int id, struct sockaddr_in* addr)
 	p->peers[p->peers_count] = make_peer(p, id, addr);
 	paxos_log_debug("peer initialized");
 	struct peer* peer = p->peers[p->peers_count];
+	p->acceptors[id] = peer;
 	bufferevent_setcb(peer->bev, on_read, NULL, on_peer_event, peer);
 	peer->reconnect_ev = evtimer_new(p->base, on_connection_timeout, peer);
 	paxos_log_debug("Connecting...");
@@ -179,59 +209,36 @@ static void peers_connect(struct peers* p, int id, struct sockaddr_in* addr)
 }
 
 /**
- * Establishes connections to all acceptors based on the provided peers structure's configuration.
- * It iterates through acceptor addresses, connecting to each acceptor using peers_connect.
+ * Establishes connections to the acceptors this replica is linked to in the
+ * acceptor tree, and builds the routing tables used to forward messages.
  *
  * @param p A pointer to the peers structure.
+ * @param replica_id The id of the local replica.
  */
 void peers_connect_to_acceptors(struct peers* p, int replica_id)
 {
+	int i, count;
+	const int* ids;
+
 	p->ownid = replica_id;
-	int i;
-	int arridx = 0;
-	for (i = 0; i < evpaxos_acceptor_count(p->config); i++) {
-		paxos_log_debug("replica %d Connect to acceptor address , idx %d",replica_id,i);
-		struct sockaddr_in addr = evpaxos_acceptor_address(p->config, i);
-
-		if (p->config->acceptors[i].groupid == p->config->acceptors[replica_id].groupid)
-		{
-			peers_connect(p, i, &addr);
-			paxos_log_debug("replica %d Connect case 1 , idx %d, arridx %d", replica_id, i,arridx);
-			arridx++;
-		}
-		else if (
-			(p->config->acceptors[replica_id].groupid != p->config->acceptors[replica_id].parentid)
-			&&
-			(p->config->acceptors[i].groupid == p->config->acceptors[replica_id].parentid)
-			) 
-		{
-			peers_connect(p, i, &addr);
-			paxos_log_debug("replica %d Connect case 2 , idx %d, arridx %d", replica_id, i, arridx);
-			arridx++;
-		}
-		else if (
-			(p->config->acceptors[replica_id].groupid != p->config->acceptors[replica_id].parentid)
-			&&
-			(p->config->acceptors[i].groupid != p->config->acceptors[i].parentid)
-			&&
-			(p->config->acceptors[i].parentid == p->config->acceptors[replica_id].parentid)
-			)
-		{
-			peers_connect(p, i, &addr);
-			paxos_log_debug("replica %d Connect case 3 , idx %d, arridx %d", replica_id, i, arridx);
-			arridx++;
-		}
-		else if (
-			(p->config->acceptors[i].groupid != p->config->acceptors[i].parentid)
-			&&
-			(p->config->acceptors[i].parentid == p->config->acceptors[replica_id].groupid)
-			)
-		{
-			peers_connect(p, i, &addr);
-			paxos_log_debug("replica %d Connect case 4 , idx %d, arridx %d", replica_id, i, arridx);
-			arridx++;
-		}
+	p->topology = topology_new(p->config, replica_id);
+	if (p->topology == NULL) {
+		paxos_log_error("Invalid replica id %d", replica_id);
+		return;
 	}
+
+	count = topology_peers(p->topology, &ids);
+	for (i = 0; i < count; i++) {
+		struct sockaddr_in addr = evpaxos_acceptor_address(p->config, ids[i]);
+		paxos_log_debug("replica %d Connect to acceptor %d", replica_id, ids[i]);
+		peers_connect(p, ids[i], &addr);
+	}
+
+	count = topology_children(p->topology, &ids);
+	p->down = malloc(sizeof(struct peer*) * (count > 0 ? count : 1));
+	for (i = 0; i < count; i++)
+		if (p->acceptors[ids[i]] != NULL)
+			p->down[p->down_count++] = p->acceptors[ids[i]];
 }
 
 /**
@@ -262,23 +269,133 @@ void peers_foreach_client(struct peers* p, peer_iter_cb cb, void* arg)
 		cb(p->clients[i], arg);
 }
 
+/**
+ * Executes the given callback function for each acceptor below this one in
+ * the acceptor tree, i.e. the ones requests are forwarded down to.
+ *
+ * @param p A pointer to the peers structure.
+ * @param cb The callback function to execute for each acceptor.
+ * @param arg An additional argument to pass to the callback function.
+ */
 void peers_foreach_down_acceptor(struct peers* p, peer_iter_cb cb, void* arg)
 {
-	if(p->config->acceptors[p->ownid].groupid==p->config->acceptors[p->ownid].parentid) return;
-
-	for(int i = 0; i < p->peers_count; i++)
-	{
+	int i;
+	for (i = 0; i < p->down_count; ++i)
+		cb(p->down[i], arg);
+}
 
-			if (
-				( (p->config->acceptors[p->ownid].groupid == p->config->acceptors[i].groupid) && (p->config->acceptors[i].groupid == p->config->acceptors[i].parentid))
-				|| 
-				( (p->config->acceptors[p->ownid].groupid == p->config->acceptors[i].parentid) && (p->config->acceptors[i].groupid != p->config->acceptors[i].parentid) )
-			   )
-			{
-				cb(p->peers[i], arg);
-				// paxos_log_debug("CALLBACK ALL ACCEPTOR IN GROUP AND BELOW");
-			}
+/**
+ * Packs a message once and sends it to each of the given peers. The message
+ * is packed at most twice, as msgpack and as a frame, depending on what
+ * the peers agreed on.
+ *
+ * A message handed over is owned by its first packing, which references
+ * its large values in place; a second packing copies them, while the
+ * first one keeps the message alive.
+ *
+ * @param peers An array of pointers to peer structures.
+ * @param count The number of peers in the array.
+ * @param msg A pointer to the message to send.
+ * @param owned Whether the message is handed over.
+ */
+static void peers_broadcast(struct peer** peers, int count, paxos_message* msg,
+	int owned)
+{
+	int i;
+	struct packed_message* pm[2] = { NULL, NULL };
+	for (i = 0; i < count; ++i) {
+		int framed = peers[i]->framed;
+		if (pm[framed] == NULL) {
+			if (owned && pm[!framed] == NULL)
+				pm[framed] = framed ? pack_paxos_frame_owned(msg)
+					: pack_paxos_message_owned(msg);
+			else
+				pm[framed] = framed ? pack_paxos_frame(msg) : pack_paxos_message(msg);
+		}
+		send_packed_message(peers[i]->bev, pm[framed]);
 	}
+	if (owned && count == 0)
+		paxos_message_destroy(msg);
+	for (i = 0; i < 2; ++i)
+		if (pm[i] != NULL)
+			packed_message_release(pm[i]);
+}
+
+/**
+ * Sends a message to every acceptor, encoding it only once.
+ *
+ * @param p A pointer to the peers structure.
+ * @param msg A pointer to the message to send.
+ */
+void peers_broadcast_acceptors(struct peers* p, paxos_message* msg)
+{
+	peers_broadcast(p->peers, p->peers_count, msg, 0);
+}
+
+/**
+ * Sends a message to every client, encoding it only once.
+ *
+ * @param p A pointer to the peers structure.
+ * @param msg A pointer to the message to send.
+ */
+void peers_broadcast_clients(struct peers* p, paxos_message* msg)
+{
+	peers_broadcast(p->clients, p->clients_count, msg, 0);
+}
+
+/**
+ * Sends a message to every client, encoding it only once, and takes
+ * ownership of it: its large values are sent without being copied, and it
+ * is destroyed once written out to all of them.
+ *
+ * @param p A pointer to the peers structure.
+ * @param msg A pointer to the message to hand over.
+ */
+void peers_broadcast_clients_owned(struct peers* p, paxos_message* msg)
+{
+	peers_broadcast(p->clients, p->clients_count, msg, 1);
+}
+
+/**
+ * Sends a message to every acceptor below this one in the acceptor tree,
+ * encoding it only once.
+ *
+ * @param p A pointer to the peers structure.
+ * @param msg A pointer to the message to send.
+ */
+void peers_broadcast_down_acceptors(struct peers* p, paxos_message* msg)
+{
+	peers_broadcast(p->down, p->down_count, msg, 0);
+}
+
+/**
+ * Sends a message to a peer, in the encoding agreed on with it.
+ *
+ * @param p A pointer to the peer structure.
+ * @param msg A pointer to the message to send.
+ */
+void peer_send_message(struct peer* p, paxos_message* msg)
+{
+	if (p->framed)
+		send_paxos_frame(p->bev, msg);
+	else
+		send_paxos_message(p->bev, msg);
+}
+
+/**
+ * Sends a message to a peer, in the encoding agreed on with it, and takes
+ * ownership of it: its large values are sent without being copied, and it
+ * is destroyed once written out.
+ *
+ * @param p A pointer to the peer structure.
+ * @param msg A pointer to the message to hand over.
+ */
+void peer_send_message_owned(struct peer* p, paxos_message* msg)
+{
+	struct packed_message* pm = p->framed ? pack_paxos_frame_owned(msg)
+		: pack_paxos_message_owned(msg);
+	send_packed_message(p->bev, pm);
+	packed_message_release(pm);
 }
 
 /**
@@ -290,14 +407,9 @@ void peers_foreach_down_acceptor(struct peers* p, peer_iter_cb cb, void* arg)
  */
 struct peer* peers_get_acceptor(struct peers* p, int id)
 {
-	if (p == NULL) return NULL;
-	int i;
-	for (i = 0; i<p->peers_count; i++)
-	{
-		if (p->peers[i] !=NULL && p->peers[i]->id == id)
-			return p->peers[i];
-	};
-	return NULL;
+	if (p == NULL || id < 0 || id >= p->acceptors_count)
+		return NULL;
+	return p->acceptors[id];
 }
 
 struct peer* peer_get_acceptor(struct peer* p, int id)
@@ -389,6 +501,36 @@ void peers_subscribe(struct peers* p, paxos_message_type type, peer_cb cb, void*
 	p->subs_count++;
 }
 
+/**
+ * Registers a pair of callbacks run around each read burst, i.e. before the
+ * first and after the last message drained from a connection in one read
+ * event. This lets a subscriber group the work of all the messages of the
+ * burst, e.g. in a single storage transaction.
+ *
+ * @param p A pointer to the peers structure.
+ * @param begin The callback to execute before the messages are dispatched.
+ * @param end The callback to execute after the messages are dispatched.
+ * @param arg An additional argument to pass to the callbacks.
+ * @return 0 on success, -1 if PEERS_MAX_BURST_SUBSCRIPTIONS are registered
+ *         already.
+ */
+int peers_subscribe_burst(struct peers* p, peers_burst_cb begin, peers_burst_cb end, void* arg)
+{
+	struct burst_subscription* sub;
+
+	if (p->bursts_count == PEERS_MAX_BURST_SUBSCRIPTIONS) {
+		paxos_log_error("Too many read burst subscriptions, at most %d",
+			PEERS_MAX_BURST_SUBSCRIPTIONS);
+		return -1;
+	}
+	sub = &p->bursts[p->bursts_count];
+	sub->begin = begin;
+	sub->end = end;
+	sub->arg = arg;
+	p->bursts_count++;
+	return 0;
+}
+
 
 /**
  * Retrieves the event base associated with the provided peers structure.
@@ -418,15 +560,59 @@ static void dispatch_message(struct peer* p, paxos_message* msg)
 	}
 }
 
+/**
+ * Switches the messages sent to a peer to frames, once the peer announced
+ * it decodes them. The side that did not connect announces its own version
+ * only in reply, so that clients unaware of frames never receive one.
+ * Both run on the connection's event loop, where the messages to the peer
+ * are sent from, so no message is sent between the marker and the switch.
+ *
+ * @param p A pointer to the peer structure.
+ */
+static void peer_negotiate(struct peer* p)
+{
+	if (p->framed || !paxos_config.wire_binary ||
+		message_reader_peer_version(p->reader) != PAXOS_WIRE_VERSION)
+		return;
+	if (!p->hello) {
+		send_paxos_hello(p->bev);
+		p->hello = 1;
+	}
+	send_paxos_switch(p->bev);
+	p->framed = 1;
+	paxos_log_debug("Sending frames to %s:%d", inet_ntoa(p->addr.sin_addr),
+		ntohs(p->addr.sin_port));
+}
+
+/**
+ * Closes the connection of a peer that sent a malformed stream, through its
+ * event callback, as if the connection was lost: acceptors are reconnected
+ * with their reader reset, clients are dropped.
+ *
+ * @param p A pointer to the peer structure.
+ */
+static void peer_close_malformed(struct peer* p)
+{
+	bufferevent_event_cb eventcb;
+	void* arg;
+
+	paxos_log_error("Closing the connection to %s:%d", inet_ntoa(p->addr.sin_addr),
+		ntohs(p->addr.sin_port));
+	bufferevent_getcb(p->bev, NULL, NULL, &eventcb, &arg);
+	eventcb(p->bev, BEV_EVENT_ERROR, arg);
+}
+
 /**
  * Handles incoming data from the peer's buffer event by processing paxos messages
- * and dispatching them to the appropriate subscription callbacks.
+ * and dispatching them to the appropriate subscription callbacks. A malformed
+ * stream closes the connection.
  *
  * @param bev A pointer to the bufferevent associated with the peer.
  * @param arg A pointer to the peer structure.
  */
 static void on_read(struct bufferevent* bev, void* arg)
 {
+	int i, rv;
 	paxos_message msg;
 	memset(&msg, 0, sizeof(msg));
 	struct peer* p = (struct peer*)arg;
@@ -440,13 +626,22 @@ static void on_read(struct bufferevent* bev, void* arg)
 	fflush(stdout);
 	//bev_opt_defer_callbacks;
 	//bufferevent_options(BEV_OPT_DEFER_CALLBACKS);
-	while (recv_paxos_message(in, &msg)) {
+	for (i = 0; i < p->peers->bursts_count; i++)
+		p->peers->bursts[i].begin(p->peers->bursts[i].arg);
+	while ((rv = recv_paxos_message(p->reader, in, &msg)) > 0) {
 
 		dispatch_message(p, &msg);
 		paxos_message_destroy(&msg);
 		memset(&msg, 0, sizeof(msg));
 	}
+	if (rv == 0)
+		peer_negotiate(p);
+	for (i = 0; i < p->peers->bursts_count; i++)
+		p->peers->bursts[i].end(p->peers->bursts[i].arg);
 	if (pgs != NULL)  pthread_mutex_unlock(pgs);
+	// May free a client peer, so nothing touches p afterwards
+	if (rv < 0)
+		peer_close_malformed(p);
 }
 
 /**
@@ -468,6 +663,10 @@ static void on_peer_event(struct bufferevent* bev, short ev, void* arg)
 	if (ev & BEV_EVENT_CONNECTED) {
 		paxos_log_info("Connected to %s:%d", inet_ntoa(p->addr.sin_addr), ntohs(p->addr.sin_port));
 		p->status = ev;
+		if (paxos_config.wire_binary) {
+			send_paxos_hello(p->bev);
+			p->hello = 1;
+		}
 	}
 	else if (ev & BEV_EVENT_ERROR || ev & BEV_EVENT_EOF) {
 		struct event_base* base;
@@ -475,6 +674,9 @@ static void on_peer_event(struct bufferevent* bev, short ev, void* arg)
 		paxos_log_error("%s (%s:%d)", evutil_socket_error_to_string(err), inet_ntoa(p->addr.sin_addr), ntohs(p->addr.sin_port));
 		base = bufferevent_get_base(p->bev);
 		bufferevent_free(p->bev);
+		message_reader_reset(p->reader);
+		p->hello = 0;
+		p->framed = 0;
 		//p->bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
 		p->bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS | BEV_OPT_UNLOCK_CALLBACKS | BEV_OPT_THREADSAFE); // | BEV_OPT_DEFER_CALLBACKS
 		
@@ -630,6 +832,9 @@ static struct peer* make_peer(struct peers* peers, int id, struct sockaddr_in* a
 	p->addr = *addr;
 	// paxos_log_debug("Set up socket.");
 	p->bev = bufferevent_socket_new(peers->base, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS | BEV_OPT_UNLOCK_CALLBACKS | BEV_OPT_THREADSAFE); //| BEV_OPT_DEFER_CALLBACKS
+	p->reader = message_reader_new();
+	p->hello = 0;
+	p->framed = 0;
 	p->peers = peers;
 	p->reconnect_ev = NULL;
 	// paxos_log_debug("Set up status.");
@@ -667,6 +872,7 @@ static void free_all_peers(struct peer** p, int count)
 static void free_peer(struct peer* p)
 {
 	bufferevent_free(p->bev);
+	message_reader_free(p->reader);
 	if (p->reconnect_ev != NULL)
 		event_free(p->reconnect_ev);
 	free(p);
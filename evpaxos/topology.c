@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "topology.h"
+#include "aidset.h"
+#include <stdlib.h>
+
+/*
+ * The acceptors form a tree of groups. An acceptor whose groupid equals its
+ * parentid belongs to a leaf group (or to the root group, for group 0).
+ * The others lead their group: they are reached from the parent group and
+ * forward requests down to the members of their group and to the leaders
+ * of the child groups.
+ *
+ * All the relations of one acceptor are computed here once, from the
+ * configuration, as flat arrays of acceptor ids.
+ */
+struct topology
+{
+	int id;
+	int leader;
+	int peers_count;      /* acceptors to connect to */
+	int children_count;   /* acceptors requests are forwarded down to */
+	int parents_count;    /* acceptors of the parent group */
+	int siblings_count;   /* leaders of the other child groups of the parent */
+	int subordinates;     /* acceptors of the whole subtree */
+	int* peers;
+	int* children;
+	int* parents;
+	int* siblings;
+	paxos_aidset subtree;
+};
+
+static int is_leader(struct address* a)
+{
+	return a->groupid != a->parentid;
+}
+
+/**
+ * Collects the acceptors below a group leader, scanning the child groups
+ * breadth first.
+ */
+static void topology_scan_subtree(struct topology* t, struct evpaxos_config* c)
+{
+	int i, head = 0, tail = 0;
+	int* groups = malloc(sizeof(int) * (c->acceptors_count + 1));
+	paxos_aidset scanned;
+
+	aidset_clear(&scanned);
+	groups[tail++] = c->acceptors[t->id].groupid;
+	aidset_add(&scanned, c->acceptors[t->id].groupid);
+
+	while (head < tail) {
+		int grp = groups[head++];
+		for (i = 0; i < c->acceptors_count; i++) {
+			if (c->acceptors[i].parentid != grp || i == t->id)
+				continue;
+			if (aidset_add(&t->subtree, i) == 1)
+				t->subordinates++;
+			if (aidset_add(&scanned, c->acceptors[i].groupid) == 1)
+				groups[tail++] = c->acceptors[i].groupid;
+		}
+	}
+	free(groups);
+}
+
+/**
+ * Builds the routing tables of an acceptor from the configuration.
+ *
+ * @param c The evpaxos configuration.
+ * @param id The id of the acceptor (replica) the tables are built for.
+ * @return A pointer to the new topology, or NULL if the id is not valid.
+ */
+struct topology* topology_new(struct evpaxos_config* c, int id)
+{
+	int i, n = c->acceptors_count;
+	struct topology* t;
+
+	if (id < 0 || id >= n)
+		return NULL;
+
+	t = calloc(1, sizeof(struct topology));
+	t->id = id;
+	t->peers = malloc(sizeof(int) * n);
+	t->children = malloc(sizeof(int) * n);
+	t->parents = malloc(sizeof(int) * n);
+	t->siblings = malloc(sizeof(int) * n);
+	aidset_clear(&t->subtree);
+
+	struct address* own = &c->acceptors[id];
+	t->leader = is_leader(own);
+	for (i = 0; i < n; i++) {
+		struct address* a = &c->acceptors[i];
+		int peer = 0;
+
+		// members of the own group
+		if (a->groupid == own->groupid)
+			peer = 1;
+
+		if (is_leader(own)) {
+			// the parent group
+			if (a->groupid == own->parentid) {
+				t->parents[t->parents_count++] = i;
+				peer = 1;
+			}
+			// leaders of the other child groups of the parent
+			if (is_leader(a) && a->parentid == own->parentid) {
+				if (i != id && a->groupid != own->groupid)
+					t->siblings[t->siblings_count++] = i;
+				peer = 1;
+			}
+			// members of the own group, and leaders of the child groups
+			if ((a->groupid == own->groupid && !is_leader(a))
+				|| (is_leader(a) && a->parentid == own->groupid))
+				t->children[t->children_count++] = i;
+		}
+
+		// leaders of the child groups
+		if (is_leader(a) && a->parentid == own->groupid)
+			peer = 1;
+
+		if (peer)
+			t->peers[t->peers_count++] = i;
+	}
+
+	if (is_leader(own))
+		topology_scan_subtree(t, c);
+
+	return t;
+}
+
+/**
+ * Releases the routing tables.
+ *
+ * @param t A pointer to the topology.
+ */
+void topology_free(struct topology* t)
+{
+	free(t->peers);
+	free(t->children);
+	free(t->parents);
+	free(t->siblings);
+	free(t);
+}
+
+/**
+ * @param t A pointer to the topology.
+ * @return The id of the acceptor the topology was built for.
+ */
+int topology_id(struct topology* t)
+{
+	return t->id;
+}
+
+/**
+ * @param t A pointer to the topology.
+ * @return 1 if the acceptor leads a group below the root, 0 otherwise.
+ */
+int topology_is_leader(struct topology* t)
+{
+	return t->leader;
+}
+
+/**
+ * Returns the acceptors this one connects to, in increasing id order.
+ *
+ * @param t A pointer to the topology.
+ * @param ids Set to the array of acceptor ids.
+ * @return The number of ids.
+ */
+int topology_peers(struct topology* t, const int** ids)
+{
+	*ids = t->peers;
+	return t->peers_count;
+}
+
+/**
+ * Returns the acceptors that prepare, accept and trim requests are
+ * forwarded down to.
+ *
+ * @param t A pointer to the topology.
+ * @param ids Set to the array of acceptor ids.
+ * @return The number of ids.
+ */
+int topology_children(struct topology* t, const int** ids)
+{
+	*ids = t->children;
+	return t->children_count;
+}
+
+/**
+ * Returns the acceptors of the parent group.
+ *
+ * @param t A pointer to the topology.
+ * @param ids Set to the array of acceptor ids.
+ * @return The number of ids.
+ */
+int topology_parents(struct topology* t, const int** ids)
+{
+	*ids = t->parents;
+	return t->parents_count;
+}
+
+/**
+ * Returns the leaders of the other groups sharing the same parent group.
+ *
+ * @param t A pointer to the topology.
+ * @param ids Set to the array of acceptor ids.
+ * @return The number of ids.
+ */
+int topology_siblings(struct topology* t, const int** ids)
+{
+	*ids = t->siblings;
+	return t->siblings_count;
+}
+
+/**
+ * Returns the acceptors of the subtree below this one.
+ *
+ * @param t A pointer to the topology.
+ * @param subtree If not NULL, set to the ids of the subtree.
+ * @return The number of acceptors in the subtree.
+ */
+int topology_subordinates(struct topology* t, paxos_aidset* subtree)
+{
+	if (subtree != NULL)
+		*subtree = t->subtree;
+	return t->subordinates;
+}
@@ -27,21 +27,45 @@
 
 
 #include "acceptor.h"
+#include "aidset.h"
 #include "storage.h"
+#include "khash.h"
 #include <stdlib.h>
 #include <string.h>
 
+/* ACCEPTEDs of the subtree collected by a group leader for one instance. */
+struct aggregate
+{
+	int src;            /* node the combined accepted is sent to */
+	int sent;           /* the combined accepted was emitted */
+	ballot_t ballot;
+	paxos_aidset seen;  /* subordinates heard from at this ballot */
+	paxos_accepted acc; /* combined accepted, until it is emitted */
+};
+KHASH_MAP_INIT_INT(aggregate, struct aggregate*)
+
 struct acceptor
 {
 	int id;
 	iid_t trim_iid;
+	iid_t max_iid;            /* highest instance with a stored record */
+	iid_t promised_from;      /* every iid >= promised_from is promised ... */
+	ballot_t promised_ballot; /* ... to this ballot, 0 if there is none */
+	int promised_src;         /* node the watermark promise was sent to */
 	int subordinates;
+	int acceptors;
+	paxos_aidset subtree; /* acceptors below this one in the tree */
+	kh_aggregate_t* aggregates;
+	int batch;        /* a burst transaction is open */
+	int batch_failed; /* a message of the burst failed, roll it back */
 	struct storage store;
 };
 
 static void paxos_accepted_to_promise(paxos_accepted* acc, paxos_message* out);
 static void paxos_accept_to_accepted(int id, paxos_accept* acc, paxos_message* out);
-static void paxos_accepted_to_preempted(int id, paxos_accepted* acc, paxos_message* out);
+static void paxos_accepted_to_preempted(int id, iid_t iid, ballot_t ballot, paxos_message* out);
+static void aggregate_free(struct aggregate* g);
+static void acceptor_trim_aggregates(struct acceptor* a, iid_t iid);
 
  int get_aid(struct acceptor* a)
 { 
@@ -50,6 +74,24 @@ static void paxos_accepted_to_preempted(int id, paxos_accepted* acc, paxos_messa
 
 
  void setsubordinates(struct acceptor* a, int isubs) { if (a != NULL) a->subordinates = isubs; }
+
+/**
+ * Sets the number of configured acceptors, used to size the per-acceptor
+ * arrays of stored records once instead of growing them one aid at a time.
+ *
+ * @param a Pointer to the acceptor structure.
+ * @param count Number of acceptors in the configuration.
+ */
+void setacceptors(struct acceptor* a, int count) { if (a != NULL) a->acceptors = count; }
+
+/**
+ * Sets the acceptors of the subtree rooted at this acceptor, whose accepted
+ * messages are aggregated before being sent upward.
+ *
+ * @param a Pointer to the acceptor structure.
+ * @param aids Set of the subordinate acceptor ids.
+ */
+void setsubtree(struct acceptor* a, paxos_aidset* aids) { if (a != NULL) a->subtree = *aids; }
 /**
  * Creates a new instance of the acceptor structure.
  *
@@ -74,7 +116,19 @@ struct acceptor* acceptor_new(int id)
 	if (storage_tx_begin(&a->store) != 0)
 		return NULL;
 	a->id = id;
+	a->subordinates = 0;
+	a->acceptors = 0;
+	aidset_clear(&a->subtree);
+	a->aggregates = kh_init(aggregate);
+	a->batch = 0;
+	a->batch_failed = 0;
 	a->trim_iid = storage_get_trim_instance(&a->store);
+	a->max_iid = storage_get_max_instance(&a->store);
+	a->promised_src = -1;
+	if (!storage_get_watermark(&a->store, &a->promised_from, &a->promised_ballot)) {
+		a->promised_from = 0;
+		a->promised_ballot = 0;
+	}
 
 	// Commit transaction for storage
 	if (storage_tx_commit(&a->store) != 0)
@@ -90,10 +144,162 @@ struct acceptor* acceptor_new(int id)
  */
 void acceptor_free(struct acceptor* a) 
 {
+	struct aggregate* g;
+	if (a->batch)
+		storage_tx_abort(&a->store);
+	kh_foreach_value(a->aggregates, g, aggregate_free(g));
+	kh_destroy_aggregate(a->aggregates);
 	storage_close(&a->store);
 	free(a);
 }
 
+/*
+ * Transaction helpers used by the request handlers. While a batch is open
+ * they join the batch transaction instead of opening their own, and an
+ * abort marks the whole batch for rollback.
+ */
+static int acceptor_tx_begin(struct acceptor* a)
+{
+	if (a->batch)
+		return a->batch_failed ? -1 : 0;
+	return storage_tx_begin(&a->store);
+}
+
+static int acceptor_tx_commit(struct acceptor* a)
+{
+	if (a->batch)
+		return a->batch_failed ? -1 : 0;
+	return storage_tx_commit(&a->store);
+}
+
+static void acceptor_tx_abort(struct acceptor* a)
+{
+	if (a->batch)
+		a->batch_failed = 1;
+	else
+		storage_tx_abort(&a->store);
+}
+
+/**
+ * Opens a transaction shared by all the requests received until
+ * acceptor_batch_commit() is called, so that a burst of requests costs a
+ * single commit (and a single sync with a durable backend). Replies built
+ * while the batch is open must not be sent before the batch is committed.
+ *
+ * @param a Pointer to the acceptor structure.
+ * @return 0 on success, -1 if the transaction could not be opened.
+ */
+int acceptor_batch_begin(struct acceptor* a)
+{
+	if (a->batch)
+		return 0;
+	if (storage_tx_begin(&a->store) != 0)
+		return -1;
+	a->batch = 1;
+	a->batch_failed = 0;
+	return 0;
+}
+
+/**
+ * Commits the transaction opened by acceptor_batch_begin(). If one of the
+ * requests of the batch failed the transaction is aborted instead, and none
+ * of the replies built during the batch may be sent.
+ *
+ * @param a Pointer to the acceptor structure.
+ * @return 0 if the batch was committed, -1 otherwise.
+ */
+int acceptor_batch_commit(struct acceptor* a)
+{
+	if (!a->batch)
+		return 0;
+	a->batch = 0;
+	if (a->batch_failed) {
+		storage_tx_abort(&a->store);
+		return -1;
+	}
+	return storage_tx_commit(&a->store) != 0 ? -1 : 0;
+}
+
+/**
+ * Syncs the transactions committed so far, for storages that defer it
+ * according to a sync interval. Must not be called during a batch.
+ *
+ * @param a Pointer to the acceptor structure.
+ * @return 0 on success, -1 otherwise.
+ */
+int acceptor_sync(struct acceptor* a)
+{
+	if (a->batch)
+		return 0;
+	return storage_sync(&a->store) != 0 ? -1 : 0;
+}
+
+/*
+ * Ballot promised to iid by the promised-from watermark, 0 if the iid is
+ * not covered.
+ */
+static ballot_t acceptor_watermark(struct acceptor* a, iid_t iid)
+{
+	if (a->promised_ballot == 0 || iid < a->promised_from)
+		return 0;
+	return a->promised_ballot;
+}
+
+static void acceptor_stored(struct acceptor* a, iid_t iid)
+{
+	if (iid > a->max_iid)
+		a->max_iid = iid;
+}
+
+/* State shared with the storage update callbacks below. */
+struct acceptor_update
+{
+	struct acceptor* a;
+	int isrc;
+	ballot_t ballot;
+	void* msg;
+	paxos_message* out;
+	int src;
+	int count;
+};
+
+static int acceptor_prepare_record(paxos_accepted* acc, int found, void* arg)
+{
+	struct acceptor_update* u = arg;
+	struct acceptor* a = u->a;
+	int rv;
+
+	if (found && acc->ballots[0] <= u->ballot && acc->values != NULL
+		&& acc->values[0].paxos_value_len > 0) {
+		// Keep the accepted value, only raise the promised ballot. The
+		// subordinates promised the old ballot and must promise again.
+		paxos_log_debug("Acceptor %u Preparing iid: %u, ballot: %u source %u", a->id, acc->iid, u->ballot, u->isrc);
+		if (acc->ballots[0] < u->ballot)
+			paxos_accepted_truncate(acc, 1);
+		acc->src = u->isrc;
+		acc->ballot_0 = u->ballot;
+		acc->ballots[0] = u->ballot;
+		rv = 1;
+	} else if (!found || acc->ballots[0] <= u->ballot) {
+		paxos_log_debug("Acceptor %u Preparing iid: %u, ballot: %u source %u", a->id, acc->iid, u->ballot, u->isrc);
+		iid_t iid = acc->iid;
+		paxos_accepted_destroy(acc);
+		memset(acc, 0, sizeof(paxos_accepted));
+		acc->src = u->isrc;
+		acc->iid = iid;
+		acc->ballot_0 = u->ballot;
+		if (paxos_accepted_add_aid(acc, a->id, u->ballot, 0, a->acceptors) < 0)
+			return -1;
+		rv = 1;
+	} else if ((rv = paxos_accepted_add_aid(acc, a->id, u->ballot, u->ballot, a->acceptors)) < 0) {
+		return -1;
+	}
+
+	paxos_accepted_to_promise(acc, u->out);
+	u->count = 1;
+	return rv;
+}
+
 /**
  * Receives and processes a prepare request from a proposer.
  *
@@ -104,88 +310,254 @@ void acceptor_free(struct acceptor* a)
  */
 int acceptor_receive_prepare(int isrc, struct acceptor* a, paxos_prepare* req, paxos_message* out)
 {
-	paxos_accepted acc;
-	memset(&acc, 0, sizeof(acc));
+	struct acceptor_update u = {a, isrc, req->ballot, req, out, -1, 0};
 
 	if (req->iid <= a->trim_iid)
 		return 0;
 
-	memset(&acc, 0, sizeof(paxos_accepted));
+	if (acceptor_watermark(a, req->iid) > req->ballot) {
+		// Promised to a leader: answer with its ballot, nothing to write
+		paxos_accepted acc;
+		memset(&acc, 0, sizeof(paxos_accepted));
+		acc.src = isrc;
+		acc.iid = req->iid;
+		if (paxos_accepted_add_aid(&acc, a->id, a->promised_ballot, 0, 1) < 0)
+			return 0;
+		paxos_accepted_to_promise(&acc, out);
+		paxos_accepted_destroy(&acc);
+		return 1;
+	}
 
-	if (storage_tx_begin(&a->store) != 0)
+	if (acceptor_tx_begin(a) != 0)
+		return 0;
+
+	if (storage_update_record(&a->store, req->iid, acceptor_prepare_record, &u) < 0) {
+		acceptor_tx_abort(a);
+		if (u.count)
+			paxos_message_destroy(out);
 		return 0;
+	}
 
-	int found = storage_get_record(&a->store, req->iid, &acc); // Search for exisiting entry. One entry is enough.
+	if (acceptor_tx_commit(a) != 0) {
+		paxos_message_destroy(out);
+		return 0;
+	}
 
-	if (!found || acc.ballots[0] <= req->ballot) {
-		paxos_log_debug("Acceptor %u Preparing iid: %u, ballot: %u source %u", a->id,req->iid, req->ballot,isrc);
-		acc.src = isrc;
-		acc.iid = req->iid;
-		acc.ballot_0 = req->ballot;
-		acc.n_aids = 1;
-		acc.aids = calloc(1, sizeof(uint32_t));
-		acc.ballots = calloc(1, sizeof(uint32_t));
-		acc.value_ballots = calloc(1, sizeof(uint32_t));
-		acc.aids[0] = a->id;
-		acc.ballots[0] = req->ballot;
-		acc.value_ballots[0] = req->ballot;
-		acc.values = NULL;
-
-		if (storage_put_record(&a->store, &acc) != 0) {
-			storage_tx_abort(&a->store);
+	acceptor_stored(a, req->iid);
+	return 1;
+}
+
+/*
+ * Adds the value accepted in a record to a range promise.
+ */
+static void promise_range_add_value(struct acceptor* a, paxos_promise_range* pr, paxos_accepted* acc)
+{
+	if (pr->iids == NULL) {
+		uint32_t size = (pr->to_iid != 0 ? pr->to_iid : a->max_iid) - pr->from_iid + 1;
+		pr->iids = calloc(size, sizeof(uint32_t));
+		pr->value_ballots = calloc(size, sizeof(uint32_t));
+		pr->values = calloc(size, sizeof(paxos_value));
+	}
+	pr->iids[pr->n_values] = acc->iid;
+	pr->value_ballots[pr->n_values] = acc->value_ballots[0];
+	pr->values[pr->n_values].paxos_value_len = acc->values[0].paxos_value_len;
+	pr->values[pr->n_values].paxos_value_flags = acc->values[0].paxos_value_flags;
+	pr->values[pr->n_values].paxos_value_val = malloc(acc->values[0].paxos_value_len);
+	memcpy(pr->values[pr->n_values].paxos_value_val, acc->values[0].paxos_value_val,
+		acc->values[0].paxos_value_len);
+	pr->n_values++;
+}
+
+static int acceptor_prepare_range_record(paxos_accepted* acc, int found, void* arg)
+{
+	struct acceptor_update* u = arg;
+	struct acceptor* a = u->a;
+	paxos_promise_range* pr = &u->out->u.promise_range;
+	ballot_t promised = acceptor_watermark(a, acc->iid);
+
+	if (found && acc->ballots[0] > promised)
+		promised = acc->ballots[0];
+
+	if (promised > u->ballot) {
+		if (promised > pr->ballot)
+			pr->ballot = promised;
+		return 0;
+	}
+
+	if (found && acc->values != NULL && acc->values[0].paxos_value_len > 0) {
+		// Keep the accepted value and report it in the promise.
+		promise_range_add_value(a, pr, acc);
+		if (acc->ballots[0] < u->ballot)
+			paxos_accepted_truncate(acc, 1);
+		acc->src = u->isrc;
+		acc->ballot_0 = u->ballot;
+		acc->ballots[0] = u->ballot;
+		return 1;
+	}
+
+	iid_t iid = acc->iid;
+	paxos_accepted_destroy(acc);
+	memset(acc, 0, sizeof(paxos_accepted));
+	acc->src = u->isrc;
+	acc->iid = iid;
+	acc->ballot_0 = u->ballot;
+	if (paxos_accepted_add_aid(acc, a->id, u->ballot, 0, a->acceptors) < 0)
+		return -1;
+	return 1;
+}
+
+static int acceptor_watermark_record(paxos_accepted* acc, int found, void* arg)
+{
+	struct acceptor_update* u = arg;
+	paxos_promise_range* pr = &u->out->u.promise_range;
+
+	if (!found)
+		return 0;
+
+	if (acc->ballots[0] > u->ballot) {
+		if (acc->ballots[0] > pr->ballot)
+			pr->ballot = acc->ballots[0];
+	} else if (acc->values != NULL && acc->values[0].paxos_value_len > 0) {
+		promise_range_add_value(u->a, pr, acc);
+	}
+	return 0;
+}
+
+/*
+ * Handles an open ended range prepare, promising every instance from
+ * req->from_iid on. Existing records are only read, to report their values;
+ * the promise itself is stored as a single watermark. Taking a watermark
+ * below the current one keeps the lower from iid, since promising the higher
+ * ballot to the instances in between is only more restrictive.
+ */
+static int acceptor_receive_prepare_from(int isrc, struct acceptor* a, paxos_prepare_range* req, paxos_message* out)
+{
+	iid_t iid, from = req->from_iid;
+	struct acceptor_update u = {a, isrc, req->ballot, req, out, -1, 0};
+	paxos_promise_range* pr = &out->u.promise_range;
+
+	if (from <= a->trim_iid)
+		from = a->trim_iid + 1;
+
+	if (acceptor_tx_begin(a) != 0)
+		return 0;
+
+	paxos_log_debug("Acceptor %u Preparing iids from %u, ballot: %u source %u", a->id,
+		from, req->ballot, isrc);
+
+	memcpy(&(out->msg_info[0]), "AAtW", 4);
+	out->type = PAXOS_PROMISE_RANGE;
+	*pr = (paxos_promise_range) {a->id, from, 0, req->ballot, 0, NULL, NULL, NULL};
+
+	if (a->promised_ballot > req->ballot) {
+		pr->ballot = a->promised_ballot;
+		return acceptor_tx_commit(a) == 0;
+	}
+
+	for (iid = from; iid <= a->max_iid && pr->ballot == req->ballot; iid++) {
+		if (storage_update_record(&a->store, iid, acceptor_watermark_record, &u) < 0) {
+			acceptor_tx_abort(a);
+			paxos_promise_range_destroy(pr);
 			return 0;
 		}
 	}
-	else
-	{
-		int bfound = 0;
-		for (int ii = 0; ii < acc.n_aids; ii++)
-		{
-			if (acc.aids[ii] == a->id)
-			{	
-				bfound = 1;
-				break;
-			}
-		}
 
-		if (bfound == 0)
-		{
-			acc.n_aids++;
-			uint32_t* paids = calloc(acc.n_aids, sizeof(uint32_t));
-			for (int jj = 0; jj < acc.n_aids - 1; jj++)
-			{
-				paids[jj] = acc.aids[jj];
-			}
-			paids[acc.n_aids - 1] = a->id;
-			free(acc.aids);
-			acc.aids = paids;
-			uint32_t* pblt = calloc(acc.n_aids, sizeof(uint32_t));
-			for (int jj = 0; jj < acc.n_aids - 1; jj++)
-			{
-				pblt[jj] = acc.ballots[jj];
-			}
-			pblt[acc.n_aids - 1] = req->ballot;
-			free(acc.ballots);
-			acc.ballots = pblt;
-			uint32_t* pvb = calloc(acc.n_aids, sizeof(uint32_t));
-			for (int jj = 0; jj < acc.n_aids - 1; jj++)
-			{
-				pvb[jj] = acc.value_ballots[jj];
-			}
-			pvb[acc.n_aids - 1] = req->ballot;
-			free(acc.value_ballots);
-			acc.value_ballots = pvb;
-			storage_put_record(&a->store, &acc);
+	if (pr->ballot != req->ballot) {
+		// Preempted: the values are of no use to the proposer
+		paxos_promise_range_destroy(pr);
+		return acceptor_tx_commit(a) == 0;
+	}
+
+	if (a->promised_ballot > 0 && a->promised_from < from)
+		from = a->promised_from;
+
+	if (storage_put_watermark(&a->store, from, req->ballot) != 0) {
+		acceptor_tx_abort(a);
+		paxos_promise_range_destroy(pr);
+		return 0;
+	}
+
+	if (acceptor_tx_commit(a) != 0) {
+		paxos_promise_range_destroy(pr);
+		return 0;
+	}
+
+	a->promised_from = from;
+	a->promised_ballot = req->ballot;
+	a->promised_src = isrc;
+	return 1;
+}
+
+/**
+ * Receives and processes a prepare request for a range of instances, reading
+ * and updating all of them within a single storage transaction.
+ *
+ * The answer is one aggregated promise. It lists only the instances of the
+ * range that already have an accepted value; the remaining ones are
+ * promised implicitly. If some instance was promised to a higher ballot,
+ * the promise carries the highest such ballot and the proposer treats the
+ * whole range as preempted.
+ *
+ * A range with to_iid 0 is open ended: it covers every instance from
+ * from_iid on, as sent by a stable leader, and is answered by a promise
+ * with to_iid 0 as well.
+ *
+ * @param isrc Id of the node the request came from.
+ * @param a Pointer to the acceptor structure.
+ * @param req Pointer to the range prepare request.
+ * @param out Pointer to the paxos_message structure to store the response.
+ * @return 1 if the request was successfully processed, 0 otherwise.
+ */
+int acceptor_receive_prepare_range(int isrc, struct acceptor* a, paxos_prepare_range* req, paxos_message* out)
+{
+	iid_t iid, from = req->from_iid;
+	struct acceptor_update u = {a, isrc, req->ballot, req, out, -1, 0};
+
+	if (req->to_iid == 0)
+		return acceptor_receive_prepare_from(isrc, a, req, out);
+
+	if (from <= a->trim_iid)
+		from = a->trim_iid + 1;
+
+	if (req->to_iid < from)
+		return 0;
+
+	if (acceptor_tx_begin(a) != 0)
+		return 0;
+
+	paxos_log_debug("Acceptor %u Preparing iids: %u-%u, ballot: %u source %u", a->id,
+		from, req->to_iid, req->ballot, isrc);
+
+	memcpy(&(out->msg_info[0]), "AAtR", 4);
+	out->type = PAXOS_PROMISE_RANGE;
+	out->u.promise_range = (paxos_promise_range) {a->id, from, req->to_iid, req->ballot, 0, NULL, NULL, NULL};
+
+	for (iid = from; iid <= req->to_iid; iid++) {
+		if (storage_update_record(&a->store, iid, acceptor_prepare_range_record, &u) < 0) {
+			acceptor_tx_abort(a);
+			paxos_promise_range_destroy(&out->u.promise_range);
+			return 0;
 		}
 	}
 
-	if (storage_tx_commit(&a->store) != 0)
+	if (acceptor_tx_commit(a) != 0) {
+		paxos_promise_range_destroy(&out->u.promise_range);
 		return 0;
+	}
 
-	paxos_accepted_to_promise(&acc, out);
+	acceptor_stored(a, req->to_iid);
 	return 1;
 }
 
+/*
+ * Reads the ballot promised or accepted by a stored record, without copying
+ * its value.
+ */
+static void acceptor_read_ballot(paxos_accepted* acc, void* arg)
+{
+	if (acc->ballots != NULL)
+		*(ballot_t*)arg = acc->ballots[0];
+}
 
 /**
  * Receives and processes an accept request from a proposer.
@@ -197,34 +569,36 @@ int acceptor_receive_prepare(int isrc, struct acceptor* a, paxos_prepare* req, p
  */
 int acceptor_receive_accept(struct acceptor* a, paxos_accept* req, paxos_message* out)
 {
-	paxos_accepted acc;
+	ballot_t stored = 0;
 
 	if (req->iid <= a->trim_iid)
 		return 0;
 
-	memset(&acc, 0, sizeof(paxos_accepted));
-
-	if (storage_tx_begin(&a->store) != 0)
+	if (acceptor_tx_begin(a) != 0)
 		return 0;
 
-	int found = storage_get_record(&a->store, req->iid, &acc);
+	storage_read_record(&a->store, req->iid, acceptor_read_ballot, &stored);
+	ballot_t promised = acceptor_watermark(a, req->iid);
 
-	if (!found || acc.ballots[0] <= req->ballot) {
+	if (stored > promised)
+		promised = stored;
+
+	if (promised <= req->ballot) {
 		paxos_log_debug("Acceptor %u Accepting iid: %u, ballot: %u", a->id,req->iid, req->ballot);
 		paxos_accept_to_accepted(a->id, req, out);
 
 		if (storage_put_record(&a->store, &(out->u.accepted)) != 0) {
-			storage_tx_abort(&a->store);
+			acceptor_tx_abort(a);
 			return 0;
 		}
+		acceptor_stored(a, req->iid);
 	} else {
-		paxos_accepted_to_preempted(a->id, &acc, out);
+		paxos_accepted_to_preempted(a->id, req->iid, promised, out);
 	}
 
-	if (storage_tx_commit(&a->store) != 0)
+	if (acceptor_tx_commit(a) != 0)
 		return 0;
 
-	paxos_accepted_destroy(&acc);
 	return 1;
 }
 
@@ -243,14 +617,14 @@ int acceptor_receive_repeat(struct acceptor* a, iid_t iid, paxos_accepted* out)
 	memset(out, 0, sizeof(paxos_accepted));
 	//paxos_log_debug("out zeroed");
 
-	if (storage_tx_begin(&a->store) != 0)
+	if (acceptor_tx_begin(a) != 0)
 		return 0;
 
 	//paxos_log_debug("tx begin");
 	int found = storage_get_record(&a->store, iid, out);
 	//paxos_log_debug("Got record with rc %d ",found);
 
-	if (storage_tx_commit(&a->store) != 0)
+	if (acceptor_tx_commit(a) != 0)
 		return 0;
 
 	//paxos_log_debug("tx commit");
@@ -261,6 +635,57 @@ int acceptor_receive_repeat(struct acceptor* a, iid_t iid, paxos_accepted* out)
 	return found && (out->values[0].paxos_value_len > 0);
 }
 
+/* State shared with acceptor_repeat_record(). */
+struct acceptor_repeat
+{
+	acceptor_repeat_cb cb;
+	void* arg;
+	int count;
+};
+
+static void acceptor_repeat_record(paxos_accepted* acc, void* arg)
+{
+	struct acceptor_repeat* r = arg;
+
+	if (acc->values == NULL || acc->values[0].paxos_value_len == 0)
+		return;
+	r->cb(acc, r->arg);
+	r->count++;
+}
+
+/**
+ * Receives a repeat request for a range of instances, reading all of them in
+ * a single transaction. The callback is invoked, in order, for each instance
+ * of the range holding an accepted value. Records are read without being
+ * copied where the storage allows it: the callback must not modify, free or
+ * keep them, see storage_read_cb.
+ *
+ * @param a Pointer to the acceptor structure.
+ * @param req The repeat request, with the range to resend.
+ * @param cb Callback receiving the accepted values.
+ * @param arg Argument passed to the callback.
+ * @return The number of accepted values passed to the callback, 0 if the
+ * transaction failed.
+ */
+int acceptor_receive_repeat_range(struct acceptor* a, paxos_repeat* req,
+	acceptor_repeat_cb cb, void* arg)
+{
+	iid_t iid;
+	struct acceptor_repeat r = {cb, arg, 0};
+
+	paxos_log_debug("Acceptor %u got repeat for iids %u-%u", a->id, req->from, req->to);
+
+	if (acceptor_tx_begin(a) != 0)
+		return 0;
+
+	for (iid = req->from; iid <= req->to && iid >= req->from; iid++)
+		storage_read_record(&a->store, iid, acceptor_repeat_record, &r);
+
+	if (acceptor_tx_commit(a) != 0)
+		return 0;
+	return r.count;
+}
+
 /**
  * Receives a trim request and updates the acceptor's trim instance ID.
  *
@@ -276,13 +701,14 @@ int acceptor_receive_trim(struct acceptor* a, paxos_trim* trim)
 		return 0;
 
 	a->trim_iid = trim->iid;
+	acceptor_trim_aggregates(a, trim->iid);
 
-	if (storage_tx_begin(&a->store) != 0)
+	if (acceptor_tx_begin(a) != 0)
 		return 0;
 
 	storage_trim(&a->store, trim->iid);
 
-	if (storage_tx_commit(&a->store) != 0)
+	if (acceptor_tx_commit(a) != 0)
 		return 0;
 
 	return 1;
@@ -331,12 +757,15 @@ static void paxos_accepted_to_promise(paxos_accepted* acc, paxos_message* out)
 	if (acc->values != NULL)
 	{
 		out->u.promise.values[0].paxos_value_len = acc->values[0].paxos_value_len;
+		out->u.promise.values[0].paxos_value_flags = acc->values[0].paxos_value_flags;
 		out->u.promise.values[0].paxos_value_val = malloc(acc->values[0].paxos_value_len);
 		memcpy(out->u.promise.values[0].paxos_value_val, acc->values[0].paxos_value_val, acc->values[0].paxos_value_len);
 	};
 
 	out->u.promise.ballots[0] = acc->ballots[0];
 	out->u.promise.value_ballots[0] = acc->value_ballots[0];
+	out->u.promise.aids_cap = 1;
+	aidset_add(&out->u.promise.aidset, acc->aids[0]);
 }
 
 /**
@@ -368,194 +797,295 @@ static void paxos_accept_to_accepted(int id, paxos_accept* acc, paxos_message* o
 	};
 	out->u.accepted.aids[0] = id;
 	out->u.accepted.values[0].paxos_value_len = acc->value.paxos_value_len;
+	out->u.accepted.values[0].paxos_value_flags = acc->value.paxos_value_flags;
 	out->u.accepted.values[0].paxos_value_val = malloc(acc->value.paxos_value_len);
 	memcpy(out->u.accepted.values[0].paxos_value_val, acc->value.paxos_value_val, acc->value.paxos_value_len);
 	out->u.accepted.ballots[0] = acc->ballot;
 	out->u.accepted.value_ballots[0] = acc->ballot;
+	out->u.accepted.aids_cap = 1;
+	aidset_add(&out->u.accepted.aidset, id);
 }
 
 /**
- * Converts a paxos_accepted structure to a paxos_preempted structure for preempted messages.
+ * Fills a paxos_preempted message for an instance promised to a higher ballot.
  *
  * @param id The ID of the acceptor.
- * @param acc Pointer to the paxos_accepted structure to be converted.
- * @param out Pointer to the paxos_message structure to store the converted preempted message.
+ * @param iid The preempted instance.
+ * @param ballot The ballot the instance is promised to.
+ * @param out Pointer to the paxos_message structure to store the preempted message.
  */
-static void paxos_accepted_to_preempted(int id, paxos_accepted* acc, paxos_message* out)
+static void paxos_accepted_to_preempted(int id, iid_t iid, ballot_t ballot, paxos_message* out)
 {
 	out->type = PAXOS_PREEMPTED;
 	out->u.preempted = (paxos_preempted) { 
 		id, 
-		acc->iid, 
-		acc->ballots[0]
+		iid, 
+		ballot
 	};
 }
 
+static int acceptor_merge_promise(paxos_accepted* acc, int found, void* arg)
+{
+	struct acceptor_update* u = arg;
+	if (!found)
+		return 0;
+	u->src = acc->src;
+	// A promise for an older ballot does not count toward the current one
+	if (((paxos_promise*)u->msg)->ballot_0 < acc->ballots[0])
+		return 0;
+	int added = paxos_accepted_merge_promise(acc, u->msg, u->a->acceptors);
+	if (added > 0)
+		u->count = acc->n_aids;
+	return added > 0 ? 1 : added;
+}
+
+static int acceptor_record_src(paxos_accepted* acc, int found, void* arg)
+{
+	struct acceptor_update* u = arg;
+	if (found)
+		u->src = acc->src;
+	return 0;
+}
+
+/**
+ * Runs an update callback on the record of an instance in its own transaction.
+ *
+ * @return The value returned by the callback, -1 on storage error.
+ */
+static int acceptor_update_record(struct acceptor* a, iid_t iid, storage_update_cb cb,
+	struct acceptor_update* u)
+{
+	int rv;
+
+	if (acceptor_tx_begin(a) != 0)
+		return -1;
+
+	rv = storage_update_record(&a->store, iid, cb, u);
+	if (rv < 0) {
+		acceptor_tx_abort(a);
+		return -1;
+	}
+
+	if (acceptor_tx_commit(a) != 0)
+		return -1;
+
+	return rv;
+}
+
 int get_srcid_promise_and_adjust(paxos_promise* pr, struct acceptor* a)
 {
-	int ret = -1;
-	int promised = 0;
-	paxos_accepted acc;
-	memset(&acc, 0, sizeof(paxos_accepted));
+	struct acceptor_update u = {a, -1, 0, pr, NULL, -1, 0};
 
-	if (storage_tx_begin(&a->store) != 0)
+	if (acceptor_update_record(a, pr->iid, acceptor_merge_promise, &u) < 0)
 		return -1;
 
-	int found = storage_get_record(&a->store, pr->iid, &acc);
-	if (found)
-	{
-		ret = acc.src;
+	if (u.count >= a->subordinates / 2) return u.src; else return -1;
+}
 
-		for(int j0=0;j0<pr->n_aids;j0++)
-		{
-			int bfound = 0;
-
-			for (int ii = 0; ii < acc.n_aids; ii++)
-			{
-				if (acc.aids[ii] == pr->aids[j0])
-				{
-					bfound = 1;
-					break;
-				}
-			}
-
-			if (bfound == 0)
-			{
-				acc.n_aids++;
-				uint32_t* paids = calloc(acc.n_aids, sizeof(uint32_t));
-
-				for (int jj = 0; jj < acc.n_aids - 1; jj++)
-				{
-					paids[jj] = acc.aids[jj];
-				}
-
-				paids[acc.n_aids - 1] = pr->aids[j0];
-				free(acc.aids);
-				acc.aids = paids;
-				uint32_t* pblt = calloc(acc.n_aids, sizeof(uint32_t));
-
-				for (int jj = 0; jj < acc.n_aids - 1; jj++)
-				{
-					pblt[jj] = acc.ballots[jj];
-				}
-
-				pblt[acc.n_aids - 1] = pr->ballots[j0];
-				free(acc.ballots);
-				acc.ballots = pblt;
-				uint32_t* pvb = calloc(acc.n_aids, sizeof(uint32_t));
-
-				for (int jj = 0; jj < acc.n_aids - 1; jj++)
-				{
-					pvb[jj] = acc.value_ballots[jj];
-				}
-
-				pvb[acc.n_aids - 1] = pr->value_ballots[j0];
-				free(acc.value_ballots);
-				acc.value_ballots = pvb;
-
-				promised = acc.n_aids;
-				storage_put_record(&a->store, &acc);
-			}
+static void aggregate_free(struct aggregate* g)
+{
+	paxos_accepted_destroy(&g->acc);
+	free(g);
+}
+
+/**
+ * Restarts the aggregate of an instance for a new ballot. The node to
+ * report to is read again, since a new ballot may come from a new leader.
+ *
+ * @return 0 on success, -1 if the instance is not known to this acceptor.
+ */
+static int aggregate_reset(struct acceptor* a, struct aggregate* g, iid_t iid, ballot_t ballot)
+{
+	struct acceptor_update u = {a, -1, 0, NULL, NULL, -1, 0};
+	uint32_t cap = a->acceptors > 0 ? a->acceptors : 1;
+
+	if (acceptor_update_record(a, iid, acceptor_record_src, &u) < 0 || u.src < 0)
+		return -1;
+
+	paxos_accepted_destroy(&g->acc);
+	memset(&g->acc, 0, sizeof(paxos_accepted));
+	aidset_clear(&g->seen);
+	g->src = u.src;
+	g->sent = 0;
+	g->ballot = ballot;
+	g->acc.iid = iid;
+	g->acc.ballot_0 = ballot;
+	g->acc.value_ballot_0 = ballot;
+	g->acc.values = calloc(cap, sizeof(paxos_value));
+	return paxos_accepted_reserve(&g->acc, cap);
+}
+
+static void acceptor_trim_aggregates(struct acceptor* a, iid_t iid)
+{
+	khiter_t k;
+	for (k = kh_begin(a->aggregates); k != kh_end(a->aggregates); ++k) {
+		if (kh_exist(a->aggregates, k) && kh_key(a->aggregates, k) <= iid) {
+			aggregate_free(kh_value(a->aggregates, k));
+			kh_del_aggregate(a->aggregates, k);
 		}
 	}
+}
 
-	if (storage_tx_commit(&a->store) != 0)
+/**
+ * Copies an accepted from the subtree into out, to forward it as it is to
+ * the node the subordinate reports to.
+ *
+ * @return The node to send out to, -1 if the accepted is absorbed.
+ */
+static int aggregate_forward(struct acceptor* a, paxos_accepted* ac, paxos_message* out)
+{
+	int i;
+	paxos_accepted* fwd = &out->u.accepted;
+
+	for (i = 0; i < ac->n_aids; i++)
+		if (aidset_contains(&a->subtree, ac->aids[i]))
+			break;
+	if (i == ac->n_aids)
 		return -1;
 
-	if (promised >= a->subordinates / 2) return ret; else return -1;
+	memcpy(&(out->msg_info[0]), "AFwA", 4);
+	out->type = PAXOS_ACCEPTED;
+	memset(fwd, 0, sizeof(paxos_accepted));
+	fwd->src = ac->src;
+	fwd->iid = ac->iid;
+	fwd->ballot_0 = ac->ballot_0;
+	fwd->value_ballot_0 = ac->value_ballot_0;
+	fwd->values = calloc(ac->n_aids, sizeof(paxos_value));
+	if (fwd->values == NULL || paxos_accepted_merge(fwd, ac, ac->n_aids) < 0) {
+		paxos_accepted_destroy(fwd);
+		return -1;
+	}
+	for (i = 0; ac->values != NULL && i < fwd->n_aids; i++) {
+		if (ac->values[i].paxos_value_len == 0)
+			continue;
+		fwd->values[i].paxos_value_len = ac->values[i].paxos_value_len;
+		fwd->values[i].paxos_value_flags = ac->values[i].paxos_value_flags;
+		fwd->values[i].paxos_value_val = malloc(ac->values[i].paxos_value_len);
+		memcpy(fwd->values[i].paxos_value_val, ac->values[i].paxos_value_val,
+			ac->values[i].paxos_value_len);
+	}
+	return ac->src;
 }
 
-int get_srcid_accepted(paxos_accepted* ac, struct acceptor* a)
+/**
+ * Number of instances whose accepted messages are being aggregated.
+ *
+ * @param a Pointer to the acceptor structure.
+ * @return The number of aggregates held in memory.
+ */
+int acceptor_aggregate_count(struct acceptor* a)
 {
-	int ret = -1;
-	int naccepted = 0;
-	paxos_accepted acc;
-	memset(&acc, 0, sizeof(paxos_accepted));
+	return kh_size(a->aggregates);
+}
 
-	if (storage_tx_begin(&a->store) != 0)
-		return -1;
+/**
+ * Aggregates the accepted messages coming from the subtree of this
+ * acceptor. They are collected in memory per instance, and once a majority
+ * of the subtree accepted the same ballot a single accepted carrying all
+ * their aids is returned in out. Every other accepted for the instance, and
+ * any accepted not coming from the subtree, is absorbed, so that each group
+ * leader sends one message upward per instance. The aggregate is dropped
+ * once it was sent and the whole subtree accepted its ballot, as nothing is
+ * left to absorb; others go at trim time.
+ *
+ * An accepted for an instance this acceptor has no record of, e.g. whose
+ * accept did not reach it, cannot be aggregated as the node to report to
+ * is unknown: it is forwarded as it is, to the node of the accepted.
+ *
+ * @param ac Pointer to the received accepted.
+ * @param a Pointer to the acceptor structure.
+ * @param out Pointer to the paxos_message receiving the combined accepted.
+ * @return Id of the node to send out to, -1 if there is nothing to send.
+ */
+int acceptor_aggregate_accepted(paxos_accepted* ac, struct acceptor* a, paxos_message* out)
+{
+	int i, rv;
+	khiter_t k;
+	struct aggregate* g;
 
-	int found = storage_get_record(&a->store, ac->iid, &acc);
+	if (a->subordinates == 0 || ac->iid <= a->trim_iid || ac->n_aids == 0
+		|| ac->aids == NULL || ac->ballots == NULL)
+		return -1;
 
-	if (found)
-	{
-		ret = acc.src;
-		for (int j0 = 0; j0 < ac->n_aids; j0++)
-		{
-			int bfound = 0;
-
-			for (int ii = 0; ii < acc.n_aids; ii++)
-			{
-				if (acc.aids[ii] == ac->aids[j0])
-				{
-					bfound = 1;
-					break;
-				}
-			}
-
-			if (bfound == 0)
-			{
-				acc.n_aids++;
-				uint32_t* paids = calloc(acc.n_aids, sizeof(uint32_t));
-
-				for (int jj = 0; jj < acc.n_aids - 1; jj++)
-				{
-					paids[jj] = acc.aids[jj];
-				}
-
-				paids[acc.n_aids - 1] = ac->aids[j0];
-				free(acc.aids);
-				acc.aids = paids;
-				uint32_t* pblt = calloc(acc.n_aids, sizeof(uint32_t));
-
-				for (int jj = 0; jj < acc.n_aids - 1; jj++)
-				{
-					pblt[jj] = acc.ballots[jj];
-				}
-
-				pblt[acc.n_aids - 1] = ac->ballots[j0];
-				free(acc.ballots);
-				acc.ballots = pblt;
-				uint32_t* pvb = calloc(acc.n_aids, sizeof(uint32_t));
-
-				for (int jj = 0; jj < acc.n_aids - 1; jj++)
-				{
-					pvb[jj] = acc.value_ballots[jj];
-				}
-
-				pvb[acc.n_aids - 1] = ac->value_ballots[j0];
-				free(acc.value_ballots);
-				acc.value_ballots = pvb;
-
-				naccepted = acc.n_aids;
-				storage_put_record(&a->store, &acc);
-			}
+	k = kh_get_aggregate(a->aggregates, ac->iid);
+	if (k == kh_end(a->aggregates)) {
+		g = calloc(1, sizeof(struct aggregate));
+		if (aggregate_reset(a, g, ac->iid, ac->ballots[0]) != 0) {
+			aggregate_free(g);
+			return aggregate_forward(a, ac, out);
 		}
-
+		k = kh_put_aggregate(a->aggregates, ac->iid, &rv);
+		if (rv == -1) {
+			aggregate_free(g);
+			return -1;
+		}
+		kh_value(a->aggregates, k) = g;
 	}
+	g = kh_value(a->aggregates, k);
 
-	if (storage_tx_commit(&a->store) != 0)
+	if (ac->ballots[0] < g->ballot)
 		return -1;
+	if (ac->ballots[0] > g->ballot && aggregate_reset(a, g, ac->iid, ac->ballots[0]) != 0) {
+		aggregate_free(g);
+		kh_del_aggregate(a->aggregates, k);
+		return aggregate_forward(a, ac, out);
+	}
 
-	if (naccepted >= a->subordinates / 2) return ret; else return -1;
+	for (i = 0; i < ac->n_aids; i++) {
+		if (!aidset_contains(&a->subtree, ac->aids[i]))
+			continue;
+		if (aidset_add(&g->seen, ac->aids[i]) != 1 || g->sent)
+			continue;
+		if (paxos_accepted_add_aid(&g->acc, ac->aids[i], ac->ballots[i],
+				ac->value_ballots ? ac->value_ballots[i] : 0, a->acceptors) < 0)
+			return -1;
+		if (g->acc.values[0].paxos_value_len == 0 && ac->values != NULL
+			&& ac->values[i].paxos_value_len > 0) {
+			g->acc.values[0].paxos_value_len = ac->values[i].paxos_value_len;
+			g->acc.values[0].paxos_value_flags = ac->values[i].paxos_value_flags;
+			g->acc.values[0].paxos_value_val = malloc(ac->values[i].paxos_value_len);
+			memcpy(g->acc.values[0].paxos_value_val, ac->values[i].paxos_value_val,
+				ac->values[i].paxos_value_len);
+		}
+	}
+
+	rv = -1;
+	if (!g->sent && g->acc.n_aids >= a->subordinates / 2 + 1) {
+		paxos_log_debug("Acceptor %u iid %u subtree quorum of %u aids at ballot %u",
+			a->id, ac->iid, g->acc.n_aids, g->ballot);
+		memcpy(&(out->msg_info[0]), "AAgA", 4);
+		out->type = PAXOS_ACCEPTED;
+		out->u.accepted = g->acc;
+		memset(&g->acc, 0, sizeof(paxos_accepted));
+		g->sent = 1;
+		rv = g->src;
+	}
+	if (g->sent && aidset_count(&g->seen) >= aidset_count(&a->subtree)) {
+		aggregate_free(g);
+		kh_del_aggregate(a->aggregates, k);
+	}
+	return rv;
 }
 
 int get_srcid_preempted(paxos_preempted* ac, struct acceptor* a)
 {
-	int ret = -1;
-	paxos_accepted acc;
-	memset(&acc, 0, sizeof(paxos_accepted));
+	struct acceptor_update u = {a, -1, 0, ac, NULL, -1, 0};
 
-	if (storage_tx_begin(&a->store) != 0)
+	if (acceptor_update_record(a, ac->iid, acceptor_record_src, &u) < 0)
 		return -1;
 
-	int found = storage_get_record(&a->store, ac->iid, &acc);
+	return u.src;
+}
 
-	if (found)
-		ret = acc.src;
+int get_srcid_promise_range(paxos_promise_range* pr, struct acceptor* a)
+{
+	struct acceptor_update u = {a, -1, 0, pr, NULL, -1, 0};
 
-	if (storage_tx_commit(&a->store) != 0)
+	if (pr->to_iid == 0)
+		return a->promised_src;
+
+	if (acceptor_update_record(a, pr->from_iid, acceptor_record_src, &u) < 0)
 		return -1;
 
-	return ret;
-}
\ No newline at end of file
+	return u.src;
+}
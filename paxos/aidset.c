@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "aidset.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define AIDSET_WORD(aid) ((aid) >> 6)
+#define AIDSET_BIT(aid) ((uint64_t)1 << ((aid) & 63))
+
+/**
+ * Removes every acceptor id from the set.
+ *
+ * @param s Pointer to the acceptor set.
+ */
+void aidset_clear(paxos_aidset* s)
+{
+	memset(s->bits, 0, sizeof(s->bits));
+}
+
+/**
+ * Checks whether an acceptor id is a member of the set.
+ *
+ * @param s Pointer to the acceptor set.
+ * @param aid Acceptor id to look up.
+ * @return 1 if the id is in the set, 0 otherwise.
+ */
+int aidset_contains(paxos_aidset* s, uint32_t aid)
+{
+	if (aid >= PAXOS_MAX_ACCEPTORS)
+		return 0;
+	return (s->bits[AIDSET_WORD(aid)] & AIDSET_BIT(aid)) != 0;
+}
+
+/**
+ * Adds an acceptor id to the set.
+ *
+ * @param s Pointer to the acceptor set.
+ * @param aid Acceptor id to add.
+ * @return 1 if the id was added, 0 if already present, -1 if out of range.
+ */
+int aidset_add(paxos_aidset* s, uint32_t aid)
+{
+	if (aid >= PAXOS_MAX_ACCEPTORS)
+		return -1;
+	if (s->bits[AIDSET_WORD(aid)] & AIDSET_BIT(aid))
+		return 0;
+	s->bits[AIDSET_WORD(aid)] |= AIDSET_BIT(aid);
+	return 1;
+}
+
+/**
+ * Merges the members of one set into another.
+ *
+ * @param dst Set receiving the union.
+ * @param src Set whose members are added to dst.
+ */
+void aidset_or(paxos_aidset* dst, paxos_aidset* src)
+{
+	for (int i = 0; i < PAXOS_AIDSET_WORDS; i++)
+		dst->bits[i] |= src->bits[i];
+}
+
+/**
+ * Counts the members of the set.
+ *
+ * @param s Pointer to the acceptor set.
+ * @return Number of acceptor ids in the set.
+ */
+int aidset_count(paxos_aidset* s)
+{
+	int count = 0;
+	for (int i = 0; i < PAXOS_AIDSET_WORDS; i++)
+		count += __builtin_popcountll(s->bits[i]);
+	return count;
+}
+
+/**
+ * Rebuilds a set from a list of acceptor ids.
+ *
+ * @param s Pointer to the acceptor set.
+ * @param aids Array of acceptor ids, may be NULL when n is 0.
+ * @param n Number of ids in aids.
+ */
+void aidset_from_aids(paxos_aidset* s, uint32_t* aids, int n)
+{
+	aidset_clear(s);
+	for (int i = 0; i < n && aids != NULL; i++)
+		aidset_add(s, aids[i]);
+}
+
+static int aidset_is_empty(paxos_aidset* s)
+{
+	for (int i = 0; i < PAXOS_AIDSET_WORDS; i++)
+		if (s->bits[i] != 0)
+			return 0;
+	return 1;
+}
+
+/**
+ * Records built field by field (tests, legacy buffers) carry aids without
+ * a bitmap; derive it once so that membership tests stay O(1).
+ */
+static void paxos_accepted_sync_aidset(paxos_accepted* acc)
+{
+	if (acc->n_aids > 0 && acc->aids != NULL && aidset_is_empty(&acc->aidset))
+		aidset_from_aids(&acc->aidset, acc->aids, acc->n_aids);
+}
+
+static int grow_array(void** array, uint32_t old, uint32_t cap, size_t size,
+	int borrowed)
+{
+	char* p;
+	if (*array == NULL)
+		old = 0;
+	if (borrowed) {
+		// Not ours to reallocate: grow a copy instead
+		p = malloc(cap * size);
+		if (p != NULL && old > 0)
+			memcpy(p, *array, old * size);
+	} else {
+		p = realloc(*array, cap * size);
+	}
+	if (p == NULL)
+		return -1;
+	memset(p + old * size, 0, (cap - old) * size);
+	*array = p;
+	return 0;
+}
+
+/*
+ * Replaces the borrowed arrays of a record with grown copies of its own.
+ * The copies are all made before any is installed, so that on failure the
+ * record still only borrows.
+ */
+static int paxos_accepted_own_arrays(paxos_accepted* acc, uint32_t old, uint32_t cap)
+{
+	void* arrays[4] = {acc->aids, acc->ballots, acc->value_ballots, acc->values};
+	size_t sizes[4] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t),
+		sizeof(paxos_value)};
+	int i, n = acc->values != NULL ? 4 : 3;
+
+	for (i = 0; i < n; i++) {
+		if (grow_array(&arrays[i], old, cap, sizes[i], 1) != 0) {
+			while (--i >= 0)
+				free(arrays[i]);
+			return -1;
+		}
+	}
+	acc->aids = arrays[0];
+	acc->ballots = arrays[1];
+	acc->value_ballots = arrays[2];
+	acc->values = arrays[3];
+	acc->aids_cap = cap;
+	acc->borrowed &= ~PAXOS_ACCEPTED_BORROWED_ARRAYS;
+	return 0;
+}
+
+/**
+ * Makes room for cap acceptors in the per-acceptor arrays of a record, so
+ * that subsequent additions do not allocate. The values array is grown only
+ * if the record carries one. Borrowed arrays are copied to the heap when
+ * they must grow, and are the record's own afterwards; the bytes of the
+ * values are not copied.
+ *
+ * @param acc Pointer to the record.
+ * @param cap Number of acceptors the arrays must hold.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int paxos_accepted_reserve(paxos_accepted* acc, uint32_t cap)
+{
+	uint32_t old = acc->aids_cap > acc->n_aids ? acc->aids_cap : acc->n_aids;
+	if (cap <= old && acc->aids != NULL && acc->ballots != NULL
+		&& acc->value_ballots != NULL)
+		return 0;
+	if (cap < old)
+		cap = old;
+	if (acc->borrowed & PAXOS_ACCEPTED_BORROWED_ARRAYS)
+		return paxos_accepted_own_arrays(acc, old, cap);
+	if (grow_array((void**)&acc->aids, old, cap, sizeof(uint32_t), 0) != 0 ||
+		grow_array((void**)&acc->ballots, old, cap, sizeof(uint32_t), 0) != 0 ||
+		grow_array((void**)&acc->value_ballots, old, cap, sizeof(uint32_t), 0) != 0)
+		return -1;
+	if (acc->values != NULL &&
+		grow_array((void**)&acc->values, old, cap, sizeof(paxos_value), 0) != 0)
+		return -1;
+	acc->aids_cap = cap;
+	return 0;
+}
+
+static int paxos_accepted_append(paxos_accepted* acc, uint32_t aid,
+	uint32_t ballot, uint32_t value_ballot, uint32_t cap)
+{
+	if (acc->n_aids >= acc->aids_cap) {
+		if (cap <= acc->n_aids)
+			cap = acc->n_aids * 2 > 0 ? acc->n_aids * 2 : 1;
+		if (paxos_accepted_reserve(acc, cap) != 0)
+			return -1;
+	}
+	acc->aids[acc->n_aids] = aid;
+	acc->ballots[acc->n_aids] = ballot;
+	acc->value_ballots[acc->n_aids] = value_ballot;
+	acc->n_aids++;
+	return 0;
+}
+
+/**
+ * Adds a single acceptor to a record unless it is already listed.
+ *
+ * @param acc Pointer to the record.
+ * @param aid Acceptor id to add.
+ * @param ballot Ballot promised by the acceptor.
+ * @param value_ballot Ballot of the value accepted by the acceptor.
+ * @param cap Capacity to allocate if the arrays are full, usually the
+ *        number of configured acceptors.
+ * @return 1 if the acceptor was added, 0 if already present, -1 on error.
+ */
+int paxos_accepted_add_aid(paxos_accepted* acc, uint32_t aid, uint32_t ballot,
+	uint32_t value_ballot, uint32_t cap)
+{
+	paxos_accepted_sync_aidset(acc);
+	if (aid >= PAXOS_MAX_ACCEPTORS)
+		return -1;
+	if (aidset_contains(&acc->aidset, aid))
+		return 0;
+	if (paxos_accepted_append(acc, aid, ballot, value_ballot, cap) != 0)
+		return -1;
+	aidset_add(&acc->aidset, aid);
+	return 1;
+}
+
+/**
+ * Drops every acceptor of a record past the first n, e.g. the subordinates
+ * that promised a ballot the record no longer holds. Their values are freed
+ * unless borrowed; the arrays keep their capacity.
+ *
+ * @param acc Pointer to the record.
+ * @param n Number of leading acceptors to keep.
+ */
+void paxos_accepted_truncate(paxos_accepted* acc, uint32_t n)
+{
+	uint32_t i;
+
+	if (n >= acc->n_aids)
+		return;
+	for (i = n; acc->values != NULL && i < acc->n_aids; i++) {
+		if (!(acc->borrowed & PAXOS_ACCEPTED_BORROWED_VALUES)
+			&& acc->values[i].paxos_value_len > 0)
+			free(acc->values[i].paxos_value_val);
+		memset(&acc->values[i], 0, sizeof(paxos_value));
+	}
+	acc->n_aids = n;
+	aidset_from_aids(&acc->aidset, acc->aids, n);
+}
+
+static int paxos_accepted_merge_arrays(paxos_accepted* dst, paxos_aidset* set,
+	uint32_t n_aids, uint32_t* aids, uint32_t* ballots, uint32_t* value_ballots,
+	uint32_t cap)
+{
+	int i, added = 0;
+	paxos_aidset src, diff;
+
+	if (n_aids == 0 || aids == NULL)
+		return 0;
+	paxos_accepted_sync_aidset(dst);
+	src = *set;
+	if (aidset_is_empty(&src))
+		aidset_from_aids(&src, aids, n_aids);
+
+	for (i = 0; i < PAXOS_AIDSET_WORDS; i++)
+		diff.bits[i] = src.bits[i] & ~dst->aidset.bits[i];
+	if (aidset_is_empty(&diff))
+		return 0;
+
+	if (cap < dst->n_aids + aidset_count(&diff))
+		cap = dst->n_aids + aidset_count(&diff);
+	if (paxos_accepted_reserve(dst, cap) != 0)
+		return -1;
+
+	for (i = 0; i < n_aids; i++) {
+		if (!aidset_contains(&diff, aids[i]))
+			continue;
+		paxos_accepted_append(dst, aids[i], ballots ? ballots[i] : 0,
+			value_ballots ? value_ballots[i] : 0, cap);
+		diff.bits[AIDSET_WORD(aids[i])] &= ~AIDSET_BIT(aids[i]);
+		added++;
+	}
+	aidset_or(&dst->aidset, &src);
+	return added;
+}
+
+/**
+ * Merges the acceptors listed in an accepted message into a record. Only
+ * acceptors not yet in the record are appended; their values are not copied.
+ *
+ * @param dst Record to merge into.
+ * @param src Accepted message received from a subordinate.
+ * @param cap Capacity to allocate if the arrays are full.
+ * @return Number of acceptors added, -1 on error.
+ */
+int paxos_accepted_merge(paxos_accepted* dst, paxos_accepted* src, uint32_t cap)
+{
+	return paxos_accepted_merge_arrays(dst, &src->aidset, src->n_aids,
+		src->aids, src->ballots, src->value_ballots, cap);
+}
+
+/**
+ * Merges the acceptors listed in a promise into a record.
+ *
+ * @param dst Record to merge into.
+ * @param src Promise received from a subordinate.
+ * @param cap Capacity to allocate if the arrays are full.
+ * @return Number of acceptors added, -1 on error.
+ */
+int paxos_accepted_merge_promise(paxos_accepted* dst, paxos_promise* src, uint32_t cap)
+{
+	return paxos_accepted_merge_arrays(dst, &src->aidset, src->n_aids,
+		src->aids, src->ballots, src->value_ballots, cap);
+}
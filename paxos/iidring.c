@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "iidring.h"
+#include <stdlib.h>
+#include <assert.h>
+
+struct iidring
+{
+	iid_t head;   /* smallest iid stored, if any */
+	iid_t tail;   /* one past the largest iid stored */
+	size_t size;  /* capacity, a power of two */
+	int count;
+	void** slots;
+};
+
+static int iidring_grow(struct iidring* r, uint64_t span);
+static void iidring_advance(struct iidring* r);
+
+struct iidring* iidring_new(int size)
+{
+	struct iidring* r;
+	r = malloc(sizeof(struct iidring));
+	assert(r != NULL);
+	r->size = 1;
+	while (r->size < size)
+		r->size *= 2;
+	r->head = 0;
+	r->tail = 0;
+	r->count = 0;
+	r->slots = calloc(r->size, sizeof(void*));
+	assert(r->slots != NULL);
+	return r;
+}
+
+void iidring_free(struct iidring* r)
+{
+	free(r->slots);
+	free(r);
+}
+
+int iidring_count(struct iidring* r)
+{
+	return r->count;
+}
+
+int iidring_size(struct iidring* r)
+{
+	return (int)r->size;
+}
+
+void* iidring_get(struct iidring* r, iid_t iid)
+{
+	if (r->count == 0 || iid < r->head || iid >= r->tail)
+		return NULL;
+	return r->slots[iid & (r->size - 1)];
+}
+
+/*
+ * Number of slots the ring needs to hold iid along with the stored iids.
+ */
+static uint64_t iidring_span(struct iidring* r, iid_t iid)
+{
+	if (r->count == 0)
+		return 1;
+	if (iid < r->head)
+		return (uint64_t)r->tail - iid;
+	if (iid >= r->tail)
+		return (uint64_t)iid + 1 - r->head;
+	return r->tail - r->head;
+}
+
+/**
+ * Checks whether iid can be stored without the span of the ring exceeding
+ * IIDRING_MAX_SIZE. The largest iid never fits, as the ring end would wrap.
+ *
+ * @return 1 if the iid fits, 0 otherwise.
+ */
+int iidring_fits(struct iidring* r, iid_t iid)
+{
+	return iid != (iid_t)-1 && iidring_span(r, iid) <= IIDRING_MAX_SIZE;
+}
+
+/**
+ * Stores p at the given iid.
+ *
+ * @return 0 on success, -1 if the iid is already present, does not fit
+ *         (see iidring_fits()), or the ring cannot grow.
+ */
+int iidring_put(struct iidring* r, iid_t iid, void* p)
+{
+	uint64_t span = iidring_span(r, iid);
+
+	if (!iidring_fits(r, iid))
+		return -1;
+	if (span > r->size && iidring_grow(r, span) != 0)
+		return -1;
+	if (r->count == 0) {
+		r->head = iid;
+		r->tail = iid + 1;
+	} else if (iid < r->head) {
+		r->head = iid;
+	} else if (iid >= r->tail) {
+		r->tail = iid + 1;
+	} else if (r->slots[iid & (r->size - 1)] != NULL) {
+		return -1;
+	}
+	r->slots[iid & (r->size - 1)] = p;
+	r->count++;
+	return 0;
+}
+
+/**
+ * Removes the given iid.
+ *
+ * @return The pointer stored at iid, or NULL if it was not present.
+ */
+void* iidring_del(struct iidring* r, iid_t iid)
+{
+	void* p = iidring_get(r, iid);
+	if (p == NULL)
+		return NULL;
+	r->slots[iid & (r->size - 1)] = NULL;
+	r->count--;
+	if (iid == r->head)
+		iidring_advance(r);
+	return p;
+}
+
+/**
+ * @return The pointer stored at the smallest iid, NULL if the ring is empty.
+ */
+void* iidring_first(struct iidring* r)
+{
+	if (r->count == 0)
+		return NULL;
+	return r->slots[r->head & (r->size - 1)];
+}
+
+/**
+ * Returns the first iid of the range that may hold elements, to be iterated
+ * up to iidring_end() with iidring_get().
+ */
+iid_t iidring_begin(struct iidring* r)
+{
+	return r->count == 0 ? r->tail : r->head;
+}
+
+iid_t iidring_end(struct iidring* r)
+{
+	return r->tail;
+}
+
+/**
+ * Removes all the iids up to and including iid, calling cb on each of them.
+ */
+void iidring_trim(struct iidring* r, iid_t iid, void (*cb)(void*, void*), void* arg)
+{
+	while (r->count > 0 && r->head <= iid) {
+		void** slot = &r->slots[r->head & (r->size - 1)];
+		if (*slot != NULL) {
+			cb(*slot, arg);
+			*slot = NULL;
+			r->count--;
+		}
+		r->head++;
+	}
+	iidring_advance(r);
+}
+
+void iidring_foreach(struct iidring* r, void (*cb)(void*))
+{
+	iid_t iid;
+	for (iid = iidring_begin(r); iid < r->tail; iid++) {
+		void* p = r->slots[iid & (r->size - 1)];
+		if (p != NULL)
+			cb(p);
+	}
+}
+
+/*
+ * Grows the ring to hold span iids, which callers bound by IIDRING_MAX_SIZE.
+ *
+ * @return 0 on success, -1 on allocation failure, the ring left as it was.
+ */
+static int iidring_grow(struct iidring* r, uint64_t span)
+{
+	iid_t iid;
+	size_t size = r->size;
+	void** slots;
+
+	while (size < span)
+		size *= 2;
+	slots = calloc(size, sizeof(void*));
+	if (slots == NULL)
+		return -1;
+	for (iid = r->head; iid < r->tail; iid++)
+		slots[iid & (size - 1)] = r->slots[iid & (r->size - 1)];
+	free(r->slots);
+	r->slots = slots;
+	r->size = size;
+	return 0;
+}
+
+/* Moves head to the next stored iid. */
+static void iidring_advance(struct iidring* r)
+{
+	if (r->count == 0) {
+		r->head = r->tail;
+		return;
+	}
+	while (r->slots[r->head & (r->size - 1)] == NULL)
+		r->head++;
+}
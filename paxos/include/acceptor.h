@@ -37,19 +37,31 @@ extern "C" {
 
 struct acceptor;
 
+typedef void (*acceptor_repeat_cb)(paxos_accepted* acc, void* arg);
+
 int get_aid(struct acceptor* a);
 
 struct acceptor* acceptor_new(int id);
 void acceptor_free(struct acceptor* a);
+int acceptor_batch_begin(struct acceptor* a);
+int acceptor_batch_commit(struct acceptor* a);
+int acceptor_sync(struct acceptor* a);
 int acceptor_receive_prepare(int isrc, struct acceptor* a, paxos_prepare* req, paxos_message* out);
+int acceptor_receive_prepare_range(int isrc, struct acceptor* a, paxos_prepare_range* req, paxos_message* out);
 int acceptor_receive_accept(struct acceptor* a, paxos_accept* req, paxos_message* out);
 int acceptor_receive_repeat(struct acceptor* a, iid_t iid, paxos_accepted* out);
+int acceptor_receive_repeat_range(struct acceptor* a, paxos_repeat* req,
+	acceptor_repeat_cb cb, void* arg);
 int acceptor_receive_trim(struct acceptor* a, paxos_trim* trim);
 void acceptor_set_current_state(struct acceptor* a, paxos_acceptor_state* out);
 int get_srcid_promise_and_adjust(paxos_promise* pr, struct acceptor* a);
-int get_srcid_accepted(paxos_accepted* ac, struct acceptor* a);
+int acceptor_aggregate_accepted(paxos_accepted* ac, struct acceptor* a, paxos_message* out);
+int acceptor_aggregate_count(struct acceptor* a);
 int get_srcid_preempted(paxos_preempted* ac, struct acceptor* a);
+int get_srcid_promise_range(paxos_promise_range* pr, struct acceptor* a);
 void setsubordinates(struct acceptor* a, int isubs);
+void setacceptors(struct acceptor* a, int count);
+void setsubtree(struct acceptor* a, paxos_aidset* aids);
 
 #ifdef __cplusplus
 }
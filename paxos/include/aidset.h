@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AIDSET_H_
+#define _AIDSET_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "paxos_types.h"
+
+void aidset_clear(paxos_aidset* s);
+int aidset_contains(paxos_aidset* s, uint32_t aid);
+int aidset_add(paxos_aidset* s, uint32_t aid);
+void aidset_or(paxos_aidset* dst, paxos_aidset* src);
+int aidset_count(paxos_aidset* s);
+void aidset_from_aids(paxos_aidset* s, uint32_t* aids, int n);
+
+int paxos_accepted_reserve(paxos_accepted* acc, uint32_t cap);
+int paxos_accepted_add_aid(paxos_accepted* acc, uint32_t aid, uint32_t ballot,
+	uint32_t value_ballot, uint32_t cap);
+void paxos_accepted_truncate(paxos_accepted* acc, uint32_t n);
+int paxos_accepted_merge(paxos_accepted* dst, paxos_accepted* src, uint32_t cap);
+int paxos_accepted_merge_promise(paxos_accepted* dst, paxos_promise* src, uint32_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _IIDRING_H_
+#define _IIDRING_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "paxos.h"
+
+/*
+ * A set of pointers indexed by instance id, stored in a ring buffer at
+ * position iid modulo the (power of two) capacity. It suits instances that
+ * are opened in increasing order and closed roughly in order: lookups are
+ * direct, and getting the smallest iid or dropping all iids below a given
+ * one is O(1) amortised. The ring grows when the span between the smallest
+ * and largest stored iids exceeds its capacity, up to IIDRING_MAX_SIZE.
+ */
+struct iidring;
+
+/* Largest capacity of a ring, i.e. span of iids it can hold (32MB of slots). */
+#define IIDRING_MAX_SIZE (1 << 22)
+
+struct iidring* iidring_new(int size);
+void iidring_free(struct iidring* r);
+int iidring_count(struct iidring* r);
+int iidring_size(struct iidring* r);
+void* iidring_get(struct iidring* r, iid_t iid);
+int iidring_fits(struct iidring* r, iid_t iid);
+int iidring_put(struct iidring* r, iid_t iid, void* p);
+void* iidring_del(struct iidring* r, iid_t iid);
+void* iidring_first(struct iidring* r);
+iid_t iidring_begin(struct iidring* r);
+iid_t iidring_end(struct iidring* r);
+void iidring_trim(struct iidring* r, iid_t iid, void (*cb)(void*, void*), void* arg);
+void iidring_foreach(struct iidring* r, void (*cb)(void*));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
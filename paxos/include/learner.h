@@ -41,6 +41,7 @@ struct learner* learner_new(int acceptors);
 void learner_free(struct learner* l);
 void learner_set_instance_id(struct learner* l, iid_t iid);
 void learner_receive_accepted(struct learner* l, paxos_accepted* ack);
+void learner_take_accepted(struct learner* l, paxos_accepted* ack);
 int learner_deliver_next(struct learner* l, paxos_accepted* out);
 int learner_has_holes(struct learner* l, iid_t* from, iid_t* to);
 
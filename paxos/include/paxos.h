@@ -54,7 +54,8 @@ typedef enum
 typedef enum
 {
 	PAXOS_MEM_STORAGE = 0,
-	PAXOS_LMDB_STORAGE = 1
+	PAXOS_LMDB_STORAGE = 1,
+	PAXOS_WAL_STORAGE = 2
 } paxos_storage_backend;
 
 /* Configuration */
@@ -63,13 +64,18 @@ struct paxos_config
 	/* General configuration */
 	paxos_log_level verbosity;
 	int tcp_nodelay;
+	int wire_binary;
 	
 	/* Learner */
 	int learner_catch_up;
 	
 	/* Proposer */
-	int proposer_timeout;
+	int proposer_timeout; /* ms */
 	int proposer_preexec_window;
+	int proposer_stable_leader;
+	size_t proposer_batch_size;
+	int proposer_batch_count;
+	int proposer_batch_linger;
 	
 	/* Acceptor */
 	paxos_storage_backend storage_backend;
@@ -79,6 +85,12 @@ struct paxos_config
 	int lmdb_sync;
 	char *lmdb_env_path;
 	size_t lmdb_mapsize;
+
+	/* wal storage configuration */
+	char *wal_path;
+	size_t wal_segment_size;
+	int wal_sync_interval; /* us, 0 to sync on every commit */
+	size_t wal_sync_bytes;
 };
 
 extern struct paxos_config paxos_config;
@@ -88,6 +100,7 @@ int paxos_quorum(int acceptors);
 paxos_value* paxos_value_new(const char* v, size_t s);
 void paxos_value_free(paxos_value* v);
 void paxos_promise_destroy(paxos_promise* p);
+void paxos_promise_range_destroy(paxos_promise_range* p);
 void paxos_accept_destroy(paxos_accept* a);
 void paxos_accepted_destroy(paxos_accepted* a);
 void paxos_message_destroy(paxos_message* m);
@@ -35,9 +35,23 @@ struct paxos_value
 {
 	int paxos_value_len;
 	char *paxos_value_val;
+	uint32_t paxos_value_flags; /* PAXOS_VALUE_* */
 };
 typedef struct paxos_value paxos_value;
 
+/* The value is a batch of client values, see valuebatch.h. */
+#define PAXOS_VALUE_BATCH 1
+
+#define PAXOS_AIDSET_WORDS 4
+#define PAXOS_MAX_ACCEPTORS (PAXOS_AIDSET_WORDS * 64)
+
+/* Membership bitmap of the acceptor ids listed in a promise/accepted. */
+struct paxos_aidset
+{
+	uint64_t bits[PAXOS_AIDSET_WORDS];
+};
+typedef struct paxos_aidset paxos_aidset;
+
 struct paxos_prepare
 {
 	uint32_t src;
@@ -46,6 +60,15 @@ struct paxos_prepare
 };
 typedef struct paxos_prepare paxos_prepare;
 
+struct paxos_prepare_range
+{
+	uint32_t src;
+	uint32_t from_iid;
+	uint32_t to_iid;
+	uint32_t ballot;
+};
+typedef struct paxos_prepare_range paxos_prepare_range;
+
 struct paxos_promise
 {
 	uint32_t src;
@@ -58,9 +81,25 @@ struct paxos_promise
 	paxos_value* values;
 	uint32_t* ballots;
 	uint32_t* value_ballots;
+	uint32_t aids_cap;
+	paxos_aidset aidset;
 };
 typedef struct paxos_promise paxos_promise;
 
+/* Promise for a range of instances; lists only instances with a value. */
+struct paxos_promise_range
+{
+	uint32_t aid;
+	uint32_t from_iid;
+	uint32_t to_iid;
+	uint32_t ballot;
+	uint32_t n_values;
+	uint32_t* iids;
+	uint32_t* value_ballots;
+	paxos_value* values;
+};
+typedef struct paxos_promise_range paxos_promise_range;
+
 struct paxos_accept
 {
 	uint32_t src;
@@ -82,9 +121,20 @@ struct paxos_accepted
 	paxos_value* values;
 	uint32_t* ballots;
 	uint32_t* value_ballots;
+	uint32_t aids_cap;
+	paxos_aidset aidset;
+	uint32_t borrowed;   /* PAXOS_ACCEPTED_BORROWED_* flags */
 };
 typedef struct paxos_accepted paxos_accepted;
 
+/*
+ * Parts of a paxos_accepted owned by someone else, e.g. a storage that
+ * packed them: they are never freed, and the arrays are copied to the heap
+ * when they must grow.
+ */
+#define PAXOS_ACCEPTED_BORROWED_ARRAYS 1  /* aids, values, ballots arrays */
+#define PAXOS_ACCEPTED_BORROWED_VALUES 2  /* bytes of the values */
+
 struct paxos_preempted
 {
 	uint32_t aid;
@@ -129,7 +179,9 @@ enum paxos_message_type
 	PAXOS_REPEAT,
 	PAXOS_TRIM,
 	PAXOS_ACCEPTOR_STATE,
-	PAXOS_CLIENT_VALUE
+	PAXOS_CLIENT_VALUE,
+	PAXOS_PREPARE_RANGE,
+	PAXOS_PROMISE_RANGE
 };
 typedef enum paxos_message_type paxos_message_type;
 
@@ -148,6 +200,8 @@ struct paxos_message
 		paxos_trim trim;
 		paxos_acceptor_state state;
 		paxos_client_value client_value;
+		paxos_prepare_range prepare_range;
+		paxos_promise_range promise_range;
 	} u;
 };
 typedef struct paxos_message paxos_message;
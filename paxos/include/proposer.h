@@ -43,12 +43,19 @@ int get_prid(struct proposer* p);
 struct proposer* proposer_new(int id, int acceptors);
 void proposer_free(struct proposer* p);
 void proposer_propose(struct proposer* p, const char* value, size_t size);
+int proposer_flush_batch(struct proposer* p);
+int proposer_batched_count(struct proposer* p);
 int proposer_prepared_count(struct proposer* p);
 void proposer_set_instance_id(struct proposer* p, iid_t iid);
 
 // phase 1
 void proposer_prepare(struct proposer* p, paxos_prepare* out);
 int proposer_receive_promise(struct proposer* p, paxos_promise* ack, paxos_prepare* out);
+int proposer_prepare_range(struct proposer* p, int count, paxos_prepare_range* out);
+int proposer_receive_promise_range(struct proposer* p, paxos_promise_range* ack,
+	paxos_prepare_range* out);
+int proposer_prepare_leader(struct proposer* p, paxos_prepare_range* out);
+int proposer_is_leader(struct proposer* p);
 
 // phase 2
 int proposer_accept(struct proposer* p, paxos_accept* out);
@@ -62,6 +69,8 @@ void proposer_receive_acceptor_state(struct proposer* p, paxos_acceptor_state* s
 // timeouts
 struct timeout_iterator* proposer_timeout_iterator(struct proposer* p);
 int timeout_iterator_prepare(struct timeout_iterator* iter, paxos_prepare* out);
+int timeout_iterator_prepare_leader(struct timeout_iterator* iter,
+	paxos_prepare_range* out);
 int timeout_iterator_accept(struct timeout_iterator* iter, paxos_accept* out);
 void timeout_iterator_free(struct timeout_iterator* iter);
 
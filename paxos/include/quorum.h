@@ -33,18 +33,26 @@
 extern "C" {
 #endif
 
+#include "paxos_types.h"
+
+/*
+ * Acceptors heard from, as a bitmap of acceptor ids. Only the words needed
+ * for the number of acceptors are used, a single one up to 64 acceptors.
+ */
 struct quorum
 {
-	int count;
 	int quorum;
 	int acceptors;
-	int* acceptor_ids;
+	int words;
+	paxos_aidset ids;
 };
 
 void quorum_init(struct quorum *q, int acceptors);
 void quorum_clear(struct quorum* q);
 void quorum_destroy(struct quorum* q);
 int quorum_add(struct quorum* q, int id);
+int quorum_add_set(struct quorum* q, paxos_aidset* ids);
+int quorum_count(struct quorum* q);
 int quorum_reached(struct quorum* q);
 
 #ifdef __cplusplus
@@ -35,6 +35,26 @@ extern "C" {
 
 #include "paxos.h"
 
+/*
+ * Callback for storage_update_record. It receives the stored record, or a
+ * zeroed record carrying only the iid if none exists (found == 0), and may
+ * modify it in place. It returns 1 if the record must be written back, 0 if
+ * it was left untouched, and a negative value on error.
+ *
+ * The arrays and values of the record may be borrowed from the storage
+ * (see PAXOS_ACCEPTED_BORROWED_ARRAYS): they are grown only through
+ * paxos_accepted_reserve() and the functions built on it, and released only
+ * with paxos_accepted_destroy(), never with free() or realloc().
+ */
+typedef int (*storage_update_cb) (paxos_accepted* acc, int found, void* arg);
+
+/*
+ * Callback for storage_read_record. The record may point into the storage
+ * itself: it is valid only during the call and must not be modified, freed
+ * or kept.
+ */
+typedef void (*storage_read_cb) (paxos_accepted* acc, void* arg);
+
 struct storage
 {
 	void* handle;
@@ -47,8 +67,14 @@ struct storage
 		void (*tx_abort) (void* handle);
 		int (*get) (void* handle, iid_t iid, paxos_accepted* out);
 		int (*put) (void* handle, paxos_accepted* acc);
+		int (*update) (void* handle, iid_t iid, storage_update_cb cb, void* arg);
+		int (*read) (void* handle, iid_t iid, storage_read_cb cb, void* arg);
+		int (*sync) (void* handle);
 		int (*trim) (void* handle, iid_t iid);
 		iid_t (*get_trim_instance) (void* handle);
+		iid_t (*get_max_instance) (void* handle);
+		int (*get_watermark) (void* handle, iid_t* from, ballot_t* ballot);
+		int (*put_watermark) (void* handle, iid_t from, ballot_t ballot);
 	} api;
 };
 
@@ -60,11 +86,18 @@ int storage_tx_commit(struct storage* store);
 void storage_tx_abort(struct storage* store);
 int storage_get_record(struct storage* store, iid_t iid, paxos_accepted* out);
 int storage_put_record(struct storage* store, paxos_accepted* acc);
+int storage_update_record(struct storage* store, iid_t iid, storage_update_cb cb, void* arg);
+int storage_read_record(struct storage* store, iid_t iid, storage_read_cb cb, void* arg);
+int storage_sync(struct storage* store);
 int storage_trim(struct storage* store, iid_t iid);
 iid_t storage_get_trim_instance(struct storage* store);
+iid_t storage_get_max_instance(struct storage* store);
+int storage_get_watermark(struct storage* store, iid_t* from, ballot_t* ballot);
+int storage_put_watermark(struct storage* store, iid_t from, ballot_t ballot);
 
 void storage_init_mem(struct storage* s, int acceptor_id);
 void storage_init_lmdb(struct storage* s, int acceptor_id);
+void storage_init_wal(struct storage* s, int acceptor_id);
 
 #ifdef __cplusplus
 }
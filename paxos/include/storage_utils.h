@@ -35,8 +35,24 @@ extern "C" {
 
 #include "paxos.h"
 
+/*
+ * A record decoded in place by paxos_accepted_view_buffer(), with room for
+ * the per-aid arrays of any record.
+ */
+struct paxos_accepted_view
+{
+	paxos_accepted acc;
+	uint32_t aids[PAXOS_MAX_ACCEPTORS];
+	uint32_t ballots[PAXOS_MAX_ACCEPTORS];
+	uint32_t value_ballots[PAXOS_MAX_ACCEPTORS];
+	paxos_value values[PAXOS_MAX_ACCEPTORS];
+};
+
+size_t paxos_accepted_buffer_size(paxos_accepted* acc);
+void paxos_accepted_write_buffer(paxos_accepted* acc, char* buffer);
 char* paxos_accepted_to_buffer(paxos_accepted* acc);
-void paxos_accepted_from_buffer(char* buffer, paxos_accepted* out);
+int paxos_accepted_from_buffer(char* buffer, size_t size, paxos_accepted* out);
+int paxos_accepted_view_buffer(char* buffer, size_t size, struct paxos_accepted_view* view);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TIMEWHEEL_H_
+#define _TIMEWHEEL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * A hierarchical timing wheel with millisecond ticks. Timers are embedded
+ * in the objects they belong to and linked into the slot of their expiry
+ * time, so scheduling and cancelling are O(1) and advancing the wheel only
+ * visits the slots of the elapsed ticks. Expired timers are moved to a list
+ * the owner drains with timewheel_next_expired(); until drained they can
+ * still be cancelled. Expiries further than about 4.6 hours away are
+ * clamped.
+ */
+struct wheel_timer
+{
+	struct wheel_timer* next;
+	struct wheel_timer* prev;
+	uint64_t expires;  /* in ms, on the clock passed to the wheel */
+	int expired;       /* in the expired list */
+	void* data;
+};
+
+struct timewheel;
+
+struct timewheel* timewheel_new(uint64_t now);
+void timewheel_free(struct timewheel* w);
+int timewheel_count(struct timewheel* w);
+void timer_init(struct wheel_timer* t, void* data);
+int timer_pending(struct wheel_timer* t);
+void timewheel_schedule(struct timewheel* w, struct wheel_timer* t, uint64_t expires);
+void timewheel_cancel(struct timewheel* w, struct wheel_timer* t);
+int timewheel_advance(struct timewheel* w, uint64_t now);
+struct wheel_timer* timewheel_next_expired(struct timewheel* w);
+uint64_t timewheel_now(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VALUEBATCH_H_
+#define _VALUEBATCH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "paxos.h"
+#include <stddef.h>
+
+/*
+ * Packs many client values into a single paxos value. A batch starts with
+ * a 4 byte magic and a 4 byte count, followed by each value as a 4 byte
+ * length and its bytes; integers are big endian. The bytes alone do not
+ * tell a batch from a client value that looks like one: sealed batches
+ * carry PAXOS_VALUE_BATCH, which readers check instead.
+ */
+struct value_batch
+{
+	char* buf;
+	size_t len;
+	size_t cap;
+	int count;
+};
+
+typedef void (*value_batch_cb)(const char* value, size_t size, void* arg);
+
+void value_batch_init(struct value_batch* b);
+void value_batch_destroy(struct value_batch* b);
+int value_batch_count(struct value_batch* b);
+size_t value_batch_size(struct value_batch* b);
+int value_batch_append(struct value_batch* b, const char* value, size_t size);
+paxos_value* value_batch_seal(struct value_batch* b);
+int value_batch_foreach(const char* value, size_t size, value_batch_cb cb, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,20 +27,37 @@
 
 
 #include "learner.h"
-#include "khash.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+/* Initial and maximum number of instances the learner keeps track of. */
+#define LEARNER_RING_SIZE 1024
+#define LEARNER_RING_MAX (1 << 18)
+
+/*
+ * An instance being learned. Besides the ballot accepted by each acceptor
+ * and the number of acceptors at each ballot, kept outside of the slot,
+ * only the value of the highest ballot seen is stored, so an instance
+ * costs a single copy of its value.
+ */
 struct instance
 {
-	iid_t iid;
-	ballot_t last_update_ballot;
-	paxos_accepted** acks;
-	paxos_accepted* final_value;
+	iid_t iid;                   /* 0 if the slot is free */
+	ballot_t last_update_ballot; /* the ballot decided, once closed */
+	ballot_t value_ballot;
+	uint32_t aid;                /* last acceptor counted */
+	int closed;
+	int ballots;                 /* entries in use in the slot counts */
+	paxos_value value;
+};
+
+/* Number of acceptors whose last accepted ballot is ballot. */
+struct ballot_count
+{
+	ballot_t ballot;
+	int count;
 };
-/** Define a hash map for instances with integer keys */
-KHASH_MAP_INIT_INT(instance, struct instance*)
 
 struct learner
 {
@@ -48,21 +65,28 @@ struct learner
 	int late_start;
 	iid_t current_iid;
 	iid_t highest_iid_closed;
-	khash_t(instance)* instances;
+	int size;                /* slots in the ring, a power of two */
+	struct instance* slots;  /* instance iid lives at slot iid & (size - 1) */
+	ballot_t* acks;          /* ballot accepted by each acceptor, per slot */
+	struct ballot_count* counts; /* up to one per acceptor, per slot */
 };
 
 static struct instance* learner_get_instance(struct learner* l, iid_t iid);
 static struct instance* learner_get_current_instance(struct learner* l);
 static struct instance* learner_get_instance_or_create(struct learner* l, iid_t iid);
 static void learner_delete_instance(struct learner* l, struct instance* inst);
-static struct instance* instance_new(int acceptors);
-static void instance_free(struct instance* i, int acceptors);
-static void instance_update(struct instance* i, paxos_accepted* ack, int acceptors);
-static int instance_has_quorum(struct instance* i, int acceptors);
-static void instance_add_accept(struct instance* i, paxos_accepted* ack);
-static paxos_accepted* paxos_accepted_dup(paxos_accepted* ack);
-static void paxos_value_copy(paxos_value* dst, paxos_value* src);
-static void paxos_accepted_deep_copy(paxos_accepted* ack, paxos_accepted* copy);
+static int learner_grow(struct learner* l, iid_t iid);
+static ballot_t* learner_acks(struct learner* l, struct instance* inst);
+static struct ballot_count* learner_counts(struct learner* l, struct instance* inst);
+static void learner_update(struct learner* l, paxos_accepted* ack, int move);
+static void instance_update(struct learner* l, struct instance* inst, paxos_accepted* ack,
+	int move);
+static int instance_has_quorum(struct instance* inst);
+static struct ballot_count* instance_count(struct learner* l, struct instance* inst,
+	ballot_t ballot, int create);
+static void instance_set_value(struct instance* inst, paxos_accepted* ack, int i, int move);
+static void instance_to_accepted(struct instance* inst, paxos_accepted* out);
+static paxos_value* paxos_accepted_value(paxos_accepted* ack, int i);
 
 /**
  * Creates a new learner instance.
@@ -78,7 +102,11 @@ struct learner* learner_new(int acceptors)
 	l->current_iid = 1;
 	l->highest_iid_closed = 1;
 	l->late_start = !paxos_config.learner_catch_up;
-	l->instances = kh_init(instance);
+	l->size = LEARNER_RING_SIZE;
+	l->slots = calloc(l->size, sizeof(struct instance));
+	l->acks = calloc((size_t)l->size * acceptors, sizeof(ballot_t));
+	l->counts = calloc((size_t)l->size * acceptors, sizeof(struct ballot_count));
+	assert(l->slots != NULL && l->acks != NULL && l->counts != NULL);
 	return l;
 }
 
@@ -89,9 +117,13 @@ struct learner* learner_new(int acceptors)
  */
 void learner_free(struct learner* l)
 {
-	struct instance* inst;
-	kh_foreach_value(l->instances, inst, instance_free(inst, l->acceptors));
-	kh_destroy(instance, l->instances);
+	int i;
+	for (i = 0; i < l->size; i++)
+		if (l->slots[i].iid != 0)
+			learner_delete_instance(l, &l->slots[i]);
+	free(l->slots);
+	free(l->acks);
+	free(l->counts);
 	free(l);
 }
 
@@ -104,49 +136,92 @@ void learner_free(struct learner* l)
  */
 void learner_set_instance_id(struct learner* l, iid_t iid)
 {
+	int i;
+	for (i = 0; i < l->size; i++)
+		if (l->slots[i].iid != 0 && l->slots[i].iid <= iid)
+			learner_delete_instance(l, &l->slots[i]);
 	l->current_iid = iid + 1;
 	l->highest_iid_closed = iid;
 }
 
 /**
- * Handles the reception of an accepted message by the learner.
+ * Handles the reception of an accepted message by the learner. The value
+ * is copied if the learner needs it.
  *
  * @param l Pointer to the learner instance.
  * @param ack Pointer to the received paxos_accepted message.
  */
 void learner_receive_accepted(struct learner* l, paxos_accepted* ack)
+{
+	learner_update(l, ack, 0);
+}
+
+/**
+ * Same as learner_receive_accepted(), except that a value the learner
+ * needs is moved out of ack instead of copied: its buffer is handed over
+ * to the learner, and left empty in ack. The value must be heap allocated,
+ * as in a decoded message, and ack must not be read for it afterwards.
+ *
+ * @param l Pointer to the learner instance.
+ * @param ack Pointer to the received paxos_accepted message.
+ */
+void learner_take_accepted(struct learner* l, paxos_accepted* ack)
+{
+	learner_update(l, ack, 1);
+}
+
+/*
+ * Counts ack towards its instance, moving its value if move is set.
+ */
+static void learner_update(struct learner* l, paxos_accepted* ack, int move)
 {	
-	// paxos_log_debug("entering paxos learner %lx", l);
+	paxos_accepted single;
+
+	// A record without aid list is the accepted of acceptor src alone,
+	// held in the flat fields
+	if (ack->n_aids == 0) {
+		single = *ack;
+		single.n_aids = 1;
+		single.aids = &ack->src;
+		single.ballots = &ack->ballot_0;
+		single.value_ballots = &ack->value_ballot_0;
+		single.values = &ack->value_0;
+		ack = &single;
+	}
 
 	if (l->late_start) {
 		l->late_start = 0; // Turn off late start flag
 		l->current_iid = ack->iid; // Set current instance ID
 	}
-	
-//	paxos_log_debug("learner %lx stage 1", l);
 
 	if (ack->iid < l->current_iid) {
 		// paxos_log_debug("Dropped paxos_accepted for iid %u. Already delivered.", ack->iid);
 		return;
 	}
 
-	// paxos_log_debug("learner %lx stage2", l);
 	struct instance* inst;
 	inst = learner_get_instance_or_create(l, ack->iid);
+
+	// Too far ahead to be tracked: report it as a hole to be repaired later
+	if (inst == NULL) {
+		paxos_log_debug("Dropped paxos_accepted for iid %u. Beyond the learner window.", ack->iid);
+		if (ack->iid > l->highest_iid_closed)
+			l->highest_iid_closed = ack->iid;
+		return;
+	}
+
 	// Update instance with accepted message
-	instance_update(inst, ack, l->acceptors);
-	// paxos_log_debug("learner %lx stage3", l);
+	instance_update(l, inst, ack, move);
 
 	// If instance has a quorum and is not yet closed, update highest closed instance ID
-	if (instance_has_quorum(inst, l->acceptors)
+	if (instance_has_quorum(inst)
 		&& (inst->iid > l->highest_iid_closed))
 		l->highest_iid_closed = inst->iid;
-
-	// paxos_log_debug("learner %lx stage4", l);
-
 }
+
 /**
  * Attempts to deliver the next accepted value from the learner's instance queue.
+ * The value is handed over to out, to be released with paxos_accepted_destroy().
  *
  * @param l Pointer to the learner instance.
  * @param out Pointer to store the delivered paxos_accepted value.
@@ -154,21 +229,15 @@ void learner_receive_accepted(struct learner* l, paxos_accepted* ack)
  */
 int learner_deliver_next(struct learner* l, paxos_accepted* out)
 {
-	// paxos_log_debug("learner %lx deliever next stage1", l);
 	struct instance* inst = learner_get_current_instance(l);
 
 	// If no current instance or quorum is missing, cannot deliver
-	if (inst == NULL || !instance_has_quorum(inst, l->acceptors))
+	if (inst == NULL || !instance_has_quorum(inst))
 		return 0;
 
-	// Copy the final value and mark it as delivered
-	// paxos_log_debug("learner %lx deliever next stage2", l);
-	// memcpy(out, inst->final_value, sizeof(paxos_accepted));
-	// paxos_value_copy(&out->value, &inst->final_value->value);
-	paxos_accepted_deep_copy(inst->final_value, out);
+	instance_to_accepted(inst, out);
 	learner_delete_instance(l, inst);
 	l->current_iid++;
-	// paxos_log_debug("learner %lx deliever next stage3", l);
 	return 1;
 }
 
@@ -191,7 +260,7 @@ int learner_has_holes(struct learner* l, iid_t* from, iid_t* to)
 }
 
 /**
- * Retrieves an instance with a specific instance ID from the learner's instance map.
+ * Retrieves an instance with a specific instance ID from the learner's ring.
  *
  * @param l Pointer to the learner instance.
  * @param iid Instance ID to retrieve.
@@ -199,13 +268,13 @@ int learner_has_holes(struct learner* l, iid_t* from, iid_t* to)
  */
 static struct instance* learner_get_instance(struct learner* l, iid_t iid)
 {
-	khiter_t k;
-	k = kh_get_instance(l->instances, iid);
+	struct instance* inst;
 
-	if (k == kh_end(l->instances))
+	if (iid < l->current_iid || iid - l->current_iid >= (iid_t)l->size)
 		return NULL;
 
-	return kh_value(l->instances, k);
+	inst = &l->slots[iid & (l->size - 1)];
+	return inst->iid == iid ? inst : NULL;
 }
 
 /**
@@ -220,258 +289,295 @@ static struct instance* learner_get_current_instance(struct learner* l)
 }
 
 /**
- * Retrieves an instance with a specific instance ID from the learner's instance map.
- * If the instance does not exist, creates a new instance and adds it to the map.
+ * Retrieves an instance with a specific instance ID from the learner's ring.
+ * If the instance does not exist, it is started in its slot, growing the
+ * ring if the instance is too far ahead of the current one.
  *
  * @param l Pointer to the learner instance.
- * @param iid Instance ID to retrieve or create.
- * @return Pointer to the retrieved or newly created instance.
+ * @param iid Instance ID to retrieve or create, not below the current one.
+ * @return Pointer to the instance, or NULL if it is beyond the largest ring.
  */
 static struct instance* learner_get_instance_or_create(struct learner* l, iid_t iid)
 {
-	struct instance* inst = learner_get_instance(l, iid);
+	struct instance* inst;
 
-	if (inst == NULL) {
-		int rv;
-		khiter_t k = kh_put_instance(l->instances, iid, &rv); // Store the instance in the map
-		assert(rv != -1);
-		inst = instance_new(l->acceptors);
-		kh_value(l->instances, k) = inst;
-	}
+	if (iid - l->current_iid >= (iid_t)l->size && learner_grow(l, iid) != 0)
+		return NULL;
 
+	inst = &l->slots[iid & (l->size - 1)];
+	if (inst->iid != iid) {
+		// Slots only hold instances of the window, a stale one is finished
+		if (inst->iid != 0)
+			learner_delete_instance(l, inst);
+		memset(inst, 0, sizeof(struct instance));
+		memset(learner_acks(l, inst), 0, sizeof(ballot_t) * l->acceptors);
+		inst->iid = iid;
+	}
 	return inst;
 }
 
 /**
- * Deletes an instance from the learner's instance map and frees its resources.
+ * Frees the value of an instance and releases its slot.
  *
  * @param l Pointer to the learner instance.
  * @param inst Pointer to the instance to be deleted.
  */
 static void learner_delete_instance(struct learner* l, struct instance* inst)
 {
-	khiter_t k;
-	k = kh_get_instance(l->instances, inst->iid);
-	kh_del_instance(l->instances, k);
-	instance_free(inst, l->acceptors);
+	free(inst->value.paxos_value_val);
+	memset(inst, 0, sizeof(struct instance));
 }
 
-/**
- * Creates a new instance with allocated memory for the acknowledgments.
- *
- * @param acceptors Number of acceptors for which acknowledgments will be stored.
- * @return Pointer to the newly created instance.
+/*
+ * Doubles the ring until iid fits in the window starting at the current
+ * instance, moving the instances to their new slots.
  */
-static struct instance* instance_new(int acceptors)
+static int learner_grow(struct learner* l, iid_t iid)
 {
-	int i;
-	struct instance* inst;
-	inst = malloc(sizeof(struct instance));
-	memset(inst, 0, sizeof(struct instance));
-	inst->acks = malloc(sizeof(paxos_accepted*) * acceptors);
+	int i, size = l->size;
+	struct instance* slots;
+	ballot_t* acks;
+	struct ballot_count* counts;
+
+	while (iid - l->current_iid >= (iid_t)size) {
+		if (size >= LEARNER_RING_MAX)
+			return -1;
+		size *= 2;
+	}
 
-	for (i = 0; i < acceptors; ++i)
-		inst->acks[i] = NULL;
+	slots = calloc(size, sizeof(struct instance));
+	acks = calloc((size_t)size * l->acceptors, sizeof(ballot_t));
+	counts = calloc((size_t)size * l->acceptors, sizeof(struct ballot_count));
+	if (slots == NULL || acks == NULL || counts == NULL) {
+		free(slots);
+		free(acks);
+		free(counts);
+		return -1;
+	}
 
-	return inst;
+	for (i = 0; i < l->size; i++) {
+		struct instance* inst = &l->slots[i];
+		int j = inst->iid & (size - 1);
+		if (inst->iid == 0)
+			continue;
+		slots[j] = *inst;
+		memcpy(&acks[(size_t)j * l->acceptors], learner_acks(l, inst),
+			sizeof(ballot_t) * l->acceptors);
+		memcpy(&counts[(size_t)j * l->acceptors], learner_counts(l, inst),
+			sizeof(struct ballot_count) * inst->ballots);
+	}
+
+	free(l->slots);
+	free(l->acks);
+	free(l->counts);
+	l->slots = slots;
+	l->acks = acks;
+	l->counts = counts;
+	l->size = size;
+	return 0;
 }
 
-/**
- * Frees the resources associated with an instance, including the acks array.
- *
- * @param inst Pointer to the instance to be freed.
- * @param acceptors Number of acceptors for which acknowledgments are stored.
+/*
+ * The ballots accepted by each acceptor for the instance in a slot.
  */
-static void instance_free(struct instance* inst, int acceptors)
+static ballot_t* learner_acks(struct learner* l, struct instance* inst)
 {
-	int i;
-	for (i = 0; i < acceptors; i++)
-		if (inst->acks[i] != NULL) paxos_accepted_free(inst->acks[i]);
+	return &l->acks[(size_t)(inst - l->slots) * l->acceptors];
+}
 
-	free(inst->acks);
-	free(inst);
+/*
+ * The acceptor counts per ballot of the instance in a slot, inst->ballots
+ * of them are in use.
+ */
+static struct ballot_count* learner_counts(struct learner* l, struct instance* inst)
+{
+	return &l->counts[(size_t)(inst - l->slots) * l->acceptors];
 }
 
 /**
- * Updates an instance with a received accepted value.
+ * Updates an instance with a received accepted value. Each acceptor moves
+ * from the count of its previous ballot to the one of its new ballot, and
+ * the instance closes as soon as a count reaches the quorum.
  *
+ * @param l Pointer to the learner.
  * @param inst Pointer to the instance to be updated.
  * @param accepted Pointer to the received paxos_accepted value.
- * @param acceptors Number of acceptors for which acknowledgments are stored.
+ * @param move Whether the value may be moved out of accepted.
  */
-static void instance_update(struct instance* inst, paxos_accepted* accepted, int acceptors)
+static void instance_update(struct learner* l, struct instance* inst, paxos_accepted* accepted,
+	int move)
 {	
-	// Initialize the instance if it's the first message received for it
-	if (inst->iid == 0) {
-		// paxos_log_debug("Received first message for iid: %u", accepted->iid);
-		inst->iid = accepted->iid;
-		inst->last_update_ballot = accepted->ballots[0];
-	}
-	
+	ballot_t* acks = learner_acks(l, inst);
+	struct ballot_count* c = NULL;
+	int quorum = paxos_quorum(l->acceptors);
+
 	// If the instance is already closed, drop the message
-	if (instance_has_quorum(inst, acceptors)) {
+	if (inst->closed) {
 		// paxos_log_debug("Dropped paxos_accepted iid %u. Already closed.", accepted->iid);
 		return;
 	}
-	
-	// Check if the received ballot is newer than the previous ballot
-	paxos_accepted* prev_accepted = inst->acks[accepted->aids[0]];
-	if (prev_accepted != NULL && prev_accepted->ballots[0] >= accepted->ballots[0]) {
-		// paxos_log_debug("Dropped paxos_accepted for iid %u. Previous ballot is newer or equal.", accepted->iid);
+
+	if (accepted->aids == NULL || accepted->ballots == NULL)
 		return;
-	}
 	
-	instance_add_accept(inst, accepted);
-}
+	// An accepted aggregated by a group leader carries the aids of several
+	// acceptors, all at the same ballot; count each of them.
+	for (int i = 0; i < accepted->n_aids && !inst->closed; i++) {
+		uint32_t aid = accepted->aids[i];
+		ballot_t ballot = accepted->ballots[i];
+		if (aid >= l->acceptors)
+			continue;
+
+		// Check if the received ballot is newer than the previous ballot
+		if (acks[aid] >= ballot) {
+			// paxos_log_debug("Dropped paxos_accepted for iid %u. Previous ballot is newer or equal.", accepted->iid);
+			continue;
+		}
 
-/* 
-	Checks if a given instance is closed, that is if a quorum of acceptor 
-	accepted the same value ballot pair. 
-	Returns 1 if the instance is closed, 0 otherwise.
-*/
+		if (acks[aid] != 0)
+			instance_count(l, inst, acks[aid], 0)->count--;
+		if (c == NULL || c->ballot != ballot)
+			c = instance_count(l, inst, ballot, 1);
+		c->count++;
 
-/**
- * Checks if the instance has achieved a quorum for acceptance.
- *
- * @param inst Pointer to the instance to be checked.
- * @param acceptors Number of acceptors in the system.
- * @return 1 if a quorum has been reached, 0 otherwise.
- */
-static int instance_has_quorum(struct instance* inst, int acceptors)
-{
-	paxos_accepted* curr_ack;
-	int i, a_valid_index = -1, count = 0;
+		acks[aid] = ballot;
+		inst->last_update_ballot = ballot;
+		inst->aid = aid;
+		instance_set_value(inst, accepted, i, move);
 
-	// If a final value has been set, the instance is considered closed
-	if (inst->final_value != NULL)
-		return 1;
-
-	// Iterate through acceptor acknowledgments
-	for (i = 0; i < acceptors; i++) {
-		curr_ack = inst->acks[i];
-	
-		// Skip over missing acceptor acks
-		if (curr_ack == NULL) continue;
-		
-		// Count the ones "agreeing" with the last added
-		if (curr_ack->ballots[0] == inst->last_update_ballot) {
-			count++;
-			a_valid_index = i;
+		if (c->count >= quorum) {
+			// paxos_log_debug("Reached quorum, iid: %u is closed!", inst->iid);
+			inst->closed = 1;
 		}
 	}
-
-	// Check if a quorum has been reached and set the final value if so
-	if (count >= paxos_quorum(acceptors)) {
-		// paxos_log_debug("Reached quorum, iid: %u is closed!", inst->iid);
-		inst->final_value = inst->acks[a_valid_index];
-		return 1;
-	}
-	return 0;
 }
 
-/*
-	Adds the given paxos_accepted to the given instance, 
-	replacing the previous paxos_accepted, if any.
-*/
+/**
+ * @param inst Pointer to the instance to be checked.
+ * @return 1 if a quorum of acceptors accepted the same ballot, 0 otherwise.
+ */
+static int instance_has_quorum(struct instance* inst)
+{
+	return inst->closed;
+}
 
 /**
- * Adds an accepted value to the instance's acknowledgments array.
+ * Looks up the acceptor count of a ballot. There are at most as many
+ * ballots as acceptors, and usually a single one.
  *
- * @param inst Pointer to the instance to be updated.
- * @param accepted Pointer to the accepted value to be added.
+ * @param l Pointer to the learner.
+ * @param inst Pointer to the instance.
+ * @param ballot The ballot to look up.
+ * @param create Whether to add the ballot if missing.
+ * @return The count of the ballot, NULL if missing and not created.
  */
-static void instance_add_accept(struct instance* inst, paxos_accepted* accepted)
+static struct ballot_count* instance_count(struct learner* l, struct instance* inst,
+	ballot_t ballot, int create)
 {
-	// paxos_log_debug("learner %lx add accept stage1",inst );
-	int acceptor_id = accepted->aids[0];
+	int i, free_entry = -1;
+	struct ballot_count* counts = learner_counts(l, inst);
+
+	for (i = inst->ballots - 1; i >= 0; i--) {
+		if (counts[i].ballot == ballot)
+			return &counts[i];
+		if (counts[i].count == 0)
+			free_entry = i;
+	}
 
-	if (inst->acks[acceptor_id] != NULL)
-		paxos_accepted_free(inst->acks[acceptor_id]);
+	if (!create)
+		return NULL;
 
-	inst->acks[acceptor_id] = paxos_accepted_dup(accepted);
-	inst->last_update_ballot = accepted->ballots[0];
-	// paxos_log_debug("learner %lx add accept stage2", inst);
+	if (free_entry < 0) {
+		assert(inst->ballots < l->acceptors);
+		free_entry = inst->ballots++;
+	}
+	counts[free_entry] = (struct ballot_count) {ballot, 0};
+	return &counts[free_entry];
 }
 
-/*
-	Returns a copy of it's argument.
-*/
-
 /**
- * Creates a copy of a paxos_accepted structure.
+ * Keeps the value accepted with the highest ballot. Acceptors accepting the
+ * same ballot accepted the same value, which is copied (or moved) only once.
  *
- * @param ack Pointer to the paxos_accepted structure to be duplicated.
- * @return Pointer to the newly duplicated paxos_accepted structure.
+ * @param inst Pointer to the instance.
+ * @param ack The accepted message.
+ * @param i Index of the acceptor in ack.
+ * @param move Whether to take the buffer of the value from ack.
  */
-static paxos_accepted* paxos_accepted_dup(paxos_accepted* ack)
+static void instance_set_value(struct instance* inst, paxos_accepted* ack, int i, int move)
 {
-	// paxos_log_debug("learner %lx add copy stage1", ack);
-	paxos_accepted* copy;
-	copy = malloc(sizeof(paxos_accepted));
-	memcpy(copy, ack, sizeof(paxos_accepted));
-//	paxos_value_copy(&copy->value, &ack->value);
-	copy->value_0.paxos_value_len = 0;
-	copy->value_0.paxos_value_val = NULL;
-	// paxos_log_debug("learner %lx add copy stage2", ack);
-	if (copy->n_aids > 0)
-	{
-		if (ack->aids != NULL) copy->aids = calloc(copy->n_aids, sizeof(uint32_t)); else ack->aids = NULL;
-		if (ack->values != NULL) copy->values = calloc(copy->n_aids, sizeof(paxos_value)); else ack->values = NULL;
-		if (ack->ballots != NULL) copy->ballots = calloc(copy->n_aids, sizeof(uint32_t)); else ack->ballots = NULL;
-		if (ack->value_ballots != NULL) copy->value_ballots = calloc(copy->n_aids, sizeof(uint32_t)); else ack->value_ballots = NULL;
-
-		for (int ii = 0; ii < copy->n_aids; ii++)
-		{
-			if (ack->aids != NULL)  copy->aids[ii] = ack->aids[ii];
-			if (ack->values != NULL) paxos_value_copy(&copy->values[ii], &ack->values[ii]);
-			if (ack->ballots != NULL) copy->ballots[ii]=ack->ballots[ii];
-			if (ack->value_ballots != NULL) copy->value_ballots[ii] = ack->value_ballots[ii];
-		}
-
-	}
+	paxos_value* v;
+	ballot_t ballot = ack->ballots[i];
 
-	return copy;
-}
+	if (ballot < inst->value_ballot)
+		return;
+	if (ballot == inst->value_ballot && inst->value.paxos_value_len > 0)
+		return;
 
-static void paxos_accepted_deep_copy(paxos_accepted* ack, paxos_accepted* copy)
-{
-	// paxos_log_debug("learner %lx add copy stage1", ack);
-
-	memcpy(copy, ack, sizeof(paxos_accepted));
-	copy->value_0.paxos_value_len = 0;
-	copy->value_0.paxos_value_val = NULL;
-	// paxos_value_copy(&copy->value, &ack->value);
-	// paxos_log_debug("learner %lx add copy stage2", ack);
-	if (copy->n_aids > 0)
-	{
-		if (ack->aids != NULL) copy->aids = calloc(copy->n_aids, sizeof(uint32_t)); else ack->aids = NULL;
-		if (ack->values != NULL) copy->values = calloc(copy->n_aids, sizeof(paxos_value)); else ack->values = NULL;
-		if (ack->ballots != NULL) copy->ballots = calloc(copy->n_aids, sizeof(uint32_t)); else ack->ballots = NULL;
-		if (ack->value_ballots != NULL) copy->value_ballots = calloc(copy->n_aids, sizeof(uint32_t)); else ack->value_ballots = NULL;
-
-		for (int ii = 0; ii < copy->n_aids; ii++)
-		{
-			if (ack->aids != NULL)  copy->aids[ii] = ack->aids[ii];
-			if (ack->values != NULL) paxos_value_copy(&copy->values[ii], &ack->values[ii]);
-			if (ack->ballots != NULL) copy->ballots[ii] = ack->ballots[ii];
-			if (ack->value_ballots != NULL) copy->value_ballots[ii] = ack->value_ballots[ii];
-		}
+	if (ballot > inst->value_ballot) {
+		free(inst->value.paxos_value_val);
+		inst->value.paxos_value_val = NULL;
+		inst->value.paxos_value_len = 0;
+		inst->value.paxos_value_flags = 0;
+		inst->value_ballot = ballot;
+	}
 
+	v = paxos_accepted_value(ack, i);
+	if (v == NULL)
+		return;
+	if (move) {
+		inst->value = *v;
+		v->paxos_value_val = NULL;
+		v->paxos_value_len = 0;
+		return;
 	}
+	inst->value.paxos_value_len = v->paxos_value_len;
+	inst->value.paxos_value_flags = v->paxos_value_flags;
+	inst->value.paxos_value_val = malloc(v->paxos_value_len);
+	memcpy(inst->value.paxos_value_val, v->paxos_value_val, v->paxos_value_len);
 }
 
 /**
- * Copies the value from one paxos_value structure to another.
+ * Fills out with the decision of a closed instance, moving its value.
  *
- * @param dst Pointer to the destination paxos_value structure.
- * @param src Pointer to the source paxos_value structure.
+ * @param inst Pointer to the closed instance.
+ * @param out Accepted message to fill, with a single acceptor.
  */
-static void paxos_value_copy(paxos_value* dst, paxos_value* src)
+static void instance_to_accepted(struct instance* inst, paxos_accepted* out)
 {
-	int len = src->paxos_value_len;
-	dst->paxos_value_len = len;
-	if (src->paxos_value_val != NULL) {
-		dst->paxos_value_val = malloc(len);
-		memcpy(dst->paxos_value_val, src->paxos_value_val, len);	
-	}
+	memset(out, 0, sizeof(paxos_accepted));
+	out->src = inst->aid;
+	out->iid = inst->iid;
+	out->ballot_0 = inst->last_update_ballot;
+	out->value_ballot_0 = inst->last_update_ballot;
+	out->n_aids = 1;
+	out->aids_cap = 1;
+	out->aids = calloc(1, sizeof(uint32_t));
+	out->values = calloc(1, sizeof(paxos_value));
+	out->ballots = calloc(1, sizeof(uint32_t));
+	out->value_ballots = calloc(1, sizeof(uint32_t));
+	out->aids[0] = inst->aid;
+	out->values[0] = inst->value;
+	out->ballots[0] = inst->last_update_ballot;
+	out->value_ballots[0] = inst->last_update_ballot;
+	out->aidset.bits[inst->aid >> 6] |= (uint64_t)1 << (inst->aid & 63);
+	inst->value.paxos_value_val = NULL;
+	inst->value.paxos_value_len = 0;
+	inst->value.paxos_value_flags = 0;
+}
+
+/*
+ * The value accepted by the i-th acceptor of a message. A message
+ * aggregated by a group leader carries the value only once, in the first
+ * position.
+ */
+static paxos_value* paxos_accepted_value(paxos_accepted* ack, int i)
+{
+	if (ack->values == NULL)
+		return NULL;
+	if (ack->values[i].paxos_value_len > 0)
+		return &ack->values[i];
+	if (ack->values[0].paxos_value_len > 0 && ack->ballots[0] == ack->ballots[i])
+		return &ack->values[0];
+	return NULL;
 }
@@ -40,14 +40,23 @@ struct paxos_config paxos_config =
 {
 	.verbosity = PAXOS_LOG_INFO,
 	.tcp_nodelay = 1,
+	.wire_binary = 0,
 	.learner_catch_up = 1,
-	.proposer_timeout = 1,
+	.proposer_timeout = 1000,
 	.proposer_preexec_window = 32,
+	.proposer_stable_leader = 0,
+	.proposer_batch_size = 0,
+	.proposer_batch_count = 128,
+	.proposer_batch_linger = 1000,
 	.storage_backend = PAXOS_MEM_STORAGE,
 	.trash_files = 0,
 	.lmdb_sync = 0,
 	.lmdb_env_path = "/tmp/acceptor",
-	.lmdb_mapsize = 1024*1024
+	.lmdb_mapsize = 1024*1024,
+	.wal_path = "/tmp/acceptor-wal",
+	.wal_segment_size = 64*1024*1024,
+	.wal_sync_interval = 0,
+	.wal_sync_bytes = 0
 };
 
 /**
@@ -73,6 +82,7 @@ paxos_value* paxos_value_new(const char* value, size_t size)
 	paxos_value* v;
 	v = malloc(sizeof(paxos_value));
 	v->paxos_value_len = size;
+	v->paxos_value_flags = 0;
 	v->paxos_value_val = malloc(size);
 	memcpy(v->paxos_value_val, value, size);
 	return v;
@@ -129,6 +139,21 @@ void paxos_promise_destroy(paxos_promise* p)
 	p->value_ballots = NULL;
 }
 
+void paxos_promise_range_destroy(paxos_promise_range* p)
+{
+	if (p->values != NULL)
+	{
+		for (int ii = 0; ii < p->n_values; ii++) paxos_value_destroy(&(p->values[ii]));
+		free(p->values);
+		p->values = NULL;
+	}
+	if (p->iids != NULL) free(p->iids);
+	p->iids = NULL;
+	if (p->value_ballots != NULL) free(p->value_ballots);
+	p->value_ballots = NULL;
+	p->n_values = 0;
+}
+
 void paxos_accept_destroy(paxos_accept* p)
 {
 	paxos_value_destroy(&p->value);
@@ -136,31 +161,35 @@ void paxos_accept_destroy(paxos_accept* p)
 
 void paxos_accepted_destroy(paxos_accepted* p)
 {
+	int arrays = !(p->borrowed & PAXOS_ACCEPTED_BORROWED_ARRAYS);
+	int values = !(p->borrowed & PAXOS_ACCEPTED_BORROWED_VALUES);
+
 	// paxos_log_debug("destroying %lx in accepted", p);
-	if (p->aids != NULL) free(p->aids);
+	if (arrays && p->aids != NULL) free(p->aids);
 	p->aids = NULL;
 	// paxos_log_debug("destroying %lx in accepted stage 1", p);
 	//	paxos_value_destroy(&p->value_0);
 	if (p->values != NULL)
 	{
 		// paxos_log_debug("destroying %lx in accepted stage 2 start", p);
-		for (int ii = 0; ii < p->n_aids; ii++)
+		for (int ii = 0; values && ii < p->n_aids; ii++)
 		{
 			// paxos_log_debug("destroying value %lx in accepted stage 2 idx %ld", p->values[ii].paxos_value_val,ii);
 			if (p->values[ii].paxos_value_len > 0) paxos_value_destroy(&(p->values[ii]));
 			//paxos_log_debug("value destroyed for index %ld", ii);
 		}
-		free(p->values);
+		if (arrays) free(p->values);
 		p->values = NULL;
 		//paxos_log_debug("destroying %lx in accepted stage 2 end", p);
 
 	}
 	// paxos_log_debug("destroying %lx in accepted stage 3 start", p);
-	if (p->ballots) free(p->ballots);
+	if (arrays && p->ballots) free(p->ballots);
 	p->ballots = NULL;
 	// paxos_log_debug("destroying %lx in accepted stage 4 start", p);
-	if (p->value_ballots) free(p->value_ballots);
+	if (arrays && p->value_ballots) free(p->value_ballots);
 	p->value_ballots = NULL;
+	p->borrowed = 0;
 
 	// paxos_log_debug("finished destroying %lx in accepted %lx", p->aids, p);
 }
@@ -186,6 +215,9 @@ void paxos_message_destroy(paxos_message* m)
 	case PAXOS_CLIENT_VALUE:
 		paxos_client_value_destroy(&m->u.client_value);
 		break;
+	case PAXOS_PROMISE_RANGE:
+		paxos_promise_range_destroy(&m->u.promise_range);
+		break;
 	default: break;
 	}
 	// paxos_log_debug("destroyed message %lx", m);
@@ -29,11 +29,13 @@
 #include "proposer.h"
 #include "carray.h"
 #include "quorum.h"
-#include "khash.h"
+#include "aidset.h"
+#include "iidring.h"
+#include "valuebatch.h"
+#include "timewheel.h"
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sys/time.h>
 
 struct instance
 {
@@ -43,40 +45,56 @@ struct instance
 	paxos_value* promised_value;
 	ballot_t value_ballot;
 	struct quorum quorum;
-	struct timeval created_at;
+	struct wheel_timer timer;  /* retransmission timeout */
 };
-KHASH_MAP_INIT_INT(instance, struct instance*)
 
 struct proposer
 {
 	int id;
 	int acceptors;
 	struct carray* values;
+	struct value_batch batch;  /* client values not sealed into a value yet */
 	iid_t max_trim_iid;
 	iid_t next_prepare_iid;
-	khash_t(instance)* prepare_instances; /* Waiting for prepare acks */
-	khash_t(instance)* accept_instances;  /* Waiting for accept acks */
+	struct iidring* prepare_instances; /* Waiting for prepare acks */
+	struct iidring* accept_instances;  /* Waiting for accept acks */
+	struct timewheel* prepare_timers;  /* Timeouts of prepare_instances */
+	struct timewheel* accept_timers;   /* Timeouts of accept_instances */
+	/* Stable leader: one open ended prepare for every iid >= leader_from */
+	int leader;                /* LEADER_NONE, LEADER_PREPARING or LEADER_ACTIVE */
+	iid_t leader_from;
+	ballot_t leader_ballot;
+	ballot_t leader_preempted; /* highest ballot of a competing leader */
+	struct quorum leader_quorum;
+	uint64_t leader_expires;   /* when the leader prepare is sent again */
 };
 
+#define LEADER_NONE 0
+#define LEADER_PREPARING 1
+#define LEADER_ACTIVE 2
+
 struct timeout_iterator
 {
-	khiter_t pi, ai;
-	struct timeval timeout;
+	uint64_t now;
 	struct proposer* proposer;
 };
 
 static ballot_t proposer_next_ballot(struct proposer* p, ballot_t b);
 static void proposer_preempt(struct proposer* p, struct instance* inst, paxos_prepare* out);
-static void proposer_move_instance(khash_t(instance)* f, khash_t(instance)* t, struct instance* inst);
-static void proposer_trim_instances(struct proposer* p, khash_t(instance)* h, iid_t iid);
+static void proposer_move_instance(struct iidring* f, struct iidring* t, struct instance* inst);
+static void proposer_schedule(struct timewheel* w, struct instance* inst, uint64_t now);
+static int proposer_add_accepted(struct instance* inst, paxos_accepted* ack);
+static void proposer_trim_instance(void* inst, void* proposer);
+static int proposer_receive_promise_from(struct proposer* p, paxos_promise_range* ack);
+static int instance_is_prepared(struct proposer* p, struct instance* inst);
 static struct instance* instance_new(iid_t iid, ballot_t ballot, int acceptors);
-static void instance_free(struct instance* inst);
+static void instance_free(void* inst);
 static int instance_has_value(struct instance* inst);
 static int instance_has_promised_value(struct instance* inst);
-static int instance_has_timedout(struct instance* inst, struct timeval* now);
 static void instance_to_accept(struct proposer* p,struct instance* inst, paxos_accept* acc);
 static void carray_paxos_value_free(void* v);
 static int paxos_value_cmp(struct paxos_value* v1, struct paxos_value* v2);
+static paxos_value* proposer_copy_value(paxos_value* v);
 int proposer_no_values(struct proposer* p);
 
 
@@ -92,33 +110,96 @@ struct proposer* proposer_new(int id, int acceptors)
 	p->max_trim_iid = 0;
 	p->next_prepare_iid = 0;
 	p->values = carray_new(128);
-	p->prepare_instances = kh_init(instance);
-	p->accept_instances = kh_init(instance);
+	value_batch_init(&p->batch);
+	p->prepare_instances = iidring_new(128);
+	p->accept_instances = iidring_new(128);
+	p->prepare_timers = timewheel_new(timewheel_now());
+	p->accept_timers = timewheel_new(timewheel_now());
+	p->leader = LEADER_NONE;
+	p->leader_from = 0;
+	p->leader_ballot = 0;
+	p->leader_preempted = 0;
+	p->leader_expires = 0;
+	quorum_init(&p->leader_quorum, acceptors);
 	return p;
 }
 
 void proposer_free(struct proposer* p)
 {
-	struct instance* inst;
-	kh_foreach_value(p->prepare_instances, inst, instance_free(inst));
-	kh_foreach_value(p->accept_instances, inst, instance_free(inst));
-	kh_destroy(instance, p->prepare_instances);
-	kh_destroy(instance, p->accept_instances);
+	iidring_foreach(p->prepare_instances, instance_free);
+	iidring_foreach(p->accept_instances, instance_free);
+	iidring_free(p->prepare_instances);
+	iidring_free(p->accept_instances);
+	timewheel_free(p->prepare_timers);
+	timewheel_free(p->accept_timers);
+	quorum_destroy(&p->leader_quorum);
 	carray_foreach(p->values, carray_paxos_value_free);
 	carray_free(p->values);
+	value_batch_destroy(&p->batch);
 	free(p);
 }
 
+/**
+ * Queues a client value. With batching enabled (proposer-batch-size > 0)
+ * the value is packed into the open batch, which is sealed into a single
+ * paxos value once it reaches the configured size or count; otherwise it
+ * is queued as a paxos value of its own.
+ *
+ * @param p Pointer to the proposer.
+ * @param value The client value.
+ * @param size Its size in bytes.
+ */
 void proposer_propose(struct proposer* p, const char* value, size_t size)
 {
 	paxos_value* v;
-	v = paxos_value_new(value, size);
+	size_t max_size = paxos_config.proposer_batch_size;
+
+	if (max_size == 0) {
+		v = paxos_value_new(value, size);
+		carray_push_back(p->values, v);
+		return;
+	}
+
+	if (value_batch_count(&p->batch) > 0
+		&& value_batch_size(&p->batch) + 4 + size > max_size)
+		proposer_flush_batch(p);
+
+	if (value_batch_append(&p->batch, value, size) != 0) {
+		paxos_log_error("Proposer %u: Could not batch a value of %zu bytes", p->id, size);
+		return;
+	}
+
+	if (value_batch_size(&p->batch) >= max_size
+		|| value_batch_count(&p->batch) >= paxos_config.proposer_batch_count)
+		proposer_flush_batch(p);
+}
+
+/**
+ * Seals the open batch, if any, into a paxos value ready to be proposed.
+ *
+ * @param p Pointer to the proposer.
+ * @return 1 if a value was queued, 0 if there was no pending client value.
+ */
+int proposer_flush_batch(struct proposer* p)
+{
+	paxos_value* v = value_batch_seal(&p->batch);
+	if (v == NULL)
+		return 0;
 	carray_push_back(p->values, v);
+	return 1;
+}
+
+/**
+ * @return The number of client values waiting in the open batch.
+ */
+int proposer_batched_count(struct proposer* p)
+{
+	return value_batch_count(&p->batch);
 }
 
 int proposer_prepared_count(struct proposer* p)
 {
-	return kh_size(p->prepare_instances);
+	return iidring_count(p->prepare_instances);
 }
 
 void proposer_set_instance_id(struct proposer* p, iid_t iid)
@@ -126,8 +207,8 @@ void proposer_set_instance_id(struct proposer* p, iid_t iid)
 	if (iid > p->next_prepare_iid) {
 		p->next_prepare_iid = iid;
 		// remove instances older than iid
-		proposer_trim_instances(p, p->prepare_instances, iid);
-		proposer_trim_instances(p, p->accept_instances, iid);
+		iidring_trim(p->prepare_instances, iid, proposer_trim_instance, p);
+		iidring_trim(p->accept_instances, iid, proposer_trim_instance, p);
 	}
 }
 
@@ -137,25 +218,252 @@ void proposer_prepare(struct proposer* p, paxos_prepare* out)
 	iid_t iid = ++(p->next_prepare_iid);
 	ballot_t bal = proposer_next_ballot(p, 0);
 	struct instance* inst = instance_new(iid, bal, p->acceptors);
-	khiter_t k = kh_put_instance(p->prepare_instances, iid, &rv);
-	assert(rv > 0);
-	kh_value(p->prepare_instances, k) = inst;
+	rv = iidring_put(p->prepare_instances, iid, inst);
+	assert(rv == 0);
+	proposer_schedule(p->prepare_timers, inst, timewheel_now());
 	*out = (paxos_prepare) {p->id,inst->iid, inst->ballot};
 	paxos_log_debug("Proposer %u: Prepare with instance %u", p->id, iid);
 }
 
+/**
+ * Opens count new instances at once, all with the same ballot, and fills
+ * a single range prepare covering them.
+ *
+ * @param p Pointer to the proposer.
+ * @param count Number of instances to open.
+ * @param out Range prepare to broadcast to the acceptors.
+ * @return The number of instances opened.
+ */
+int proposer_prepare_range(struct proposer* p, int count, paxos_prepare_range* out)
+{
+	int i, rv;
+	iid_t from = p->next_prepare_iid + 1;
+	ballot_t bal = proposer_next_ballot(p, 0);
+	uint64_t now = timewheel_now();
+
+	for (i = 0; i < count; i++) {
+		iid_t iid = ++(p->next_prepare_iid);
+		struct instance* inst = instance_new(iid, bal, p->acceptors);
+		rv = iidring_put(p->prepare_instances, iid, inst);
+		assert(rv == 0);
+		proposer_schedule(p->prepare_timers, inst, now);
+	}
+
+	if (count > 0) {
+		*out = (paxos_prepare_range) {p->id, from, p->next_prepare_iid, bal};
+		paxos_log_debug("Proposer %u: Prepare with instances %u-%u", p->id, from, p->next_prepare_iid);
+	}
+	return count > 0 ? count : 0;
+}
+
+/**
+ * Handles an aggregated promise for a range of instances. Every pending
+ * instance of the range prepared with the same ballot counts the acceptor
+ * towards its quorum; values are only reported for instances that have one.
+ *
+ * @param p Pointer to the proposer.
+ * @param ack The range promise received.
+ * An open ended promise (to_iid 0) answers proposer_prepare_leader().
+ *
+ * @param out Range prepare to send if the range was preempted.
+ * @return 1 if the range was preempted and out must be sent, 0 otherwise.
+ */
+int proposer_receive_promise_range(struct proposer* p, paxos_promise_range* ack, paxos_prepare_range* out)
+{
+	iid_t iid, from = 0, to = 0;
+	ballot_t ballot = 0;
+	paxos_prepare unused;
+	struct instance* inst;
+	int i;
+
+	if (ack->to_iid == 0)
+		return proposer_receive_promise_from(p, ack);
+
+	// Preempted instances are re-prepared together, so they get a common
+	// ballot derived from the highest one among them.
+	for (iid = ack->from_iid; iid <= ack->to_iid; iid++) {
+		inst = iidring_get(p->prepare_instances, iid);
+		if (inst == NULL)
+			continue;
+		if (inst->ballot < ack->ballot && inst->ballot >= ballot)
+			ballot = inst->ballot;
+	}
+	if (ballot > 0)
+		ballot = proposer_next_ballot(p, ballot);
+
+	for (iid = ack->from_iid; iid <= ack->to_iid; iid++) {
+		inst = iidring_get(p->prepare_instances, iid);
+		if (inst == NULL)
+			continue;
+
+		if (ack->ballot < inst->ballot)
+			continue;
+
+		if (ack->ballot > inst->ballot) {
+			paxos_log_debug("Proposer %u: Instance %u preempted: ballot %d ack ballot %d",
+				p->id, inst->iid, inst->ballot, ack->ballot);
+			if (instance_has_promised_value(inst))
+				paxos_value_free(inst->promised_value);
+			proposer_preempt(p, inst, &unused);
+			inst->ballot = ballot;
+			if (from == 0)
+				from = iid;
+			to = iid;
+			continue;
+		}
+
+		if (quorum_add(&inst->quorum, ack->aid) == 0)
+			paxos_log_debug("Proposer %u: Duplicate promise dropped from: %d, iid: %u", p->id, ack->aid, iid);
+	}
+
+	for (i = 0; i < ack->n_values; i++) {
+		inst = iidring_get(p->prepare_instances, ack->iids[i]);
+		if (inst == NULL)
+			continue;
+		if (inst->ballot != ack->ballot || ack->value_ballots[i] <= inst->value_ballot)
+			continue;
+		if (instance_has_promised_value(inst))
+			paxos_value_free(inst->promised_value);
+		inst->value_ballot = ack->value_ballots[i];
+		inst->promised_value = proposer_copy_value(&ack->values[i]);
+		paxos_log_debug("Proposer %u: Value in promise saved for iid %u", p->id, inst->iid);
+	}
+
+	if (from == 0)
+		return 0;
+
+	*out = (paxos_prepare_range) {p->id, from, to, ballot};
+	return 1;
+}
+
+/**
+ * Starts (or restarts) stable leader mode: a single open ended range prepare
+ * covers every instance not opened yet, so that once a quorum promised it
+ * instances go straight to phase 2. Instances opened under a previous leader
+ * ballot and not accepted yet are moved to the new ballot and covered too.
+ *
+ * @param p Pointer to the proposer.
+ * @param out Open ended range prepare (to_iid 0) to broadcast.
+ * @return 1 if out must be sent, 0 if the proposer already is, or is
+ *         becoming, the leader.
+ */
+int proposer_prepare_leader(struct proposer* p, paxos_prepare_range* out)
+{
+	iid_t iid, from = p->next_prepare_iid + 1;
+	ballot_t old = p->leader_ballot;
+	struct instance* inst;
+	uint64_t now = timewheel_now();
+
+	if (p->leader != LEADER_NONE)
+		return 0;
+
+	p->leader_ballot = proposer_next_ballot(p,
+		p->leader_preempted > old ? p->leader_preempted : old);
+
+	for (iid = iidring_begin(p->prepare_instances); old > 0
+			&& iid < iidring_end(p->prepare_instances); iid++) {
+		inst = iidring_get(p->prepare_instances, iid);
+		if (inst == NULL || inst->ballot != old)
+			continue;
+		if (instance_has_promised_value(inst))
+			paxos_value_free(inst->promised_value);
+		inst->promised_value = NULL;
+		inst->value_ballot = 0;
+		inst->ballot = p->leader_ballot;
+		quorum_clear(&inst->quorum);
+		proposer_schedule(p->prepare_timers, inst, now);
+		if (iid < from)
+			from = iid;
+	}
+
+	p->leader = LEADER_PREPARING;
+	p->leader_from = from;
+	p->leader_expires = now + paxos_config.proposer_timeout;
+	quorum_clear(&p->leader_quorum);
+	*out = (paxos_prepare_range) {p->id, from, 0, p->leader_ballot};
+	paxos_log_debug("Proposer %u: Prepare as leader from instance %u ballot %u", p->id,
+		from, p->leader_ballot);
+	return 1;
+}
+
+/**
+ * @return 1 if the stable leader prepare got a quorum of promises.
+ */
+int proposer_is_leader(struct proposer* p)
+{
+	return p->leader == LEADER_ACTIVE;
+}
+
+/*
+ * Handles the answer to an open ended range prepare. Reported values are
+ * kept in instances prepared with the leader ballot, opening them (and the
+ * holes before them) if needed; a higher ballot means another leader took
+ * over, and leadership is requested again by the next
+ * proposer_prepare_leader().
+ */
+static int proposer_receive_promise_from(struct proposer* p, paxos_promise_range* ack)
+{
+	int i;
+	iid_t iid;
+	struct instance* inst;
+
+	if (p->leader == LEADER_NONE || ack->ballot < p->leader_ballot)
+		return 0;
+
+	if (ack->ballot > p->leader_ballot) {
+		paxos_log_debug("Proposer %u: Leader ballot %u preempted by %u", p->id,
+			p->leader_ballot, ack->ballot);
+		if (ack->ballot > p->leader_preempted)
+			p->leader_preempted = ack->ballot;
+		p->leader = LEADER_NONE;
+		return 0;
+	}
+
+	for (i = 0; i < ack->n_values; i++) {
+		if (ack->iids[i] < p->leader_from
+			|| iidring_get(p->accept_instances, ack->iids[i]) != NULL)
+			continue;
+		while (p->next_prepare_iid < ack->iids[i]) {
+			iid = p->next_prepare_iid + 1;
+			inst = instance_new(iid, p->leader_ballot, p->acceptors);
+			if (iidring_put(p->prepare_instances, iid, inst) != 0) {
+				paxos_log_error("Proposer %u: Could not open iid %u", p->id, iid);
+				instance_free(inst);
+				break;
+			}
+			p->next_prepare_iid = iid;
+			proposer_schedule(p->prepare_timers, inst, timewheel_now());
+		}
+		inst = iidring_get(p->prepare_instances, ack->iids[i]);
+		if (inst == NULL || inst->ballot != p->leader_ballot
+			|| ack->value_ballots[i] <= inst->value_ballot)
+			continue;
+		if (instance_has_promised_value(inst))
+			paxos_value_free(inst->promised_value);
+		inst->value_ballot = ack->value_ballots[i];
+		inst->promised_value = proposer_copy_value(&ack->values[i]);
+		paxos_log_debug("Proposer %u: Value in leader promise saved for iid %u", p->id, inst->iid);
+	}
+
+	if (quorum_add(&p->leader_quorum, ack->aid) && quorum_reached(&p->leader_quorum)
+		&& p->leader == LEADER_PREPARING) {
+		paxos_log_debug("Proposer %u: Leader from instance %u with ballot %u", p->id,
+			p->leader_from, p->leader_ballot);
+		p->leader = LEADER_ACTIVE;
+	}
+	return 0;
+}
+
 int proposer_receive_promise(struct proposer* p, paxos_promise* ack, paxos_prepare* out)
 {
 	int rc = 0;
-	khiter_t k = kh_get_instance(p->prepare_instances, ack->iid);
+	struct instance* inst = iidring_get(p->prepare_instances, ack->iid);
 	
-	if (k == kh_end(p->prepare_instances)) {
+	if (inst == NULL) {
 		paxos_log_debug("Proposer %u: Promise dropped, instance %u not pending", p->id, ack->iid);
 		return 0;
 	}
 
-	struct instance* inst = kh_value(p->prepare_instances, k);
-
 	for(int ii = 0; ii < ack->n_aids;ii++)
 	{
 		if (ack->ballots[ii] < inst->ballot) {
@@ -186,7 +494,7 @@ int proposer_receive_promise(struct proposer* p, paxos_promise* ack, paxos_prepa
 					paxos_value_free(inst->promised_value);
 
 				inst->value_ballot = ack->value_ballots[ii];
-				inst->promised_value = paxos_value_new(ack->values[ii].paxos_value_val, ack->values[ii].paxos_value_len);
+				inst->promised_value = proposer_copy_value(&ack->values[ii]);
 				paxos_log_debug("Proposer %u: Value in promise saved, removed older value", p->id);
 			} else
 				paxos_log_debug("Proposer %u: Value in promise ignored", p->id);
@@ -197,19 +505,16 @@ int proposer_receive_promise(struct proposer* p, paxos_promise* ack, paxos_prepa
 
 int proposer_accept(struct proposer* p, paxos_accept* out)
 {
-	khiter_t k;
-	struct instance* inst = NULL;
-	khash_t(instance)* h = p->prepare_instances;
-	
-	// Find smallest inst->iid
-	for (k = kh_begin(h); k != kh_end(h); ++k) {
-		if (!kh_exist(h, k))
-			continue;
-		else if (inst == NULL || inst->iid > kh_value(h, k)->iid)
-			inst = kh_value(h, k);
+	// The prepared instance with the smallest iid
+	struct instance* inst = iidring_first(p->prepare_instances);
+
+	// A leader skips phase 1 for new instances
+	if (inst == NULL && p->leader == LEADER_ACTIVE && !carray_empty(p->values)) {
+		inst = instance_new(++(p->next_prepare_iid), p->leader_ballot, p->acceptors);
+		iidring_put(p->prepare_instances, inst->iid, inst);
 	}
 	
-	if (inst == NULL || !quorum_reached(&inst->quorum))
+	if (inst == NULL || !instance_is_prepared(p, inst))
 		return 0;
 		
 	paxos_log_debug("Proposer %u: Trying to accept iid %u",p->id, inst->iid);
@@ -228,6 +533,8 @@ int proposer_accept(struct proposer* p, paxos_accept* out)
 	
 	// We have both a prepared instance and a value
 	proposer_move_instance(p->prepare_instances, p->accept_instances, inst);
+	timewheel_cancel(p->prepare_timers, &inst->timer);
+	proposer_schedule(p->accept_timers, inst, timewheel_now());
 	instance_to_accept(p,inst, out);
 	paxos_log_debug("Proposer %u to accept stage %u", p->id, inst->iid);
 	return 1;
@@ -235,17 +542,15 @@ int proposer_accept(struct proposer* p, paxos_accept* out)
 
 int proposer_receive_accepted(struct proposer* p, paxos_accepted* ack)
 {
-	khiter_t k = kh_get_instance(p->accept_instances, ack->iid);
+	struct instance* inst = iidring_get(p->accept_instances, ack->iid);
 	
-	if (k == kh_end(p->accept_instances)) {
+	if (inst == NULL) {
 		paxos_log_debug("Proposer %u: Accept ack dropped, iid: %u not pending", p->id, ack->iid);
 		return 0;
 	}
 	
-	struct instance* inst = kh_value(p->accept_instances, k);
-	
 	if (ack->ballots[0] == inst->ballot) {
-		if (!quorum_add(&inst->quorum, ack->aids[0])) {
+		if (!proposer_add_accepted(inst, ack)) {
 			paxos_log_debug("Proposer %u: Duplicate accept dropped from: %d, iid: %u", p->id, ack->aids[0], inst->iid);
 			return 0;
 		}
@@ -260,7 +565,8 @@ int proposer_receive_accepted(struct proposer* p, paxos_accepted* ack)
 				}
 			}
 
-			kh_del_instance(p->accept_instances, k);
+			iidring_del(p->accept_instances, inst->iid);
+			timewheel_cancel(p->accept_timers, &inst->timer);
 			instance_free(inst);
 		}
 		
@@ -272,22 +578,27 @@ int proposer_receive_accepted(struct proposer* p, paxos_accepted* ack)
 
 int proposer_receive_preempted(struct proposer* p, paxos_preempted* ack, paxos_prepare* out)
 {
-	khiter_t k = kh_get_instance(p->accept_instances, ack->iid);
+	struct instance* inst = iidring_get(p->accept_instances, ack->iid);
 	
-	if (k == kh_end(p->accept_instances)) {
+	if (inst == NULL) {
 		paxos_log_debug("Proposer %u: Preempted dropped, iid: %u not pending", p->id, ack->iid);
 		return 0;
 	}
 	
-	struct instance* inst = kh_value(p->accept_instances, k);
-	
 	if (ack->ballot > inst->ballot) {
 		paxos_log_debug("Proposer %u Instance %u preempted: ballot %d ack ballot %d", p->id, inst->iid, inst->ballot, ack->ballot);
 
+		if (inst->ballot == p->leader_ballot && p->leader != LEADER_NONE) {
+			if (ack->ballot > p->leader_preempted)
+				p->leader_preempted = ack->ballot;
+			p->leader = LEADER_NONE;
+		}
+
 		if (instance_has_promised_value(inst))
 			paxos_value_free(inst->promised_value);
 
 		proposer_move_instance(p->accept_instances, p->prepare_instances, inst);
+		timewheel_cancel(p->accept_timers, &inst->timer);
 		proposer_preempt(p, inst, out);
 		return  1; 
 	} else {
@@ -303,60 +614,76 @@ void proposer_receive_acceptor_state(struct proposer* p, paxos_acceptor_state* s
 	}
 }
 
+/**
+ * Advances the timeout wheels to the current time. The instances whose
+ * timeout expired are then returned by timeout_iterator_prepare() and
+ * timeout_iterator_accept(), and scheduled for another timeout.
+ *
+ * @param p Pointer to the proposer.
+ * @return A new timeout iterator, freed with timeout_iterator_free().
+ */
 struct timeout_iterator* proposer_timeout_iterator(struct proposer* p)
 {
 	struct timeout_iterator* iter;
 	iter = malloc(sizeof(struct timeout_iterator));
-	iter->pi = kh_begin(p->prepare_instances);
-	iter->ai = kh_begin(p->accept_instances);
+	iter->now = timewheel_now();
 	iter->proposer = p;
-	gettimeofday(&iter->timeout, NULL);
+	timewheel_advance(p->prepare_timers, iter->now);
+	timewheel_advance(p->accept_timers, iter->now);
 	return iter;
 }
 
-static struct instance* next_timedout(khash_t(instance)* h, khiter_t* k, struct timeval* t)
+int timeout_iterator_prepare(struct timeout_iterator* iter, paxos_prepare* out)
 {
-	for (; *k != kh_end(h); ++(*k)) {
-		if (!kh_exist(h, *k))
-			continue;
-
-		struct instance* inst = kh_value(h, *k);
+	struct wheel_timer* t;
+	struct instance* inst;
+	struct proposer* p = iter->proposer;
 
-		if (quorum_reached(&inst->quorum))
+	// Prepared instances wait for a value, and are scheduled again once
+	// they get one or are preempted
+	while ((t = timewheel_next_expired(p->prepare_timers)) != NULL) {
+		inst = t->data;
+		if (instance_is_prepared(p, inst))
 			continue;
-
-		if (instance_has_timedout(inst, t)) 
-			return inst;
+		*out = (paxos_prepare){p->id,inst->iid, inst->ballot};
+		proposer_schedule(p->prepare_timers, inst, iter->now);
+		return 1;
 	}
-
-	return NULL;
+	return 0;
 }
 
-int timeout_iterator_prepare(struct timeout_iterator* iter, paxos_prepare* out)
+/**
+ * Retransmits the stable leader prepare if its quorum of promises did not
+ * arrive in time.
+ *
+ * @param iter The timeout iterator.
+ * @param out Open ended range prepare to broadcast.
+ * @return 1 if out must be sent, 0 otherwise.
+ */
+int timeout_iterator_prepare_leader(struct timeout_iterator* iter, paxos_prepare_range* out)
 {
-	struct instance* inst;
 	struct proposer* p = iter->proposer;
-	inst = next_timedout(p->prepare_instances, &iter->pi, &iter->timeout);
 
-	if (inst == NULL)
+	if (p->leader != LEADER_PREPARING || iter->now < p->leader_expires)
 		return 0;
 
-	*out = (paxos_prepare){p->id,inst->iid, inst->ballot};
-	inst->created_at = iter->timeout;
+	*out = (paxos_prepare_range) {p->id, p->leader_from, 0, p->leader_ballot};
+	p->leader_expires = iter->now + paxos_config.proposer_timeout;
 	return 1;
 }
 
 int timeout_iterator_accept(struct timeout_iterator* iter, paxos_accept* out)
 {
+	struct wheel_timer* t;
 	struct instance* inst;
 	struct proposer* p = iter->proposer;
-	inst = next_timedout(p->accept_instances, &iter->ai, &iter->timeout);
 
-	if (inst == NULL)
+	if ((t = timewheel_next_expired(p->accept_timers)) == NULL)
 		return 0;
 
+	inst = t->data;
 	instance_to_accept(p,inst, out);
-	inst->created_at = iter->timeout;
+	proposer_schedule(p->accept_timers, inst, iter->now);
 	return 1;
 }
 
@@ -380,42 +707,65 @@ static void proposer_preempt(struct proposer* p, struct instance* inst, paxos_pr
 	inst->promised_value = NULL;
 	quorum_clear(&inst->quorum);
 	*out = (paxos_prepare) {p->id,inst->iid, inst->ballot};
-	gettimeofday(&inst->created_at, NULL);
+	proposer_schedule(p->prepare_timers, inst, timewheel_now());
 }
 
-static void proposer_move_instance(khash_t(instance)* f, khash_t(instance)* t, struct instance* inst)
+static void proposer_move_instance(struct iidring* f, struct iidring* t, struct instance* inst)
 {
 	int rv;
-	khiter_t k;
-	k = kh_get_instance(f, inst->iid);
-	assert(k != kh_end(f));
-	kh_del_instance(f, k);
-	k = kh_put_instance(t, inst->iid, &rv);
-	assert(rv > 0);
-	kh_value(t, k) = inst;
+	void* moved = iidring_del(f, inst->iid);
+	assert(moved == inst);
+	rv = iidring_put(t, inst->iid, inst);
+	assert(rv == 0);
 	quorum_clear(&inst->quorum);
 }
 
-static void proposer_trim_instances(struct proposer* p, khash_t(instance)* h, iid_t iid)
+/*
+ * Counts the acceptors of an accepted message towards the instance quorum.
+ * An aggregated message whose acceptors all accepted the instance ballot
+ * is added in one go, provided its bitmap is in sync with its aids (records
+ * built field by field may carry no bitmap).
+ */
+static int proposer_add_accepted(struct instance* inst, paxos_accepted* ack)
 {
-	khiter_t k;
+	uint32_t i;
+	int added = 0;
 
-	for (k = kh_begin(h); k != kh_end(h); ++k) {
-		if (!kh_exist(h, k))
-			continue;
+	if (ack->n_aids == 1)
+		return quorum_add(&inst->quorum, ack->aids[0]);
 
-		struct instance* inst = kh_value(h,k);
+	for (i = 0; i < ack->n_aids; i++)
+		if (ack->ballots[i] != inst->ballot)
+			break;
+	if (i == ack->n_aids && aidset_count(&ack->aidset) == (int)ack->n_aids)
+		return quorum_add_set(&inst->quorum, &ack->aidset);
 
-		if (inst->iid <= iid) {
-			if (instance_has_value(inst)) {
-				carray_push_back(p->values, inst->value);
-				inst->value = NULL;
-			}
+	for (i = 0; i < ack->n_aids; i++)
+		if (ack->ballots[i] == inst->ballot)
+			added += quorum_add(&inst->quorum, ack->aids[i]);
+	return added;
+}
 
-			kh_del_instance(h, k);
-			instance_free(inst);
-		}
+static void proposer_schedule(struct timewheel* w, struct instance* inst, uint64_t now)
+{
+	timewheel_schedule(w, &inst->timer, now + paxos_config.proposer_timeout);
+}
+
+static void proposer_trim_instance(void* arg, void* proposer)
+{
+	struct instance* inst = arg;
+	struct proposer* p = proposer;
+
+	if (iidring_get(p->accept_instances, inst->iid) == inst)
+		timewheel_cancel(p->accept_timers, &inst->timer);
+	else
+		timewheel_cancel(p->prepare_timers, &inst->timer);
+
+	if (instance_has_value(inst)) {
+		carray_push_back(p->values, inst->value);
+		inst->value = NULL;
 	}
+	instance_free(inst);
 }
 
 static struct instance* instance_new(iid_t iid, ballot_t ballot, int acceptors)
@@ -427,14 +777,15 @@ static struct instance* instance_new(iid_t iid, ballot_t ballot, int acceptors)
 	inst->value_ballot = 0;
 	inst->value = NULL;
 	inst->promised_value = NULL;
-	gettimeofday(&inst->created_at, NULL);
+	timer_init(&inst->timer, inst);
 	quorum_init(&inst->quorum, acceptors);
 	assert(inst->iid > 0);
 	return inst;
 }
 
-static void instance_free(struct instance* inst)
+static void instance_free(void* arg)
 {
+	struct instance* inst = arg;
 	quorum_destroy(&inst->quorum);
 
 	if (instance_has_value(inst))
@@ -446,6 +797,18 @@ static void instance_free(struct instance* inst)
 	free(inst);
 }
 
+/*
+ * Instances of the leader range are prepared once the leader promise got
+ * its quorum, the others need their own quorum of promises.
+ */
+static int instance_is_prepared(struct proposer* p, struct instance* inst)
+{
+	if (p->leader == LEADER_ACTIVE && inst->ballot == p->leader_ballot
+		&& inst->iid >= p->leader_from)
+		return 1;
+	return quorum_reached(&inst->quorum);
+}
+
 static int instance_has_value(struct instance* inst)
 {
 	return inst->value != NULL;
@@ -456,12 +819,6 @@ static int instance_has_promised_value(struct instance* inst)
 	return inst->promised_value != NULL;
 }
 
-static int instance_has_timedout(struct instance* inst, struct timeval* now)
-{
-	int diff = now->tv_sec - inst->created_at.tv_sec;
-	return diff >= paxos_config.proposer_timeout;
-}
-
 static void instance_to_accept(struct proposer* p,struct instance* inst, paxos_accept* accept)
 {
 	paxos_value* v = inst->value;
@@ -475,19 +832,32 @@ static void instance_to_accept(struct proposer* p,struct instance* inst, paxos_a
 		inst->ballot,
 		{ 
 			v->paxos_value_len,
-			v->paxos_value_val 
+			v->paxos_value_val,
+			v->paxos_value_flags
 		}
 	};
 }
 
 static int paxos_value_cmp(struct paxos_value* v1, struct paxos_value* v2)
 {
-	if (v1->paxos_value_len != v2->paxos_value_len)
+	if (v1->paxos_value_len != v2->paxos_value_len
+		|| v1->paxos_value_flags != v2->paxos_value_flags)
 		return -1;
 
 	return memcmp(v1->paxos_value_val, v2->paxos_value_val, v1->paxos_value_len);
 }
 
+/*
+ * Copies a value reported in a promise, keeping its flags so that a batch
+ * is proposed again as a batch.
+ */
+static paxos_value* proposer_copy_value(paxos_value* v)
+{
+	paxos_value* copy = paxos_value_new(v->paxos_value_val, v->paxos_value_len);
+	copy->paxos_value_flags = v->paxos_value_flags;
+	return copy;
+}
+
 static void carray_paxos_value_free(void* v)
 {
 	paxos_value_free(v);
@@ -30,6 +30,10 @@
 #include "quorum.h"
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
+
+#define QUORUM_WORD(id) ((id) >> 6)
+#define QUORUM_BIT(id) ((uint64_t)1 << ((id) & 63))
 
  /**
   * Initializes the quorum structure with the given number of acceptors.
@@ -39,9 +43,12 @@
   */
 void quorum_init(struct quorum* q, int acceptors)
 {
+	assert(acceptors <= PAXOS_MAX_ACCEPTORS);
 	q->acceptors = acceptors;
 	q->quorum = paxos_quorum(acceptors);
-	q->acceptor_ids = malloc(sizeof(int) * q->acceptors);
+	q->words = (acceptors + 63) / 64;
+	if (q->words == 0)
+		q->words = 1;
 	quorum_clear(q);
 }
 
@@ -52,18 +59,17 @@ void quorum_init(struct quorum* q, int acceptors)
  */
 void quorum_clear(struct quorum* q)
 {
-	q->count = 0;
-	memset(q->acceptor_ids, 0, sizeof(int) * q->acceptors); // Reset the acceptor presence tracking.
+	memset(q->ids.bits, 0, sizeof(uint64_t) * q->words);
 }
 
 /**
- * Frees memory allocated for the quorum structure.
+ * Releases the quorum structure. The bitmap is embedded, so there is
+ * nothing to free.
  *
  * @param q Pointer to the quorum structure to destroy.
  */
 void quorum_destroy(struct quorum* q)
 {
-	free(q->acceptor_ids);
 }
 
 /**
@@ -71,16 +77,61 @@ void quorum_destroy(struct quorum* q)
  *
  * @param q Pointer to the quorum structure.
  * @param id ID of the acceptor to add.
- * @return 1 if the acceptor was successfully added, 0 if it was already present.
+ * @return 1 if the acceptor was successfully added, 0 if it was already
+ *         present or is not a valid acceptor id.
  */
 int quorum_add(struct quorum* q, int id)
 {
-	if (q->acceptor_ids[id] == 0) {
-		q->count++;
-		q->acceptor_ids[id] = 1;
-		return 1;
+	uint64_t* word;
+
+	if (id < 0 || id >= q->acceptors)
+		return 0;
+
+	word = &q->ids.bits[QUORUM_WORD(id)];
+	if (*word & QUORUM_BIT(id))
+		return 0;
+	*word |= QUORUM_BIT(id);
+	return 1;
+}
+
+/**
+ * Adds every acceptor of a set at once, e.g. the acceptors aggregated in
+ * a single accepted message. Ids beyond the number of acceptors are ignored.
+ *
+ * @param q Pointer to the quorum structure.
+ * @param ids Set of acceptor ids to add.
+ * @return The number of acceptors that were not present yet.
+ */
+int quorum_add_set(struct quorum* q, paxos_aidset* ids)
+{
+	int i, added = 0;
+	uint64_t fresh, mask;
+
+	for (i = 0; i < q->words; i++) {
+		mask = ~(uint64_t)0;
+		if (i == q->words - 1 && q->acceptors % 64 != 0)
+			mask = QUORUM_BIT(q->acceptors) - 1;
+		fresh = ids->bits[i] & mask & ~q->ids.bits[i];
+		q->ids.bits[i] |= fresh;
+		added += __builtin_popcountll(fresh);
 	}
-	return 0;
+	return added;
+}
+
+/**
+ * @param q Pointer to the quorum structure.
+ * @return The number of acceptors added so far.
+ */
+int quorum_count(struct quorum* q)
+{
+	int i, count = 0;
+
+	if (q->words == 1)
+		return __builtin_popcountll(q->ids.bits[0]);
+
+	for (i = 0; i < q->words; i++)
+		count += __builtin_popcountll(q->ids.bits[i]);
+	return count;
 }
 
 /**
@@ -91,5 +142,5 @@ int quorum_add(struct quorum* q, int id)
  */
 int quorum_reached(struct quorum* q)
 {
-	return (q->count >= q->quorum); // Check if the count of acceptors in the quorum is sufficient.
+	return quorum_count(q) >= q->quorum;
 }
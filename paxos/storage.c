@@ -28,6 +28,7 @@
 
 #include "storage.h"
 #include <stdlib.h>
+#include <string.h>
 
 /// <summary>
 /// Initialize storage for an Acceptor and checking which set up has to be chosen for allocating.
@@ -45,6 +46,9 @@ void storage_init(struct storage* store, int acceptor_id)
 			storage_init_lmdb(store, acceptor_id);
 			break;
 		#endif
+		case PAXOS_WAL_STORAGE: // Storage is a write-ahead log. Use of storage_wal.c.
+			storage_init_wal(store, acceptor_id);
+			break;
 		default: // Error Code
 		paxos_log_error("Storage backend not available");
 		exit(0);
@@ -101,6 +105,62 @@ storage_put_record(struct storage* store, paxos_accepted* acc)
 	return store->api.put(store->handle, acc);
 }
 
+/*
+* Backends that can hand out the stored record mutate it in place. For the
+* others the record is read, passed to the callback and written back.
+*/
+int
+storage_update_record(struct storage* store, iid_t iid, storage_update_cb cb, void* arg)
+{
+	int found, rv;
+	paxos_accepted acc;
+
+	if (store->api.update != NULL)
+		return store->api.update(store->handle, iid, cb, arg);
+
+	memset(&acc, 0, sizeof(paxos_accepted));
+	found = store->api.get(store->handle, iid, &acc);
+	if (!found)
+		acc.iid = iid;
+	rv = cb(&acc, found, arg);
+	if (rv > 0 && store->api.put(store->handle, &acc) != 0)
+		rv = -1;
+	paxos_accepted_destroy(&acc);
+	return rv;
+}
+
+/*
+* Backends that can hand out the stored record, or a view of it, pass it to
+* the callback without copying it. For the others the record is read into a
+* copy. Returns 1 if the record exists, 0 otherwise.
+*/
+int
+storage_read_record(struct storage* store, iid_t iid, storage_read_cb cb, void* arg)
+{
+	paxos_accepted acc;
+
+	if (store->api.read != NULL)
+		return store->api.read(store->handle, iid, cb, arg);
+
+	memset(&acc, 0, sizeof(paxos_accepted));
+	if (!store->api.get(store->handle, iid, &acc))
+		return 0;
+	cb(&acc, arg);
+	paxos_accepted_destroy(&acc);
+	return 1;
+}
+
+/*
+* Backends that may defer syncing committed transactions sync them now.
+*/
+int
+storage_sync(struct storage* store)
+{
+	if (store->api.sync == NULL)
+		return 0;
+	return store->api.sync(store->handle);
+}
+
 int
 storage_trim(struct storage* store, iid_t iid)
 {
@@ -111,3 +171,26 @@ iid_t storage_get_trim_instance(struct storage* store)
 {
 	return store->api.get_trim_instance(store->handle);
 }
+
+/*
+* Highest instance id with a stored record, 0 if there is none.
+*/
+iid_t storage_get_max_instance(struct storage* store)
+{
+	return store->api.get_max_instance(store->handle);
+}
+
+/*
+* The promised-from watermark is a single promise covering every instance
+* from a given iid on, as taken by a stable leader. Returns 1 and fills
+* from and ballot if one was stored, 0 otherwise.
+*/
+int storage_get_watermark(struct storage* store, iid_t* from, ballot_t* ballot)
+{
+	return store->api.get_watermark(store->handle, from, ballot);
+}
+
+int storage_put_watermark(struct storage* store, iid_t from, ballot_t ballot)
+{
+	return store->api.put_watermark(store->handle, from, ballot);
+}
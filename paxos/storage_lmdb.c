@@ -43,8 +43,22 @@ struct lmdb_storage
 	MDB_txn* txn;
 	MDB_dbi dbi;
 	int acceptor_id;
+	iid_t max_iid;              /* Highest instance stored, if max_known */
+	int max_known;
+	struct paxos_accepted_view view; /* Record handed to read callbacks */
 };
 
+/*
+* Key 0 holds the metadata: the trim instance, then the iid and the ballot
+* of the promised-from watermark. Instances are stored from key 1 on, so
+* that appending a new highest instance is an append to the whole tree.
+*/
+#define LMDB_META_KEY 0
+#define LMDB_META_TRIM 0
+#define LMDB_META_WATERMARK_IID 1
+#define LMDB_META_WATERMARK_BALLOT 2
+#define LMDB_META_FIELDS 3
+
 static void lmdb_storage_close(void* handle);
 
 static int
@@ -219,21 +233,19 @@ lmdb_storage_tx_abort(void* handle)
 		mdb_txn_abort(s->txn);
 		s->txn = NULL;
 	}
+	s->max_known = 0;
 }
 
 static int
-lmdb_storage_get(void* handle, iid_t iid, paxos_accepted* out)
+lmdb_storage_get_buffer(struct lmdb_storage* s, iid_t iid, MDB_val* data)
 {
-	struct lmdb_storage* s = handle;
 	int result;
-	MDB_val key, data;
-
-	memset(&data, 0, sizeof(data));
+	MDB_val key;
 
 	key.mv_data = &iid;
 	key.mv_size = sizeof(iid_t);
 
-	if ((result = mdb_get(s->txn, s->dbi, &key, &data)) != 0) {
+	if ((result = mdb_get(s->txn, s->dbi, &key, data)) != 0) {
 		if (result == MDB_NOTFOUND) {
 			paxos_log_debug("There is no record for iid: %d", iid);
 		} else {
@@ -242,74 +254,154 @@ lmdb_storage_get(void* handle, iid_t iid, paxos_accepted* out)
 		}
 		return 0;
 	}
+	return 1;
+}
 
-	paxos_accepted_from_buffer(data.mv_data, out);
+static int
+lmdb_storage_get(void* handle, iid_t iid, paxos_accepted* out)
+{
+	struct lmdb_storage* s = handle;
+	MDB_val data;
+
+	if (iid == LMDB_META_KEY || !lmdb_storage_get_buffer(s, iid, &data))
+		return 0;
+
+	if (paxos_accepted_from_buffer(data.mv_data, data.mv_size, out) != 0) {
+		paxos_log_error("Corrupted record for iid: %d", iid);
+		return 0;
+	}
 	assert(iid == out->iid);
 
 	return 1;
 }
 
+/*
+* Reads the record straight from the memory map. Its values point into the
+* map, which stays valid until the transaction ends.
+*/
+static int
+lmdb_storage_read(void* handle, iid_t iid, storage_read_cb cb, void* arg)
+{
+	struct lmdb_storage* s = handle;
+	MDB_val data;
+
+	if (iid == LMDB_META_KEY || !lmdb_storage_get_buffer(s, iid, &data))
+		return 0;
+
+	if (paxos_accepted_view_buffer(data.mv_data, data.mv_size, &s->view) != 0) {
+		paxos_log_error("Corrupted record for iid: %d", iid);
+		return 0;
+	}
+	assert(iid == s->view.acc.iid);
+
+	cb(&s->view.acc, arg);
+	return 1;
+}
+
+static iid_t lmdb_storage_get_max_instance(void* handle);
+
+/*
+* The record is serialized directly into the space reserved in the map.
+* Instances beyond the highest one stored, the common case of an acceptor
+* moving forward, are appended without searching the tree.
+*/
 static int
 lmdb_storage_put(void* handle, paxos_accepted* acc)
 {
 	struct lmdb_storage* s = handle;
 	int result;
+	unsigned flags = MDB_RESERVE;
 	MDB_val key, data;
-	char* buffer = paxos_accepted_to_buffer(acc);
+
+	assert(acc->iid != LMDB_META_KEY);
+
+	if (!s->max_known) {
+		s->max_iid = lmdb_storage_get_max_instance(handle);
+		s->max_known = 1;
+	}
+	if (acc->iid > s->max_iid)
+		flags |= MDB_APPEND;
 
 	key.mv_data = &acc->iid;
 	key.mv_size = sizeof(iid_t);
 
-	data.mv_data = buffer;
-	data.mv_size = sizeof(paxos_accepted) + acc->value.paxos_value_len;
+	data.mv_data = NULL;
+	data.mv_size = paxos_accepted_buffer_size(acc);
 
-	result = mdb_put(s->txn, s->dbi, &key, &data, 0);
-	free(buffer);
-	return result;
+	if ((result = mdb_put(s->txn, s->dbi, &key, &data, flags)) != 0) {
+		paxos_log_error("Could not store record for iid: %d : %s",
+			acc->iid, mdb_strerror(result));
+		return result;
+	}
+	paxos_accepted_write_buffer(acc, data.mv_data);
+
+	if (acc->iid > s->max_iid)
+		s->max_iid = acc->iid;
+	return 0;
 }
 
-static iid_t
-lmdb_storage_get_trim_instance(void* handle)
+/*
+* Reads the metadata record, zeroed if there is none. A record written by an
+* older version holds only the trim instance.
+*/
+static void
+lmdb_storage_get_meta(struct lmdb_storage* s, uint32_t* meta)
 {
-	struct lmdb_storage* s = handle;
 	int result;
-	iid_t iid = 0, k = 0;
+	iid_t k = LMDB_META_KEY;
 	MDB_val key, data;
 
+	memset(meta, 0, LMDB_META_FIELDS * sizeof(uint32_t));
+
 	key.mv_data = &k;
 	key.mv_size = sizeof(iid_t);
 
 	if ((result = mdb_get(s->txn, s->dbi, &key, &data)) != 0) {
-		if (result != MDB_NOTFOUND) {
+		if (result != MDB_NOTFOUND)
 			paxos_log_error("mdb_get failed: %s", mdb_strerror(result));
-			assert(result == 0);
-		} else {
-			iid = 0;
-		}
-	} else {
-		iid = *(iid_t*)data.mv_data;
+		return;
 	}
-
-	return iid;
+	memcpy(meta, data.mv_data, data.mv_size < LMDB_META_FIELDS * sizeof(uint32_t) ?
+		data.mv_size : LMDB_META_FIELDS * sizeof(uint32_t));
 }
 
 static int
-lmdb_storage_put_trim_instance(void* handle, iid_t iid)
+lmdb_storage_put_meta(struct lmdb_storage* s, uint32_t* meta)
 {
-	struct lmdb_storage* s = handle;
-	iid_t k = 0;
 	int result;
+	iid_t k = LMDB_META_KEY;
 	MDB_val key, data;
 
 	key.mv_data = &k;
 	key.mv_size = sizeof(iid_t);
 
-	data.mv_data = &iid;
-	data.mv_size = sizeof(iid_t);
+	data.mv_data = meta;
+	data.mv_size = LMDB_META_FIELDS * sizeof(uint32_t);
 
 	result = mdb_put(s->txn, s->dbi, &key, &data, 0);
 	if (result != 0)
 		paxos_log_error("%s\n", mdb_strerror(result));
+	return result;
+}
+
+static iid_t
+lmdb_storage_get_trim_instance(void* handle)
+{
+	uint32_t meta[LMDB_META_FIELDS];
+
+	lmdb_storage_get_meta(handle, meta);
+	return meta[LMDB_META_TRIM];
+}
+
+static int
+lmdb_storage_put_trim_instance(void* handle, iid_t iid)
+{
+	uint32_t meta[LMDB_META_FIELDS];
+	int result;
+
+	lmdb_storage_get_meta(handle, meta);
+	meta[LMDB_META_TRIM] = iid;
+	result = lmdb_storage_put_meta(handle, meta);
 	assert(result == 0);
 
 	return 0;
@@ -339,7 +431,7 @@ lmdb_storage_trim(void* handle, iid_t iid)
 
 	do {
 		if ((result = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
-			assert(key.mv_size = sizeof(iid_t));
+			assert(key.mv_size == sizeof(iid_t));
 			min = *(iid_t*)key.mv_data;
 		} else {
 			goto cleanup_exit;
@@ -361,6 +453,52 @@ lmdb_storage_trim(void* handle, iid_t iid)
 	return 0;
 }
 
+static iid_t
+lmdb_storage_get_max_instance(void* handle)
+{
+	struct lmdb_storage* s = handle;
+	int result;
+	iid_t iid = 0;
+	MDB_cursor* cursor = NULL;
+	MDB_val key, data;
+
+	if ((result = mdb_cursor_open(s->txn, s->dbi, &cursor)) != 0) {
+		paxos_log_error("Could not create cursor. %s", mdb_strerror(result));
+		return 0;
+	}
+
+	if (mdb_cursor_get(cursor, &key, &data, MDB_LAST) == 0)
+		iid = *(iid_t*)key.mv_data;
+
+	mdb_cursor_close(cursor);
+	return iid;
+}
+
+static int
+lmdb_storage_get_watermark(void* handle, iid_t* from, ballot_t* ballot)
+{
+	uint32_t meta[LMDB_META_FIELDS];
+
+	lmdb_storage_get_meta(handle, meta);
+	if (meta[LMDB_META_WATERMARK_IID] == 0)
+		return 0;
+
+	*from = meta[LMDB_META_WATERMARK_IID];
+	*ballot = meta[LMDB_META_WATERMARK_BALLOT];
+	return 1;
+}
+
+static int
+lmdb_storage_put_watermark(void* handle, iid_t from, ballot_t ballot)
+{
+	uint32_t meta[LMDB_META_FIELDS];
+
+	lmdb_storage_get_meta(handle, meta);
+	meta[LMDB_META_WATERMARK_IID] = from;
+	meta[LMDB_META_WATERMARK_BALLOT] = ballot;
+	return lmdb_storage_put_meta(handle, meta);
+}
+
 
 /// <summary>
 /// Initialize storage for LMDB usage instead of Memory
@@ -378,6 +516,12 @@ storage_init_lmdb(struct storage* s, int acceptor_id)
 	s->api.tx_abort = lmdb_storage_tx_abort;
 	s->api.get = lmdb_storage_get;
 	s->api.put = lmdb_storage_put;
+	s->api.update = NULL; // decoded and re-encoded by storage_update_record
+	s->api.read = lmdb_storage_read;
+	s->api.sync = NULL;
 	s->api.trim = lmdb_storage_trim;
 	s->api.get_trim_instance = lmdb_storage_get_trim_instance;
+	s->api.get_max_instance = lmdb_storage_get_max_instance;
+	s->api.get_watermark = lmdb_storage_get_watermark;
+	s->api.put_watermark = lmdb_storage_put_watermark;
 }
@@ -27,14 +27,56 @@
 
 
 #include "storage.h"
-#include "khash.h"
+#include "iidring.h"
+#include <stdlib.h>
+#include <string.h>
 
-KHASH_MAP_INIT_INT(record, paxos_accepted*); // Initialize to hash and map records of accepted values.
+// Initial capacity of the records ring, grown as the untrimmed window widens.
+#define MEM_STORAGE_RING_SIZE 1024
+// Size of the arena chunks records are packed into.
+#define MEM_STORAGE_CHUNK_SIZE (1 << 20)
+#define MEM_ALIGN(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+/*
+ * A stored record. Records written by put are packed into the arena as a
+ * single block: the header followed by the values array, the aids, ballots
+ * and value_ballots arrays, and the value bytes. Update callbacks work on
+ * the packed arrays, borrowed (see PAXOS_ACCEPTED_BORROWED_ARRAYS): entries
+ * change in place, and only arrays that must grow are copied, to be packed
+ * into a new block afterwards. The value bytes are never copied by updates:
+ * a new block points to the bytes of the old one, which stay in the arena
+ * as long as the record, since chunks are released by iid. A record that
+ * cannot be packed for lack of memory stays on the heap (size is 0).
+ */
+struct mem_record
+{
+	paxos_accepted acc;
+	size_t size;           // Bytes reserved in the arena, 0 if on the heap
+};
+
+/*
+ * Arena chunks are allocated in iid order, roughly, and each remembers the
+ * highest iid packed into it, so that a chunk is released as a whole once
+ * every record it holds is trimmed.
+ */
+struct mem_chunk
+{
+	struct mem_chunk* next;
+	iid_t max_iid;
+	size_t used;
+	size_t size;
+	char data[];
+};
 
 struct mem_storage
 {
 	iid_t trim_iid;
-	kh_record_t* records;
+	iid_t max_iid;
+	iid_t watermark_iid;
+	ballot_t watermark_ballot;
+	struct iidring* records; // Records ordered by iid, trimmed as a prefix.
+	struct mem_chunk* chunks; // Arena chunks, oldest first
+	struct mem_chunk* chunk;  // Chunk being filled, last in the list
 };
 
 /**
@@ -57,10 +99,224 @@ static struct mem_storage* mem_storage_new(int acceptor_id)
 	if (s == NULL)
 		return s;
 	s->trim_iid = 0;
-	s->records = kh_init(record);
+	s->max_iid = 0;
+	s->watermark_iid = 0;
+	s->watermark_ballot = 0;
+	s->records = iidring_new(MEM_STORAGE_RING_SIZE);
+	s->chunks = NULL;
+	s->chunk = NULL;
 	return s;
 }
 
+/**
+ * Reserves size bytes in the arena for a record of the given instance.
+ *
+ * @param s Pointer to the memory storage instance.
+ * @param iid Instance ID of the record.
+ * @param size Number of bytes to reserve, aligned.
+ * @return Pointer to the reserved memory, NULL on allocation failure.
+ */
+static struct mem_record* mem_arena_alloc(struct mem_storage* s, iid_t iid, size_t size)
+{
+	struct mem_chunk* c = s->chunk;
+	if (c == NULL || c->size - c->used < size) {
+		size_t csize = size > MEM_STORAGE_CHUNK_SIZE ? size : MEM_STORAGE_CHUNK_SIZE;
+		c = malloc(sizeof(struct mem_chunk) + csize);
+		if (c == NULL)
+			return NULL;
+		c->next = NULL;
+		c->max_iid = 0;
+		c->used = 0;
+		c->size = csize;
+		if (s->chunk != NULL)
+			s->chunk->next = c;
+		else
+			s->chunks = c;
+		s->chunk = c;
+	}
+	struct mem_record* rec = (struct mem_record*)(c->data + c->used);
+	c->used += size;
+	if (iid > c->max_iid)
+		c->max_iid = iid;
+	return rec;
+}
+
+/**
+ * Releases the arena chunks holding only instances up to iid. The chunk
+ * being filled is kept.
+ *
+ * @param s Pointer to the memory storage instance.
+ * @param iid Trim instance ID.
+ */
+static void mem_arena_release(struct mem_storage* s, iid_t iid)
+{
+	struct mem_chunk** c = &s->chunks;
+	while (*c != NULL) {
+		struct mem_chunk* chunk = *c;
+		if (chunk != s->chunk && chunk->max_iid <= iid) {
+			*c = chunk->next;
+			free(chunk);
+		} else {
+			c = &chunk->next;
+		}
+	}
+}
+
+/**
+ * Number of acceptors the arrays of a packed record have room for. The
+ * spare capacity of the source is kept, so that a record put again with
+ * more acceptors usually fits in its old block.
+ */
+static uint32_t mem_record_cap(paxos_accepted* acc)
+{
+	if (acc->n_aids == 0)
+		return 0;
+	return acc->aids_cap > acc->n_aids ? acc->aids_cap : acc->n_aids;
+}
+
+/**
+ * Computes the size of a record packed into the arena.
+ *
+ * @param acc Pointer to the record to pack.
+ * @return The aligned number of bytes the packed record takes.
+ */
+static size_t mem_record_size(paxos_accepted* acc)
+{
+	size_t size = sizeof(struct mem_record);
+	uint32_t i, cap = mem_record_cap(acc);
+	if (cap == 0)
+		return MEM_ALIGN(size);
+	if (acc->values != NULL) {
+		size += cap * sizeof(paxos_value);
+		for (i = 0; i < acc->n_aids && !(acc->borrowed & PAXOS_ACCEPTED_BORROWED_VALUES); i++)
+			size += acc->values[i].paxos_value_len;
+	}
+	if (acc->aids != NULL)
+		size += cap * sizeof(uint32_t);
+	if (acc->ballots != NULL)
+		size += cap * sizeof(uint32_t);
+	if (acc->value_ballots != NULL)
+		size += cap * sizeof(uint32_t);
+	return MEM_ALIGN(size);
+}
+
+/**
+ * Packs a copy of a record into the given block. Arrays missing from the
+ * source stay NULL, and value_0 is not stored, as in paxos_accepted_copy().
+ * Borrowed value bytes are pointed to rather than copied.
+ *
+ * @param rec Block of at least mem_record_size(acc) bytes.
+ * @param acc Pointer to the record to pack.
+ * @param size Size of the block.
+ */
+static void mem_record_pack(struct mem_record* rec, paxos_accepted* acc, size_t size)
+{
+	uint32_t i, n = acc->n_aids, cap = mem_record_cap(acc);
+	char* p = (char*)(rec + 1);
+
+	memcpy(&rec->acc, acc, sizeof(paxos_accepted));
+	rec->size = size;
+	rec->acc.aids = NULL;
+	rec->acc.values = NULL;
+	rec->acc.ballots = NULL;
+	rec->acc.value_ballots = NULL;
+	rec->acc.aids_cap = cap;
+	rec->acc.value_0.paxos_value_len = 0;
+	rec->acc.value_0.paxos_value_val = NULL;
+	rec->acc.borrowed = 0;
+	if (cap == 0)
+		return;
+	if (acc->values != NULL) {
+		rec->acc.values = (paxos_value*)p;
+		memset(p, 0, cap * sizeof(paxos_value));
+		p += cap * sizeof(paxos_value);
+	}
+	if (acc->aids != NULL) {
+		rec->acc.aids = (uint32_t*)p;
+		memcpy(p, acc->aids, n * sizeof(uint32_t));
+		p += cap * sizeof(uint32_t);
+	}
+	if (acc->ballots != NULL) {
+		rec->acc.ballots = (uint32_t*)p;
+		memcpy(p, acc->ballots, n * sizeof(uint32_t));
+		p += cap * sizeof(uint32_t);
+	}
+	if (acc->value_ballots != NULL) {
+		rec->acc.value_ballots = (uint32_t*)p;
+		memcpy(p, acc->value_ballots, n * sizeof(uint32_t));
+		p += cap * sizeof(uint32_t);
+	}
+	for (i = 0; rec->acc.values != NULL && i < n; i++) {
+		int len = acc->values[i].paxos_value_len;
+		rec->acc.values[i].paxos_value_len = len;
+		rec->acc.values[i].paxos_value_flags = acc->values[i].paxos_value_flags;
+		rec->acc.values[i].paxos_value_val = NULL;
+		if (len > 0 && (acc->borrowed & PAXOS_ACCEPTED_BORROWED_VALUES)) {
+			rec->acc.values[i].paxos_value_val = acc->values[i].paxos_value_val;
+		} else if (len > 0) {
+			rec->acc.values[i].paxos_value_val = p;
+			memcpy(p, acc->values[i].paxos_value_val, len);
+			p += len;
+		}
+	}
+}
+
+/**
+ * Frees a record, unless it lives in the arena.
+ *
+ * @param rec Pointer to the record.
+ */
+static void mem_record_free(struct mem_record* rec)
+{
+	if (rec->size > 0)
+		return;
+	paxos_accepted_destroy(&rec->acc);
+	free(rec);
+}
+
+/**
+ * Packs an updated record back into its block if it fits, or into a new
+ * arena block. A record still pointing to value bytes of its block always
+ * takes a new one, so that its arrays do not overwrite them. The record
+ * stays on the heap, with its copy dropped, only if the arena is out of
+ * memory.
+ *
+ * @param s Pointer to the memory storage instance.
+ * @param rec Pointer to the stored record, NULL if there is none yet.
+ * @param acc Updated record, with arrays of its own, destroyed.
+ * @return 0 on success, -1 if a new record cannot be indexed.
+ */
+static int mem_record_repack(struct mem_storage* s,
+	struct mem_record* rec, paxos_accepted* acc)
+{
+	size_t size = mem_record_size(acc);
+	struct mem_record* packed = NULL;
+
+	if (rec != NULL && rec->size >= size
+		&& !(acc->borrowed & PAXOS_ACCEPTED_BORROWED_VALUES))
+		packed = rec;
+	else
+		packed = mem_arena_alloc(s, acc->iid, size);
+	if (packed == NULL) {
+		packed = malloc(sizeof(struct mem_record));
+		memcpy(&packed->acc, acc, sizeof(paxos_accepted));
+		packed->size = 0;
+	} else {
+		mem_record_pack(packed, acc, packed == rec ? rec->size : size);
+		paxos_accepted_destroy(acc);
+	}
+	if (packed != rec) {
+		if (rec != NULL)
+			iidring_del(s->records, acc->iid);
+		// Only a new record can fail, if the ring cannot grow
+		if (iidring_put(s->records, acc->iid, packed) != 0) {
+			mem_record_free(packed);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /**
  * Opens the memory storage. This function does not require any action in memory storage.
  *
@@ -72,6 +328,16 @@ static int mem_storage_open(void* handle)
 	return 0;
 }
 
+static void mem_storage_free_record(void* record)
+{
+	mem_record_free(record);
+}
+
+static void mem_storage_trim_record(void* record, void* arg)
+{
+	mem_record_free(record);
+}
+
 /**
  * Closes the memory storage and frees associated memory.
  *
@@ -80,9 +346,10 @@ static int mem_storage_open(void* handle)
 static void mem_storage_close(void* handle)
 {
 	struct mem_storage* s = handle;
-	paxos_accepted* accepted;
-	kh_foreach_value(s->records, accepted, paxos_accepted_free(accepted));
-	kh_destroy_record(s->records);
+	iidring_foreach(s->records, mem_storage_free_record);
+	iidring_free(s->records);
+	mem_arena_release(s, (iid_t)-1);
+	free(s->chunk);
 	free(s);
 }
 
@@ -126,17 +393,16 @@ static void mem_storage_tx_abort(void* handle) { }
  */
 static int mem_storage_get(void* handle, iid_t iid, paxos_accepted* out)
 {
-	khiter_t k;
 	struct mem_storage* s = handle;
-	k = kh_get_record(s->records, iid);
-	if (k == kh_end(s->records))
+	struct mem_record* rec = iidring_get(s->records, iid);
+	if (rec == NULL)
 		return 0;
-	paxos_accepted_copy(out, kh_value(s->records, k));
+	paxos_accepted_copy(out, &rec->acc);
 	return 1;
 }
 
 /**
- * Stores an accepted value in memory storage.
+ * Stores an accepted value in memory storage, packed into the arena.
  *
  * @param handle Pointer to the memory storage instance.
  * @param acc Pointer to the paxos_accepted structure to store.
@@ -144,25 +410,106 @@ static int mem_storage_get(void* handle, iid_t iid, paxos_accepted* out)
  */
 static int mem_storage_put(void* handle, paxos_accepted* acc)
 {
-	int rv;
-	khiter_t k;
 	struct mem_storage* s = handle;
-	paxos_accepted* record = malloc(sizeof(paxos_accepted));
-	paxos_accepted_copy(record, acc);
-	k = kh_put_record(s->records, acc->iid, &rv);
-	if (rv == -1) { // error
-		paxos_accepted_free(record);
+	size_t size = mem_record_size(acc);
+	struct mem_record* rec = iidring_get(s->records, acc->iid);
+	if (rec != NULL && rec->size >= size) { // the old block is large enough
+		mem_record_pack(rec, acc, rec->size);
+		return 0;
+	}
+	if (rec == NULL && !iidring_fits(s->records, acc->iid)) {
+		paxos_log_error("Instance %u is too far from the stored ones", acc->iid);
 		return -1;
 	}
-	if (rv == 0) { // key is already present
-		paxos_accepted_free(kh_value(s->records, k));
+	struct mem_record* packed = mem_arena_alloc(s, acc->iid, size);
+	if (packed == NULL)
+		return -1;
+	mem_record_pack(packed, acc, size);
+	if (rec != NULL) {
+		iidring_del(s->records, acc->iid);
+		mem_record_free(rec);
 	}
-	kh_value(s->records, k) = record;
+	if (iidring_put(s->records, acc->iid, packed) != 0)
+		return -1;
+	if (acc->iid > s->max_iid)
+		s->max_iid = acc->iid;
 	return 0;
 }
 
 /**
- * Trims instances in memory storage up to a specified instance ID.
+ * Applies a callback to the stored record. A record left on the heap is
+ * modified in place. A packed record is lent to the callback with its
+ * arrays borrowed: if they did not have to grow, the changes are already
+ * in the block and only the header is written back, otherwise the record
+ * is packed again. A new record is inserted only if the callback asks for
+ * it.
+ *
+ * @param handle Pointer to the memory storage instance.
+ * @param iid Instance ID of the record.
+ * @param cb Callback modifying the record.
+ * @param arg Argument passed to the callback.
+ * @return The value returned by the callback, -1 on error.
+ */
+static int mem_storage_update(void* handle, iid_t iid, storage_update_cb cb, void* arg)
+{
+	int rv;
+	paxos_accepted acc;
+	struct mem_storage* s = handle;
+	struct mem_record* rec = iidring_get(s->records, iid);
+
+	if (rec != NULL && rec->size == 0)
+		return cb(&rec->acc, 1, arg);
+	if (rec == NULL && !iidring_fits(s->records, iid)) {
+		paxos_log_error("Instance %u is too far from the stored ones", iid);
+		return -1;
+	}
+
+	if (rec != NULL) {
+		acc = rec->acc;
+		acc.borrowed = PAXOS_ACCEPTED_BORROWED_ARRAYS | PAXOS_ACCEPTED_BORROWED_VALUES;
+	} else {
+		memset(&acc, 0, sizeof(paxos_accepted));
+		acc.iid = iid;
+	}
+	rv = cb(&acc, rec != NULL, arg);
+	if (rv <= 0) {
+		paxos_accepted_destroy(&acc); // frees only what the callback allocated
+		return rv;
+	}
+	if (acc.borrowed & PAXOS_ACCEPTED_BORROWED_ARRAYS) {
+		rec->acc = acc;
+		rec->acc.borrowed = 0;
+	} else if (mem_record_repack(s, rec, &acc) != 0) {
+		return -1;
+	}
+	if (iid > s->max_iid)
+		s->max_iid = iid;
+	return rv;
+}
+
+/**
+ * Passes the stored record to a callback, without copying it.
+ *
+ * @param handle Pointer to the memory storage instance.
+ * @param iid Instance ID of the record.
+ * @param cb Callback reading the record.
+ * @param arg Argument passed to the callback.
+ * @return 1 if the record exists, 0 otherwise.
+ */
+static int mem_storage_read(void* handle, iid_t iid, storage_read_cb cb, void* arg)
+{
+	struct mem_storage* s = handle;
+	struct mem_record* rec = iidring_get(s->records, iid);
+	if (rec == NULL)
+		return 0;
+	cb(&rec->acc, arg);
+	return 1;
+}
+
+/**
+ * Trims instances in memory storage up to a specified instance ID. Records
+ * are kept ordered by iid, so only the trimmed prefix is visited, and the
+ * arena chunks it filled are released in bulk.
  *
  * @param handle Pointer to the memory storage instance.
  * @param iid Instance ID up to which instances should be trimmed.
@@ -170,17 +517,9 @@ static int mem_storage_put(void* handle, paxos_accepted* acc)
  */
 static int mem_storage_trim(void* handle, iid_t iid)
 {
-	khiter_t k;
 	struct mem_storage* s = handle;
-	for (k = kh_begin(s->records); k != kh_end(s->records); ++k) {
-		if (kh_exist(s->records, k)) {
-			paxos_accepted* acc = kh_value(s->records, k);
-			if (acc->iid <= iid) {
-				paxos_accepted_free(acc);
-				kh_del_record(s->records, k);
-			}
-		}
-	}
+	iidring_trim(s->records, iid, mem_storage_trim_record, NULL);
+	mem_arena_release(s, iid);
 	s->trim_iid = iid;
 	return 0;
 }
@@ -197,6 +536,52 @@ static iid_t mem_storage_get_trim_instance(void* handle)
 	return s->trim_iid;
 }
 
+/**
+ * Retrieves the highest instance ID ever stored in memory storage.
+ *
+ * @param handle Pointer to the memory storage instance.
+ * @return The highest instance ID stored, 0 if none.
+ */
+static iid_t mem_storage_get_max_instance(void* handle)
+{
+	struct mem_storage* s = handle;
+	return s->max_iid;
+}
+
+/**
+ * Retrieves the promised-from watermark.
+ *
+ * @param handle Pointer to the memory storage instance.
+ * @param from Receives the first instance ID covered by the promise.
+ * @param ballot Receives the promised ballot.
+ * @return 1 if a watermark was stored, 0 otherwise.
+ */
+static int mem_storage_get_watermark(void* handle, iid_t* from, ballot_t* ballot)
+{
+	struct mem_storage* s = handle;
+	if (s->watermark_iid == 0)
+		return 0;
+	*from = s->watermark_iid;
+	*ballot = s->watermark_ballot;
+	return 1;
+}
+
+/**
+ * Stores the promised-from watermark, replacing the previous one.
+ *
+ * @param handle Pointer to the memory storage instance.
+ * @param from First instance ID covered by the promise.
+ * @param ballot Promised ballot.
+ * @return Always returns 0.
+ */
+static int mem_storage_put_watermark(void* handle, iid_t from, ballot_t ballot)
+{
+	struct mem_storage* s = handle;
+	s->watermark_iid = from;
+	s->watermark_ballot = ballot;
+	return 0;
+}
+
 /**
  * Copies the contents of a source paxos_accepted structure to a destination.
  *
@@ -208,17 +593,22 @@ static void paxos_accepted_copy(paxos_accepted* dst, paxos_accepted* src)
 	memcpy(dst, src, sizeof(paxos_accepted));
 	if (src->n_aids > 0)
 	{
+		// Keep the spare capacity so that merging further aids into the copy
+		// does not need to grow the arrays again.
+		uint32_t cap = src->aids_cap > src->n_aids ? src->aids_cap : src->n_aids;
+		dst->aids_cap = cap;
 		if (src->aids != NULL)
 		{
-			dst->aids = calloc(src->n_aids, sizeof(uint32_t));
-			for (int i = 0; i < src->n_aids; i++) dst->aids[i] = src->aids[i];
+			dst->aids = calloc(cap, sizeof(uint32_t));
+			memcpy(dst->aids, src->aids, src->n_aids * sizeof(uint32_t));
 		}
 		if (src->values != NULL)
 		{
-			dst->values = calloc(src->n_aids, sizeof(paxos_value));
+			dst->values = calloc(cap, sizeof(paxos_value));
 			for (int i = 0; i < src->n_aids; i++)
 			{
 				dst->values[i].paxos_value_len = src->values[i].paxos_value_len;
+				dst->values[i].paxos_value_flags = src->values[i].paxos_value_flags;
 				if (dst->values[i].paxos_value_len > 0)
 				{
 					dst->values[i].paxos_value_val = malloc(dst->values[i].paxos_value_len);
@@ -230,23 +620,26 @@ static void paxos_accepted_copy(paxos_accepted* dst, paxos_accepted* src)
 		}
 		if (src->ballots != NULL)
 		{
-			dst->ballots = calloc( src->n_aids, sizeof(uint32_t));
-			for (int i = 0; i < dst->n_aids; i++) { dst->ballots[i] = src->ballots[i]; }
+			dst->ballots = calloc(cap, sizeof(uint32_t));
+			memcpy(dst->ballots, src->ballots, src->n_aids * sizeof(uint32_t));
 		}
 		if (src->value_ballots != NULL)
 		{
-			dst->value_ballots = calloc( src->n_aids, sizeof(uint32_t));
-			for (int i = 0; i < dst->n_aids; i++) { dst->value_ballots[i] = src->value_ballots[i]; }
+			dst->value_ballots = calloc(cap, sizeof(uint32_t));
+			memcpy(dst->value_ballots, src->value_ballots, src->n_aids * sizeof(uint32_t));
 		}
 	}
 	else
 	{
 		dst->aids = NULL;
+		dst->values = NULL;
 		dst->ballots = NULL;
 		dst->value_ballots = NULL;
+		dst->aids_cap = 0;
 	}
 	dst->value_0.paxos_value_len = 0;
 	dst->value_0.paxos_value_val = NULL;
+	dst->borrowed = 0;
 	/*if (dst->value.paxos_value_len > 0) {
 		dst->value.paxos_value_val = malloc(src->value.paxos_value_len);
 		memcpy(dst->value.paxos_value_val, src->value.paxos_value_val,
@@ -271,6 +664,12 @@ void storage_init_mem(struct storage* s, int acceptor_id)
 	s->api.tx_abort = mem_storage_tx_abort;
 	s->api.get = mem_storage_get;
 	s->api.put = mem_storage_put;
+	s->api.update = mem_storage_update;
+	s->api.read = mem_storage_read;
+	s->api.sync = NULL;
 	s->api.trim = mem_storage_trim;
 	s->api.get_trim_instance = mem_storage_get_trim_instance;
+	s->api.get_max_instance = mem_storage_get_max_instance;
+	s->api.get_watermark = mem_storage_get_watermark;
+	s->api.put_watermark = mem_storage_put_watermark;
 }
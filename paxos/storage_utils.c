@@ -25,78 +25,238 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-
 #include "storage_utils.h"
+#include "aidset.h"
 #include <stdlib.h>
 #include <string.h>
 
-char*
-paxos_accepted_to_buffer(paxos_accepted* acc)
+/*
+ * A record is a header of uint32 fields followed by the per-aid arrays, all
+ * of them uint32 as well, and then by the bytes of the values:
+ *
+ *   iid src ballot_0 value_ballot_0 n_aids value_0_len arrays
+ *   aids[n] ballots[n] value_ballots[n] value_lens[n]
+ *   value_0 values[0] ... values[n-1]
+ *
+ * Missing arrays are stored as zeroes, and flagged as such in arrays so that
+ * they are missing again once read. The top bit of a value length stands for
+ * PAXOS_VALUE_BATCH.
+ */
+#define RECORD_HEADER 7
+#define RECORD_ARRAYS 4
+
+#define RECORD_AIDS 0x1
+#define RECORD_BALLOTS 0x2
+#define RECORD_VALUE_BALLOTS 0x4
+#define RECORD_VALUES 0x8
+
+#define RECORD_VALUE_BATCH 0x80000000
+
+static size_t
+record_values_offset(uint32_t n_aids)
+{
+	return (RECORD_HEADER + RECORD_ARRAYS * (size_t)n_aids) * sizeof(uint32_t);
+}
+
+static void
+put_u32(char* p, size_t i, uint32_t v)
+{
+	memcpy(p + i * sizeof(uint32_t), &v, sizeof(uint32_t));
+}
+
+static uint32_t
+get_u32(const char* p, size_t i)
 {
-	size_t len = acc->n_aids * sizeof(uint32_t);
-	for (int i = 0; i < acc->n_aids; i++)
-	{
-		len += acc->values[i].paxos_value_len+sizeof(uint32_t);
+	uint32_t v;
+	memcpy(&v, p + i * sizeof(uint32_t), sizeof(uint32_t));
+	return v;
+}
+
+static void
+put_array(char* p, const uint32_t* a, uint32_t n)
+{
+	if (a != NULL)
+		memcpy(p, a, n * sizeof(uint32_t));
+	else
+		memset(p, 0, n * sizeof(uint32_t));
+}
+
+size_t
+paxos_accepted_buffer_size(paxos_accepted* acc)
+{
+	uint32_t i;
+	size_t len = record_values_offset(acc->n_aids) + acc->value_0.paxos_value_len;
+	if (acc->values != NULL)
+		for (i = 0; i < acc->n_aids; i++)
+			len += acc->values[i].paxos_value_len;
+	return len;
+}
+
+void
+paxos_accepted_write_buffer(paxos_accepted* acc, char* buffer)
+{
+	uint32_t i, n = acc->n_aids;
+	char* p = buffer + RECORD_HEADER * sizeof(uint32_t);
+
+	put_u32(buffer, 0, acc->iid);
+	put_u32(buffer, 1, acc->src);
+	put_u32(buffer, 2, acc->ballot_0);
+	put_u32(buffer, 3, acc->value_ballot_0);
+	put_u32(buffer, 4, n);
+	put_u32(buffer, 5, acc->value_0.paxos_value_len);
+	put_u32(buffer, 6, (acc->aids ? RECORD_AIDS : 0)
+		| (acc->ballots ? RECORD_BALLOTS : 0)
+		| (acc->value_ballots ? RECORD_VALUE_BALLOTS : 0)
+		| (acc->values ? RECORD_VALUES : 0));
+
+	put_array(p, acc->aids, n);
+	p += n * sizeof(uint32_t);
+	put_array(p, acc->ballots, n);
+	p += n * sizeof(uint32_t);
+	put_array(p, acc->value_ballots, n);
+	p += n * sizeof(uint32_t);
+	for (i = 0; i < n; i++) {
+		uint32_t len = 0;
+		if (acc->values != NULL) {
+			len = acc->values[i].paxos_value_len;
+			if (acc->values[i].paxos_value_flags & PAXOS_VALUE_BATCH)
+				len |= RECORD_VALUE_BATCH;
+		}
+		put_u32(p, i, len);
 	}
+	p += n * sizeof(uint32_t);
 
-	char* buffer = malloc(sizeof(paxos_accepted) + len+sizeof(uint32_t)*acc->n_aids*2);
-	if (buffer == NULL)
-		return NULL;
-	memcpy(buffer, acc, sizeof(paxos_accepted));
-	memcpy(buffer+sizeof(paxos_accepted), &(acc->aids[0]), acc->n_aids * sizeof(uint32_t));
-	char* p = buffer + sizeof(paxos_accepted) + acc->n_aids * sizeof(uint32_t);
-	for(int i=0;i< acc->n_aids;i++)
-	{ 
-		memcpy(p, &(acc->values[i].paxos_value_len), sizeof(uint32_t));
-		p += sizeof(uint32_t);
-		memcpy(p, &(acc->values[i].paxos_value_val), acc->values[i].paxos_value_len);
+	if (acc->value_0.paxos_value_len > 0) {
+		memcpy(p, acc->value_0.paxos_value_val, acc->value_0.paxos_value_len);
+		p += acc->value_0.paxos_value_len;
+	}
+	for (i = 0; acc->values != NULL && i < n; i++) {
+		memcpy(p, acc->values[i].paxos_value_val, acc->values[i].paxos_value_len);
 		p += acc->values[i].paxos_value_len;
 	}
-	if (acc->ballots != NULL)
-	{
-		memcpy(p, acc->ballots, sizeof(uint32_t) * acc->n_aids);
+}
+
+char*
+paxos_accepted_to_buffer(paxos_accepted* acc)
+{
+	char* buffer = malloc(paxos_accepted_buffer_size(acc));
+	if (buffer != NULL)
+		paxos_accepted_write_buffer(acc, buffer);
+	return buffer;
+}
+
+/*
+ * Views the record in place: the values point into the buffer, while the
+ * small per-aid arrays are copied out of it, since the buffer may not be
+ * aligned for them.
+ */
+int
+paxos_accepted_view_buffer(char* buffer, size_t size, struct paxos_accepted_view* view)
+{
+	uint32_t i, n, arrays;
+	size_t len;
+	char* p;
+	paxos_accepted* acc = &view->acc;
+
+	if (size < record_values_offset(0))
+		return -1;
+	n = get_u32(buffer, 4);
+	if (n > PAXOS_MAX_ACCEPTORS || size < record_values_offset(n))
+		return -1;
+
+	memset(acc, 0, sizeof(paxos_accepted));
+	acc->iid = get_u32(buffer, 0);
+	acc->src = get_u32(buffer, 1);
+	acc->ballot_0 = get_u32(buffer, 2);
+	acc->value_ballot_0 = get_u32(buffer, 3);
+	acc->n_aids = n;
+	acc->aids_cap = n;
+	acc->value_0.paxos_value_len = get_u32(buffer, 5);
+	arrays = get_u32(buffer, 6);
+
+	p = buffer + RECORD_HEADER * sizeof(uint32_t);
+	memcpy(view->aids, p, n * sizeof(uint32_t));
+	p += n * sizeof(uint32_t);
+	memcpy(view->ballots, p, n * sizeof(uint32_t));
+	p += n * sizeof(uint32_t);
+	memcpy(view->value_ballots, p, n * sizeof(uint32_t));
+	p += n * sizeof(uint32_t);
+	for (i = 0; i < n; i++) {
+		uint32_t len = get_u32(p, i);
+		view->values[i].paxos_value_len = len & ~RECORD_VALUE_BATCH;
+		view->values[i].paxos_value_flags = len & RECORD_VALUE_BATCH ? PAXOS_VALUE_BATCH : 0;
 	}
-	else
-	{
-		memset(p, 0, sizeof(uint32_t) * acc->n_aids);
+	p += n * sizeof(uint32_t);
+
+	len = record_values_offset(n) + acc->value_0.paxos_value_len;
+	if (len > size)
+		return -1;
+	acc->value_0.paxos_value_val = acc->value_0.paxos_value_len > 0 ? p : NULL;
+	p += acc->value_0.paxos_value_len;
+	for (i = 0; i < n; i++) {
+		len += view->values[i].paxos_value_len;
+		if (len > size)
+			return -1;
+		view->values[i].paxos_value_val = view->values[i].paxos_value_len > 0 ? p : NULL;
+		p += view->values[i].paxos_value_len;
+		aidset_add(&acc->aidset, view->aids[i]);
 	}
-	p += sizeof(uint32_t) * acc->n_aids;
-	if (acc->value_ballots != NULL)
-	{
-		memcpy(p, acc->value_ballots, sizeof(uint32_t) * acc->n_aids);
+
+	if (n > 0) {
+		acc->aids = arrays & RECORD_AIDS ? view->aids : NULL;
+		acc->ballots = arrays & RECORD_BALLOTS ? view->ballots : NULL;
+		acc->value_ballots = arrays & RECORD_VALUE_BALLOTS ? view->value_ballots : NULL;
+		acc->values = arrays & RECORD_VALUES ? view->values : NULL;
 	}
-	else
-	{
-		memset(p, 0, sizeof(uint32_t) * acc->n_aids);
+	return 0;
+}
+
+static uint32_t*
+copy_array(uint32_t* a, uint32_t n)
+{
+	uint32_t* copy;
+	if (a == NULL)
+		return NULL;
+	copy = malloc(n * sizeof(uint32_t));
+	memcpy(copy, a, n * sizeof(uint32_t));
+	return copy;
+}
+
+static void
+copy_value(paxos_value* dst, paxos_value* src)
+{
+	dst->paxos_value_len = src->paxos_value_len;
+	dst->paxos_value_flags = src->paxos_value_flags;
+	dst->paxos_value_val = NULL;
+	if (src->paxos_value_len > 0) {
+		dst->paxos_value_val = malloc(src->paxos_value_len);
+		memcpy(dst->paxos_value_val, src->paxos_value_val, src->paxos_value_len);
 	}
-	p += sizeof(uint32_t) * acc->n_aids;
-	return buffer;
 }
 
-void
-paxos_accepted_from_buffer(char* buffer, paxos_accepted* out)
+int
+paxos_accepted_from_buffer(char* buffer, size_t size, paxos_accepted* out)
 {
-	memcpy(out, buffer, sizeof(paxos_accepted));
-	if (out->n_aids > 0)
-	{
-		out->aids = malloc(out->n_aids * sizeof(uint32_t));
-		memcpy(out->aids, buffer + sizeof(paxos_accepted), out->n_aids * sizeof(uint32_t));
-		out->values = malloc(out->n_aids * sizeof(paxos_value));
-		char* p = buffer + sizeof(paxos_accepted) + out->n_aids * sizeof(uint32_t);
-		for (int i = 0; i < out->n_aids; i++)
-		{
-			memcpy(&(out->values[i].paxos_value_len), p, sizeof(uint32_t));
-			p += sizeof(uint32_t);
-			out->values[i].paxos_value_val = malloc(out->values[i].paxos_value_len);
-			memcpy(out->values[i].paxos_value_val, p, out->values[i].paxos_value_len);
-			p += out->values[i].paxos_value_len;
+	uint32_t i, n;
+	struct paxos_accepted_view* view = malloc(sizeof(struct paxos_accepted_view));
 
-		}
-		out->ballots = malloc(sizeof(uint32_t) * out->n_aids);
-		memcpy(out->ballots, p, sizeof(uint32_t) * out->n_aids);
-		p += sizeof(uint32_t) * out->n_aids;
-		out->value_ballots = malloc(sizeof(uint32_t) * out->n_aids);
-		memcpy(out->value_ballots, p, sizeof(uint32_t) * out->n_aids);
-		p += sizeof(uint32_t) * out->n_aids;
+	if (paxos_accepted_view_buffer(buffer, size, view) != 0) {
+		free(view);
+		return -1;
+	}
+	n = view->acc.n_aids;
+	*out = view->acc;
+	copy_value(&out->value_0, &view->acc.value_0);
+	if (n > 0) {
+		out->aids = copy_array(view->acc.aids, n);
+		out->ballots = copy_array(view->acc.ballots, n);
+		out->value_ballots = copy_array(view->acc.value_ballots, n);
+	}
+	if (view->acc.values != NULL) {
+		out->values = malloc(n * sizeof(paxos_value));
+		for (i = 0; i < n; i++)
+			copy_value(&out->values[i], &view->values[i]);
 	}
+	free(view);
+	return 0;
 }
@@ -0,0 +1,859 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "storage.h"
+#include "storage_utils.h"
+#include "khash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/*
+* Write-ahead log storage. Records are appended to segment files, and an
+* in-memory index maps each iid to the position of its latest record. A
+* transaction is buffered in memory and written with a single write at
+* commit, followed by an fdatasync according to the sync policy.
+*
+* Each entry of a segment is a header of three uint32, the CRC32 of the
+* type and of the payload, the length of the payload and the type, followed
+* by the payload. Segments are named after their sequence number.
+*/
+
+#define WAL_RECORD 1     /* An accepted record, see storage_utils.c */
+#define WAL_TRIM 2       /* The trim instance */
+#define WAL_WATERMARK 3  /* The promised-from watermark */
+
+#define WAL_HEADER (3 * sizeof(uint32_t))
+
+struct wal_entry
+{
+	uint32_t segment;  /* Sequence number of the segment */
+	uint32_t length;   /* Length of the payload */
+	uint64_t offset;   /* Offset of the payload in the segment */
+};
+
+KHASH_MAP_INIT_INT(wal_index, struct wal_entry)
+
+struct wal_segment
+{
+	uint32_t seq;
+	int fd;
+	uint64_t size;     /* Bytes written to the file */
+	iid_t max_iid;     /* Highest iid recorded in the segment */
+};
+
+/* An index entry replaced by the current transaction */
+struct wal_undo
+{
+	iid_t iid;
+	int existed;
+	struct wal_entry entry;
+};
+
+struct wal_storage
+{
+	int acceptor_id;
+	char* path;
+	kh_wal_index_t* index;
+	struct wal_segment* segments; /* Oldest first, the last is written */
+	int segments_count;
+	int segments_cap;
+	char* buffer;                 /* Entries of the current transaction */
+	size_t buffer_len;
+	size_t buffer_cap;
+	struct wal_undo* undo;
+	int undo_count;
+	int undo_cap;
+	iid_t trim_iid;
+	iid_t max_iid;
+	iid_t watermark_iid;
+	ballot_t watermark_ballot;
+	iid_t tx_trim_iid;            /* State to restore on abort */
+	iid_t tx_max_iid;
+	iid_t tx_watermark_iid;
+	ballot_t tx_watermark_ballot;
+	uint64_t unsynced;            /* Bytes written since the last sync */
+	int broken;                   /* A failed write or sync could not be undone */
+	struct timeval synced;        /* Time of the last sync */
+	char* scratch;                /* Payload read for a read callback */
+	size_t scratch_cap;
+	struct paxos_accepted_view view;
+};
+
+static uint32_t wal_crc_table[256];
+
+static void
+wal_crc_init(void)
+{
+	uint32_t i, j, c;
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		wal_crc_table[i] = c;
+	}
+}
+
+static uint32_t
+wal_crc(uint32_t crc, const char* data, size_t len)
+{
+	size_t i;
+	crc = ~crc;
+	for (i = 0; i < len; i++)
+		crc = wal_crc_table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static char*
+wal_segment_path(struct wal_storage* s, uint32_t seq)
+{
+	size_t len = strlen(s->path) + 32;
+	char* path = malloc(len);
+	snprintf(path, len, "%s/%010u.wal", s->path, seq);
+	return path;
+}
+
+static struct wal_segment*
+wal_current(struct wal_storage* s)
+{
+	return &s->segments[s->segments_count - 1];
+}
+
+static struct wal_segment*
+wal_find_segment(struct wal_storage* s, uint32_t seq)
+{
+	int i;
+	for (i = s->segments_count - 1; i >= 0; i--)
+		if (s->segments[i].seq == seq)
+			return &s->segments[i];
+	return NULL;
+}
+
+static void*
+wal_reserve(void* array, int count, int* cap, size_t size)
+{
+	if (count < *cap)
+		return array;
+	*cap = *cap > 0 ? *cap * 2 : 16;
+	return realloc(array, *cap * size);
+}
+
+static void
+wal_sync_dir(struct wal_storage* s)
+{
+	int fd = open(s->path, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/*
+* Makes room at the end of the buffer of the current transaction for an
+* entry, returning where its payload must be written. The entry is added
+* by wal_append_end().
+*/
+static char*
+wal_append_begin(struct wal_storage* s, size_t len)
+{
+	size_t need = s->buffer_len + WAL_HEADER + len;
+
+	if (need > s->buffer_cap) {
+		while (need > s->buffer_cap)
+			s->buffer_cap = s->buffer_cap > 0 ? s->buffer_cap * 2 : 4096;
+		s->buffer = realloc(s->buffer, s->buffer_cap);
+	}
+	return s->buffer + s->buffer_len + WAL_HEADER;
+}
+
+/*
+* Adds the entry whose payload was written in place, returning the offset
+* the payload will have in the current segment.
+*/
+static uint64_t
+wal_append_end(struct wal_storage* s, uint32_t type, size_t len)
+{
+	uint32_t header[3];
+	char* payload = s->buffer + s->buffer_len + WAL_HEADER;
+	uint64_t offset;
+
+	header[0] = wal_crc(wal_crc(0, (char*)&type, sizeof(uint32_t)), payload, len);
+	header[1] = len;
+	header[2] = type;
+	memcpy(s->buffer + s->buffer_len, header, WAL_HEADER);
+
+	offset = wal_current(s)->size + s->buffer_len + WAL_HEADER;
+	s->buffer_len += WAL_HEADER + len;
+	return offset;
+}
+
+/*
+* Appends an entry to the buffer of the current transaction, returning the
+* offset its payload will have in the current segment.
+*/
+static uint64_t
+wal_append(struct wal_storage* s, uint32_t type, const char* payload, size_t len)
+{
+	char* p = wal_append_begin(s, len);
+	if (len > 0)
+		memcpy(p, payload, len);
+	return wal_append_end(s, type, len);
+}
+
+static void
+wal_append_meta(struct wal_storage* s)
+{
+	uint32_t watermark[2] = { s->watermark_iid, s->watermark_ballot };
+	wal_append(s, WAL_TRIM, (char*)&s->trim_iid, sizeof(iid_t));
+	if (s->watermark_iid != 0)
+		wal_append(s, WAL_WATERMARK, (char*)watermark, sizeof(watermark));
+}
+
+static int
+wal_segment_open(struct wal_storage* s, uint32_t seq, int create)
+{
+	struct wal_segment* seg;
+	char* path = wal_segment_path(s, seq);
+	int fd = open(path, O_RDWR | O_APPEND | (create ? O_CREAT | O_EXCL : 0),
+		S_IRUSR | S_IWUSR);
+
+	if (fd < 0) {
+		paxos_log_error("Could not open wal segment %s: %s", path, strerror(errno));
+		free(path);
+		return -1;
+	}
+	free(path);
+
+	s->segments = wal_reserve(s->segments, s->segments_count, &s->segments_cap,
+		sizeof(struct wal_segment));
+	seg = &s->segments[s->segments_count++];
+	seg->seq = seq;
+	seg->fd = fd;
+	seg->size = 0;
+	seg->max_iid = 0;
+	if (create)
+		wal_sync_dir(s);
+	return 0;
+}
+
+static int
+wal_sync(struct wal_storage* s)
+{
+	if (fdatasync(wal_current(s)->fd) != 0) {
+		paxos_log_error("wal fdatasync failed: %s", strerror(errno));
+		return -1;
+	}
+	s->unsynced = 0;
+	gettimeofday(&s->synced, NULL);
+	return 0;
+}
+
+static int
+wal_sync_due(struct wal_storage* s)
+{
+	struct timeval now;
+	long elapsed;
+
+	if (paxos_config.wal_sync_interval == 0 && paxos_config.wal_sync_bytes == 0)
+		return 1;
+	if (paxos_config.wal_sync_bytes > 0 && s->unsynced >= paxos_config.wal_sync_bytes)
+		return 1;
+	if (paxos_config.wal_sync_interval > 0) {
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - s->synced.tv_sec) * 1000000
+			+ (now.tv_usec - s->synced.tv_usec);
+		if (elapsed >= paxos_config.wal_sync_interval)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+* Starts a new segment once the current one is full. The new segment begins
+* with the trim instance and the watermark, so that deleting older segments
+* never loses them. The old segment is synced before it is left behind.
+*/
+static int
+wal_rotate(struct wal_storage* s)
+{
+	struct wal_segment* cur = wal_current(s);
+	uint32_t seq = cur->seq + 1;
+
+	if (s->unsynced > 0 && wal_sync(s) != 0)
+		return -1;
+	if (wal_segment_open(s, seq, 1) != 0)
+		return -1;
+	wal_append_meta(s);
+	return 0;
+}
+
+/*
+* Cuts the current segment back to size bytes. If that fails, the segment
+* must not be written anymore and the wal is marked broken.
+*/
+static int
+wal_cut(struct wal_storage* s, uint64_t size)
+{
+	struct wal_segment* seg = wal_current(s);
+
+	if (ftruncate(seg->fd, size) != 0) {
+		paxos_log_error("wal truncate failed: %s", strerror(errno));
+		s->broken = 1;
+		return -1;
+	}
+	if (seg->size > size) {
+		s->unsynced -= seg->size - size;
+		seg->size = size;
+	}
+	return 0;
+}
+
+/*
+* Writes the buffered entries at the end of the current segment. The bytes
+* of a failed or partial write are cut off the segment, since the offsets
+* of the entries appended next assume they follow seg->size.
+*/
+static int
+wal_write(struct wal_storage* s)
+{
+	struct wal_segment* seg = wal_current(s);
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < s->buffer_len) {
+		n = write(seg->fd, s->buffer + done, s->buffer_len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			paxos_log_error("wal write failed: %s", strerror(errno));
+			wal_cut(s, seg->size);
+			return -1;
+		}
+		done += n;
+	}
+	seg->size += s->buffer_len;
+	s->unsynced += s->buffer_len;
+	s->buffer_len = 0;
+	return 0;
+}
+
+/*
+* Leaves a segment whose tail could not be cut off for a new one. The
+* replay of the old segment then ends at the torn entry, and goes on with
+* the new one.
+*/
+static void
+wal_leave_segment(struct wal_storage* s)
+{
+	s->broken = 0;
+	s->buffer_len = 0;
+	if (wal_rotate(s) != 0 || wal_write(s) != 0) {
+		paxos_log_error("Could not start a new wal segment, the wal is read only");
+		s->buffer_len = 0;
+		s->broken = 1;
+	}
+}
+
+/*
+* Drops the index entries and the whole segments below the trim instance.
+* The segment being written is never dropped.
+*/
+static void
+wal_apply_trim(struct wal_storage* s)
+{
+	int i, kept = 0;
+	khiter_t k;
+	char* path;
+
+	for (k = kh_begin(s->index); k != kh_end(s->index); ++k)
+		if (kh_exist(s->index, k) && kh_key(s->index, k) <= s->trim_iid)
+			kh_del_wal_index(s->index, k);
+
+	for (i = 0; i < s->segments_count; i++) {
+		struct wal_segment* seg = &s->segments[i];
+		if (i < s->segments_count - 1 && seg->max_iid <= s->trim_iid) {
+			close(seg->fd);
+			path = wal_segment_path(s, seg->seq);
+			if (unlink(path) != 0)
+				paxos_log_error("Could not remove wal segment %s: %s",
+					path, strerror(errno));
+			free(path);
+			continue;
+		}
+		s->segments[kept++] = *seg;
+	}
+	s->segments_count = kept;
+}
+
+static void
+wal_index_put(struct wal_storage* s, iid_t iid, struct wal_entry* e, int undo)
+{
+	int rv;
+	khiter_t k = kh_put_wal_index(s->index, iid, &rv);
+
+	if (undo) {
+		s->undo = wal_reserve(s->undo, s->undo_count, &s->undo_cap,
+			sizeof(struct wal_undo));
+		s->undo[s->undo_count].iid = iid;
+		s->undo[s->undo_count].existed = (rv == 0);
+		if (rv == 0)
+			s->undo[s->undo_count].entry = kh_value(s->index, k);
+		s->undo_count++;
+	}
+	kh_value(s->index, k) = *e;
+}
+
+/*
+* Applies an entry read back from a segment when the log is opened.
+*/
+static void
+wal_replay_entry(struct wal_storage* s, struct wal_segment* seg, uint32_t type,
+	char* payload, uint32_t len, uint64_t offset)
+{
+	struct wal_entry e;
+	iid_t iid;
+
+	switch (type) {
+	case WAL_RECORD:
+		if (len < sizeof(iid_t))
+			return;
+		memcpy(&iid, payload, sizeof(iid_t));
+		e.segment = seg->seq;
+		e.length = len;
+		e.offset = offset;
+		wal_index_put(s, iid, &e, 0);
+		if (iid > seg->max_iid)
+			seg->max_iid = iid;
+		if (iid > s->max_iid)
+			s->max_iid = iid;
+		break;
+	case WAL_TRIM:
+		if (len == sizeof(iid_t))
+			memcpy(&s->trim_iid, payload, sizeof(iid_t));
+		break;
+	case WAL_WATERMARK:
+		if (len == 2 * sizeof(uint32_t)) {
+			memcpy(&s->watermark_iid, payload, sizeof(iid_t));
+			memcpy(&s->watermark_ballot, payload + sizeof(iid_t), sizeof(ballot_t));
+		}
+		break;
+	}
+}
+
+/*
+* Scans a segment, rebuilding the index. A torn or corrupted entry ends the
+* scan; in the last segment it is the tail of a write that never completed,
+* and is cut off so that new entries follow the valid ones.
+*/
+static int
+wal_replay_segment(struct wal_storage* s, struct wal_segment* seg, int last)
+{
+	uint32_t header[3];
+	uint64_t offset = 0;
+	char* payload = NULL;
+	size_t cap = 0;
+	struct stat sb;
+
+	if (fstat(seg->fd, &sb) != 0)
+		return -1;
+
+	while (offset + WAL_HEADER <= (uint64_t)sb.st_size) {
+		if (pread(seg->fd, header, WAL_HEADER, offset) != WAL_HEADER)
+			break;
+		if (offset + WAL_HEADER + header[1] > (uint64_t)sb.st_size)
+			break;
+		if (header[1] > cap) {
+			cap = header[1];
+			payload = realloc(payload, cap);
+		}
+		if (pread(seg->fd, payload, header[1], offset + WAL_HEADER) != header[1])
+			break;
+		if (wal_crc(wal_crc(0, (char*)&header[2], sizeof(uint32_t)),
+				payload, header[1]) != header[0])
+			break;
+		wal_replay_entry(s, seg, header[2], payload, header[1], offset + WAL_HEADER);
+		offset += WAL_HEADER + header[1];
+	}
+	free(payload);
+
+	if (offset < (uint64_t)sb.st_size) {
+		paxos_log_error("wal segment %u has an invalid entry at offset %lu",
+			seg->seq, (unsigned long)offset);
+		if (last && ftruncate(seg->fd, offset) != 0)
+			return -1;
+	}
+	seg->size = offset;
+	return 0;
+}
+
+static int
+wal_compare_seq(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static int
+wal_storage_recover(struct wal_storage* s)
+{
+	DIR* dir;
+	struct dirent* d;
+	uint32_t seq, *seqs = NULL;
+	int i, count = 0, cap = 0;
+	char suffix[8];
+
+	if ((dir = opendir(s->path)) == NULL)
+		return -1;
+	while ((d = readdir(dir)) != NULL) {
+		if (sscanf(d->d_name, "%10u.%4s", &seq, suffix) != 2 || strcmp(suffix, "wal") != 0)
+			continue;
+		seqs = wal_reserve(seqs, count, &cap, sizeof(uint32_t));
+		seqs[count++] = seq;
+	}
+	closedir(dir);
+	qsort(seqs, count, sizeof(uint32_t), wal_compare_seq);
+
+	for (i = 0; i < count; i++) {
+		if (wal_segment_open(s, seqs[i], 0) != 0
+			|| wal_replay_segment(s, wal_current(s), i == count - 1) != 0) {
+			free(seqs);
+			return -1;
+		}
+	}
+	free(seqs);
+
+	if (s->segments_count == 0)
+		return wal_segment_open(s, 1, 1);
+	wal_apply_trim(s);
+	return 0;
+}
+
+static struct wal_storage*
+wal_storage_new(int acceptor_id)
+{
+	struct wal_storage* s = calloc(1, sizeof(struct wal_storage));
+	s->acceptor_id = acceptor_id;
+	s->index = kh_init(wal_index);
+	return s;
+}
+
+static int
+wal_storage_open(void* handle)
+{
+	struct wal_storage* s = handle;
+	size_t len = strlen(paxos_config.wal_path) + 16;
+	struct stat sb;
+
+	wal_crc_init();
+	s->path = malloc(len);
+	snprintf(s->path, len, "%s_%d", paxos_config.wal_path, s->acceptor_id);
+
+	// Trash files -- testing only
+	if (paxos_config.trash_files) {
+		char rm_command[600];
+		snprintf(rm_command, sizeof(rm_command), "rm -rf %s", s->path);
+		system(rm_command);
+	}
+
+	if (stat(s->path, &sb) != 0 && mkdir(s->path, S_IRWXU) != 0) {
+		paxos_log_error("Failed to create wal dir %s: %s", s->path, strerror(errno));
+		return -1;
+	}
+	if (wal_storage_recover(s) != 0) {
+		paxos_log_error("Failed to recover wal at %s", s->path);
+		return -1;
+	}
+	gettimeofday(&s->synced, NULL);
+	paxos_log_info("wal storage opened successfully");
+	return 0;
+}
+
+static void
+wal_storage_close(void* handle)
+{
+	int i;
+	struct wal_storage* s = handle;
+
+	for (i = 0; i < s->segments_count; i++) {
+		if (i == s->segments_count - 1 && s->unsynced > 0)
+			fdatasync(s->segments[i].fd);
+		close(s->segments[i].fd);
+	}
+	kh_destroy_wal_index(s->index);
+	free(s->segments);
+	free(s->buffer);
+	free(s->undo);
+	free(s->scratch);
+	free(s->path);
+	free(s);
+}
+
+static int
+wal_storage_tx_begin(void* handle)
+{
+	struct wal_storage* s = handle;
+	s->buffer_len = 0;
+	s->undo_count = 0;
+	s->tx_trim_iid = s->trim_iid;
+	s->tx_max_iid = s->max_iid;
+	s->tx_watermark_iid = s->watermark_iid;
+	s->tx_watermark_ballot = s->watermark_ballot;
+	return 0;
+}
+
+static void wal_storage_tx_abort(void* handle);
+
+static int
+wal_storage_tx_commit(void* handle)
+{
+	struct wal_storage* s = handle;
+	struct wal_segment* seg = wal_current(s);
+	uint64_t size = seg->size;
+	int i;
+
+	if (s->broken) {
+		wal_storage_tx_abort(s);
+		return -1;
+	}
+	if (s->buffer_len > 0) {
+		if (wal_write(s) != 0) {
+			// Nothing of the transaction is left, as if it was aborted
+			wal_storage_tx_abort(s);
+			if (s->broken)
+				wal_leave_segment(s);
+			return -1;
+		}
+		if (wal_sync_due(s) && wal_sync(s) != 0) {
+			// The entries may not be on disk: cut them off and abort,
+			// unless they cannot be cut off, as they would then be
+			// replayed. They are kept, committed, and the wal is broken.
+			if (wal_cut(s, size) == 0) {
+				wal_storage_tx_abort(s);
+				return -1;
+			}
+		}
+		for (i = 0; i < s->undo_count; i++)
+			if (s->undo[i].iid > seg->max_iid)
+				seg->max_iid = s->undo[i].iid;
+	}
+	if (s->trim_iid != s->tx_trim_iid)
+		wal_apply_trim(s);
+	if (!s->broken && wal_current(s)->size >= paxos_config.wal_segment_size) {
+		if (wal_rotate(s) == 0 && wal_write(s) == 0)
+			return 0;
+		if (s->broken)
+			wal_leave_segment(s);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+wal_storage_tx_abort(void* handle)
+{
+	int i;
+	khiter_t k;
+	struct wal_storage* s = handle;
+
+	for (i = s->undo_count - 1; i >= 0; i--) {
+		struct wal_undo* u = &s->undo[i];
+		k = kh_get_wal_index(s->index, u->iid);
+		if (u->existed)
+			kh_value(s->index, k) = u->entry;
+		else
+			kh_del_wal_index(s->index, k);
+	}
+	s->undo_count = 0;
+	s->buffer_len = 0;
+	s->trim_iid = s->tx_trim_iid;
+	s->max_iid = s->tx_max_iid;
+	s->watermark_iid = s->tx_watermark_iid;
+	s->watermark_ballot = s->tx_watermark_ballot;
+}
+
+/*
+* Syncs the records committed since the last sync, so that a sync interval
+* bounds how long they stay unsynced even when no transaction follows.
+*/
+static int
+wal_storage_sync(void* handle)
+{
+	struct wal_storage* s = handle;
+	if (s->unsynced == 0 || s->broken)
+		return 0;
+	return wal_sync(s);
+}
+
+/*
+* Returns the payload of an indexed record, from the transaction buffer if
+* it was written by the current transaction, or read into the scratch
+* buffer otherwise.
+*/
+static char*
+wal_load(struct wal_storage* s, struct wal_entry* e)
+{
+	struct wal_segment* seg = wal_find_segment(s, e->segment);
+
+	if (seg == NULL)
+		return NULL;
+	if (seg == wal_current(s) && e->offset >= seg->size)
+		return s->buffer + (e->offset - seg->size);
+
+	if (e->length > s->scratch_cap) {
+		s->scratch_cap = e->length;
+		s->scratch = realloc(s->scratch, s->scratch_cap);
+	}
+	if (pread(seg->fd, s->scratch, e->length, e->offset) != e->length) {
+		paxos_log_error("wal read failed: %s", strerror(errno));
+		return NULL;
+	}
+	return s->scratch;
+}
+
+static int
+wal_storage_get(void* handle, iid_t iid, paxos_accepted* out)
+{
+	struct wal_storage* s = handle;
+	khiter_t k = kh_get_wal_index(s->index, iid);
+	char* payload;
+
+	if (k == kh_end(s->index))
+		return 0;
+	struct wal_entry e = kh_value(s->index, k);
+	if ((payload = wal_load(s, &e)) == NULL)
+		return 0;
+	return paxos_accepted_from_buffer(payload, e.length, out) == 0;
+}
+
+static int
+wal_storage_read(void* handle, iid_t iid, storage_read_cb cb, void* arg)
+{
+	struct wal_storage* s = handle;
+	khiter_t k = kh_get_wal_index(s->index, iid);
+	char* payload;
+
+	if (k == kh_end(s->index))
+		return 0;
+	struct wal_entry e = kh_value(s->index, k);
+	if ((payload = wal_load(s, &e)) == NULL
+		|| paxos_accepted_view_buffer(payload, e.length, &s->view) != 0)
+		return 0;
+	cb(&s->view.acc, arg);
+	return 1;
+}
+
+static int
+wal_storage_put(void* handle, paxos_accepted* acc)
+{
+	struct wal_storage* s = handle;
+	struct wal_entry e;
+	size_t len = paxos_accepted_buffer_size(acc);
+
+	paxos_accepted_write_buffer(acc, wal_append_begin(s, len));
+	e.segment = wal_current(s)->seq;
+	e.length = len;
+	e.offset = wal_append_end(s, WAL_RECORD, len);
+
+	wal_index_put(s, acc->iid, &e, 1);
+	if (acc->iid > s->max_iid)
+		s->max_iid = acc->iid;
+	return 0;
+}
+
+static int
+wal_storage_trim(void* handle, iid_t iid)
+{
+	struct wal_storage* s = handle;
+	if (iid <= s->trim_iid)
+		return 0;
+	s->trim_iid = iid;
+	wal_append(s, WAL_TRIM, (char*)&iid, sizeof(iid_t));
+	return 0;
+}
+
+static iid_t
+wal_storage_get_trim_instance(void* handle)
+{
+	struct wal_storage* s = handle;
+	return s->trim_iid;
+}
+
+static iid_t
+wal_storage_get_max_instance(void* handle)
+{
+	struct wal_storage* s = handle;
+	return s->max_iid;
+}
+
+static int
+wal_storage_get_watermark(void* handle, iid_t* from, ballot_t* ballot)
+{
+	struct wal_storage* s = handle;
+	if (s->watermark_iid == 0)
+		return 0;
+	*from = s->watermark_iid;
+	*ballot = s->watermark_ballot;
+	return 1;
+}
+
+static int
+wal_storage_put_watermark(void* handle, iid_t from, ballot_t ballot)
+{
+	struct wal_storage* s = handle;
+	uint32_t watermark[2] = { from, ballot };
+	s->watermark_iid = from;
+	s->watermark_ballot = ballot;
+	wal_append(s, WAL_WATERMARK, (char*)watermark, sizeof(watermark));
+	return 0;
+}
+
+void
+storage_init_wal(struct storage* s, int acceptor_id)
+{
+	s->handle = wal_storage_new(acceptor_id);
+	s->api.open = wal_storage_open;
+	s->api.close = wal_storage_close;
+	s->api.tx_begin = wal_storage_tx_begin;
+	s->api.tx_commit = wal_storage_tx_commit;
+	s->api.tx_abort = wal_storage_tx_abort;
+	s->api.get = wal_storage_get;
+	s->api.put = wal_storage_put;
+	s->api.update = NULL; // decoded and re-encoded by storage_update_record
+	s->api.read = wal_storage_read;
+	s->api.sync = wal_storage_sync;
+	s->api.trim = wal_storage_trim;
+	s->api.get_trim_instance = wal_storage_get_trim_instance;
+	s->api.get_max_instance = wal_storage_get_max_instance;
+	s->api.get_watermark = wal_storage_get_watermark;
+	s->api.put_watermark = wal_storage_put_watermark;
+}
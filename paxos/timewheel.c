@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "timewheel.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct timewheel
+{
+	uint64_t now;    /* last tick processed */
+	int count;       /* timers in the slots or in the expired list */
+	int expired_count;
+	struct wheel_timer expired;
+	struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+static void list_init(struct wheel_timer* head);
+static void list_append(struct wheel_timer* head, struct wheel_timer* t);
+static void list_unlink(struct wheel_timer* t);
+static void timewheel_insert(struct timewheel* w, struct wheel_timer* t);
+static void timewheel_cascade(struct timewheel* w, int level);
+
+struct timewheel* timewheel_new(uint64_t now)
+{
+	int i, j;
+	struct timewheel* w;
+	w = malloc(sizeof(struct timewheel));
+	assert(w != NULL);
+	w->now = now;
+	w->count = 0;
+	w->expired_count = 0;
+	list_init(&w->expired);
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		for (j = 0; j < WHEEL_SIZE; j++)
+			list_init(&w->slots[i][j]);
+	return w;
+}
+
+/**
+ * Frees the wheel. Timers still linked are left dangling: their owners
+ * are expected to be freed together with it.
+ */
+void timewheel_free(struct timewheel* w)
+{
+	free(w);
+}
+
+int timewheel_count(struct timewheel* w)
+{
+	return w->count;
+}
+
+void timer_init(struct wheel_timer* t, void* data)
+{
+	t->next = t->prev = NULL;
+	t->expires = 0;
+	t->expired = 0;
+	t->data = data;
+}
+
+/**
+ * @return 1 if the timer is scheduled or expired and not drained yet.
+ */
+int timer_pending(struct wheel_timer* t)
+{
+	return t->next != NULL;
+}
+
+/**
+ * Schedules (or reschedules) a timer. An expiry not after the last
+ * processed tick fires on the next one.
+ *
+ * @param w The wheel.
+ * @param t The timer, initialized with timer_init().
+ * @param expires Expiry time in ms.
+ */
+void timewheel_schedule(struct timewheel* w, struct wheel_timer* t, uint64_t expires)
+{
+	if (timer_pending(t))
+		timewheel_cancel(w, t);
+	if (expires <= w->now)
+		expires = w->now + 1;
+	if (expires - w->now >= WHEEL_SPAN)
+		expires = w->now + WHEEL_SPAN - 1;
+	t->expires = expires;
+	timewheel_insert(w, t);
+	w->count++;
+}
+
+void timewheel_cancel(struct timewheel* w, struct wheel_timer* t)
+{
+	if (!timer_pending(t))
+		return;
+	if (t->expired)
+		w->expired_count--;
+	list_unlink(t);
+	w->count--;
+}
+
+/**
+ * Processes every tick up to now, moving the timers that expired to the
+ * expired list.
+ *
+ * @param w The wheel.
+ * @param now Current time in ms.
+ * @return The number of timers in the expired list.
+ */
+int timewheel_advance(struct timewheel* w, uint64_t now)
+{
+	int level;
+	struct wheel_timer* t;
+	struct wheel_timer* head;
+
+	// Nothing to fire, skip the idle ticks
+	if (w->count == w->expired_count && now > w->now) {
+		w->now = now;
+		return w->expired_count;
+	}
+
+	while (w->now < now) {
+		w->now++;
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			if ((w->now >> (WHEEL_BITS * level - WHEEL_BITS)) & WHEEL_MASK)
+				break;
+			timewheel_cascade(w, level);
+		}
+		head = &w->slots[0][w->now & WHEEL_MASK];
+		while (head->next != head) {
+			t = head->next;
+			list_unlink(t);
+			list_append(&w->expired, t);
+			t->expired = 1;
+			w->expired_count++;
+		}
+	}
+	return w->expired_count;
+}
+
+/**
+ * Removes the first timer from the expired list.
+ *
+ * @return The timer, or NULL if none expired.
+ */
+struct wheel_timer* timewheel_next_expired(struct timewheel* w)
+{
+	struct wheel_timer* t = w->expired.next;
+	if (t == &w->expired)
+		return NULL;
+	list_unlink(t);
+	w->count--;
+	w->expired_count--;
+	return t;
+}
+
+/**
+ * @return A monotonic time in ms, suitable as the wheel's clock.
+ */
+uint64_t timewheel_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Links a timer in the slot of the lowest level whose span covers its
+ * expiry. A timer cascaded on its expiry tick lands in the level 0 slot
+ * about to be fired.
+ */
+static void timewheel_insert(struct timewheel* w, struct wheel_timer* t)
+{
+	int level;
+	uint64_t delta = t->expires - w->now;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < ((uint64_t)1 << (WHEEL_BITS * (level + 1))))
+			break;
+	list_append(&w->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+}
+
+/*
+ * Moves the timers of the current slot of a level down to lower levels.
+ */
+static void timewheel_cascade(struct timewheel* w, int level)
+{
+	struct wheel_timer* t;
+	struct wheel_timer* head;
+	head = &w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	while (head->next != head) {
+		t = head->next;
+		list_unlink(t);
+		timewheel_insert(w, t);
+	}
+}
+
+static void list_init(struct wheel_timer* head)
+{
+	head->next = head->prev = head;
+}
+
+static void list_append(struct wheel_timer* head, struct wheel_timer* t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static void list_unlink(struct wheel_timer* t)
+{
+	t->expired = 0;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "valuebatch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define VALUE_BATCH_MAGIC 0x50584231 /* "PXB1" */
+#define VALUE_BATCH_HEADER 8
+
+static void put_u32(char* p, uint32_t v);
+static uint32_t get_u32(const char* p);
+
+void value_batch_init(struct value_batch* b)
+{
+	b->buf = NULL;
+	b->len = 0;
+	b->cap = 0;
+	b->count = 0;
+}
+
+void value_batch_destroy(struct value_batch* b)
+{
+	free(b->buf);
+	value_batch_init(b);
+}
+
+int value_batch_count(struct value_batch* b)
+{
+	return b->count;
+}
+
+/**
+ * @return The size in bytes the batch would have if sealed now.
+ */
+size_t value_batch_size(struct value_batch* b)
+{
+	return b->count == 0 ? 0 : b->len;
+}
+
+/**
+ * Appends a copy of value to the batch.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int value_batch_append(struct value_batch* b, const char* value, size_t size)
+{
+	size_t need = (b->count == 0 ? VALUE_BATCH_HEADER : b->len) + 4 + size;
+
+	if (need > b->cap) {
+		size_t cap = b->cap > 0 ? b->cap : 256;
+		while (cap < need)
+			cap *= 2;
+		char* buf = realloc(b->buf, cap);
+		if (buf == NULL)
+			return -1;
+		b->buf = buf;
+		b->cap = cap;
+	}
+
+	if (b->count == 0) {
+		put_u32(b->buf, VALUE_BATCH_MAGIC);
+		b->len = VALUE_BATCH_HEADER;
+	}
+	put_u32(b->buf + b->len, size);
+	memcpy(b->buf + b->len + 4, value, size);
+	b->len += 4 + size;
+	b->count++;
+	put_u32(b->buf + 4, b->count);
+	return 0;
+}
+
+/**
+ * Hands the packed values over as a single paxos value, flagged as a
+ * batch, and empties the batch.
+ *
+ * @return The paxos value, NULL if the batch is empty.
+ */
+paxos_value* value_batch_seal(struct value_batch* b)
+{
+	paxos_value* v;
+
+	if (b->count == 0)
+		return NULL;
+
+	v = malloc(sizeof(paxos_value));
+	assert(v != NULL);
+	v->paxos_value_len = b->len;
+	v->paxos_value_val = b->buf;
+	v->paxos_value_flags = PAXOS_VALUE_BATCH;
+	value_batch_init(b);
+	return v;
+}
+
+/**
+ * Calls cb on each value packed in a batch. The whole framing is checked
+ * before cb is called, so that a value that merely starts like a batch is
+ * rejected as a whole.
+ *
+ * @param value The paxos value to unpack.
+ * @param size Its size in bytes.
+ * @return The number of values in the batch, -1 if value is not a batch.
+ */
+int value_batch_foreach(const char* value, size_t size, value_batch_cb cb, void* arg)
+{
+	uint32_t i, count, len;
+	size_t off = VALUE_BATCH_HEADER;
+
+	if (size < VALUE_BATCH_HEADER || get_u32(value) != VALUE_BATCH_MAGIC)
+		return -1;
+
+	count = get_u32(value + 4);
+	for (i = 0; i < count; i++) {
+		if (size - off < 4)
+			return -1;
+		len = get_u32(value + off);
+		if (size - off - 4 < len)
+			return -1;
+		off += 4 + len;
+	}
+	if (count == 0 || off != size)
+		return -1;
+
+	for (off = VALUE_BATCH_HEADER, i = 0; i < count; i++) {
+		len = get_u32(value + off);
+		cb(value + off + 4, len, arg);
+		off += 4 + len;
+	}
+	return count;
+}
+
+static void put_u32(char* p, uint32_t v)
+{
+	p[0] = (char)(v >> 24);
+	p[1] = (char)(v >> 16);
+	p[2] = (char)(v >> 8);
+	p[3] = (char)v;
+}
+
+static uint32_t get_u32(const char* p)
+{
+	const unsigned char* u = (const unsigned char*)p;
+	return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
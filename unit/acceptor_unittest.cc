@@ -27,8 +27,10 @@
 
 
 #include "acceptor.h"
+#include "aidset.h"
 #include "gtest/gtest.h"
 #include <stdio.h>
+#include <vector>
 
 class AcceptorTest : public::testing::TestWithParam<paxos_storage_backend> {
 protected:
@@ -192,6 +194,131 @@ TEST_P(AcceptorTest, PrepareWithAcceptedValue) {
 	counter++;
 }
 
+TEST_P(AcceptorTest, PrepareRange) {
+	paxos_message msg;
+	paxos_prepare_range pr = {0, 1, 32, 101};
+	ASSERT_TRUE(acceptor_receive_prepare_range(-1, a, &pr, &msg));
+	ASSERT_EQ(msg.type, PAXOS_PROMISE_RANGE);
+	ASSERT_EQ(msg.u.promise_range.aid, id);
+	ASSERT_EQ(msg.u.promise_range.from_iid, 1);
+	ASSERT_EQ(msg.u.promise_range.to_iid, 32);
+	ASSERT_EQ(msg.u.promise_range.ballot, 101);
+	ASSERT_EQ(msg.u.promise_range.n_values, 0);
+	paxos_message_destroy(&msg);
+
+	// every instance of the range is now promised
+	paxos_accept ar = {0, 16, 99, {4, (char*)"foo"}};
+	acceptor_receive_accept(a, &ar, &msg);
+	CHECK_PREEMPTED(msg, 16, 101);
+}
+
+TEST_P(AcceptorTest, PrepareRangeWithAcceptedValue) {
+	paxos_message msg;
+	paxos_accept ar = {0, 5, 101, {4, (char*)"bar"}};
+	acceptor_receive_accept(a, &ar, &msg);
+	paxos_message_destroy(&msg);
+
+	paxos_prepare_range pr = {0, 1, 10, 201};
+	ASSERT_TRUE(acceptor_receive_prepare_range(-1, a, &pr, &msg));
+	ASSERT_EQ(msg.u.promise_range.ballot, 201);
+	ASSERT_EQ(msg.u.promise_range.n_values, 1);
+	ASSERT_EQ(msg.u.promise_range.iids[0], 5);
+	ASSERT_EQ(msg.u.promise_range.value_ballots[0], 101);
+	ASSERT_STREQ(msg.u.promise_range.values[0].paxos_value_val, "bar");
+	paxos_message_destroy(&msg);
+}
+
+TEST_P(AcceptorTest, PrepareRangePreempted) {
+	paxos_message msg;
+	paxos_prepare pre = {0, 3, 301};
+	acceptor_receive_prepare(-1, a, &pre, &msg);
+	paxos_message_destroy(&msg);
+
+	paxos_prepare_range pr = {0, 1, 5, 201};
+	ASSERT_TRUE(acceptor_receive_prepare_range(-1, a, &pr, &msg));
+	ASSERT_EQ(msg.u.promise_range.ballot, 301);
+	paxos_message_destroy(&msg);
+}
+
+TEST_P(AcceptorTest, PrepareFrom) {
+	paxos_message msg;
+	paxos_prepare_range pr = {0, 10, 0, 101};
+	ASSERT_TRUE(acceptor_receive_prepare_range(-1, a, &pr, &msg));
+	ASSERT_EQ(msg.type, PAXOS_PROMISE_RANGE);
+	ASSERT_EQ(msg.u.promise_range.from_iid, 10);
+	ASSERT_EQ(msg.u.promise_range.to_iid, 0);
+	ASSERT_EQ(msg.u.promise_range.ballot, 101);
+	paxos_message_destroy(&msg);
+
+	// any instance from 10 on is promised, without a record of its own
+	paxos_accept ar = {0, 5000, 99, {4, (char*)"foo"}};
+	acceptor_receive_accept(a, &ar, &msg);
+	CHECK_PREEMPTED(msg, 5000, 101);
+
+	paxos_prepare p = {0, 20, 100};
+	acceptor_receive_prepare(-1, a, &p, &msg);
+	CHECK_PROMISE(msg, 20, 101, 0, NULL);
+	paxos_message_destroy(&msg);
+
+	ar.ballot = 101;
+	acceptor_receive_accept(a, &ar, &msg);
+	CHECK_ACCEPTED(msg, 5000, 101, 101, "foo");
+	paxos_message_destroy(&msg);
+
+	// instances below the watermark are not affected
+	ar = (paxos_accept) {0, 9, 1, {4, (char*)"bar"}};
+	acceptor_receive_accept(a, &ar, &msg);
+	CHECK_ACCEPTED(msg, 9, 1, 1, "bar");
+	paxos_message_destroy(&msg);
+}
+
+TEST_P(AcceptorTest, PrepareFromWithAcceptedValue) {
+	paxos_message msg;
+	paxos_accept ar = {0, 7, 101, {4, (char*)"bar"}};
+	acceptor_receive_accept(a, &ar, &msg);
+	paxos_message_destroy(&msg);
+
+	paxos_prepare_range pr = {0, 1, 0, 201};
+	ASSERT_TRUE(acceptor_receive_prepare_range(-1, a, &pr, &msg));
+	ASSERT_EQ(msg.u.promise_range.ballot, 201);
+	ASSERT_EQ(msg.u.promise_range.n_values, 1);
+	ASSERT_EQ(msg.u.promise_range.iids[0], 7);
+	ASSERT_EQ(msg.u.promise_range.value_ballots[0], 101);
+	ASSERT_STREQ(msg.u.promise_range.values[0].paxos_value_val, "bar");
+	paxos_message_destroy(&msg);
+}
+
+TEST_P(AcceptorTest, PrepareFromPreempted) {
+	paxos_message msg;
+	paxos_prepare_range pr = {0, 1, 0, 201};
+	ASSERT_TRUE(acceptor_receive_prepare_range(-1, a, &pr, &msg));
+	paxos_message_destroy(&msg);
+
+	// a lower leader ballot is refused, even from a higher iid
+	pr = (paxos_prepare_range) {0, 50, 0, 101};
+	ASSERT_TRUE(acceptor_receive_prepare_range(-1, a, &pr, &msg));
+	ASSERT_EQ(msg.u.promise_range.ballot, 201);
+	paxos_message_destroy(&msg);
+
+	// and so is a leader behind an instance promised to a higher ballot
+	paxos_prepare p = {0, 60, 301};
+	acceptor_receive_prepare(-1, a, &p, &msg);
+	paxos_message_destroy(&msg);
+	pr = (paxos_prepare_range) {0, 50, 0, 251};
+	ASSERT_TRUE(acceptor_receive_prepare_range(-1, a, &pr, &msg));
+	ASSERT_EQ(msg.u.promise_range.ballot, 301);
+	ASSERT_EQ(msg.u.promise_range.n_values, 0);
+	paxos_message_destroy(&msg);
+
+	paxos_accept ar = {0, 55, 151, {4, (char*)"foo"}};
+	acceptor_receive_accept(a, &ar, &msg);
+	CHECK_PREEMPTED(msg, 55, 201);
+	ar.ballot = 201;
+	acceptor_receive_accept(a, &ar, &msg);
+	CHECK_ACCEPTED(msg, 55, 201, 201, "foo");
+	paxos_message_destroy(&msg);
+}
+
 TEST_P(AcceptorTest, Repeat) {
 	paxos_message msg;
 	paxos_accepted acc;
@@ -220,6 +347,223 @@ TEST_P(AcceptorTest, RepeatPrepared) {
 	counter++;
 }
 
+static void collect_repeated(paxos_accepted* acc, void* arg)
+{
+	std::vector<iid_t>* iids = (std::vector<iid_t>*)arg;
+	iids->push_back(acc->iid);
+}
+
+TEST_P(AcceptorTest, RepeatRange) {
+	paxos_message msg;
+	std::vector<iid_t> iids;
+	paxos_repeat rep = {1, 10};
+
+	for (int i = 1; i <= 10; ++i) {
+		if (i % 3 == 0)
+			continue;
+		paxos_accept ar = {0, (uint32_t)i, 101, {4, (char*)"foo"}};
+		ASSERT_TRUE(acceptor_receive_accept(a, &ar, &msg));
+		paxos_message_destroy(&msg);
+	}
+
+	ASSERT_EQ(7, acceptor_receive_repeat_range(a, &rep, collect_repeated, &iids));
+	ASSERT_EQ(7, (int)iids.size());
+	ASSERT_EQ(1, iids[0]);
+	ASSERT_EQ(4, iids[2]);
+	ASSERT_EQ(10, iids[6]);
+	counter++;
+}
+
+TEST_P(AcceptorTest, Batch) {
+	paxos_message msg;
+	paxos_accepted acc;
+
+	ASSERT_EQ(acceptor_batch_begin(a), 0);
+	for (int i = 1; i <= 10; ++i) {
+		paxos_prepare pr = {0, (uint32_t)i, 101};
+		paxos_accept ar = {0, (uint32_t)i, 101, {4, (char*)"foo"}};
+		ASSERT_TRUE(acceptor_receive_prepare(-1, a, &pr, &msg));
+		CHECK_PROMISE(msg, i, 101, 0, NULL);
+		paxos_message_destroy(&msg);
+		ASSERT_TRUE(acceptor_receive_accept(a, &ar, &msg));
+		CHECK_ACCEPTED(msg, i, 101, 101, "foo");
+		paxos_message_destroy(&msg);
+	}
+	ASSERT_EQ(acceptor_batch_commit(a), 0);
+
+	for (int i = 1; i <= 10; ++i) {
+		ASSERT_TRUE(acceptor_receive_repeat(a, i, &acc));
+		ASSERT_EQ(acc.ballots[0], 101);
+		paxos_accepted_destroy(&acc);
+	}
+}
+
+TEST_P(AcceptorTest, BatchCommitWithoutBegin) {
+	ASSERT_EQ(acceptor_batch_commit(a), 0);
+	ASSERT_EQ(acceptor_batch_begin(a), 0);
+	ASSERT_EQ(acceptor_batch_commit(a), 0);
+}
+
+static paxos_accepted SubordinateAccepted(uint32_t iid, uint32_t* aid, uint32_t* ballot,
+	paxos_value* value)
+{
+	return (paxos_accepted) {0, iid, *ballot, *ballot, 1, aid, {0, NULL}, value, ballot, ballot};
+}
+
+TEST_P(AcceptorTest, AggregateAccepted) {
+	paxos_message msg;
+	paxos_aidset subtree;
+	paxos_accept ar = {0, 1, 101, {4, (char*)"foo"}};
+	uint32_t aids[] = {3, 4, 5, 7}, ballot = 101;
+	paxos_value value = {4, (char*)"foo"};
+
+	aidset_from_aids(&subtree, aids, 3);
+	setsubordinates(a, 3);
+	setsubtree(a, &subtree);
+	setacceptors(a, 8);
+	acceptor_receive_accept(a, &ar, &msg);
+	paxos_message_destroy(&msg);
+
+	paxos_accepted ac = SubordinateAccepted(1, &aids[0], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+	ac = SubordinateAccepted(1, &aids[3], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+	ac = SubordinateAccepted(1, &aids[0], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+
+	ac = SubordinateAccepted(1, &aids[1], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), 0);
+	ASSERT_EQ(msg.type, PAXOS_ACCEPTED);
+	ASSERT_EQ(msg.u.accepted.iid, 1);
+	ASSERT_EQ(msg.u.accepted.n_aids, 2);
+	ASSERT_EQ(msg.u.accepted.aids[0], 3);
+	ASSERT_EQ(msg.u.accepted.aids[1], 4);
+	ASSERT_EQ(msg.u.accepted.ballots[1], 101);
+	ASSERT_STREQ(msg.u.accepted.values[0].paxos_value_val, "foo");
+	paxos_message_destroy(&msg);
+
+	// the rest of the subtree is absorbed
+	ac = SubordinateAccepted(1, &aids[2], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+}
+
+TEST_P(AcceptorTest, AggregateAcceptedHigherBallot) {
+	paxos_message msg;
+	paxos_aidset subtree;
+	paxos_accept ar = {0, 1, 101, {4, (char*)"foo"}};
+	uint32_t aids[] = {3, 4, 5}, ballot = 101, higher = 201;
+	paxos_value value = {4, (char*)"foo"};
+
+	aidset_from_aids(&subtree, aids, 3);
+	setsubordinates(a, 3);
+	setsubtree(a, &subtree);
+	acceptor_receive_accept(a, &ar, &msg);
+	paxos_message_destroy(&msg);
+
+	paxos_accepted ac = SubordinateAccepted(1, &aids[0], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+	ac = SubordinateAccepted(1, &aids[1], &higher, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+	ac = SubordinateAccepted(1, &aids[0], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+	ac = SubordinateAccepted(1, &aids[2], &higher, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), 0);
+	ASSERT_EQ(msg.u.accepted.n_aids, 2);
+	ASSERT_EQ(msg.u.accepted.ballots[0], 201);
+	paxos_message_destroy(&msg);
+}
+
+TEST_P(AcceptorTest, AggregateDroppedOnceSubtreeAccepted) {
+	paxos_message msg;
+	paxos_aidset subtree;
+	paxos_accept ar = {0, 1, 101, {4, (char*)"foo"}};
+	uint32_t aids[] = {3, 4, 5}, ballot = 101;
+	paxos_value value = {4, (char*)"foo"};
+
+	aidset_from_aids(&subtree, aids, 3);
+	setsubordinates(a, 3);
+	setsubtree(a, &subtree);
+	acceptor_receive_accept(a, &ar, &msg);
+	paxos_message_destroy(&msg);
+
+	paxos_accepted ac = SubordinateAccepted(1, &aids[0], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+	ac = SubordinateAccepted(1, &aids[1], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), 0);
+	paxos_message_destroy(&msg);
+	ASSERT_EQ(acceptor_aggregate_count(a), 1);
+
+	// the last of the subtree is absorbed, and nothing is left to wait for
+	ac = SubordinateAccepted(1, &aids[2], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+	ASSERT_EQ(acceptor_aggregate_count(a), 0);
+}
+
+TEST_P(AcceptorTest, AggregateForwardedWithoutRecord) {
+	paxos_message msg;
+	paxos_aidset subtree;
+	uint32_t aids[] = {3, 4, 5, 7}, ballot = 101;
+	paxos_value value = {4, (char*)"foo"};
+
+	aidset_from_aids(&subtree, aids, 3);
+	setsubordinates(a, 3);
+	setsubtree(a, &subtree);
+
+	// the accept did not reach this acceptor: forward to the subordinate's node
+	paxos_accepted ac = SubordinateAccepted(1, &aids[0], &ballot, &value);
+	ac.src = 6;
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), 6);
+	ASSERT_EQ(msg.type, PAXOS_ACCEPTED);
+	ASSERT_EQ(msg.u.accepted.iid, 1);
+	ASSERT_EQ(msg.u.accepted.n_aids, 1);
+	ASSERT_EQ(msg.u.accepted.aids[0], 3);
+	ASSERT_EQ(msg.u.accepted.ballots[0], 101);
+	ASSERT_STREQ(msg.u.accepted.values[0].paxos_value_val, "foo");
+	ASSERT_NE(msg.u.accepted.values[0].paxos_value_val, value.paxos_value_val);
+	paxos_message_destroy(&msg);
+	ASSERT_EQ(acceptor_aggregate_count(a), 0);
+
+	ac = SubordinateAccepted(1, &aids[3], &ballot, &value);
+	ASSERT_EQ(acceptor_aggregate_accepted(&ac, a, &msg), -1);
+}
+
+static paxos_promise SubordinatePromise(uint32_t iid, uint32_t* aid, uint32_t* ballot,
+	uint32_t* value_ballot)
+{
+	return (paxos_promise) {0, iid, *ballot, *value_ballot, 1, aid, {0, NULL}, NULL,
+		ballot, value_ballot};
+}
+
+TEST_P(AcceptorTest, PromiseQuorumAfterHigherPrepare) {
+	paxos_message msg;
+	paxos_accept ar = {0, 1, 101, {4, (char*)"foo"}};
+	paxos_prepare pr = {0, 1, 201};
+	uint32_t aids[] = {3, 4}, ballot = 201, higher = 301, vballot = 0;
+
+	setsubordinates(a, 4);
+	setacceptors(a, 8);
+	acceptor_receive_accept(a, &ar, &msg);
+	paxos_message_destroy(&msg);
+	acceptor_receive_prepare(7, a, &pr, &msg);
+	CHECK_PROMISE(msg, 1, 201, 101, "foo");
+	paxos_message_destroy(&msg);
+
+	paxos_promise p = SubordinatePromise(1, &aids[0], &ballot, &vballot);
+	ASSERT_EQ(get_srcid_promise_and_adjust(&p, a), 7);
+
+	// the subordinates must promise the higher ballot again
+	pr = (paxos_prepare) {0, 1, 301};
+	acceptor_receive_prepare(7, a, &pr, &msg);
+	CHECK_PROMISE(msg, 1, 301, 101, "foo");
+	ASSERT_EQ(msg.u.promise.n_aids, 1);
+	paxos_message_destroy(&msg);
+
+	p = SubordinatePromise(1, &aids[1], &ballot, &vballot);
+	ASSERT_EQ(get_srcid_promise_and_adjust(&p, a), -1);
+	p = SubordinatePromise(1, &aids[0], &higher, &vballot);
+	ASSERT_EQ(get_srcid_promise_and_adjust(&p, a), 7);
+}
+
 TEST_P(AcceptorTest, TrimmedInstances) {
 	paxos_message msg;
 
@@ -267,6 +611,7 @@ const paxos_storage_backend backends[] = {
 #if HAS_LMDB
 	PAXOS_LMDB_STORAGE,
 #endif
+	PAXOS_WAL_STORAGE,
 };
 
 INSTANTIATE_TEST_CASE_P(StorageBackends, AcceptorTest, 
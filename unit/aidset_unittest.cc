@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "aidset.h"
+#include "paxos.h"
+#include "gtest/gtest.h"
+
+TEST(AidsetTest, AddAndContains) {
+	paxos_aidset s;
+	aidset_clear(&s);
+	ASSERT_EQ(aidset_count(&s), 0);
+	ASSERT_EQ(aidset_add(&s, 3), 1);
+	ASSERT_EQ(aidset_add(&s, 3), 0);
+	ASSERT_EQ(aidset_add(&s, 64), 1);
+	ASSERT_EQ(aidset_add(&s, PAXOS_MAX_ACCEPTORS), -1);
+	ASSERT_TRUE(aidset_contains(&s, 3));
+	ASSERT_TRUE(aidset_contains(&s, 64));
+	ASSERT_FALSE(aidset_contains(&s, 4));
+	ASSERT_EQ(aidset_count(&s), 2);
+}
+
+TEST(AidsetTest, Or) {
+	paxos_aidset a, b;
+	uint32_t aids[] = {1, 2, 100};
+	aidset_from_aids(&a, aids, 2);
+	aidset_from_aids(&b, aids + 1, 2);
+	aidset_or(&a, &b);
+	ASSERT_EQ(aidset_count(&a), 3);
+	ASSERT_TRUE(aidset_contains(&a, 100));
+}
+
+TEST(AidsetTest, AddAidReservesOnce) {
+	paxos_accepted acc;
+	memset(&acc, 0, sizeof(paxos_accepted));
+	ASSERT_EQ(paxos_accepted_add_aid(&acc, 5, 11, 0, 15), 1);
+	uint32_t* aids = acc.aids;
+	for (int i = 0; i < 15; i++)
+		paxos_accepted_add_aid(&acc, i, 11, 0, 15);
+	ASSERT_EQ(acc.n_aids, 15);
+	ASSERT_EQ(acc.aids_cap, 15);
+	ASSERT_EQ(acc.aids, aids);
+	ASSERT_EQ(acc.aids[0], 5);
+	ASSERT_EQ(acc.ballots[14], 11);
+	paxos_accepted_destroy(&acc);
+}
+
+TEST(AidsetTest, MergeSkipsKnownAids) {
+	paxos_accepted dst, src;
+	memset(&dst, 0, sizeof(paxos_accepted));
+	memset(&src, 0, sizeof(paxos_accepted));
+	paxos_accepted_add_aid(&dst, 1, 10, 0, 4);
+	paxos_accepted_add_aid(&src, 1, 10, 0, 4);
+	paxos_accepted_add_aid(&src, 2, 20, 5, 4);
+	ASSERT_EQ(paxos_accepted_merge(&dst, &src, 4), 1);
+	ASSERT_EQ(paxos_accepted_merge(&dst, &src, 4), 0);
+	ASSERT_EQ(dst.n_aids, 2);
+	ASSERT_EQ(dst.aids[1], 2);
+	ASSERT_EQ(dst.ballots[1], 20);
+	ASSERT_EQ(dst.value_ballots[1], 5);
+	paxos_accepted_destroy(&dst);
+	paxos_accepted_destroy(&src);
+}
+
+TEST(AidsetTest, MergePromiseWithoutBitmap) {
+	uint32_t aids[] = {7, 8};
+	uint32_t ballots[] = {3, 3};
+	paxos_promise pr = (paxos_promise) {0, 1, 3, 0, 2, aids, {0, NULL}, NULL, ballots, NULL};
+	paxos_accepted dst;
+	memset(&dst, 0, sizeof(paxos_accepted));
+	paxos_accepted_add_aid(&dst, 8, 3, 0, 0);
+	ASSERT_EQ(paxos_accepted_merge_promise(&dst, &pr, 0), 1);
+	ASSERT_EQ(dst.n_aids, 2);
+	ASSERT_EQ(dst.aids[1], 7);
+	ASSERT_TRUE(aidset_contains(&dst.aidset, 7));
+	paxos_accepted_destroy(&dst);
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "evpaxos.h"
+#include "peers.h"
+#include "valuebatch.h"
+#include "gtest/gtest.h"
+#include <event2/event.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#define LEARNER_CONFIG "config/learner.conf"
+
+struct Delivery
+{
+	unsigned int iid;
+	std::string value;
+};
+
+static void CountClient(struct peer* p, void* arg)
+{
+	(*(int*)arg)++;
+}
+
+class EvlearnerTest : public testing::Test {
+protected:
+
+	struct event_base* base;
+	struct evpaxos_config* config;
+	struct peers* acceptor;
+	struct evlearner* learner;
+	std::vector<Delivery> delivered;
+	std::vector<int> calls;
+
+	virtual void SetUp() {
+		paxos_config.verbosity = PAXOS_LOG_QUIET;
+		base = event_base_new();
+		config = evpaxos_config_read(LEARNER_CONFIG);
+		ASSERT_TRUE(config != NULL);
+		// A single acceptor, played by the test, closes instances alone
+		acceptor = peers_new(base, config);
+		ASSERT_TRUE(peers_listen(acceptor,
+			evpaxos_acceptor_listen_port(config, 0)));
+		learner = NULL;
+	}
+
+	virtual void TearDown() {
+		if (learner != NULL)
+			evlearner_free(learner);
+		peers_free(acceptor);
+		evpaxos_config_free(config);
+		event_base_free(base);
+	}
+
+	// The learner checks for holes every 100ms, the loop never blocks longer
+	void WaitConnected() {
+		int clients = 0;
+		time_t deadline = time(NULL) + 5;
+		while (clients == 0 && time(NULL) < deadline) {
+			event_base_loop(base, EVLOOP_ONCE);
+			peers_foreach_client(acceptor, CountClient, &clients);
+		}
+		ASSERT_EQ(clients, 1);
+	}
+
+	void WaitDeliveries(size_t count) {
+		time_t deadline = time(NULL) + 5;
+		while (delivered.size() < count && time(NULL) < deadline)
+			event_base_loop(base, EVLOOP_ONCE);
+	}
+
+	void SendAccepted(unsigned int iid, const char* value, size_t size,
+		uint32_t flags = 0) {
+		paxos_message msg;
+		uint32_t aid = 0, ballot = 101;
+		paxos_value v = {(int)size, (char*)value, flags};
+		memset(&msg, 0, sizeof(paxos_message));
+		msg.type = PAXOS_ACCEPTED;
+		msg.u.accepted.iid = iid;
+		msg.u.accepted.n_aids = 1;
+		msg.u.accepted.aids = &aid;
+		msg.u.accepted.ballots = &ballot;
+		msg.u.accepted.value_ballots = &ballot;
+		msg.u.accepted.values = &v;
+		peers_broadcast_clients(acceptor, &msg);
+	}
+
+	static void DeliverBatch(struct evpaxos_delivery* values, int count, void* arg) {
+		EvlearnerTest* t = (EvlearnerTest*)arg;
+		t->calls.push_back(count);
+		for (int i = 0; i < count; i++) {
+			Delivery d = {values[i].iid, std::string(values[i].value, values[i].size)};
+			t->delivered.push_back(d);
+		}
+	}
+
+	static void Deliver(unsigned iid, char* value, size_t size, void* arg) {
+		EvlearnerTest* t = (EvlearnerTest*)arg;
+		t->calls.push_back(1);
+		Delivery d = {iid, std::string(value, size)};
+		t->delivered.push_back(d);
+	}
+
+	// Closes instances 1 to 3 with a single message: 2 and 3 wait for 1
+	void SendBatchedInstances() {
+		struct value_batch b;
+		value_batch_init(&b);
+		value_batch_append(&b, "b", 1);
+		value_batch_append(&b, "cc", 2);
+		paxos_value* v = value_batch_seal(&b);
+		SendAccepted(2, v->paxos_value_val, v->paxos_value_len,
+			v->paxos_value_flags);
+		SendAccepted(3, "d", 1);
+		SendAccepted(1, "a", 1);
+		paxos_value_free(v);
+	}
+
+	void CheckBatchedInstances() {
+		ASSERT_EQ(delivered.size(), 4);
+		ASSERT_EQ(delivered[0].iid, 1);
+		ASSERT_EQ(delivered[0].value, "a");
+		ASSERT_EQ(delivered[1].iid, 2);
+		ASSERT_EQ(delivered[1].value, "b");
+		ASSERT_EQ(delivered[2].iid, 2);
+		ASSERT_EQ(delivered[2].value, "cc");
+		ASSERT_EQ(delivered[3].iid, 3);
+		ASSERT_EQ(delivered[3].value, "d");
+	}
+};
+
+TEST_F(EvlearnerTest, DeliverClosedRangeAsOneBatch) {
+	learner = evlearner_init_batch(LEARNER_CONFIG, DeliverBatch, this, base);
+	ASSERT_TRUE(learner != NULL);
+	WaitConnected();
+	SendBatchedInstances();
+	WaitDeliveries(4);
+	CheckBatchedInstances();
+	ASSERT_EQ(calls.size(), 1);
+	ASSERT_EQ(calls[0], 4);
+}
+
+TEST_F(EvlearnerTest, DeliverEachValueInOrder) {
+	learner = evlearner_init(LEARNER_CONFIG, Deliver, this, base);
+	ASSERT_TRUE(learner != NULL);
+	WaitConnected();
+	SendBatchedInstances();
+	WaitDeliveries(4);
+	CheckBatchedInstances();
+	ASSERT_EQ(calls.size(), 4);
+}
+
+TEST_F(EvlearnerTest, KeepValuesNotFlaggedAsBatch) {
+	learner = evlearner_init(LEARNER_CONFIG, Deliver, this, base);
+	ASSERT_TRUE(learner != NULL);
+	WaitConnected();
+
+	// A client value that happens to look like a batch
+	struct value_batch b;
+	value_batch_init(&b);
+	value_batch_append(&b, "b", 1);
+	value_batch_append(&b, "cc", 2);
+	paxos_value* v = value_batch_seal(&b);
+	SendAccepted(1, v->paxos_value_val, v->paxos_value_len);
+	WaitDeliveries(1);
+	ASSERT_EQ(delivered.size(), 1);
+	ASSERT_EQ(delivered[0].iid, 1);
+	ASSERT_EQ(delivered[0].value, std::string(v->paxos_value_val, v->paxos_value_len));
+	paxos_value_free(v);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "iidring.h"
+#include "gtest/gtest.h"
+
+static int values[1024];
+
+static void Count(void* p, void* arg)
+{
+	(*(int*)arg)++;
+}
+
+TEST(IidringTest, PutGetDel) {
+	struct iidring* r = iidring_new(4);
+	ASSERT_EQ(iidring_first(r), (void*)NULL);
+	ASSERT_EQ(iidring_put(r, 10, &values[10]), 0);
+	ASSERT_EQ(iidring_put(r, 10, &values[10]), -1);
+	ASSERT_EQ(iidring_put(r, 12, &values[12]), 0);
+	ASSERT_EQ(iidring_get(r, 10), &values[10]);
+	ASSERT_EQ(iidring_get(r, 11), (void*)NULL);
+	ASSERT_EQ(iidring_get(r, 14), (void*)NULL);
+	ASSERT_EQ(iidring_del(r, 10), &values[10]);
+	ASSERT_EQ(iidring_first(r), &values[12]);
+	ASSERT_EQ(iidring_count(r), 1);
+	iidring_free(r);
+}
+
+TEST(IidringTest, GrowKeepsElements) {
+	struct iidring* r = iidring_new(4);
+	for (iid_t i = 100; i < 200; i += 3)
+		ASSERT_EQ(iidring_put(r, i, &values[i]), 0);
+	ASSERT_EQ(iidring_put(r, 90, &values[90]), 0);
+	ASSERT_GE(iidring_size(r), 110);
+	ASSERT_EQ(iidring_first(r), &values[90]);
+	for (iid_t i = 100; i < 200; i++)
+		ASSERT_EQ(iidring_get(r, i), i % 3 == 1 ? &values[i] : NULL);
+	iidring_free(r);
+}
+
+TEST(IidringTest, Wraparound) {
+	struct iidring* r = iidring_new(8);
+	for (iid_t i = 1; i < 1000; i++) {
+		ASSERT_EQ(iidring_put(r, i, &values[i]), 0);
+		if (i > 4) {
+			ASSERT_EQ(iidring_del(r, i - 4), &values[i - 4]);
+		}
+	}
+	ASSERT_EQ(iidring_size(r), 8);
+	ASSERT_EQ(iidring_first(r), &values[996]);
+	iidring_free(r);
+}
+
+TEST(IidringTest, Trim) {
+	int trimmed = 0;
+	struct iidring* r = iidring_new(16);
+	for (iid_t i = 1; i <= 10; i++)
+		iidring_put(r, i, &values[i]);
+	iidring_del(r, 3);
+	iidring_trim(r, 5, Count, &trimmed);
+	ASSERT_EQ(trimmed, 4);
+	ASSERT_EQ(iidring_count(r), 5);
+	ASSERT_EQ(iidring_first(r), &values[6]);
+	iidring_trim(r, 100, Count, &trimmed);
+	ASSERT_EQ(trimmed, 9);
+	ASSERT_EQ(iidring_first(r), (void*)NULL);
+	ASSERT_EQ(iidring_put(r, 50, &values[50]), 0);
+	ASSERT_EQ(iidring_first(r), &values[50]);
+	iidring_free(r);
+}
+
+TEST(IidringTest, FarAheadDoesNotFit) {
+	struct iidring* r = iidring_new(4);
+	ASSERT_FALSE(iidring_fits(r, (iid_t)-1));
+	ASSERT_EQ(iidring_put(r, 10, &values[10]), 0);
+	ASSERT_TRUE(iidring_fits(r, 9 + IIDRING_MAX_SIZE));
+	ASSERT_FALSE(iidring_fits(r, 10 + IIDRING_MAX_SIZE));
+	ASSERT_EQ(iidring_put(r, 10 + IIDRING_MAX_SIZE, &values[11]), -1);
+	ASSERT_EQ(iidring_put(r, (iid_t)-1, &values[11]), -1);
+	ASSERT_EQ(iidring_size(r), 4);
+	ASSERT_EQ(iidring_end(r), 11);
+	ASSERT_EQ(iidring_put(r, 9 + IIDRING_MAX_SIZE, &values[11]), 0);
+	ASSERT_EQ(iidring_size(r), IIDRING_MAX_SIZE);
+	ASSERT_EQ(iidring_get(r, 10), &values[10]);
+	iidring_free(r);
+}
@@ -220,3 +220,105 @@ TEST_F(LearnerTest, ManyHoles) {
 	ASSERT_EQ(1, from);
 	ASSERT_EQ(100, to);
 }
+
+TEST_F(LearnerTest, LearnAggregated) {
+	paxos_accepted a, deliver;
+	uint32_t aids[] = {0, 2};
+	uint32_t ballots[] = {101, 101};
+	paxos_value values[] = {{4, (char*)"foo"}, {0, NULL}};
+
+	// a single accepted carrying the aids of a majority closes the instance
+	a = (paxos_accepted) {0, 1, 101, 101, 2, aids, {0, NULL}, values, ballots, ballots};
+	learner_receive_accepted(l, &a);
+	ASSERT_TRUE(learner_deliver_next(l, &deliver));
+	ASSERT_EQ(deliver.iid, 1);
+	ASSERT_STREQ(deliver.values[0].paxos_value_val, "foo");
+	paxos_accepted_destroy(&deliver);
+}
+
+TEST_F(LearnerTest, LearnBeyondInitialWindow) {
+	paxos_accepted a, deliver;
+	const iid_t count = 5000;
+
+	// instances far ahead of the current one grow the learner window
+	for (iid_t iid = count; iid > 0; iid--) {
+		a = (paxos_accepted) {0, iid, 101, 101, 0, NULL, {0, NULL}};
+		learner_receive_accepted(l, &a);
+		a = (paxos_accepted) {1, iid, 101, 101, 0, NULL, {0, NULL}};
+		learner_receive_accepted(l, &a);
+	}
+	for (iid_t iid = 1; iid <= count; iid++) {
+		ASSERT_TRUE(learner_deliver_next(l, &deliver));
+		ASSERT_EQ(iid, deliver.iid);
+		paxos_accepted_destroy(&deliver);
+	}
+	ASSERT_FALSE(learner_deliver_next(l, &deliver));
+}
+
+TEST_F(LearnerTest, HigherBallotReplacesValue) {
+	paxos_accepted a, deliver;
+
+	a = (paxos_accepted) {0, 1, 101, 101, 0, NULL, {4, (char*)"foo"}};
+	learner_receive_accepted(l, &a);
+	a = (paxos_accepted) {1, 1, 202, 202, 0, NULL, {4, (char*)"bar"}};
+	learner_receive_accepted(l, &a);
+	ASSERT_FALSE(learner_deliver_next(l, &deliver));
+
+	a = (paxos_accepted) {2, 1, 202, 202, 0, NULL, {4, (char*)"bar"}};
+	learner_receive_accepted(l, &a);
+	ASSERT_TRUE(learner_deliver_next(l, &deliver));
+	ASSERT_EQ(202, deliver.ballot_0);
+	ASSERT_STREQ("bar", deliver.values[0].paxos_value_val);
+	paxos_accepted_destroy(&deliver);
+}
+
+TEST_F(LearnerTest, TakeAccepted) {
+	paxos_accepted a, deliver;
+	char* value = strdup("foo");
+
+	a = (paxos_accepted) {0, 1, 101, 101, 0, NULL, {4, value}};
+	learner_take_accepted(l, &a);
+	ASSERT_EQ(NULL, a.value_0.paxos_value_val);
+	ASSERT_EQ(0, a.value_0.paxos_value_len);
+
+	a = (paxos_accepted) {1, 1, 101, 101, 0, NULL, {4, (char*)"foo"}};
+	learner_receive_accepted(l, &a);
+	ASSERT_TRUE(learner_deliver_next(l, &deliver));
+	ASSERT_EQ(value, deliver.values[0].paxos_value_val);
+	paxos_accepted_destroy(&deliver);
+}
+
+TEST_F(LearnerTest, AcceptorMovesToHigherBallot) {
+	paxos_accepted a, deliver;
+
+	a = (paxos_accepted) {0, 1, 101, 101, 0, NULL, {4, (char*)"foo"}};
+	learner_receive_accepted(l, &a);
+	a = (paxos_accepted) {0, 1, 202, 202, 0, NULL, {4, (char*)"foo"}};
+	learner_receive_accepted(l, &a);
+
+	// acceptor 0 no longer counts for ballot 101
+	a = (paxos_accepted) {1, 1, 101, 101, 0, NULL, {4, (char*)"foo"}};
+	learner_receive_accepted(l, &a);
+	ASSERT_FALSE(learner_deliver_next(l, &deliver));
+
+	a = (paxos_accepted) {2, 1, 202, 202, 0, NULL, {4, (char*)"foo"}};
+	learner_receive_accepted(l, &a);
+	ASSERT_TRUE(learner_deliver_next(l, &deliver));
+	ASSERT_EQ(202, deliver.ballot_0);
+	paxos_accepted_destroy(&deliver);
+}
+
+TEST_F(LearnerTest, QuorumOnLowerBallot) {
+	paxos_accepted a, deliver;
+
+	a = (paxos_accepted) {0, 1, 202, 202, 0, NULL, {4, (char*)"foo"}};
+	learner_receive_accepted(l, &a);
+	a = (paxos_accepted) {1, 1, 101, 101, 0, NULL, {4, (char*)"foo"}};
+	learner_receive_accepted(l, &a);
+	a = (paxos_accepted) {2, 1, 101, 101, 0, NULL, {4, (char*)"foo"}};
+	learner_receive_accepted(l, &a);
+	ASSERT_TRUE(learner_deliver_next(l, &deliver));
+	ASSERT_EQ(101, deliver.ballot_0);
+	ASSERT_STREQ("foo", deliver.values[0].paxos_value_val);
+	paxos_accepted_destroy(&deliver);
+}
@@ -0,0 +1,526 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "paxos.h"
+#include "message.h"
+#include "paxos_types_pack.h"
+#include "paxos_types_wire.h"
+#include "gtest/gtest.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <string>
+#include <vector>
+
+class MessageReaderTest : public::testing::Test {
+protected:
+
+	struct message_reader* reader;
+	struct evbuffer* in;
+	std::vector<char> stream;
+
+	virtual void SetUp() {
+		reader = message_reader_new();
+		in = evbuffer_new();
+	}
+
+	virtual void TearDown() {
+		evbuffer_free(in);
+		message_reader_free(reader);
+	}
+
+	void Append(msgpack_sbuffer* buffer) {
+		stream.insert(stream.end(), buffer->data, buffer->data + buffer->size);
+		msgpack_sbuffer_destroy(buffer);
+	}
+
+	void AppendMessage(paxos_message* msg) {
+		msgpack_sbuffer buffer;
+		msgpack_packer packer;
+		msgpack_sbuffer_init(&buffer);
+		msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+		msgpack_pack_paxos_message(&packer, msg);
+		Append(&buffer);
+	}
+
+	void AppendHello() {
+		msgpack_sbuffer buffer;
+		msgpack_packer packer;
+		msgpack_sbuffer_init(&buffer);
+		msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+		msgpack_pack_unsigned_int(&packer, PAXOS_WIRE_VERSION);
+		Append(&buffer);
+	}
+
+	void AppendSwitch() {
+		msgpack_sbuffer buffer;
+		msgpack_packer packer;
+		msgpack_sbuffer_init(&buffer);
+		msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+		msgpack_pack_nil(&packer);
+		Append(&buffer);
+	}
+
+	void AppendFrame(paxos_message* msg) {
+		size_t size = stream.size();
+		stream.resize(size + paxos_wire_size(msg));
+		stream.resize(size + paxos_wire_encode(msg, &stream[size]));
+	}
+
+	// Moves the next len bytes of the stream to the input buffer.
+	void Feed(size_t len) {
+		evbuffer_add(in, &stream[0], len);
+		stream.erase(stream.begin(), stream.begin() + len);
+	}
+
+	int Recv(paxos_message* out) {
+		memset(out, 0, sizeof(paxos_message));
+		return recv_paxos_message(reader, in, out);
+	}
+
+	void CheckPrepare(iid_t iid) {
+		paxos_message out;
+		ASSERT_EQ(Recv(&out), 1);
+		ASSERT_EQ(out.type, PAXOS_PREPARE);
+		ASSERT_EQ(out.u.prepare.iid, iid);
+		ASSERT_EQ(out.u.prepare.ballot, 101);
+	}
+
+	void CheckAccept(iid_t iid, std::vector<char>& value) {
+		paxos_message out;
+		ASSERT_EQ(Recv(&out), 1);
+		ASSERT_EQ(out.type, PAXOS_ACCEPT);
+		ASSERT_EQ(out.u.accept.iid, iid);
+		ASSERT_EQ(out.u.accept.value.paxos_value_len, (int)value.size());
+		ASSERT_EQ(memcmp(out.u.accept.value.paxos_value_val, &value[0],
+			value.size()), 0);
+		paxos_message_destroy(&out);
+	}
+};
+
+static paxos_message Prepare(iid_t iid)
+{
+	paxos_message msg;
+	paxos_prepare prepare = {0, iid, 101};
+	memset(&msg, 0, sizeof(paxos_message));
+	msg.type = PAXOS_PREPARE;
+	msg.u.prepare = prepare;
+	return msg;
+}
+
+static paxos_message Accept(iid_t iid, std::vector<char>& value)
+{
+	paxos_message msg;
+	paxos_accept accept = {0, iid, 101, {(int)value.size(), &value[0]}};
+	memset(&msg, 0, sizeof(paxos_message));
+	msg.type = PAXOS_ACCEPT;
+	msg.u.accept = accept;
+	return msg;
+}
+
+TEST_F(MessageReaderTest, MessageSplitAcrossFeeds) {
+	paxos_message out;
+	std::vector<char> value(300, 'x');
+	paxos_message msg = Accept(1, value);
+	AppendMessage(&msg);
+
+	while (stream.size() > 1) {
+		Feed(1);
+		ASSERT_EQ(Recv(&out), 0);
+	}
+	Feed(1);
+	CheckAccept(1, value);
+	ASSERT_EQ(Recv(&out), 0);
+}
+
+TEST_F(MessageReaderTest, SeveralMessagesInOneFeed) {
+	paxos_message out;
+	for (iid_t iid = 1; iid <= 3; iid++) {
+		paxos_message msg = Prepare(iid);
+		AppendMessage(&msg);
+	}
+
+	Feed(stream.size());
+	CheckPrepare(1);
+	CheckPrepare(2);
+	CheckPrepare(3);
+	ASSERT_EQ(Recv(&out), 0);
+	ASSERT_EQ(evbuffer_get_length(in), 0);
+}
+
+TEST_F(MessageReaderTest, HelloSwitchAndFramesInOneChunk) {
+	paxos_message out;
+	std::vector<char> small(10, 's'), large(3000, 'l');
+	paxos_message prepare = Prepare(1);
+	paxos_message accept = Accept(2, small);
+	paxos_message frame = Prepare(3);
+	paxos_message large_frame = Accept(4, large);
+
+	AppendHello();
+	AppendMessage(&prepare);
+	AppendSwitch();
+	AppendFrame(&accept);
+	AppendFrame(&frame);
+	AppendFrame(&large_frame);
+
+	// The last frame is split across feeds
+	Feed(stream.size() - 1000);
+	CheckPrepare(1);
+	ASSERT_EQ(message_reader_peer_version(reader), PAXOS_WIRE_VERSION);
+	CheckAccept(2, small);
+	CheckPrepare(3);
+	ASSERT_EQ(Recv(&out), 0);
+	Feed(stream.size());
+	CheckAccept(4, large);
+	ASSERT_EQ(Recv(&out), 0);
+}
+
+TEST_F(MessageReaderTest, GarbageInput) {
+	paxos_message out;
+	paxos_message msg = Prepare(1);
+	AppendMessage(&msg);
+	stream.insert(stream.end(), 4, (char)0xc1);
+	AppendMessage(&msg);
+
+	Feed(stream.size());
+	CheckPrepare(1);
+	ASSERT_EQ(Recv(&out), -1);
+
+	// The connection is reopened with the reader reset
+	message_reader_reset(reader);
+	evbuffer_drain(in, evbuffer_get_length(in));
+	AppendMessage(&msg);
+	Feed(stream.size());
+	CheckPrepare(1);
+	ASSERT_EQ(Recv(&out), 0);
+}
+
+TEST_F(MessageReaderTest, GarbageFrame) {
+	paxos_message out;
+	paxos_message msg = Prepare(1);
+	AppendSwitch();
+	AppendFrame(&msg);
+	stream.insert(stream.end(), PAXOS_WIRE_HEADER_SIZE, 'g');
+	AppendFrame(&msg);
+
+	Feed(stream.size());
+	CheckPrepare(1);
+	ASSERT_EQ(Recv(&out), -1);
+
+	message_reader_reset(reader);
+	evbuffer_drain(in, evbuffer_get_length(in));
+	AppendMessage(&msg);
+	Feed(stream.size());
+	CheckPrepare(1);
+	ASSERT_EQ(Recv(&out), 0);
+}
+
+class PackedMessageTest : public::testing::TestWithParam<int> {
+protected:
+
+	struct event_base* base;
+	struct bufferevent* bevs[3];
+	struct bufferevent* peers[3];
+	std::vector<char> value;
+	std::vector<char> small;
+
+	virtual void SetUp() {
+		base = event_base_new();
+		// The peers do not read, the bytes sent stay in the output buffers
+		for (int i = 0; i < 3; i++) {
+			struct bufferevent* pair[2];
+			bufferevent_pair_new(base, 0, pair);
+			bevs[i] = pair[0];
+			peers[i] = pair[1];
+		}
+		// Values on either side of the size from which packed messages are
+		// referenced rather than copied
+		value.assign(GetParam(), 'v');
+		small.assign(100, 's');
+	}
+
+	virtual void TearDown() {
+		for (int i = 0; i < 3; i++) {
+			bufferevent_free(bevs[i]);
+			bufferevent_free(peers[i]);
+		}
+		event_base_free(base);
+	}
+
+	// Lets a peer read what was sent to it, and drains it.
+	std::vector<char> Receive(int i) {
+		struct evbuffer* in = bufferevent_get_input(peers[i]);
+		bufferevent_enable(peers[i], EV_READ);
+		event_base_loop(base, EVLOOP_NONBLOCK);
+		std::vector<char> bytes(evbuffer_get_length(in));
+		evbuffer_remove(in, &bytes[0], bytes.size());
+		return bytes;
+	}
+
+	// Tells whether a piece of the output of a bufferevent is the given
+	// bytes in place, rather than a copy.
+	bool References(struct bufferevent* bev, const char* data) {
+		struct evbuffer* out = bufferevent_get_output(bev);
+		int n = evbuffer_peek(out, -1, NULL, NULL, 0);
+		std::vector<struct evbuffer_iovec> v(n);
+		evbuffer_peek(out, -1, NULL, &v[0], n);
+		for (int i = 0; i < n; i++)
+			if (v[i].iov_base == data)
+				return true;
+		return false;
+	}
+
+	// Sends a packed message to all the peers. Unless value is given, the
+	// message is a single piece, referenced if large enough; otherwise the
+	// value must be sent in place, as a piece of its own.
+	void SendToAll(struct packed_message* pm, std::vector<char>& expected,
+		const char* value = NULL) {
+		for (int i = 0; i < 3; i++)
+			send_packed_message(bevs[i], pm);
+		int refs = packed_message_refs(pm) - 1;
+		ASSERT_EQ(refs % 3, 0);
+		if (value == NULL) {
+			ASSERT_EQ(refs, expected.size() >= PACKED_MESSAGE_REFERENCE_MIN ? 3 : 0);
+		} else {
+			ASSERT_GE(refs, 3);
+			for (int i = 0; i < 3; i++)
+				ASSERT_TRUE(References(bevs[i], value));
+		}
+
+		// The output buffers keep the bytes once the owner lets go
+		packed_message_release(pm);
+		for (int i = 0; i < 3; i++) {
+			ASSERT_TRUE(Receive(i) == expected);
+			// The last reference frees it; under the address sanitizer a
+			// second release, or none, fails the test
+			if (refs > 0 && i < 2)
+				ASSERT_EQ(packed_message_refs(pm), refs / 3 * (2 - i));
+		}
+	}
+
+	// An accepted message carrying a small value and the test value.
+	paxos_message Accepted(paxos_value* values) {
+		static uint32_t aids[2] = {0, 2}, ballots[2] = {101, 102};
+		paxos_message msg;
+		values[0].paxos_value_len = small.size();
+		values[0].paxos_value_val = &small[0];
+		values[1].paxos_value_len = value.size();
+		values[1].paxos_value_val = &value[0];
+		values[0].paxos_value_flags = values[1].paxos_value_flags = 0;
+		memset(&msg, 0, sizeof(paxos_message));
+		msg.type = PAXOS_ACCEPTED;
+		msg.u.accepted.iid = 1;
+		msg.u.accepted.n_aids = 2;
+		msg.u.accepted.aids = aids;
+		msg.u.accepted.ballots = ballots;
+		msg.u.accepted.value_ballots = ballots;
+		msg.u.accepted.values = values;
+		return msg;
+	}
+
+	// A copy of an accepted message, owning its arrays and values as
+	// the ones built by the acceptor do.
+	static paxos_message CopyAccepted(paxos_message* msg) {
+		paxos_message copy = *msg;
+		paxos_accepted* a = &copy.u.accepted;
+		size_t size = a->n_aids * sizeof(uint32_t);
+		a->aids = (uint32_t*)malloc(size);
+		memcpy(a->aids, msg->u.accepted.aids, size);
+		a->ballots = (uint32_t*)malloc(size);
+		memcpy(a->ballots, msg->u.accepted.ballots, size);
+		a->value_ballots = (uint32_t*)malloc(size);
+		memcpy(a->value_ballots, msg->u.accepted.value_ballots, size);
+		a->values = (paxos_value*)malloc(a->n_aids * sizeof(paxos_value));
+		for (uint32_t i = 0; i < a->n_aids; i++) {
+			paxos_value* v = &msg->u.accepted.values[i];
+			a->values[i].paxos_value_len = v->paxos_value_len;
+			a->values[i].paxos_value_flags = v->paxos_value_flags;
+			a->values[i].paxos_value_val = (char*)malloc(v->paxos_value_len);
+			memcpy(a->values[i].paxos_value_val, v->paxos_value_val, v->paxos_value_len);
+		}
+		return copy;
+	}
+
+	// The value handed over that is expected to be sent in place.
+	const char* InPlace(paxos_message* owned) {
+		if (value.size() < PACKED_VALUE_REFERENCE_MIN)
+			return NULL;
+		return owned->u.accepted.values[1].paxos_value_val;
+	}
+};
+
+TEST_P(PackedMessageTest, SendToSeveralBuffers) {
+	paxos_message msg = Accept(1, value);
+	msgpack_sbuffer buffer;
+	msgpack_packer packer;
+	msgpack_sbuffer_init(&buffer);
+	msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+	msgpack_pack_paxos_message(&packer, &msg);
+	std::vector<char> expected(buffer.data, buffer.data + buffer.size);
+	msgpack_sbuffer_destroy(&buffer);
+
+	SendToAll(pack_paxos_message(&msg), expected);
+}
+
+TEST_P(PackedMessageTest, SendFrameToSeveralBuffers) {
+	paxos_message msg = Accept(1, value);
+	std::vector<char> expected(paxos_wire_size(&msg));
+	expected.resize(paxos_wire_encode(&msg, &expected[0]));
+
+	SendToAll(pack_paxos_frame(&msg), expected);
+}
+
+TEST_P(PackedMessageTest, SendOwnedToSeveralBuffers) {
+	paxos_value values[2];
+	paxos_message msg = Accepted(values);
+	msgpack_sbuffer buffer;
+	msgpack_packer packer;
+	msgpack_sbuffer_init(&buffer);
+	msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+	msgpack_pack_paxos_message(&packer, &msg);
+	std::vector<char> expected(buffer.data, buffer.data + buffer.size);
+	msgpack_sbuffer_destroy(&buffer);
+
+	paxos_message owned = CopyAccepted(&msg);
+	SendToAll(pack_paxos_message_owned(&owned), expected, InPlace(&owned));
+}
+
+TEST_P(PackedMessageTest, SendOwnedFrameToSeveralBuffers) {
+	paxos_value values[2];
+	paxos_message msg = Accepted(values);
+	std::vector<char> expected(paxos_wire_size(&msg));
+	expected.resize(paxos_wire_encode(&msg, &expected[0]));
+
+	paxos_message owned = CopyAccepted(&msg);
+	SendToAll(pack_paxos_frame_owned(&owned), expected, InPlace(&owned));
+}
+
+INSTANTIATE_TEST_CASE_P(ValueSizes, PackedMessageTest,
+	::testing::Values(16, PACKED_MESSAGE_REFERENCE_MIN - 64,
+		PACKED_MESSAGE_REFERENCE_MIN, 4000));
+
+class MessageRoundTripTest : public::testing::TestWithParam<bool> {
+protected:
+
+	struct event_base* base;
+	struct bufferevent* pair[2];
+	struct message_reader* reader;
+
+	virtual void SetUp() {
+		base = event_base_new();
+		bufferevent_pair_new(base, 0, pair);
+		bufferevent_enable(pair[1], EV_READ);
+		reader = message_reader_new();
+		if (GetParam()) {
+			send_paxos_hello(pair[0]);
+			send_paxos_switch(pair[0]);
+		}
+	}
+
+	virtual void TearDown() {
+		message_reader_free(reader);
+		bufferevent_free(pair[0]);
+		bufferevent_free(pair[1]);
+		event_base_free(base);
+	}
+
+	void Send(paxos_message* msg) {
+		if (GetParam())
+			send_paxos_frame(pair[0], msg);
+		else
+			send_paxos_message(pair[0], msg);
+	}
+
+	int Recv(paxos_message* out) {
+		event_base_loop(base, EVLOOP_NONBLOCK);
+		memset(out, 0, sizeof(paxos_message));
+		return recv_paxos_message(reader, bufferevent_get_input(pair[1]), out);
+	}
+};
+
+TEST_P(MessageRoundTripTest, SendAndDecode) {
+	paxos_message msg, out;
+	uint32_t aids[2] = {0, 2}, ballots[2] = {101, 102};
+	std::vector<char> small(100, 's'), large(8 * 1024, 'l');
+	paxos_value values[2] = {{(int)small.size(), &small[0]},
+		{(int)large.size(), &large[0]}};
+
+	msg = Prepare(1);
+	Send(&msg);
+	msg = Accept(2, small);
+	Send(&msg);
+	// Large enough to be handed over to the output buffer without a copy
+	msg = Accept(3, large);
+	Send(&msg);
+	memset(&msg, 0, sizeof(paxos_message));
+	msg.type = PAXOS_ACCEPTED;
+	msg.u.accepted.iid = 4;
+	msg.u.accepted.n_aids = 2;
+	msg.u.accepted.aids = aids;
+	msg.u.accepted.ballots = ballots;
+	msg.u.accepted.value_ballots = ballots;
+	msg.u.accepted.values = values;
+	Send(&msg);
+
+	ASSERT_EQ(Recv(&out), 1);
+	ASSERT_EQ(out.type, PAXOS_PREPARE);
+	ASSERT_EQ(out.u.prepare.iid, 1);
+	ASSERT_EQ(out.u.prepare.ballot, 101);
+	if (GetParam())
+		ASSERT_EQ(message_reader_peer_version(reader), PAXOS_WIRE_VERSION);
+
+	ASSERT_EQ(Recv(&out), 1);
+	ASSERT_EQ(out.type, PAXOS_ACCEPT);
+	ASSERT_EQ(out.u.accept.iid, 2);
+	ASSERT_EQ(std::string(out.u.accept.value.paxos_value_val,
+		out.u.accept.value.paxos_value_len), std::string(&small[0], small.size()));
+	paxos_message_destroy(&out);
+
+	ASSERT_EQ(Recv(&out), 1);
+	ASSERT_EQ(out.type, PAXOS_ACCEPT);
+	ASSERT_EQ(out.u.accept.iid, 3);
+	ASSERT_EQ(std::string(out.u.accept.value.paxos_value_val,
+		out.u.accept.value.paxos_value_len), std::string(&large[0], large.size()));
+	paxos_message_destroy(&out);
+
+	ASSERT_EQ(Recv(&out), 1);
+	ASSERT_EQ(out.type, PAXOS_ACCEPTED);
+	ASSERT_EQ(out.u.accepted.iid, 4);
+	ASSERT_EQ(out.u.accepted.n_aids, 2);
+	ASSERT_EQ(out.u.accepted.aids[1], 2);
+	ASSERT_EQ(out.u.accepted.ballots[1], 102);
+	ASSERT_EQ(out.u.accepted.value_ballots[0], 101);
+	for (int i = 0; i < 2; i++)
+		ASSERT_EQ(std::string(out.u.accepted.values[i].paxos_value_val,
+			out.u.accepted.values[i].paxos_value_len),
+			std::string(values[i].paxos_value_val, values[i].paxos_value_len));
+	paxos_message_destroy(&out);
+
+	ASSERT_EQ(Recv(&out), 0);
+}
+
+INSTANTIATE_TEST_CASE_P(MsgpackAndFrames, MessageRoundTripTest, ::testing::Bool());
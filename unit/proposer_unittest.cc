@@ -27,6 +27,7 @@
 
 
 #include "proposer.h"
+#include "aidset.h"
 #include "gtest/gtest.h"
 #include <stdio.h>
 
@@ -47,7 +48,8 @@ protected:
 	
 	virtual void SetUp() {
 		quorum = paxos_quorum(acceptors);
-		paxos_config.proposer_timeout = 1;
+		paxos_config.proposer_timeout = 100;
+		paxos_config.proposer_batch_size = 0;
 		p = proposer_new(id, acceptors);
 		paxos_config.verbosity = PAXOS_LOG_QUIET;
 	}
@@ -104,6 +106,187 @@ TEST_F(ProposerTest, Prepare) {
 	printf("%d\n", counter);
 }
 
+TEST_F(ProposerTest, PrepareRange) {
+	paxos_prepare_range pr;
+	ASSERT_EQ(0, proposer_prepare_range(p, 0, &pr));
+	ASSERT_EQ(32, proposer_prepare_range(p, 32, &pr));
+	ASSERT_EQ(pr.from_iid, 1);
+	ASSERT_EQ(pr.to_iid, 32);
+	ASSERT_EQ(pr.ballot, id + MAX_N_OF_PROPOSERS);
+	ASSERT_EQ(32, proposer_prepared_count(p));
+	proposer_prepare_range(p, 8, &pr);
+	ASSERT_EQ(pr.from_iid, 33);
+	ASSERT_EQ(pr.to_iid, 40);
+}
+
+TEST_F(ProposerTest, PromiseRange) {
+	paxos_prepare_range pr, preempted;
+	paxos_accept ar;
+	proposer_prepare_range(p, 4, &pr);
+	proposer_propose(p, "value", strlen("value")+1);
+	for (size_t i = 0; i < quorum; ++i) {
+		paxos_promise_range pa = {(uint32_t)i, pr.from_iid, pr.to_iid, pr.ballot, 0, NULL, NULL, NULL};
+		ASSERT_EQ(0, proposer_receive_promise_range(p, &pa, &preempted));
+	}
+	ASSERT_TRUE(proposer_accept(p, &ar));
+	CHECK_ACCEPT(ar, 1, pr.ballot, "value", 6);
+}
+
+TEST_F(ProposerTest, PromiseRangeWithValue) {
+	paxos_prepare_range pr, preempted;
+	paxos_accept ar;
+	uint32_t iids[] = {1};
+	uint32_t vbal[] = {100};
+	paxos_value values[] = {{4, (char*)"foo"}};
+	proposer_prepare_range(p, 2, &pr);
+	for (size_t i = 0; i < quorum; ++i) {
+		paxos_promise_range pa = {(uint32_t)i, pr.from_iid, pr.to_iid, pr.ballot, 1, iids, vbal, values};
+		ASSERT_EQ(0, proposer_receive_promise_range(p, &pa, &preempted));
+	}
+	ASSERT_TRUE(proposer_accept(p, &ar));
+	CHECK_ACCEPT(ar, 1, pr.ballot, "foo", 4);
+}
+
+TEST_F(ProposerTest, PromiseRangePreempted) {
+	paxos_prepare_range pr, preempted;
+	proposer_prepare_range(p, 4, &pr);
+	paxos_promise_range pa = {1, pr.from_iid, pr.to_iid, pr.ballot+1, 0, NULL, NULL, NULL};
+	ASSERT_EQ(1, proposer_receive_promise_range(p, &pa, &preempted));
+	ASSERT_EQ(preempted.from_iid, pr.from_iid);
+	ASSERT_EQ(preempted.to_iid, pr.to_iid);
+	ASSERT_GT(preempted.ballot, pr.ballot);
+
+	// the old ballot is now ignored
+	pa.ballot = pr.ballot;
+	ASSERT_EQ(0, proposer_receive_promise_range(p, &pa, &preempted));
+}
+
+TEST_F(ProposerTest, StableLeader) {
+	paxos_prepare_range pr, unused;
+	paxos_accept ar;
+	proposer_propose(p, "value", strlen("value")+1);
+	ASSERT_TRUE(proposer_prepare_leader(p, &pr));
+	ASSERT_EQ(pr.from_iid, 1);
+	ASSERT_EQ(pr.to_iid, 0);
+	ASSERT_FALSE(proposer_prepare_leader(p, &pr));
+	ASSERT_FALSE(proposer_accept(p, &ar));
+	for (size_t i = 0; i < quorum; ++i) {
+		paxos_promise_range pa = {(uint32_t)i, 1, 0, pr.ballot, 0, NULL, NULL, NULL};
+		ASSERT_EQ(0, proposer_receive_promise_range(p, &pa, &unused));
+	}
+	ASSERT_TRUE(proposer_is_leader(p));
+
+	// no phase 1 for any further instance
+	for (iid_t iid = 1; iid <= 100; iid++) {
+		ASSERT_TRUE(proposer_accept(p, &ar));
+		CHECK_ACCEPT(ar, iid, pr.ballot, "value", 6);
+		ASSERT_FALSE(proposer_accept(p, &ar));
+		proposer_propose(p, "value", strlen("value")+1);
+	}
+	ASSERT_EQ(proposer_prepared_count(p), 0);
+}
+
+TEST_F(ProposerTest, StableLeaderWithValue) {
+	paxos_prepare_range pr, unused;
+	paxos_accept ar;
+	uint32_t iids[] = {3};
+	uint32_t vbal[] = {100};
+	paxos_value values[] = {{4, (char*)"foo"}};
+	proposer_prepare_leader(p, &pr);
+	for (size_t i = 0; i < quorum; ++i) {
+		paxos_promise_range pa = {(uint32_t)i, 1, 0, pr.ballot, 1, iids, vbal, values};
+		proposer_receive_promise_range(p, &pa, &unused);
+	}
+
+	// the instances before the one with a value are filled first
+	proposer_propose(p, "v1", 3);
+	proposer_propose(p, "v2", 3);
+	ASSERT_TRUE(proposer_accept(p, &ar));
+	CHECK_ACCEPT(ar, 1, pr.ballot, "v1", 3);
+	ASSERT_TRUE(proposer_accept(p, &ar));
+	CHECK_ACCEPT(ar, 2, pr.ballot, "v2", 3);
+	ASSERT_TRUE(proposer_accept(p, &ar));
+	CHECK_ACCEPT(ar, 3, pr.ballot, "foo", 4);
+	ASSERT_FALSE(proposer_accept(p, &ar));
+}
+
+TEST_F(ProposerTest, StableLeaderPreempted) {
+	paxos_prepare_range pr, pr2, unused;
+	paxos_prepare prepare;
+	paxos_accept ar;
+	proposer_prepare_leader(p, &pr);
+	for (size_t i = 0; i < quorum; ++i) {
+		paxos_promise_range pa = {(uint32_t)i, 1, 0, pr.ballot, 0, NULL, NULL, NULL};
+		proposer_receive_promise_range(p, &pa, &unused);
+	}
+	proposer_propose(p, "value", strlen("value")+1);
+	ASSERT_TRUE(proposer_accept(p, &ar));
+
+	paxos_preempted pe = {0, ar.iid, pr.ballot + 10};
+	ASSERT_TRUE(proposer_receive_preempted(p, &pe, &prepare));
+	ASSERT_FALSE(proposer_is_leader(p));
+
+	// leadership is taken again above the competing ballot
+	ASSERT_TRUE(proposer_prepare_leader(p, &pr2));
+	ASSERT_GT(pr2.ballot, pe.ballot);
+	ASSERT_EQ(pr2.from_iid, 2);
+}
+
+TEST_F(ProposerTest, AggregatedAccepted) {
+	paxos_prepare_range pr, unused;
+	paxos_accept ar;
+	proposer_prepare_range(p, 1, &pr);
+	for (size_t i = 0; i < quorum; ++i) {
+		paxos_promise_range pa = {(uint32_t)i, pr.from_iid, pr.to_iid, pr.ballot, 0, NULL, NULL, NULL};
+		proposer_receive_promise_range(p, &pa, &unused);
+	}
+	proposer_propose(p, "value", strlen("value")+1);
+	ASSERT_TRUE(proposer_accept(p, &ar));
+
+	// a group leader reports a quorum of acceptors in one message
+	uint32_t aids[] = {0, 2};
+	uint32_t ballots[] = {ar.ballot, ar.ballot};
+	paxos_value values[] = {ar.value, ar.value};
+	paxos_accepted aa = {0, ar.iid, ar.ballot, ar.ballot, 2, aids, ar.value,
+		values, ballots, ballots, 2};
+	aidset_from_aids(&aa.aidset, aids, 2);
+	ASSERT_TRUE(proposer_receive_accepted(p, &aa));
+
+	// the instance is closed
+	ASSERT_FALSE(proposer_receive_accepted(p, &aa));
+}
+
+TEST_F(ProposerTest, BatchClientValues) {
+	paxos_prepare_range pr, unused;
+	paxos_accept ar;
+	paxos_config.proposer_batch_size = 64;
+	paxos_config.proposer_batch_count = 3;
+
+	// sealed by count
+	for (int i = 0; i < 4; i++)
+		proposer_propose(p, "value", 6);
+	ASSERT_EQ(proposer_batched_count(p), 1);
+	// sealed by size: 8 bytes of header, 10 per value
+	paxos_config.proposer_batch_count = 100;
+	for (int i = 0; i < 5; i++)
+		proposer_propose(p, "value", 6);
+	ASSERT_EQ(proposer_batched_count(p), 1);
+	ASSERT_TRUE(proposer_flush_batch(p));
+	ASSERT_FALSE(proposer_flush_batch(p));
+
+	proposer_prepare_range(p, 4, &pr);
+	for (size_t i = 0; i < quorum; ++i) {
+		paxos_promise_range pa = {(uint32_t)i, pr.from_iid, pr.to_iid, pr.ballot, 0, NULL, NULL, NULL};
+		proposer_receive_promise_range(p, &pa, &unused);
+	}
+	int sizes[] = {8 + 3 * 10, 8 + 5 * 10, 8 + 1 * 10};
+	for (int i = 0; i < 3; i++) {
+		ASSERT_TRUE(proposer_accept(p, &ar));
+		ASSERT_EQ(ar.value.paxos_value_len, sizes[i]);
+	}
+	ASSERT_FALSE(proposer_accept(p, &ar));
+}
+
 TEST_F(ProposerTest, IgnoreOldBallots) {
 	paxos_prepare pr, preempted;
 	paxos_promise pa;
@@ -309,7 +492,7 @@ TEST_F(ProposerTest, PendingPrepareShouldTimeout) {
 	struct timeout_iterator* iter;
 	
 	proposer_prepare(p, &pr);
-	sleep(paxos_config.proposer_timeout);
+	usleep(paxos_config.proposer_timeout * 1000);
 	
 	iter = proposer_timeout_iterator(p);
 	ASSERT_TRUE(timeout_iterator_prepare(iter, &to));
@@ -328,7 +511,7 @@ TEST_F(ProposerTest, PreparedShouldNotTimeout) {
 	proposer_prepare(p, &pr2);
 	TestPrepareAckFromQuorum(pr1.iid, pr1.ballot);
 	
-	sleep(paxos_config.proposer_timeout);
+	usleep(paxos_config.proposer_timeout * 1000);
 	
 	iter = proposer_timeout_iterator(p);
 	ASSERT_TRUE(timeout_iterator_prepare(iter, &to));
@@ -349,7 +532,7 @@ TEST_F(ProposerTest, PendingAcceptShouldTimeout) {
 
 	proposer_accept(p, &ar);
 	
-	sleep(paxos_config.proposer_timeout);
+	usleep(paxos_config.proposer_timeout * 1000);
 	
 	struct timeout_iterator* iter = proposer_timeout_iterator(p);
 	ASSERT_TRUE(timeout_iterator_accept(iter, &to));
@@ -376,7 +559,7 @@ TEST_F(ProposerTest, AcceptedShouldNotTimeout) {
 	// this one should timeout
 	proposer_prepare(p, &pr);
 	
-	sleep(paxos_config.proposer_timeout);
+	usleep(paxos_config.proposer_timeout * 1000);
 	
 	struct timeout_iterator* iter = proposer_timeout_iterator(p);
 	ASSERT_TRUE(timeout_iterator_prepare(iter, &to));
@@ -394,7 +577,7 @@ TEST_F(ProposerTest, ShouldNotTimeoutTwice) {
 	struct timeout_iterator* iter;
 	
 	proposer_prepare(p, &pr);
-	sleep(paxos_config.proposer_timeout);
+	usleep(paxos_config.proposer_timeout * 1000);
 	
 	iter = proposer_timeout_iterator(p);
 	ASSERT_TRUE(timeout_iterator_prepare(iter, &to));
@@ -405,6 +588,62 @@ TEST_F(ProposerTest, ShouldNotTimeoutTwice) {
 	timeout_iterator_free(iter);
 }
 
+TEST_F(ProposerTest, ShouldNotTimeoutEarly) {
+	paxos_prepare pr, to;
+	paxos_accept ar;
+	struct timeout_iterator* iter;
+
+	proposer_prepare(p, &pr);
+	usleep(paxos_config.proposer_timeout * 1000 / 2);
+
+	iter = proposer_timeout_iterator(p);
+	ASSERT_FALSE(timeout_iterator_prepare(iter, &to));
+	ASSERT_FALSE(timeout_iterator_accept(iter, &ar));
+	timeout_iterator_free(iter);
+}
+
+TEST_F(ProposerTest, PreemptedAcceptShouldTimeoutInPhase1) {
+	paxos_prepare_range pr, unused;
+	paxos_prepare prepare, to;
+	paxos_accept ar, acc;
+	struct timeout_iterator* iter;
+
+	proposer_prepare_range(p, 1, &pr);
+	for (size_t i = 0; i < quorum; ++i) {
+		paxos_promise_range pa = {(uint32_t)i, pr.from_iid, pr.to_iid, pr.ballot, 0, NULL, NULL, NULL};
+		proposer_receive_promise_range(p, &pa, &unused);
+	}
+	proposer_propose(p, "value", strlen("value")+1);
+	ASSERT_TRUE(proposer_accept(p, &ar));
+
+	paxos_preempted pe = {0, ar.iid, ar.ballot + 1};
+	ASSERT_TRUE(proposer_receive_preempted(p, &pe, &prepare));
+	usleep(paxos_config.proposer_timeout * 1000);
+
+	iter = proposer_timeout_iterator(p);
+	ASSERT_TRUE(timeout_iterator_prepare(iter, &to));
+	ASSERT_EQ(prepare.iid, to.iid);
+	ASSERT_EQ(prepare.ballot, to.ballot);
+	ASSERT_FALSE(timeout_iterator_accept(iter, &acc));
+	timeout_iterator_free(iter);
+}
+
+TEST_F(ProposerTest, LeaderPrepareShouldTimeout) {
+	paxos_prepare_range pr, to;
+	struct timeout_iterator* iter;
+
+	ASSERT_TRUE(proposer_prepare_leader(p, &pr));
+	usleep(paxos_config.proposer_timeout * 1000);
+
+	iter = proposer_timeout_iterator(p);
+	ASSERT_TRUE(timeout_iterator_prepare_leader(iter, &to));
+	ASSERT_EQ(pr.from_iid, to.from_iid);
+	ASSERT_EQ(0, to.to_iid);
+	ASSERT_EQ(pr.ballot, to.ballot);
+	ASSERT_FALSE(timeout_iterator_prepare_leader(iter, &to));
+	timeout_iterator_free(iter);
+}
+
 TEST_F(ProposerTest, AvoidDuplicateProposals) {
 	paxos_prepare pre;
 	paxos_accept acc;
@@ -442,3 +681,41 @@ TEST_F(ProposerTest, SetInstanceId) {
 	proposer_prepare(p, &pr);
 	ASSERT_EQ(pr.iid, iid + 1);
 }
+
+// Keeps a window of prepared instances waiting for client values, as
+// evproposer does with proposer-preexec-window, and measures the proposer
+// CPU time spent per decided instance.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+TEST_F(ProposerTest, DISABLED_WindowBenchmark) {
+	int windows[] = {32, 128, 512, 1024, 4096};
+	const int decided = 20000;
+	paxos_prepare_range pr, preempted;
+	paxos_accept ar;
+
+	for (int w = 0; w < sizeof(windows)/sizeof(int); ++w) {
+		proposer_free(p);
+		p = proposer_new(id, acceptors);
+		clock_t start = clock();
+		for (int n = 0; n < decided; ++n) {
+			int count = windows[w] - proposer_prepared_count(p);
+			if (proposer_prepare_range(p, count, &pr) > 0) {
+				for (uint32_t i = 0; i < quorum; ++i) {
+					paxos_promise_range pa = {i, pr.from_iid, pr.to_iid, pr.ballot, 0, NULL, NULL, NULL};
+					proposer_receive_promise_range(p, &pa, &preempted);
+				}
+			}
+			proposer_propose(p, "value", 6);
+			ASSERT_TRUE(proposer_accept(p, &ar));
+			ASSERT_FALSE(proposer_accept(p, &ar));
+			for (uint32_t i = 0; i < quorum; ++i) {
+				uint32_t aid = i, ballot = ar.ballot;
+				paxos_accepted aa = {0, ar.iid, ballot, ballot, 1, &aid, {0, NULL}, NULL, &ballot, &ballot};
+				ASSERT_TRUE(proposer_receive_accepted(p, &aa));
+				proposer_accept(p, &ar);
+			}
+			proposer_set_instance_id(p, ar.iid);
+		}
+		double us = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC;
+		printf("window %4d: %.3f us per decided instance\n", windows[w], us / decided);
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "quorum.h"
+#include "aidset.h"
+#include "gtest/gtest.h"
+
+TEST(QuorumTest, AddUntilReached) {
+	struct quorum q;
+	quorum_init(&q, 5);
+	ASSERT_EQ(1, quorum_add(&q, 0));
+	ASSERT_EQ(0, quorum_add(&q, 0));
+	ASSERT_EQ(1, quorum_add(&q, 4));
+	ASSERT_FALSE(quorum_reached(&q));
+	ASSERT_EQ(0, quorum_add(&q, 5));
+	ASSERT_EQ(1, quorum_add(&q, 2));
+	ASSERT_TRUE(quorum_reached(&q));
+	ASSERT_EQ(3, quorum_count(&q));
+	quorum_clear(&q);
+	ASSERT_EQ(0, quorum_count(&q));
+	quorum_destroy(&q);
+}
+
+TEST(QuorumTest, ManyAcceptors) {
+	struct quorum q;
+	quorum_init(&q, 150);
+	for (int i = 0; i < 150; i += 2)
+		ASSERT_EQ(1, quorum_add(&q, i));
+	ASSERT_FALSE(quorum_reached(&q));
+	ASSERT_EQ(1, quorum_add(&q, 149));
+	ASSERT_TRUE(quorum_reached(&q));
+	ASSERT_EQ(0, quorum_add(&q, 128));
+	quorum_destroy(&q);
+}
+
+TEST(QuorumTest, AddSet) {
+	struct quorum q;
+	paxos_aidset s;
+	quorum_init(&q, 70);
+	quorum_add(&q, 3);
+
+	aidset_clear(&s);
+	aidset_add(&s, 3);
+	aidset_add(&s, 65);
+	aidset_add(&s, 69);
+	aidset_add(&s, 70);  // not an acceptor
+	ASSERT_EQ(2, quorum_add_set(&q, &s));
+	ASSERT_EQ(0, quorum_add_set(&q, &s));
+	ASSERT_EQ(3, quorum_count(&q));
+	ASSERT_EQ(0, quorum_add(&q, 65));
+	quorum_destroy(&q);
+}
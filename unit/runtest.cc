@@ -28,10 +28,13 @@
 
 #include <iostream>
 #include "gtest/gtest.h"
+#include <event2/thread.h>
 
 int 
 main(int argc, char **argv)
 {
+	// Peers use thread safe bufferevents
+	evthread_use_pthreads();
 	testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();
 }
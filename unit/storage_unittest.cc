@@ -26,7 +26,16 @@
  */
 
 #include "storage.h"
+#include "storage_utils.h"
+#include "aidset.h"
+#include "iidring.h"
 #include "gtest/gtest.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
 
 class StorageTest : public::testing::TestWithParam<paxos_storage_backend> {
 protected:
@@ -151,11 +160,682 @@ TEST_P(StorageTest, TrimWithHoles) {
 	TestCheckInstancesExist(501, 600);
 }
 
+TEST_P(StorageTest, TrimOutOfOrder) {
+	for (int i = 300; i >= 200; i--)
+		TestPutManyInstances(i, i);
+	TestPutManyInstances(5000, 5010);
+	TestPutManyInstances(100, 150);
+
+	storage_tx_begin(&store);
+	storage_trim(&store, 250);
+	storage_tx_commit(&store);
+
+	TestCheckInstancesDeleted(100, 250);
+	TestCheckInstancesExist(251, 300);
+	TestCheckInstancesExist(5000, 5010);
+
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_max_instance(&store), 5010);
+	storage_trim(&store, 6000);
+	storage_tx_commit(&store);
+	TestCheckInstancesDeleted(251, 6000);
+}
+
+TEST_P(StorageTest, Watermark) {
+	iid_t from;
+	ballot_t ballot;
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_watermark(&store, &from, &ballot), 0);
+	ASSERT_EQ(storage_put_watermark(&store, 10, 101), 0);
+	storage_tx_commit(&store);
+
+	TestPutManyInstances(1, 100);
+
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_watermark(&store, &from, &ballot), 1);
+	ASSERT_EQ(from, 10);
+	ASSERT_EQ(ballot, 101);
+	ASSERT_EQ(storage_get_max_instance(&store), 100);
+	storage_tx_commit(&store);
+}
+
+static int AddAid(paxos_accepted* acc, int found, void* arg)
+{
+	if (!found)
+		return 0;
+	return paxos_accepted_add_aid(acc, *(uint32_t*)arg, acc->ballots[0], 0, 16);
+}
+
+static int CreateRecord(paxos_accepted* acc, int found, void* arg)
+{
+	if (found)
+		return 0;
+	return paxos_accepted_add_aid(acc, 0, 101, 0, 16);
+}
+
+TEST_P(StorageTest, UpdateInsertsOnlyWhenAsked) {
+	paxos_accepted accepted;
+	uint32_t aid = 3;
+
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_update_record(&store, 1, AddAid, &aid), 0);
+	ASSERT_EQ(storage_get_record(&store, 1, &accepted), 0);
+	ASSERT_EQ(storage_update_record(&store, 1, CreateRecord, NULL), 1);
+	ASSERT_EQ(storage_update_record(&store, 1, CreateRecord, NULL), 0);
+	storage_tx_commit(&store);
+
+	TestCheckInstancesExist(1, 1);
+}
+
+TEST_P(StorageTest, UpdateModifiesRecord) {
+	paxos_accepted accepted;
+	storage_tx_begin(&store);
+	storage_update_record(&store, 7, CreateRecord, NULL);
+	for (uint32_t aid = 1; aid < 5; aid++)
+		ASSERT_EQ(storage_update_record(&store, 7, AddAid, &aid), 1);
+	storage_tx_commit(&store);
+
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_record(&store, 7, &accepted), 1);
+	storage_tx_commit(&store);
+	ASSERT_EQ(accepted.iid, 7);
+	ASSERT_EQ(accepted.n_aids, 5);
+	ASSERT_EQ(accepted.aids[4], 4);
+	ASSERT_EQ(accepted.ballots[4], 101);
+	paxos_accepted_destroy(&accepted);
+}
+
+TEST_P(StorageTest, PutLargerRecordThenUpdate) {
+	paxos_accepted acc, out;
+	memset(&acc, 0, sizeof(paxos_accepted));
+	acc.iid = 3;
+	acc.values = (paxos_value*)calloc(1, sizeof(paxos_value));
+	paxos_accepted_add_aid(&acc, 0, 101, 101, 1);
+	acc.values[0].paxos_value_len = 4;
+	acc.values[0].paxos_value_val = strdup("foo");
+
+	storage_tx_begin(&store);
+	storage_put_record(&store, &acc);
+	// Outgrows the stored record: more aids and a longer value
+	paxos_accepted_add_aid(&acc, 1, 102, 102, 4);
+	acc.values[1].paxos_value_len = 7;
+	acc.values[1].paxos_value_val = strdup("foobar");
+	storage_put_record(&store, &acc);
+	uint32_t aid = 2;
+	ASSERT_EQ(storage_update_record(&store, 3, AddAid, &aid), 1);
+	storage_tx_commit(&store);
+	paxos_accepted_destroy(&acc);
+
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_record(&store, 3, &out), 1);
+	storage_tx_commit(&store);
+	ASSERT_EQ(out.n_aids, 3);
+	ASSERT_EQ(out.aids[2], 2);
+	ASSERT_EQ(out.ballots[1], 102);
+	ASSERT_STREQ(out.values[0].paxos_value_val, "foo");
+	ASSERT_STREQ(out.values[1].paxos_value_val, "foobar");
+	paxos_accepted_destroy(&out);
+}
+
+static int ResetRecord(paxos_accepted* acc, int found, void* arg)
+{
+	iid_t iid = acc->iid;
+	paxos_accepted_destroy(acc);
+	memset(acc, 0, sizeof(paxos_accepted));
+	acc->iid = iid;
+	return paxos_accepted_add_aid(acc, 5, 103, 0, 1);
+}
+
+TEST_P(StorageTest, UpdateOutgrowsPackedRecord) {
+	paxos_accepted acc, out;
+	memset(&acc, 0, sizeof(paxos_accepted));
+	acc.iid = 4;
+	acc.values = (paxos_value*)calloc(1, sizeof(paxos_value));
+	paxos_accepted_add_aid(&acc, 0, 101, 101, 1);
+	acc.values[0].paxos_value_len = 4;
+	acc.values[0].paxos_value_val = strdup("foo");
+
+	storage_tx_begin(&store);
+	storage_put_record(&store, &acc);
+	paxos_accepted_destroy(&acc);
+	// Packed with room for a single aid: the first update moves it out
+	for (uint32_t aid = 1; aid < 4; aid++)
+		ASSERT_EQ(storage_update_record(&store, 4, AddAid, &aid), 1);
+	storage_tx_commit(&store);
+
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_record(&store, 4, &out), 1);
+	ASSERT_EQ(out.n_aids, 4);
+	ASSERT_EQ(out.aids[3], 3);
+	ASSERT_STREQ(out.values[0].paxos_value_val, "foo");
+	paxos_accepted_destroy(&out);
+	// Dropping the value shrinks the record again
+	ASSERT_EQ(storage_update_record(&store, 4, ResetRecord, NULL), 1);
+	ASSERT_EQ(storage_get_record(&store, 4, &out), 1);
+	storage_tx_commit(&store);
+	ASSERT_EQ(out.n_aids, 1);
+	ASSERT_EQ(out.aids[0], 5);
+	ASSERT_EQ(out.ballots[0], 103);
+	ASSERT_EQ(out.values, (paxos_value*)NULL);
+	paxos_accepted_destroy(&out);
+}
+
+static long ElapsedUsec(struct timeval* start)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+}
+
+// Merges 14 subordinate aids into records holding a 1KB value, one aid per
+// transaction, as the acceptor does when promises climb a 15 node tree.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+TEST_P(StorageTest, DISABLED_UpdateVsGetPutBenchmark) {
+	const int instances = 2000, aids = 15;
+	char value[1024];
+	struct timeval start;
+	long getput, update;
+	memset(value, 'x', sizeof(value));
+
+	storage_tx_begin(&store);
+	for (int i = 1; i <= 2 * instances; i++) {
+		paxos_accepted acc;
+		memset(&acc, 0, sizeof(paxos_accepted));
+		acc.iid = i;
+		acc.values = (paxos_value*)calloc(1, sizeof(paxos_value));
+		paxos_accepted_add_aid(&acc, 0, 101, 101, aids);
+		acc.values[0].paxos_value_len = sizeof(value);
+		acc.values[0].paxos_value_val = (char*)malloc(sizeof(value));
+		memcpy(acc.values[0].paxos_value_val, value, sizeof(value));
+		storage_put_record(&store, &acc);
+		paxos_accepted_destroy(&acc);
+	}
+	storage_tx_commit(&store);
+
+	gettimeofday(&start, NULL);
+	for (int i = 1; i <= instances; i++) {
+		for (uint32_t aid = 1; aid < aids; aid++) {
+			paxos_accepted acc;
+			memset(&acc, 0, sizeof(paxos_accepted));
+			storage_tx_begin(&store);
+			storage_get_record(&store, i, &acc);
+			paxos_accepted_add_aid(&acc, aid, 101, 0, aids);
+			storage_put_record(&store, &acc);
+			storage_tx_commit(&store);
+			paxos_accepted_destroy(&acc);
+		}
+	}
+	getput = ElapsedUsec(&start);
+
+	gettimeofday(&start, NULL);
+	for (int i = instances + 1; i <= 2 * instances; i++) {
+		for (uint32_t aid = 1; aid < aids; aid++) {
+			storage_tx_begin(&store);
+			storage_update_record(&store, i, AddAid, &aid);
+			storage_tx_commit(&store);
+		}
+	}
+	update = ElapsedUsec(&start);
+
+	printf("%d merges: get+put %ld us, update %ld us\n",
+		instances * (aids - 1), getput, update);
+
+	paxos_accepted a1, a2;
+	storage_tx_begin(&store);
+	storage_get_record(&store, 1, &a1);
+	storage_get_record(&store, instances + 1, &a2);
+	storage_tx_commit(&store);
+	ASSERT_EQ(a1.n_aids, aids);
+	ASSERT_EQ(a2.n_aids, aids);
+	ASSERT_EQ(a2.values[0].paxos_value_len, sizeof(value));
+	paxos_accepted_destroy(&a1);
+	paxos_accepted_destroy(&a2);
+}
+
+static void ReadValue(paxos_accepted* acc, void* arg)
+{
+	paxos_value* v = (paxos_value*)arg;
+	*v = acc->values[0];
+}
+
+TEST_P(StorageTest, ReadRecord) {
+	paxos_accepted acc;
+	paxos_value v = {0, NULL};
+	memset(&acc, 0, sizeof(paxos_accepted));
+	acc.iid = 3;
+	acc.values = (paxos_value*)calloc(1, sizeof(paxos_value));
+	paxos_accepted_add_aid(&acc, 2, 101, 101, 4);
+	acc.values[0].paxos_value_len = 4;
+	acc.values[0].paxos_value_val = strdup("foo");
+
+	storage_tx_begin(&store);
+	storage_put_record(&store, &acc);
+	ASSERT_EQ(storage_read_record(&store, 2, ReadValue, &v), 0);
+	ASSERT_EQ(storage_read_record(&store, 3, ReadValue, &v), 1);
+	ASSERT_EQ(v.paxos_value_len, 4);
+	ASSERT_STREQ(v.paxos_value_val, "foo");
+	storage_tx_commit(&store);
+	paxos_accepted_destroy(&acc);
+}
+
+TEST_P(StorageTest, KeepBatchFlag) {
+	paxos_accepted acc, out;
+	paxos_value v = {0, NULL};
+	memset(&acc, 0, sizeof(paxos_accepted));
+	acc.iid = 4;
+	acc.values = (paxos_value*)calloc(2, sizeof(paxos_value));
+	paxos_accepted_add_aid(&acc, 0, 101, 101, 2);
+	paxos_accepted_add_aid(&acc, 1, 101, 101, 2);
+	acc.values[0].paxos_value_len = 4;
+	acc.values[0].paxos_value_val = strdup("foo");
+	acc.values[0].paxos_value_flags = PAXOS_VALUE_BATCH;
+	acc.values[1].paxos_value_len = 4;
+	acc.values[1].paxos_value_val = strdup("bar");
+
+	storage_tx_begin(&store);
+	storage_put_record(&store, &acc);
+	storage_tx_commit(&store);
+	paxos_accepted_destroy(&acc);
+
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_read_record(&store, 4, ReadValue, &v), 1);
+	ASSERT_EQ(v.paxos_value_len, 4);
+	ASSERT_EQ(v.paxos_value_flags, PAXOS_VALUE_BATCH);
+	ASSERT_EQ(storage_get_record(&store, 4, &out), 1);
+	storage_tx_commit(&store);
+	ASSERT_EQ(out.values[0].paxos_value_flags, PAXOS_VALUE_BATCH);
+	ASSERT_STREQ(out.values[0].paxos_value_val, "foo");
+	ASSERT_EQ(out.values[1].paxos_value_flags, 0);
+	ASSERT_STREQ(out.values[1].paxos_value_val, "bar");
+	paxos_accepted_destroy(&out);
+}
+
+static void ReadAddress(paxos_accepted* acc, void* arg)
+{
+	*(paxos_accepted**)arg = acc;
+}
+
+// Updates of the in-memory storage change packed records in place, and
+// move them without copying their value bytes when their arrays must grow.
+TEST_P(StorageTest, UpdateKeepsValueInPlace) {
+	paxos_accepted acc, out;
+	paxos_accepted* packed = NULL;
+	paxos_accepted* moved = NULL;
+	paxos_value v = {0, NULL}, after = {0, NULL};
+	if (GetParam() != PAXOS_MEM_STORAGE)
+		return;
+	memset(&acc, 0, sizeof(paxos_accepted));
+	acc.iid = 5;
+	acc.values = (paxos_value*)calloc(2, sizeof(paxos_value));
+	paxos_accepted_add_aid(&acc, 0, 101, 101, 2);
+	acc.values[0].paxos_value_len = 4;
+	acc.values[0].paxos_value_val = strdup("foo");
+
+	storage_tx_begin(&store);
+	storage_put_record(&store, &acc);
+	paxos_accepted_destroy(&acc);
+	ASSERT_EQ(storage_read_record(&store, 5, ReadAddress, &packed), 1);
+	ASSERT_EQ(storage_read_record(&store, 5, ReadValue, &v), 1);
+
+	// Room for a second aid: the record stays where it is
+	uint32_t aid = 1;
+	ASSERT_EQ(storage_update_record(&store, 5, AddAid, &aid), 1);
+	ASSERT_EQ(storage_read_record(&store, 5, ReadAddress, &moved), 1);
+	ASSERT_EQ(moved, packed);
+	ASSERT_EQ(moved->n_aids, 2);
+	ASSERT_EQ(moved->aids[1], 1);
+
+	// The arrays grow: the record moves, its value does not
+	for (aid = 2; aid < 4; aid++)
+		ASSERT_EQ(storage_update_record(&store, 5, AddAid, &aid), 1);
+	ASSERT_EQ(storage_read_record(&store, 5, ReadAddress, &moved), 1);
+	ASSERT_NE(moved, packed);
+	ASSERT_EQ(storage_read_record(&store, 5, ReadValue, &after), 1);
+	ASSERT_EQ(after.paxos_value_val, v.paxos_value_val);
+
+	ASSERT_EQ(storage_get_record(&store, 5, &out), 1);
+	storage_tx_commit(&store);
+	ASSERT_EQ(out.n_aids, 4);
+	ASSERT_EQ(out.aids[3], 3);
+	ASSERT_STREQ(out.values[0].paxos_value_val, "foo");
+	paxos_accepted_destroy(&out);
+}
+
+TEST_P(StorageTest, PutFarAheadFails) {
+	paxos_accepted accepted = {0, 1, 0, 0, 1, NULL, {0, NULL}, NULL};
+	if (GetParam() != PAXOS_MEM_STORAGE)
+		return;
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_put_record(&store, &accepted), 0);
+	accepted.iid = 1 + IIDRING_MAX_SIZE;
+	ASSERT_EQ(storage_put_record(&store, &accepted), -1);
+	ASSERT_EQ(storage_update_record(&store, accepted.iid, CreateRecord, NULL), -1);
+	accepted.iid = IIDRING_MAX_SIZE;
+	ASSERT_EQ(storage_put_record(&store, &accepted), 0);
+	storage_tx_commit(&store);
+	TestCheckInstancesExist(IIDRING_MAX_SIZE, IIDRING_MAX_SIZE);
+}
+
+static void ReadLength(paxos_accepted* acc, void* arg)
+{
+	*(size_t*)arg += acc->values[0].paxos_value_len;
+}
+
+// Stores, gets and reads in place records holding a 1KB value, the puts
+// appending in iid order as an acceptor does.
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+TEST_P(StorageTest, DISABLED_PutGetReadBenchmark) {
+	const int instances = 10000;
+	char value[1024];
+	struct timeval start;
+	long put, get, read;
+	size_t total = 0;
+	memset(value, 'x', sizeof(value));
+
+	paxos_accepted acc;
+	memset(&acc, 0, sizeof(paxos_accepted));
+	acc.values = (paxos_value*)calloc(1, sizeof(paxos_value));
+	paxos_accepted_add_aid(&acc, 0, 101, 101, 1);
+	acc.values[0].paxos_value_len = sizeof(value);
+	acc.values[0].paxos_value_val = value;
+
+	gettimeofday(&start, NULL);
+	storage_tx_begin(&store);
+	for (int i = 1; i <= instances; i++) {
+		acc.iid = i;
+		ASSERT_EQ(storage_put_record(&store, &acc), 0);
+	}
+	storage_tx_commit(&store);
+	put = ElapsedUsec(&start);
+	acc.values[0].paxos_value_val = NULL;
+	paxos_accepted_destroy(&acc);
+
+	gettimeofday(&start, NULL);
+	storage_tx_begin(&store);
+	for (int i = 1; i <= instances; i++) {
+		paxos_accepted out;
+		ASSERT_EQ(storage_get_record(&store, i, &out), 1);
+		total += out.values[0].paxos_value_len;
+		paxos_accepted_destroy(&out);
+	}
+	storage_tx_commit(&store);
+	get = ElapsedUsec(&start);
+
+	gettimeofday(&start, NULL);
+	storage_tx_begin(&store);
+	for (int i = 1; i <= instances; i++)
+		ASSERT_EQ(storage_read_record(&store, i, ReadLength, &total), 1);
+	storage_tx_commit(&store);
+	read = ElapsedUsec(&start);
+
+	printf("%d records: put %ld us, get %ld us, read %ld us\n",
+		instances, put, get, read);
+	ASSERT_EQ(total, 2 * instances * sizeof(value));
+}
+
+TEST(StorageUtilsTest, BufferRoundTrip) {
+	paxos_accepted acc, out;
+	struct paxos_accepted_view view;
+	memset(&acc, 0, sizeof(paxos_accepted));
+	acc.iid = 9;
+	acc.values = (paxos_value*)calloc(2, sizeof(paxos_value));
+	paxos_accepted_add_aid(&acc, 5, 101, 0, 2);
+	paxos_accepted_add_aid(&acc, 1, 202, 202, 2);
+	acc.values[1].paxos_value_len = 4;
+	acc.values[1].paxos_value_val = strdup("bar");
+
+	size_t size = paxos_accepted_buffer_size(&acc);
+	char* buffer = paxos_accepted_to_buffer(&acc);
+
+	ASSERT_EQ(paxos_accepted_view_buffer(buffer, size, &view), 0);
+	ASSERT_EQ(view.acc.iid, 9);
+	ASSERT_EQ(view.acc.n_aids, 2);
+	ASSERT_EQ(view.acc.aids[0], 5);
+	ASSERT_EQ(view.acc.ballots[1], 202);
+	ASSERT_EQ(view.acc.values[0].paxos_value_len, 0);
+	ASSERT_EQ(view.acc.values[1].paxos_value_val, buffer + size - 4);
+	ASSERT_TRUE(aidset_contains(&view.acc.aidset, 1));
+	ASSERT_EQ(paxos_accepted_view_buffer(buffer, size - 1, &view), -1);
+
+	ASSERT_EQ(paxos_accepted_from_buffer(buffer, size, &out), 0);
+	ASSERT_EQ(out.value_ballots[1], 202);
+	ASSERT_STREQ(out.values[1].paxos_value_val, "bar");
+	paxos_accepted_destroy(&out);
+	paxos_accepted_destroy(&acc);
+	free(buffer);
+}
+
+// Lets the tests make the wal syncs fail; it takes the place of the libc one.
+static int fail_fdatasync = 0;
+
+extern "C" int fdatasync(int fd)
+{
+	if (fail_fdatasync) {
+		errno = EIO;
+		return -1;
+	}
+	return syscall(SYS_fdatasync, fd);
+}
+
+class WalStorageTest : public::testing::Test {
+protected:
+
+	struct storage store;
+
+	virtual void SetUp() {
+		paxos_config.verbosity = PAXOS_LOG_QUIET;
+		paxos_config.storage_backend = PAXOS_WAL_STORAGE;
+		paxos_config.trash_files = 1;
+		storage_init(&store, 0);
+		ASSERT_EQ(storage_open(&store), 0);
+		paxos_config.trash_files = 0;
+	}
+
+	virtual void TearDown() {
+		storage_close(&store);
+		paxos_config.wal_segment_size = 64*1024*1024;
+	}
+
+	void Reopen() {
+		storage_close(&store);
+		storage_init(&store, 0);
+		ASSERT_EQ(storage_open(&store), 0);
+	}
+
+	void Put(iid_t iid, const char* value) {
+		paxos_accepted acc;
+		memset(&acc, 0, sizeof(paxos_accepted));
+		acc.iid = iid;
+		acc.values = (paxos_value*)calloc(1, sizeof(paxos_value));
+		paxos_accepted_add_aid(&acc, 0, 101, 101, 1);
+		acc.values[0].paxos_value_len = strlen(value) + 1;
+		acc.values[0].paxos_value_val = strdup(value);
+		storage_tx_begin(&store);
+		storage_put_record(&store, &acc);
+		storage_tx_commit(&store);
+		paxos_accepted_destroy(&acc);
+	}
+
+	int Segments() {
+		char cmd[256];
+		snprintf(cmd, sizeof(cmd), "ls %s_0/*.wal | wc -l", paxos_config.wal_path);
+		FILE* f = popen(cmd, "r");
+		int n = 0;
+		fscanf(f, "%d", &n);
+		pclose(f);
+		return n;
+	}
+};
+
+TEST_F(WalStorageTest, Recovery) {
+	paxos_accepted acc;
+	iid_t from;
+	ballot_t ballot;
+
+	for (int i = 1; i <= 100; i++)
+		Put(i, "foo");
+	Put(50, "bar");
+	storage_tx_begin(&store);
+	storage_put_watermark(&store, 101, 202);
+	storage_trim(&store, 10);
+	storage_tx_commit(&store);
+
+	// An aborted transaction leaves no trace
+	storage_tx_begin(&store);
+	storage_trim(&store, 20);
+	storage_tx_abort(&store);
+
+	Reopen();
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_trim_instance(&store), 10);
+	ASSERT_EQ(storage_get_max_instance(&store), 100);
+	ASSERT_EQ(storage_get_watermark(&store, &from, &ballot), 1);
+	ASSERT_EQ(from, 101);
+	ASSERT_EQ(ballot, 202);
+	ASSERT_EQ(storage_get_record(&store, 10, &acc), 0);
+	ASSERT_EQ(storage_get_record(&store, 50, &acc), 1);
+	ASSERT_STREQ(acc.values[0].paxos_value_val, "bar");
+	storage_tx_commit(&store);
+	paxos_accepted_destroy(&acc);
+}
+
+TEST_F(WalStorageTest, TornTail) {
+	paxos_accepted acc;
+	char cmd[256];
+
+	Put(1, "foo");
+	Put(2, "bar");
+	storage_close(&store);
+	snprintf(cmd, sizeof(cmd), "printf 'garbage' >> %s_0/0000000001.wal",
+		paxos_config.wal_path);
+	ASSERT_EQ(system(cmd), 0);
+	storage_init(&store, 0);
+	ASSERT_EQ(storage_open(&store), 0);
+
+	Put(3, "baz");
+	Reopen();
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_record(&store, 2, &acc), 1);
+	ASSERT_STREQ(acc.values[0].paxos_value_val, "bar");
+	paxos_accepted_destroy(&acc);
+	ASSERT_EQ(storage_get_record(&store, 3, &acc), 1);
+	ASSERT_STREQ(acc.values[0].paxos_value_val, "baz");
+	paxos_accepted_destroy(&acc);
+	storage_tx_commit(&store);
+}
+
+TEST_F(WalStorageTest, FailedWriteLeavesNoTrace) {
+	paxos_accepted acc;
+	struct rlimit limit, saved;
+	struct stat sb;
+	char path[256];
+	char value[1000];
+	memset(value, 'x', sizeof(value) - 1);
+	value[sizeof(value) - 1] = 0;
+
+	Put(1, "foo");
+	snprintf(path, sizeof(path), "%s_0/0000000001.wal", paxos_config.wal_path);
+	ASSERT_EQ(stat(path, &sb), 0);
+
+	// Let the write of the next record stop halfway
+	signal(SIGXFSZ, SIG_IGN);
+	getrlimit(RLIMIT_FSIZE, &saved);
+	limit = saved;
+	limit.rlim_cur = sb.st_size + sizeof(value) / 2;
+	setrlimit(RLIMIT_FSIZE, &limit);
+	memset(&acc, 0, sizeof(paxos_accepted));
+	acc.iid = 2;
+	acc.values = (paxos_value*)calloc(1, sizeof(paxos_value));
+	paxos_accepted_add_aid(&acc, 0, 101, 101, 1);
+	acc.values[0].paxos_value_len = sizeof(value);
+	acc.values[0].paxos_value_val = strdup(value);
+	storage_tx_begin(&store);
+	storage_put_record(&store, &acc);
+	ASSERT_NE(storage_tx_commit(&store), 0);
+	paxos_accepted_destroy(&acc);
+	setrlimit(RLIMIT_FSIZE, &saved);
+	signal(SIGXFSZ, SIG_DFL);
+
+	Put(3, "bar");
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_record(&store, 2, &acc), 0);
+	ASSERT_EQ(storage_get_record(&store, 3, &acc), 1);
+	ASSERT_STREQ(acc.values[0].paxos_value_val, "bar");
+	paxos_accepted_destroy(&acc);
+	storage_tx_commit(&store);
+
+	Reopen();
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_record(&store, 1, &acc), 1);
+	paxos_accepted_destroy(&acc);
+	ASSERT_EQ(storage_get_record(&store, 2, &acc), 0);
+	ASSERT_EQ(storage_get_record(&store, 3, &acc), 1);
+	ASSERT_STREQ(acc.values[0].paxos_value_val, "bar");
+	paxos_accepted_destroy(&acc);
+	storage_tx_commit(&store);
+}
+
+TEST_F(WalStorageTest, FailedSyncLeavesNoTrace) {
+	paxos_accepted acc;
+
+	Put(1, "foo");
+	fail_fdatasync = 1;
+	memset(&acc, 0, sizeof(paxos_accepted));
+	acc.iid = 2;
+	paxos_accepted_add_aid(&acc, 0, 101, 101, 1);
+	storage_tx_begin(&store);
+	storage_put_record(&store, &acc);
+	ASSERT_NE(storage_tx_commit(&store), 0);
+	paxos_accepted_destroy(&acc);
+	fail_fdatasync = 0;
+
+	Put(3, "bar");
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_record(&store, 2, &acc), 0);
+	ASSERT_EQ(storage_get_max_instance(&store), 3);
+	storage_tx_commit(&store);
+
+	Reopen();
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_record(&store, 2, &acc), 0);
+	ASSERT_EQ(storage_get_record(&store, 3, &acc), 1);
+	ASSERT_STREQ(acc.values[0].paxos_value_val, "bar");
+	paxos_accepted_destroy(&acc);
+	storage_tx_commit(&store);
+}
+
+TEST_F(WalStorageTest, TrimDropsSegments) {
+	paxos_accepted acc;
+	char value[1000];
+	memset(value, 'x', sizeof(value) - 1);
+	value[sizeof(value) - 1] = 0;
+
+	paxos_config.wal_segment_size = 4096;
+	for (int i = 1; i <= 40; i++)
+		Put(i, value);
+	int before = Segments();
+	ASSERT_GT(before, 5);
+
+	storage_tx_begin(&store);
+	storage_trim(&store, 30);
+	storage_tx_commit(&store);
+	ASSERT_LT(Segments(), before / 2);
+
+	Reopen();
+	storage_tx_begin(&store);
+	ASSERT_EQ(storage_get_trim_instance(&store), 30);
+	ASSERT_EQ(storage_get_record(&store, 30, &acc), 0);
+	ASSERT_EQ(storage_get_record(&store, 31, &acc), 1);
+	paxos_accepted_destroy(&acc);
+	storage_tx_commit(&store);
+}
+
 paxos_storage_backend backends[] = {
 	PAXOS_MEM_STORAGE,
 #if HAS_LMDB
 	PAXOS_LMDB_STORAGE,
 #endif
+	PAXOS_WAL_STORAGE,
 };
 
 INSTANTIATE_TEST_CASE_P(StorageBackends, StorageTest, 
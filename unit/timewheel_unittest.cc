@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "timewheel.h"
+#include "gtest/gtest.h"
+
+static int Drain(struct timewheel* w)
+{
+	int n = 0;
+	while (timewheel_next_expired(w) != NULL)
+		n++;
+	return n;
+}
+
+TEST(TimewheelTest, ExpireOnTime) {
+	struct wheel_timer t;
+	struct timewheel* w = timewheel_new(1000);
+	timer_init(&t, &t);
+	timewheel_schedule(w, &t, 1010);
+	ASSERT_TRUE(timer_pending(&t));
+	ASSERT_EQ(0, timewheel_advance(w, 1009));
+	ASSERT_EQ(1, timewheel_advance(w, 1010));
+	ASSERT_EQ(&t, timewheel_next_expired(w));
+	ASSERT_EQ((void*)&t, t.data);
+	ASSERT_FALSE(timer_pending(&t));
+	ASSERT_EQ(NULL, timewheel_next_expired(w));
+	ASSERT_EQ(0, timewheel_count(w));
+	timewheel_free(w);
+}
+
+TEST(TimewheelTest, ExpireInOrderAcrossLevels) {
+	// Expiries spanning every level of the wheel fire exactly on their tick
+	int i;
+	uint64_t delays[] = {1, 63, 64, 65, 4095, 4096, 4097, 262144, 300000};
+	int n = sizeof(delays) / sizeof(delays[0]);
+	struct wheel_timer timers[9];
+	struct timewheel* w = timewheel_new(777);
+
+	for (i = 0; i < n; i++) {
+		timer_init(&timers[i], NULL);
+		timewheel_schedule(w, &timers[i], 777 + delays[i]);
+	}
+	ASSERT_EQ(n, timewheel_count(w));
+
+	for (i = 0; i < n; i++) {
+		ASSERT_EQ(0, timewheel_advance(w, 777 + delays[i] - 1)) << delays[i];
+		ASSERT_EQ(1, timewheel_advance(w, 777 + delays[i])) << delays[i];
+		ASSERT_EQ(&timers[i], timewheel_next_expired(w));
+	}
+	ASSERT_EQ(0, timewheel_count(w));
+	timewheel_free(w);
+}
+
+TEST(TimewheelTest, Cancel) {
+	struct wheel_timer t1, t2;
+	struct timewheel* w = timewheel_new(0);
+	timer_init(&t1, NULL);
+	timer_init(&t2, NULL);
+	timewheel_schedule(w, &t1, 100);
+	timewheel_schedule(w, &t2, 100);
+	timewheel_cancel(w, &t1);
+	ASSERT_FALSE(timer_pending(&t1));
+	ASSERT_EQ(1, timewheel_count(w));
+	ASSERT_EQ(1, timewheel_advance(w, 200));
+
+	// Expired, not drained timers can be cancelled too
+	timewheel_cancel(w, &t2);
+	ASSERT_EQ(NULL, timewheel_next_expired(w));
+	ASSERT_EQ(0, timewheel_count(w));
+	timewheel_free(w);
+}
+
+TEST(TimewheelTest, Reschedule) {
+	struct wheel_timer t;
+	struct timewheel* w = timewheel_new(0);
+	timer_init(&t, NULL);
+	timewheel_schedule(w, &t, 50);
+	timewheel_schedule(w, &t, 5000);
+	ASSERT_EQ(1, timewheel_count(w));
+	ASSERT_EQ(0, timewheel_advance(w, 4999));
+	ASSERT_EQ(1, timewheel_advance(w, 5000));
+
+	// Past expiries fire on the next tick
+	ASSERT_EQ(1, Drain(w));
+	timewheel_schedule(w, &t, 10);
+	ASSERT_EQ(1, timewheel_advance(w, 5001));
+	ASSERT_EQ(1, Drain(w));
+	timewheel_free(w);
+}
+
+TEST(TimewheelTest, IdleAdvance) {
+	struct wheel_timer t;
+	struct timewheel* w = timewheel_new(0);
+	timer_init(&t, NULL);
+	ASSERT_EQ(0, timewheel_advance(w, 1000000000));
+	timewheel_schedule(w, &t, 1000000020);
+	ASSERT_EQ(0, timewheel_advance(w, 1000000019));
+	ASSERT_EQ(1, timewheel_advance(w, 1000000020));
+	ASSERT_EQ(1, Drain(w));
+	timewheel_free(w);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "topology.h"
+#include "aidset.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+static std::vector<int> Ids(const int* ids, int count)
+{
+	return std::vector<int>(ids, ids + count);
+}
+
+class TopologyTest : public testing::Test {
+protected:
+
+	struct evpaxos_config* config;
+
+	virtual void SetUp() {
+		config = evpaxos_config_read("config/tree.conf");
+	}
+
+	virtual void TearDown() {
+		evpaxos_config_free(config);
+	}
+};
+
+TEST_F(TopologyTest, RootMember) {
+	const int* ids;
+	struct topology* t = topology_new(config, 0);
+	ASSERT_FALSE(topology_is_leader(t));
+	int expected[] = {0, 1, 2, 3, 4, 5, 6, 10, 11};
+	ASSERT_EQ(Ids(expected, 9), Ids(ids, topology_peers(t, &ids)));
+	ASSERT_EQ(0, topology_children(t, &ids));
+	ASSERT_EQ(0, topology_parents(t, &ids));
+	ASSERT_EQ(0, topology_subordinates(t, NULL));
+	topology_free(t);
+}
+
+TEST_F(TopologyTest, GroupLeader) {
+	const int* ids;
+	paxos_aidset subtree;
+	struct topology* t = topology_new(config, 10);
+	ASSERT_TRUE(topology_is_leader(t));
+	int peers[] = {0, 1, 2, 3, 4, 5, 6, 10, 11, 12, 13, 14};
+	ASSERT_EQ(Ids(peers, 12), Ids(ids, topology_peers(t, &ids)));
+	int children[] = {12, 13, 14};
+	ASSERT_EQ(Ids(children, 3), Ids(ids, topology_children(t, &ids)));
+	int parents[] = {0, 1, 2, 3, 4};
+	ASSERT_EQ(Ids(parents, 5), Ids(ids, topology_parents(t, &ids)));
+	int siblings[] = {5, 6};
+	ASSERT_EQ(Ids(siblings, 2), Ids(ids, topology_siblings(t, &ids)));
+	ASSERT_EQ(3, topology_subordinates(t, &subtree));
+	ASSERT_TRUE(aidset_contains(&subtree, 12));
+	ASSERT_FALSE(aidset_contains(&subtree, 11));
+	topology_free(t);
+}
+
+TEST_F(TopologyTest, LeafMember) {
+	const int* ids;
+	struct topology* t = topology_new(config, 7);
+	ASSERT_FALSE(topology_is_leader(t));
+	int expected[] = {5, 6, 7, 8, 9};
+	ASSERT_EQ(Ids(expected, 5), Ids(ids, topology_peers(t, &ids)));
+	ASSERT_EQ(0, topology_children(t, &ids));
+	topology_free(t);
+}
+
+TEST_F(TopologyTest, InvalidId) {
+	ASSERT_EQ(NULL, topology_new(config, 15));
+	ASSERT_EQ(NULL, topology_new(config, -1));
+}
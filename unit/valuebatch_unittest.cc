@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "valuebatch.h"
+#include "gtest/gtest.h"
+#include <string>
+#include <vector>
+
+static void Collect(const char* value, size_t size, void* arg)
+{
+	((std::vector<std::string>*)arg)->push_back(std::string(value, size));
+}
+
+TEST(ValueBatchTest, AppendAndUnpack) {
+	struct value_batch b;
+	std::vector<std::string> out;
+	value_batch_init(&b);
+	ASSERT_EQ(value_batch_seal(&b), (paxos_value*)NULL);
+	value_batch_append(&b, "foo", 3);
+	value_batch_append(&b, "", 0);
+	value_batch_append(&b, "barbaz", 6);
+	ASSERT_EQ(value_batch_count(&b), 3);
+	ASSERT_EQ(value_batch_size(&b), 8 + 3 * 4 + 9);
+
+	paxos_value* v = value_batch_seal(&b);
+	ASSERT_EQ(value_batch_count(&b), 0);
+	ASSERT_EQ(v->paxos_value_len, 29);
+	ASSERT_EQ(value_batch_foreach(v->paxos_value_val, v->paxos_value_len, Collect, &out), 3);
+	ASSERT_EQ(out.size(), 3);
+	ASSERT_EQ(out[0], "foo");
+	ASSERT_EQ(out[1], "");
+	ASSERT_EQ(out[2], "barbaz");
+	paxos_value_free(v);
+	value_batch_destroy(&b);
+}
+
+TEST(ValueBatchTest, RejectNonBatch) {
+	struct value_batch b;
+	std::vector<std::string> out;
+	value_batch_init(&b);
+	value_batch_append(&b, "foo", 3);
+	paxos_value* v = value_batch_seal(&b);
+
+	ASSERT_EQ(value_batch_foreach("foo", 3, Collect, &out), -1);
+	ASSERT_EQ(value_batch_foreach(v->paxos_value_val, v->paxos_value_len - 1, Collect, &out), -1);
+	v->paxos_value_val[11] = 4;
+	ASSERT_EQ(value_batch_foreach(v->paxos_value_val, v->paxos_value_len, Collect, &out), -1);
+	ASSERT_EQ(out.size(), 0);
+	paxos_value_free(v);
+}
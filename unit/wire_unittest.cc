@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2013-2015, University of Lugano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of it
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "paxos.h"
+#include "paxos_types_pack.h"
+#include "paxos_types_wire.h"
+#include "aidset.h"
+#include "gtest/gtest.h"
+#include <time.h>
+#include <string>
+#include <vector>
+
+static size_t Encode(paxos_message* msg, std::vector<char>& buf)
+{
+	buf.resize(paxos_wire_size(msg));
+	return paxos_wire_encode(msg, &buf[0]);
+}
+
+static int Decode(std::vector<char>& buf, paxos_message* out)
+{
+	struct paxos_wire_header h;
+	memset(out, 0, sizeof(paxos_message));
+	if (paxos_wire_read_header(&buf[0], &h) != 0)
+		return -1;
+	if (PAXOS_WIRE_HEADER_SIZE + h.len != buf.size())
+		return -1;
+	return paxos_wire_decode(&h, &buf[PAXOS_WIRE_HEADER_SIZE], out);
+}
+
+TEST(WireTest, Prepare) {
+	std::vector<char> buf;
+	paxos_message in, out;
+	paxos_prepare prepare = {3, 42, 0x10203};
+	in.type = PAXOS_PREPARE;
+	in.u.prepare = prepare;
+	ASSERT_EQ(Encode(&in, buf), PAXOS_WIRE_HEADER_SIZE + 12);
+	ASSERT_EQ(Decode(buf, &out), 0);
+	ASSERT_EQ(out.type, PAXOS_PREPARE);
+	ASSERT_EQ(out.u.prepare.src, 3);
+	ASSERT_EQ(out.u.prepare.iid, 42);
+	ASSERT_EQ(out.u.prepare.ballot, 0x10203);
+}
+
+TEST(WireTest, Accept) {
+	std::vector<char> buf;
+	paxos_message in, out;
+	char value[] = "some value";
+	paxos_accept accept = {1, 7, 101, {sizeof(value), value}};
+	in.type = PAXOS_ACCEPT;
+	in.u.accept = accept;
+	ASSERT_EQ(Encode(&in, buf), PAXOS_WIRE_HEADER_SIZE + 16 + sizeof(value));
+	ASSERT_EQ(Decode(buf, &out), 0);
+	ASSERT_EQ(out.type, PAXOS_ACCEPT);
+	ASSERT_EQ(out.u.accept.src, 1);
+	ASSERT_EQ(out.u.accept.iid, 7);
+	ASSERT_EQ(out.u.accept.ballot, 101);
+	ASSERT_EQ(out.u.accept.value.paxos_value_len, sizeof(value));
+	ASSERT_STREQ(out.u.accept.value.paxos_value_val, value);
+	paxos_message_destroy(&out);
+
+	in.u.accept.value.paxos_value_len = 0;
+	in.u.accept.value.paxos_value_val = NULL;
+	Encode(&in, buf);
+	ASSERT_EQ(Decode(buf, &out), 0);
+	ASSERT_EQ(out.u.accept.value.paxos_value_len, 0);
+	ASSERT_EQ(out.u.accept.value.paxos_value_val, (char*)NULL);
+}
+
+TEST(WireTest, Accepted) {
+	std::vector<char> buf;
+	paxos_message in, out;
+	uint32_t aids[] = {0, 2, 5};
+	uint32_t ballots[] = {101, 102, 103};
+	uint32_t value_ballots[] = {101, 0, 103};
+	paxos_value values[] = {{3, (char*)"foo"}, {0, NULL}, {6, (char*)"barbaz"}};
+	memset(&in, 0, sizeof(paxos_message));
+	in.type = PAXOS_ACCEPTED;
+	in.u.accepted.iid = 9;
+	in.u.accepted.n_aids = 3;
+	in.u.accepted.aids = aids;
+	in.u.accepted.ballots = ballots;
+	in.u.accepted.value_ballots = value_ballots;
+	in.u.accepted.values = values;
+
+	Encode(&in, buf);
+	ASSERT_EQ(Decode(buf, &out), 0);
+	paxos_accepted* a = &out.u.accepted;
+	ASSERT_EQ(out.type, PAXOS_ACCEPTED);
+	ASSERT_EQ(a->src, (uint32_t)-1);
+	ASSERT_EQ(a->iid, 9);
+	ASSERT_EQ(a->n_aids, 3);
+	ASSERT_EQ(a->aids_cap, 3);
+	for (int i = 0; i < 3; i++) {
+		ASSERT_EQ(a->aids[i], aids[i]);
+		ASSERT_EQ(a->ballots[i], ballots[i]);
+		ASSERT_EQ(a->value_ballots[i], value_ballots[i]);
+		ASSERT_TRUE(aidset_contains(&a->aidset, aids[i]));
+		ASSERT_EQ(a->values[i].paxos_value_len, values[i].paxos_value_len);
+	}
+	ASSERT_EQ(aidset_count(&a->aidset), 3);
+	ASSERT_EQ(memcmp(a->values[0].paxos_value_val, "foo", 3), 0);
+	ASSERT_EQ(a->values[1].paxos_value_val, (char*)NULL);
+	ASSERT_EQ(memcmp(a->values[2].paxos_value_val, "barbaz", 6), 0);
+	paxos_message_destroy(&out);
+
+	in.u.accepted.values = NULL;
+	in.u.accepted.ballots = NULL;
+	Encode(&in, buf);
+	ASSERT_EQ(Decode(buf, &out), 0);
+	ASSERT_EQ(a->values, (paxos_value*)NULL);
+	ASSERT_EQ(a->ballots[1], 0);
+	ASSERT_EQ(a->value_ballots[2], 103);
+	paxos_message_destroy(&out);
+}
+
+TEST(WireTest, BatchFlag) {
+	std::vector<char> buf;
+	paxos_message in, out;
+	paxos_value values[] = {{3, (char*)"foo", PAXOS_VALUE_BATCH}, {3, (char*)"bar"}};
+	paxos_accept accept = {1, 7, 101, {3, (char*)"foo", PAXOS_VALUE_BATCH}};
+	in.type = PAXOS_ACCEPT;
+	in.u.accept = accept;
+	Encode(&in, buf);
+	ASSERT_EQ(Decode(buf, &out), 0);
+	ASSERT_EQ(out.u.accept.value.paxos_value_len, 3);
+	ASSERT_EQ(out.u.accept.value.paxos_value_flags, PAXOS_VALUE_BATCH);
+	paxos_message_destroy(&out);
+
+	memset(&in, 0, sizeof(paxos_message));
+	in.type = PAXOS_ACCEPTED;
+	in.u.accepted.n_aids = 2;
+	in.u.accepted.values = values;
+	Encode(&in, buf);
+	ASSERT_EQ(Decode(buf, &out), 0);
+	ASSERT_EQ(out.u.accepted.values[0].paxos_value_len, 3);
+	ASSERT_EQ(out.u.accepted.values[0].paxos_value_flags, PAXOS_VALUE_BATCH);
+	ASSERT_EQ(out.u.accepted.values[1].paxos_value_flags, 0);
+	ASSERT_EQ(memcmp(out.u.accepted.values[1].paxos_value_val, "bar", 3), 0);
+	paxos_message_destroy(&out);
+}
+
+TEST(WireTest, MsgpackBatchFlag) {
+	msgpack_sbuffer buffer;
+	msgpack_packer packer;
+	msgpack_unpacked result;
+	paxos_message in, out;
+	size_t off = 0;
+	paxos_accept accept = {1, 7, 101, {3, (char*)"foo", PAXOS_VALUE_BATCH}};
+	in.type = PAXOS_ACCEPT;
+	in.u.accept = accept;
+	msgpack_sbuffer_init(&buffer);
+	msgpack_unpacked_init(&result);
+	msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+	msgpack_pack_paxos_message(&packer, &in);
+	msgpack_unpack_next(&result, buffer.data, buffer.size, &off);
+	msgpack_unpack_paxos_message(&result.data, &out);
+	ASSERT_EQ(out.u.accept.iid, 7);
+	ASSERT_EQ(out.u.accept.value.paxos_value_len, 3);
+	ASSERT_EQ(out.u.accept.value.paxos_value_flags, PAXOS_VALUE_BATCH);
+	ASSERT_EQ(memcmp(out.u.accept.value.paxos_value_val, "foo", 3), 0);
+	paxos_message_destroy(&out);
+	msgpack_unpacked_destroy(&result);
+	msgpack_sbuffer_destroy(&buffer);
+}
+
+TEST(WireTest, RejectMalformed) {
+	std::vector<char> buf;
+	paxos_message in, out;
+	struct paxos_wire_header h;
+	uint32_t aids[] = {0, 1};
+	paxos_value values[] = {{3, (char*)"foo"}, {3, (char*)"bar"}};
+	memset(&in, 0, sizeof(paxos_message));
+	in.type = PAXOS_ACCEPTED;
+	in.u.accepted.n_aids = 2;
+	in.u.accepted.aids = aids;
+	in.u.accepted.values = values;
+	Encode(&in, buf);
+
+	buf[0] = 0x93;
+	ASSERT_EQ(paxos_wire_read_header(&buf[0], &h), -1);
+	buf[0] = (char)PAXOS_WIRE_MAGIC;
+	ASSERT_EQ(paxos_wire_read_header(&buf[0], &h), 0);
+	h.len -= 1;
+	ASSERT_EQ(paxos_wire_decode(&h, &buf[PAXOS_WIRE_HEADER_SIZE], &out), -1);
+	h.len += 1;
+	buf[PAXOS_WIRE_HEADER_SIZE + 4] = 0x7f;
+	ASSERT_EQ(paxos_wire_decode(&h, &buf[PAXOS_WIRE_HEADER_SIZE], &out), -1);
+	h.type = PAXOS_TRIM;
+	ASSERT_EQ(paxos_wire_decode(&h, &buf[PAXOS_WIRE_HEADER_SIZE], &out), -1);
+}
+
+static void ReadChunk(char* buf, uint32_t len, void* arg)
+{
+	std::vector<char>* chunk = (std::vector<char>*)arg;
+	ASSERT_LE(len, chunk->size());
+	memcpy(buf, &(*chunk)[0], len);
+	chunk->erase(chunk->begin(), chunk->begin() + len);
+}
+
+TEST(WireTest, DecodeHeadWithSeparateValues) {
+	std::vector<char> buf;
+	paxos_message in, out;
+	struct paxos_wire_header h;
+	uint32_t aids[] = {1, 2};
+	std::string v1(5000, 'a'), v2(3000, 'b');
+	paxos_value values[] = {{(int)v1.size(), (char*)v1.data()},
+		{(int)v2.size(), (char*)v2.data()}};
+	memset(&in, 0, sizeof(paxos_message));
+	in.type = PAXOS_ACCEPTED;
+	in.u.accepted.iid = 3;
+	in.u.accepted.n_aids = 2;
+	in.u.accepted.aids = aids;
+	in.u.accepted.values = values;
+	Encode(&in, buf);
+
+	ASSERT_EQ(paxos_wire_read_header(&buf[0], &h), 0);
+	const char* payload = &buf[PAXOS_WIRE_HEADER_SIZE];
+	size_t head = paxos_wire_head_size(&h, payload);
+	ASSERT_EQ(head, 12 + 2 * 12 + 2 * 4);
+	// The values are read from a buffer of their own
+	std::vector<char> rest(payload + head, payload + h.len);
+	std::vector<char> headcopy(payload, payload + head);
+	ASSERT_EQ(paxos_wire_decode_head(&h, &headcopy[0], &out, ReadChunk, &rest), 0);
+	ASSERT_EQ(rest.size(), 0);
+	ASSERT_EQ(out.u.accepted.n_aids, 2);
+	ASSERT_EQ(out.u.accepted.aids[1], 2);
+	ASSERT_EQ(std::string(out.u.accepted.values[0].paxos_value_val, 5000), v1);
+	ASSERT_EQ(std::string(out.u.accepted.values[1].paxos_value_val, 3000), v2);
+	paxos_message_destroy(&out);
+
+	h.len -= 1;
+	ASSERT_EQ(paxos_wire_decode_head(&h, &headcopy[0], &out, ReadChunk, &rest), -1);
+}
+
+static void MsgpackRoundtrip(paxos_message* in, int count, size_t* bytes)
+{
+	msgpack_sbuffer buffer;
+	msgpack_packer packer;
+	msgpack_unpacked result;
+	msgpack_sbuffer_init(&buffer);
+	msgpack_unpacked_init(&result);
+	for (int i = 0; i < count; i++) {
+		paxos_message out;
+		size_t off = 0;
+		msgpack_sbuffer_clear(&buffer);
+		msgpack_packer_init(&packer, &buffer, msgpack_sbuffer_write);
+		msgpack_pack_paxos_message(&packer, in);
+		msgpack_unpack_next(&result, buffer.data, buffer.size, &off);
+		msgpack_unpack_paxos_message(&result.data, &out);
+		paxos_message_destroy(&out);
+	}
+	*bytes = buffer.size;
+	msgpack_unpacked_destroy(&result);
+	msgpack_sbuffer_destroy(&buffer);
+}
+
+static void WireRoundtrip(paxos_message* in, int count, size_t* bytes)
+{
+	std::vector<char> buf;
+	for (int i = 0; i < count; i++) {
+		paxos_message out;
+		Encode(in, buf);
+		Decode(buf, &out);
+		paxos_message_destroy(&out);
+	}
+	*bytes = buf.size();
+}
+
+static double NsPerMessage(clock_t start, int count)
+{
+	return (double)(clock() - start) * 1000000000 / CLOCKS_PER_SEC / count;
+}
+
+// Disabled by default, run with --gtest_also_run_disabled_tests.
+TEST(WireTest, DISABLED_CodecBenchmark) {
+	const int count = 200000;
+	char value[64];
+	uint32_t aids[] = {0, 1, 2}, ballots[] = {101, 101, 101};
+	paxos_value values[] = {{sizeof(value), value}, {sizeof(value), value},
+		{sizeof(value), value}};
+	paxos_prepare prepare = {0, 1000, 101};
+	paxos_accept accept = {0, 1000, 101, {sizeof(value), value}};
+	paxos_message msgs[3];
+	const char* names[] = {"prepare", "accept", "accepted"};
+
+	memset(value, 'v', sizeof(value));
+	memset(msgs, 0, sizeof(msgs));
+	msgs[0].type = PAXOS_PREPARE;
+	msgs[0].u.prepare = prepare;
+	msgs[1].type = PAXOS_ACCEPT;
+	msgs[1].u.accept = accept;
+	msgs[2].type = PAXOS_ACCEPTED;
+	msgs[2].u.accepted.iid = 1000;
+	msgs[2].u.accepted.n_aids = 3;
+	msgs[2].u.accepted.aids = aids;
+	msgs[2].u.accepted.ballots = ballots;
+	msgs[2].u.accepted.value_ballots = ballots;
+	msgs[2].u.accepted.values = values;
+
+	for (int i = 0; i < 3; i++) {
+		size_t mbytes, wbytes;
+		clock_t start = clock();
+		MsgpackRoundtrip(&msgs[i], count, &mbytes);
+		double mns = NsPerMessage(start, count);
+		start = clock();
+		WireRoundtrip(&msgs[i], count, &wbytes);
+		double wns = NsPerMessage(start, count);
+		printf("%-8s msgpack %6.1f ns %4lu bytes, binary %6.1f ns %4lu bytes\n",
+			names[i], mns, (unsigned long)mbytes, wns, (unsigned long)wbytes);
+	}
+}